@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "analyzer.h"
+#include "sample_format.h"
+
+// Activity-gated recording: only the parts of a capture with something in
+// them reach the file.
+//
+// Each captured block's RMS level is measured with the SIMD level kernel
+// (analyzer_detail::levels). A block at or above the threshold opens a
+// segment, which stays open until the hangover time has passed without
+// another loud block. While the gate is closed, the most recent pre-roll
+// frames are kept in a circular buffer in the device format and written
+// ahead of the block that opens the next segment, so onsets aren't cut.
+// Every segment goes into a table that is saved as a CSV index next to the
+// recording: where the segment started in the original timeline and where
+// it starts in the file, which is enough to put the silence back.
+//
+// The pre-roll buffer, the decode scratch and the segment table are sized
+// up front, so push() only decodes, measures and copies. If the table ever
+// fills up, the last segment simply stays open: the file then holds more
+// audio than needed, but the index is still right.
+
+struct GateOptions
+{
+    bool enabled = false;      // --gate=THRESH_DB[:PREROLL_MS[:HANGOVER_MS]]
+    double thresholdDb = -45.0; // block RMS in dBFS that opens the gate
+    double preRollMs = 300.0;   // kept ahead of each segment
+    double hangoverMs = 1000.0; // kept after the last loud block
+};
+
+struct GateSegment
+{
+    uint64_t sourceStart = 0; // first frame in the capture timeline (device rate)
+    uint64_t frames = 0;      // length in device frames
+    uint64_t fileStart = 0;   // first frame in the file (file rate)
+};
+
+class ActivityGate
+{
+public:
+    // `maxBlock` is the largest block push() will see, `maxFrames` the
+    // length of the whole capture (it bounds the segment table)
+    ActivityGate(const GateOptions &options, SampleFormat deviceFormat, int rate, int channels, size_t maxBlock,
+                 uint64_t maxFrames)
+        : options_(options), format_(deviceFormat), rate_(rate), channels_(channels),
+          frameBytes_(sampleBytes(deviceFormat) * channels), maxBlock_(maxBlock),
+          preRollFrames_(static_cast<uint64_t>(options.preRollMs * rate / 1000.0)),
+          hangoverFrames_(static_cast<uint64_t>(options.hangoverMs * rate / 1000.0)),
+          threshold_(std::pow(10.0, options.thresholdDb / 10.0)),
+          preRoll_(preRollFrames_ * frameBytes_), scratch_(maxBlock * channels),
+          // Every segment but the last is at least a block plus the hangover long
+          table_(std::min<uint64_t>(maxFrames / std::max<uint64_t>(hangoverFrames_ + maxBlock, 1) + 2, 1 << 20))
+    {
+    }
+
+    ActivityGate(const ActivityGate &) = delete;
+    ActivityGate &operator=(const ActivityGate &) = delete;
+
+    // Audio thread: one block of interleaved device-format frames.
+    // `write(const void *frames, size_t count)` hands frames on to the file
+    // and returns how many file frames that produced (they differ with
+    // --resample); it is called with at most maxBlock frames at a time.
+    template <typename Write>
+    void push(const void *in, size_t frames, Write &&write)
+    {
+        decodeSamples(format_, in, scratch_.data(), frames * channels_);
+        double sum = 0.0;
+        float peak = 0.0f;
+        analyzer_detail::levels(scratch_.data(), frames * channels_, sum, peak);
+        bool loud = frames > 0 && sum >= threshold_ * frames * channels_;
+
+        if (loud)
+        {
+            if (!open_)
+                openSegment(write);
+            holdLeft_ = hangoverFrames_;
+        }
+        else if (open_)
+        {
+            // Closing needs a free table entry for the next segment
+            if (holdLeft_ == 0 && count_ + 1 < table_.size())
+                closeSegment();
+            else
+                holdLeft_ -= std::min<uint64_t>(holdLeft_, frames);
+        }
+
+        if (open_)
+        {
+            fileFrames_ += write(in, frames);
+            table_[count_].frames += frames;
+        }
+        else
+        {
+            remember(static_cast<const uint8_t *>(in), frames);
+        }
+        position_ += frames;
+    }
+
+    // After capture: ends a segment that is still open
+    void finish()
+    {
+        if (open_)
+            closeSegment();
+    }
+
+    size_t segments() const { return count_ + (open_ ? 1 : 0); }
+    uint64_t capturedFrames() const { return position_; }
+    uint64_t keptFrames() const
+    {
+        uint64_t kept = 0;
+        for (size_t i = 0; i < segments(); i++)
+            kept += table_[i].frames;
+        return kept;
+    }
+
+    // CSV with one row per segment; `start` is the wall-clock time of the
+    // first captured frame, `fileRate` the rate the file is written at
+    bool writeIndex(const std::string &path, int fileRate, std::chrono::system_clock::time_point start) const
+    {
+        std::ofstream out(path);
+        if (!out)
+        {
+            std::cerr << "Unable to write " << path << "\n";
+            return false;
+        }
+        out << "segment,start_time,source_start_s,duration_s,file_start_s,source_start_frame,frames,file_start_frame\n";
+        for (size_t i = 0; i < segments(); i++)
+        {
+            const GateSegment &s = table_[i];
+            double sourceStart = double(s.sourceStart) / rate_;
+            auto wall = start + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                                    std::chrono::duration<double>(sourceStart));
+            std::time_t t = std::chrono::system_clock::to_time_t(wall);
+            int ms = static_cast<int>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(wall.time_since_epoch()).count() % 1000);
+            std::tm local{};
+            localtime_r(&t, &local);
+            out << i + 1 << "," << std::put_time(&local, "%Y-%m-%dT%H:%M:%S") << "." << std::setw(3)
+                << std::setfill('0') << ms << std::setfill(' ') << "," << std::fixed << std::setprecision(6)
+                << sourceStart << "," << double(s.frames) / rate_ << "," << double(s.fileStart) / fileRate << ","
+                << s.sourceStart << "," << s.frames << "," << s.fileStart << "\n";
+        }
+        return bool(out);
+    }
+
+    // One line for the end of a recording
+    void describe(std::ostream &out) const
+    {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        uint64_t kept = keptFrames();
+        out << "Gate: " << segments() << " segments, kept " << std::fixed << std::setprecision(1)
+            << double(kept) / rate_ << " s of " << double(position_) / rate_ << " s ("
+            << (position_ ? 100.0 * kept / position_ : 0.0) << "%) above " << options_.thresholdDb << " dBFS";
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+private:
+    // Copies `frames` into the pre-roll buffer, oldest frames overwritten
+    void remember(const uint8_t *in, size_t frames)
+    {
+        if (preRollFrames_ == 0)
+            return;
+        if (frames > preRollFrames_)
+        {
+            in += (frames - preRollFrames_) * frameBytes_;
+            frames = preRollFrames_;
+        }
+        size_t first = std::min<uint64_t>(frames, preRollFrames_ - ringPos_);
+        std::memcpy(preRoll_.data() + ringPos_ * frameBytes_, in, first * frameBytes_);
+        std::memcpy(preRoll_.data(), in + first * frameBytes_, (frames - first) * frameBytes_);
+        ringPos_ = (ringPos_ + frames) % preRollFrames_;
+        ringFill_ = std::min<uint64_t>(ringFill_ + frames, preRollFrames_);
+    }
+
+    // Starts a segment with the buffered pre-roll, which then counts as used
+    template <typename Write>
+    void openSegment(Write &write)
+    {
+        GateSegment &segment = table_[count_];
+        segment.sourceStart = position_ - ringFill_;
+        segment.frames = ringFill_;
+        segment.fileStart = fileFrames_;
+
+        uint64_t at = (ringPos_ + preRollFrames_ - ringFill_) % std::max<uint64_t>(preRollFrames_, 1);
+        while (ringFill_ > 0)
+        {
+            size_t n = std::min<uint64_t>({ringFill_, preRollFrames_ - at, maxBlock_});
+            fileFrames_ += write(preRoll_.data() + at * frameBytes_, n);
+            at = (at + n) % preRollFrames_;
+            ringFill_ -= n;
+        }
+        open_ = true;
+    }
+
+    void closeSegment()
+    {
+        open_ = false;
+        count_++;
+        ringPos_ = 0;
+    }
+
+    GateOptions options_;
+    SampleFormat format_;
+    int rate_;
+    int channels_;
+    size_t frameBytes_;
+    size_t maxBlock_;
+    uint64_t preRollFrames_;
+    uint64_t hangoverFrames_;
+    double threshold_; // as a mean square
+
+    std::vector<uint8_t> preRoll_;
+    std::vector<float> scratch_;
+    std::vector<GateSegment> table_;
+    uint64_t ringPos_ = 0;  // next write position in preRoll_
+    uint64_t ringFill_ = 0; // frames buffered since the last segment
+    size_t count_ = 0;      // closed segments; table_[count_] is the open one
+    bool open_ = false;
+    uint64_t holdLeft_ = 0;
+    uint64_t position_ = 0;   // frames captured
+    uint64_t fileFrames_ = 0; // frames the file received
+};
@@ -0,0 +1,460 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fft.h"
+#include "generators.h"
+#include "sample_format.h"
+#include "spsc_ring.h"
+
+// Live level meter and spectrum analyzer fed from a capture loop.
+//
+// The audio thread calls publish() with each captured block: it converts
+// channel 0 to float into preallocated scratch and copies it into a
+// lock-free ring, nothing else. What doesn't fit in the ring is dropped and
+// counted. An analysis thread drains the ring; if more than two FFT frames
+// are queued it discards the oldest, so the display stays live rather than
+// catching up. Per hop it measures RMS/peak and runs a Hann-windowed FFT
+// (real input packed into a half-size complex transform) with 75% overlap,
+// averaged exponentially. Every update interval it redraws a two-line
+// terminal display or appends one JSON line to a metrics stream.
+
+namespace analyzer_detail
+{
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef int32_t v8si __attribute__((vector_size(32)));
+
+// out[i] = a[i] * b[i]
+template <typename VF, int W>
+__attribute__((always_inline)) inline size_t multiplyBody(const float *a, const float *b, float *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + W <= n; i += W)
+    {
+        VF x, y;
+        std::memcpy(&x, a + i, sizeof(x));
+        std::memcpy(&y, b + i, sizeof(y));
+        x *= y;
+        std::memcpy(out + i, &x, sizeof(x));
+    }
+    return i;
+}
+
+// avg[i] += k * (x[i] - avg[i])
+template <typename VF, int W>
+__attribute__((always_inline)) inline size_t smoothBody(float *avg, const float *x, float k, size_t n)
+{
+    size_t i = 0;
+    for (; i + W <= n; i += W)
+    {
+        VF a, v;
+        std::memcpy(&a, avg + i, sizeof(a));
+        std::memcpy(&v, x + i, sizeof(v));
+        a += k * (v - a);
+        std::memcpy(avg + i, &a, sizeof(a));
+    }
+    return i;
+}
+
+// Sum of squares and max |x|
+template <typename VF, typename VI, int W>
+__attribute__((always_inline)) inline size_t levelsBody(const float *x, size_t n, double &sum, float &peak)
+{
+    VF acc = {}, top = {};
+    size_t i = 0;
+    for (; i + W <= n; i += W)
+    {
+        VF v;
+        std::memcpy(&v, x + i, sizeof(v));
+        acc += v * v;
+        v = (VF)((VI)v & 0x7fffffff);
+        top = v > top ? v : top;
+    }
+    for (int k = 0; k < W; k++)
+    {
+        sum += acc[k];
+        peak = std::max(peak, top[k]);
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) inline size_t multiplyAvx2(const float *a, const float *b, float *out, size_t n)
+{
+    return multiplyBody<v8sf, 8>(a, b, out, n);
+}
+
+__attribute__((target("avx2,fma"))) inline size_t smoothAvx2(float *avg, const float *x, float k, size_t n)
+{
+    return smoothBody<v8sf, 8>(avg, x, k, n);
+}
+
+__attribute__((target("avx2,fma"))) inline size_t levelsAvx2(const float *x, size_t n, double &sum, float &peak)
+{
+    return levelsBody<v8sf, v8si, 8>(x, n, sum, peak);
+}
+#endif
+
+inline bool useVec4()
+{
+    switch (activeSimdIsa())
+    {
+    case SimdIsa::Sse:
+    case SimdIsa::Neon:
+        return true;
+    default:
+        return false;
+    }
+}
+
+inline void multiply(const float *a, const float *b, float *out, size_t n)
+{
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (activeSimdIsa() == SimdIsa::Avx2)
+        i = multiplyAvx2(a, b, out, n);
+#endif
+    if (useVec4())
+        i = multiplyBody<v4sf, 4>(a, b, out, n);
+    for (; i < n; i++)
+        out[i] = a[i] * b[i];
+}
+
+inline void smooth(float *avg, const float *x, float k, size_t n)
+{
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (activeSimdIsa() == SimdIsa::Avx2)
+        i = smoothAvx2(avg, x, k, n);
+#endif
+    if (useVec4())
+        i = smoothBody<v4sf, 4>(avg, x, k, n);
+    for (; i < n; i++)
+        avg[i] += k * (x[i] - avg[i]);
+}
+
+inline void levels(const float *x, size_t n, double &sum, float &peak)
+{
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (activeSimdIsa() == SimdIsa::Avx2)
+        i = levelsAvx2(x, n, sum, peak);
+#endif
+    if (useVec4())
+        i = levelsBody<v4sf, v4si, 4>(x, n, sum, peak);
+    for (; i < n; i++)
+    {
+        sum += double(x[i]) * x[i];
+        peak = std::max(peak, std::abs(x[i]));
+    }
+}
+
+inline double toDb(double power)
+{
+    return 10.0 * std::log10(std::max(power, 1e-12));
+}
+
+} // namespace analyzer_detail
+
+// Hann-windowed power spectrum of a real frame of `n` samples, computed as a
+// half-size complex transform. Scaled so a full-scale sine reads 0 dB in
+// its bin. One instance per thread; compute() does not allocate.
+class PowerSpectrum
+{
+public:
+    explicit PowerSpectrum(size_t n)
+        : n_(n), plan_(n / 2), window_(n), windowed_(n), re_(n / 2), im_(n / 2), twiddleRe_(n / 2), twiddleIm_(n / 2)
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < n_; i++)
+        {
+            window_[i] = static_cast<float>(0.5 - 0.5 * std::cos(2.0 * M_PI * i / n_));
+            sum += window_[i];
+        }
+        scale_ = static_cast<float>(4.0 / (sum * sum));
+        for (size_t k = 0; k < n_ / 2; k++)
+        {
+            twiddleRe_[k] = static_cast<float>(std::cos(-2.0 * M_PI * k / n_));
+            twiddleIm_[k] = static_cast<float>(std::sin(-2.0 * M_PI * k / n_));
+        }
+    }
+
+    size_t size() const { return n_; }
+    size_t bins() const { return n_ / 2 + 1; }
+
+    // `frame` holds size() samples, `power` receives bins() values
+    void compute(const float *frame, float *power)
+    {
+        analyzer_detail::multiply(frame, window_.data(), windowed_.data(), n_);
+        size_t half = n_ / 2;
+        for (size_t i = 0; i < half; i++)
+        {
+            re_[i] = windowed_[2 * i];
+            im_[i] = windowed_[2 * i + 1];
+        }
+        plan_.forward(re_.data(), im_.data());
+
+        // Split the packed transform: X[k] = E[k] + W^k O[k]
+        for (size_t k = 0; k <= half; k++)
+        {
+            size_t a = k % half, b = (half - k) % half;
+            float zr = re_[a], zi = im_[a], cr = re_[b], ci = -im_[b];
+            float er = 0.5f * (zr + cr), ei = 0.5f * (zi + ci);
+            float or_ = 0.5f * (zi - ci), oi = -0.5f * (zr - cr);
+            float wr = k < half ? twiddleRe_[k] : -1.0f, wi = k < half ? twiddleIm_[k] : 0.0f;
+            float xr = er + wr * or_ - wi * oi, xi = ei + wr * oi + wi * or_;
+            power[k] = (xr * xr + xi * xi) * scale_;
+        }
+    }
+
+private:
+    size_t n_;
+    FftPlan<float> plan_;
+    std::vector<float> window_, windowed_, re_, im_, twiddleRe_, twiddleIm_;
+    float scale_ = 1.0f;
+};
+
+struct AnalyzerOptions
+{
+    bool enabled = false;       // --analyze[=FILE]
+    std::string streamFile;     // JSON lines instead of the terminal display
+    size_t fftSize = 4096;      // --analyze-fft=N, power of two
+    double averageSeconds = 0.3; // exponential averaging time constant
+    double interval = 0.1;       // seconds between display updates / stream records
+    int bands = 48;              // log-spaced display bands from 20 Hz to Nyquist
+};
+
+class LiveAnalyzer
+{
+public:
+    // `maxBlock` is the largest block publish() will see
+    LiveAnalyzer(const AnalyzerOptions &options, unsigned int rate, size_t maxBlock)
+        : options_(options), rate_(rate), n_(nextPowerOfTwo(std::max<size_t>(options.fftSize, 64))),
+          hop_(n_ / 4), ring_(std::max<size_t>(n_ * 4, maxBlock * 4)), scratch_(maxBlock), history_(n_),
+          discard_(n_), power_(n_ / 2 + 1), average_(n_ / 2 + 1), spectrum_(n_), bandEdges_(options.bands + 1),
+          bandDb_(options.bands)
+    {
+        smoothing_ = static_cast<float>(1.0 - std::exp(-double(hop_) / rate / options.averageSeconds));
+
+        // Log-spaced band edges in bins, at least one bin wide
+        double lo = 20.0, hi = rate / 2.0;
+        for (int b = 0; b <= options.bands; b++)
+        {
+            double f = lo * std::pow(hi / lo, double(b) / options.bands);
+            bandEdges_[b] = std::min(n_ / 2, static_cast<size_t>(std::lround(f * n_ / rate)));
+            if (b > 0)
+                bandEdges_[b] = std::max(bandEdges_[b], bandEdges_[b - 1] + 1);
+        }
+    }
+
+    ~LiveAnalyzer() { stop(); }
+
+    LiveAnalyzer(const LiveAnalyzer &) = delete;
+    LiveAnalyzer &operator=(const LiveAnalyzer &) = delete;
+
+    bool start()
+    {
+        if (!options_.streamFile.empty())
+        {
+            stream_.open(options_.streamFile);
+            if (!stream_)
+            {
+                std::cerr << "Unable to open analyzer stream " << options_.streamFile << "\n";
+                return false;
+            }
+        }
+        thread_ = std::thread(&LiveAnalyzer::run, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (!thread_.joinable())
+            return;
+        stopping_.store(true, std::memory_order_release);
+        thread_.join();
+        if (!stream_.is_open())
+            std::cout << "\n";
+    }
+
+    // Audio thread: hand over channel 0 of an interleaved block. Never blocks
+    // or allocates; what doesn't fit in the ring is dropped.
+    void publish(SampleFormat format, const void *samples, size_t frames, int channels)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(samples);
+        size_t stride = sampleBytes(format) * channels;
+        for (size_t done = 0; done < frames;)
+        {
+            size_t n = std::min(frames - done, scratch_.size());
+            if (channels == 1)
+                decodeSamples(format, bytes + done * stride, scratch_.data(), n);
+            else
+                for (size_t i = 0; i < n; i++)
+                    decodeSamples(format, bytes + (done + i) * stride, &scratch_[i], 1);
+            size_t written = ring_.write(scratch_.data(), n);
+            if (written < n)
+                droppedFrames_.fetch_add(n - written, std::memory_order_relaxed);
+            done += n;
+        }
+    }
+
+    // Frames lost because the ring was full plus frames skipped to catch up
+    uint64_t droppedFrames() const
+    {
+        return droppedFrames_.load(std::memory_order_relaxed) + skippedFrames_.load(std::memory_order_relaxed);
+    }
+    uint64_t analyzedFrames() const { return analyzedFrames_.load(std::memory_order_relaxed); }
+
+private:
+    void run()
+    {
+        using namespace std::chrono;
+        auto hopTime = duration<double>(double(hop_) / rate_);
+        size_t filled = 0;
+        auto nextUpdate = steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(options_.interval));
+
+        while (!stopping_.load(std::memory_order_acquire))
+        {
+            // Too far behind: drop the backlog, keep the newest frames
+            size_t queued = ring_.readAvailable();
+            if (queued > 2 * n_)
+            {
+                size_t skip = queued - n_;
+                for (size_t left = skip; left > 0;)
+                    left -= ring_.read(discard_.data(), std::min(left, n_));
+                skippedFrames_.fetch_add(skip, std::memory_order_relaxed);
+            }
+
+            size_t want = filled < n_ ? n_ - filled : hop_;
+            if (ring_.readAvailable() < want)
+            {
+                std::this_thread::sleep_for(hopTime / 4);
+                continue;
+            }
+            if (filled == n_)
+            {
+                std::memmove(history_.data(), history_.data() + hop_, (n_ - hop_) * sizeof(float));
+                filled -= hop_;
+            }
+            ring_.read(history_.data() + filled, want);
+            analyzer_detail::levels(history_.data() + filled, want, levelSum_, levelPeak_);
+            levelFrames_ += want;
+            filled += want;
+            analyzedFrames_.fetch_add(want, std::memory_order_relaxed);
+            spectrum();
+
+            if (steady_clock::now() >= nextUpdate)
+            {
+                update();
+                nextUpdate += duration_cast<steady_clock::duration>(duration<double>(options_.interval));
+            }
+        }
+    }
+
+    // One windowed frame into the averaged power spectrum
+    void spectrum()
+    {
+        spectrum_.compute(history_.data(), power_.data());
+        if (!averaged_)
+        {
+            average_ = power_;
+            averaged_ = true;
+        }
+        else
+            analyzer_detail::smooth(average_.data(), power_.data(), smoothing_, spectrum_.bins());
+    }
+
+    // RMS is in dBFS relative to a full-scale sine, which reads 0 like its peak
+    void update()
+    {
+        double rmsDb = levelFrames_ ? analyzer_detail::toDb(levelSum_ / levelFrames_ * 2.0) : -120.0;
+        double peakDb = analyzer_detail::toDb(double(levelPeak_) * levelPeak_);
+        levelSum_ = 0.0;
+        levelFrames_ = 0;
+        levelPeak_ = 0.0f;
+
+        for (int b = 0; b < options_.bands; b++)
+        {
+            float top = 0.0f;
+            for (size_t k = bandEdges_[b]; k < bandEdges_[b + 1] && k <= n_ / 2; k++)
+                top = std::max(top, average_[k]);
+            bandDb_[b] = analyzer_detail::toDb(top);
+        }
+
+        if (stream_.is_open())
+            writeRecord(rmsDb, peakDb);
+        else
+            draw(rmsDb, peakDb);
+        elapsed_ += options_.interval;
+    }
+
+    void draw(double rmsDb, double peakDb)
+    {
+        static const char *levels[] = {" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+        const int meterWidth = 40;
+        int rmsBars = std::clamp(int((rmsDb + 60.0) / 60.0 * meterWidth), 0, meterWidth);
+        int peakBar = std::clamp(int((peakDb + 60.0) / 60.0 * meterWidth), 0, meterWidth - 1);
+
+        std::ostringstream out;
+        out << (drawn_ ? "\033[2A" : "") << "\r[";
+        for (int i = 0; i < meterWidth; i++)
+            out << (i < rmsBars ? "#" : i == peakBar ? "|" : "-");
+        out << "] rms " << std::fixed << std::setprecision(1) << std::setw(6) << rmsDb << " peak " << std::setw(6)
+            << peakDb << " dBFS  dropped " << droppedFrames() << "\033[K\n";
+        for (int b = 0; b < options_.bands; b++)
+            out << levels[std::clamp(int((bandDb_[b] + 90.0) / 90.0 * 8.0), 0, 8)];
+        out << "  20 Hz - " << rate_ / 2000 << " kHz\033[K\n";
+        std::cout << out.str() << std::flush;
+        drawn_ = true;
+    }
+
+    void writeRecord(double rmsDb, double peakDb)
+    {
+        stream_ << std::fixed << std::setprecision(1) << "{\"t\": " << elapsed_ << ", \"rms_db\": " << rmsDb
+                << ", \"peak_db\": " << peakDb << ", \"dropped\": " << droppedFrames() << ", \"bands_from_hz\": [";
+        for (int b = 0; b < options_.bands; b++)
+            stream_ << (b ? ", " : "") << std::lround(double(bandEdges_[b]) * rate_ / n_);
+        stream_ << "], \"bands_db\": [";
+        for (int b = 0; b < options_.bands; b++)
+            stream_ << (b ? ", " : "") << bandDb_[b];
+        stream_ << "]}\n" << std::flush;
+    }
+
+    AnalyzerOptions options_;
+    unsigned int rate_;
+    size_t n_, hop_;
+    SpscRing<float> ring_;
+    std::vector<float> scratch_; // audio thread only
+
+    // Analysis thread only
+    std::vector<float> history_, discard_, power_, average_;
+    PowerSpectrum spectrum_;
+    std::vector<size_t> bandEdges_;
+    std::vector<double> bandDb_;
+    float smoothing_ = 1.0f;
+    bool averaged_ = false, drawn_ = false;
+    double levelSum_ = 0.0, elapsed_ = 0.0;
+    float levelPeak_ = 0.0f;
+    size_t levelFrames_ = 0;
+    std::ofstream stream_;
+
+    std::thread thread_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<uint64_t> droppedFrames_{0}, skippedFrames_{0}, analyzedFrames_{0};
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "sample_format.h"
+
+// Streaming destination for captured audio: WavStreamWriter (wav_stream.h)
+// or FlacStreamWriter (flac_stream.h). The capture thread calls write() or
+// writeFloat(); implementations never block or allocate there and count
+// what they had to drop instead.
+class AudioSink
+{
+public:
+    virtual ~AudioSink() = default;
+
+    virtual bool open(const std::string &filename, int sampleRate, int channels,
+                      SampleFormat format = SampleFormat::S16) = 0;
+    // TPDF dither when writing float samples to a 16/24-bit file
+    virtual void setDither(bool enabled) = 0;
+    virtual void write(const short *samples, size_t frames) = 0;
+    // Same for float samples in [-1, 1)
+    virtual void writeFloat(const float *samples, size_t frames) = 0;
+    // Flushes what is buffered and finalizes the file
+    virtual void close() = 0;
+
+    virtual uint64_t framesWritten() const = 0;
+    virtual uint64_t droppedFrames() const = 0;
+    // One line for the end of a recording, e.g. " (RF64)"; empty by default
+    virtual void describe(std::ostream &) const {}
+};
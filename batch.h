@@ -0,0 +1,648 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "analyzer.h"
+#include "fft.h"
+#include "realtime.h"
+#include "sample_format.h"
+#include "thread_pool.h"
+#include "wav_file.h"
+#include "wav_mmap.h"
+
+// Offline analysis of every WAV file under a directory.
+//
+// Files are found recursively, then analysed on a work-stealing pool with
+// one worker per core, largest files first so that the long jobs never end
+// up last. Each file is memory-mapped and decoded in blocks, so levels,
+// clipping and spectrum use constant memory per worker however long the
+// recording is. The IR analysis needs the whole channel for the
+// deconvolution. Every job fills its own slot of the result table, so
+// workers share nothing but two progress counters. The main thread prints
+// files/s and MB/s while they run, then writes one CSV or JSON report with
+// a row per file and channel, sorted by path.
+
+enum class BatchAnalysis
+{
+    Levels,   // RMS, peak, DC offset, crest factor
+    Clipping, // samples at full scale and runs of them
+    Spectrum, // Welch-averaged spectrum: peak frequency and octave bands
+    ImpulseResponse, // exponential sweep deconvolution: delay and IR peak
+};
+
+inline bool parseBatchAnalysis(const std::string &name, BatchAnalysis &analysis)
+{
+    if (name == "levels")
+        analysis = BatchAnalysis::Levels;
+    else if (name == "clipping")
+        analysis = BatchAnalysis::Clipping;
+    else if (name == "spectrum")
+        analysis = BatchAnalysis::Spectrum;
+    else if (name == "ir")
+        analysis = BatchAnalysis::ImpulseResponse;
+    else
+        return false;
+    return true;
+}
+
+inline const char *batchAnalysisName(BatchAnalysis analysis)
+{
+    switch (analysis)
+    {
+    case BatchAnalysis::Levels:
+        return "levels";
+    case BatchAnalysis::Clipping:
+        return "clipping";
+    case BatchAnalysis::Spectrum:
+        return "spectrum";
+    case BatchAnalysis::ImpulseResponse:
+        return "ir";
+    }
+    return "?";
+}
+
+struct BatchOptions
+{
+    BatchAnalysis analysis = BatchAnalysis::Levels;
+    int threads = 0;            // 0 = one per core
+    double clipLevel = 0.999;   // |x| at or above this counts as clipped
+    int clipRun = 3;            // consecutive clipped samples that make a clip event
+    size_t fftSize = 4096;      // spectrum frame, 50% overlap
+    double sweepSeconds = 5.0;  // ir: the sweep that was played
+    double f0 = 20.0, f1 = 0.0; // ir: sweep range, f1 = 0 means rate / 2
+    double irMs = 500.0;        // ir: length of the written IRs
+    std::string irDir;          // ir: write each linear IR here when set
+};
+
+namespace batch_detail
+{
+
+const size_t kBlockFrames = 8192;
+const size_t kMinSpectrumFrames = 64; // smallest FFT frame, and the shortest file spectrum takes
+const double kOctaveCentres[] = {31.25, 62.5, 125, 250, 500, 1000, 2000, 4000, 8000, 16000};
+const char *const kOctaveNames[] = {"31", "63", "125", "250", "500", "1k", "2k", "4k", "8k", "16k"};
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+struct File
+{
+    std::filesystem::path path;
+    std::string name; // relative to the batch directory
+    uint64_t bytes = 0;
+};
+
+struct Row
+{
+    int channel = 0;
+    std::vector<double> values; // one per analysis column
+    std::string irFile;
+};
+
+struct Result
+{
+    int rate = 0;
+    uint64_t frames = 0;
+    std::vector<Row> rows;
+    std::string error;
+};
+
+inline std::vector<std::string> columns(const BatchOptions &options)
+{
+    switch (options.analysis)
+    {
+    case BatchAnalysis::Levels:
+        return {"rms_db", "peak_db", "dc", "crest_db"};
+    case BatchAnalysis::Clipping:
+        return {"clipped_samples", "clip_events", "longest_run", "first_clip_s"};
+    case BatchAnalysis::Spectrum:
+    {
+        std::vector<std::string> names = {"peak_hz", "peak_db"};
+        for (const char *band : kOctaveNames)
+            names.push_back(std::string("oct_") + band + "_db");
+        return names;
+    }
+    case BatchAnalysis::ImpulseResponse:
+        return {"delay_frames", "delay_ms", "peak_db"};
+    }
+    return {};
+}
+
+// Decodes a mapped file block by block and hands each channel to `fn`
+// as contiguous floats: fn(channel, samples, frames, firstFrame)
+template <typename Fn>
+void forEachBlock(const MappedWav &wav, std::vector<float> &interleaved, std::vector<float> &planar, Fn &&fn)
+{
+    int channels = wav.channels();
+    interleaved.resize(kBlockFrames * channels);
+    planar.resize(kBlockFrames);
+    for (uint64_t first = 0; first < wav.frames(); first += kBlockFrames)
+    {
+        size_t frames = static_cast<size_t>(std::min<uint64_t>(kBlockFrames, wav.frames() - first));
+        decodeSamples(wav.format(), wav.data(first), interleaved.data(), frames * channels);
+        for (int c = 0; c < channels; c++)
+        {
+            const float *in = interleaved.data() + c;
+            if (channels == 1)
+                fn(c, in, frames, first);
+            else
+            {
+                for (size_t i = 0; i < frames; i++)
+                    planar[i] = in[i * channels];
+                fn(c, planar.data(), frames, first);
+            }
+        }
+    }
+}
+
+// Per worker: decode buffers and the spectrum plan are reused across files
+struct Scratch
+{
+    std::vector<float> interleaved, planar, power;
+    std::unique_ptr<PowerSpectrum> spectrum;
+};
+
+inline void analyzeLevels(const MappedWav &wav, Scratch &scratch, Result &result)
+{
+    int channels = wav.channels();
+    std::vector<double> sum(channels), dc(channels);
+    std::vector<float> peak(channels);
+    forEachBlock(wav, scratch.interleaved, scratch.planar, [&](int c, const float *x, size_t n, uint64_t)
+    {
+        analyzer_detail::levels(x, n, sum[c], peak[c]);
+        double s = 0.0;
+        for (size_t i = 0; i < n; i++)
+            s += x[i];
+        dc[c] += s;
+    });
+    double frames = std::max<double>(1.0, wav.frames());
+    for (int c = 0; c < channels; c++)
+    {
+        double meanSquare = sum[c] / frames;
+        double peakDb = analyzer_detail::toDb(double(peak[c]) * peak[c]);
+        // RMS relative to a full-scale sine, like the live analyzer
+        result.rows.push_back({c, {analyzer_detail::toDb(meanSquare * 2.0), peakDb, dc[c] / frames,
+                                   meanSquare > 0.0 ? peakDb - analyzer_detail::toDb(meanSquare) : kNaN}, {}});
+    }
+}
+
+inline void analyzeClipping(const MappedWav &wav, const BatchOptions &options, Scratch &scratch, Result &result)
+{
+    struct State
+    {
+        uint64_t clipped = 0, events = 0, longest = 0, run = 0;
+        int64_t first = -1;
+    };
+    int channels = wav.channels();
+    std::vector<State> states(channels);
+    float level = static_cast<float>(options.clipLevel);
+    uint64_t minRun = std::max(1, options.clipRun);
+
+    forEachBlock(wav, scratch.interleaved, scratch.planar, [&](int c, const float *x, size_t n, uint64_t first)
+    {
+        State &s = states[c];
+        double sum = 0.0;
+        float peak = 0.0f;
+        analyzer_detail::levels(x, n, sum, peak);
+        if (peak < level) // nothing near full scale: skip the per-sample scan
+        {
+            s.run = 0;
+            return;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            if (std::abs(x[i]) < level)
+            {
+                s.run = 0;
+                continue;
+            }
+            s.clipped++;
+            if (s.first < 0)
+                s.first = static_cast<int64_t>(first + i);
+            if (++s.run == minRun)
+                s.events++;
+            s.longest = std::max(s.longest, s.run);
+        }
+    });
+    for (int c = 0; c < channels; c++)
+    {
+        const State &s = states[c];
+        result.rows.push_back({c, {double(s.clipped), double(s.events), double(s.longest),
+                                   s.first < 0 ? kNaN : double(s.first) / wav.rate()}, {}});
+    }
+}
+
+inline void analyzeSpectrum(const MappedWav &wav, const BatchOptions &options, Scratch &scratch, Result &result)
+{
+    // A file shorter than one frame gets the largest frame it fills: zero
+    // padding would land under the Hann window's tail and read as garbage
+    size_t n = nextPowerOfTwo(std::max<size_t>(options.fftSize, kMinSpectrumFrames));
+    while (n > kMinSpectrumFrames && n > wav.frames())
+        n /= 2;
+    size_t hop = n / 2;
+    if (!scratch.spectrum || scratch.spectrum->size() != n)
+        scratch.spectrum = std::make_unique<PowerSpectrum>(n);
+    PowerSpectrum &spectrum = *scratch.spectrum;
+    size_t bins = spectrum.bins();
+    scratch.power.resize(bins);
+
+    int channels = wav.channels();
+    std::vector<std::vector<float>> history(channels, std::vector<float>(n));
+    std::vector<std::vector<double>> average(channels, std::vector<double>(bins));
+    std::vector<size_t> filled(channels), count(channels);
+
+    auto accumulate = [&](int c)
+    {
+        spectrum.compute(history[c].data(), scratch.power.data());
+        for (size_t k = 0; k < bins; k++)
+            average[c][k] += scratch.power[k];
+        count[c]++;
+    };
+    forEachBlock(wav, scratch.interleaved, scratch.planar, [&](int c, const float *x, size_t frames, uint64_t)
+    {
+        for (size_t done = 0; done < frames;)
+        {
+            size_t take = std::min(frames - done, n - filled[c]);
+            std::memcpy(history[c].data() + filled[c], x + done, take * sizeof(float));
+            filled[c] += take;
+            done += take;
+            if (filled[c] == n)
+            {
+                accumulate(c);
+                std::memmove(history[c].data(), history[c].data() + hop, (n - hop) * sizeof(float));
+                filled[c] -= hop;
+            }
+        }
+    });
+
+    double binHz = double(wav.rate()) / n;
+    for (int c = 0; c < channels; c++)
+    {
+        Row row{c, {}, {}};
+        if (count[c] == 0)
+            row.values.assign(2 + std::size(kOctaveCentres), kNaN);
+        else
+        {
+            std::vector<double> &p = average[c];
+            for (double &v : p)
+                v /= count[c];
+
+            // Strongest bin above DC; its level is the power of the Hann main lobe
+            // (two bins either side), which reads a sine correctly between bins
+            size_t top = 1;
+            for (size_t k = 2; k + 1 < bins; k++)
+                if (p[k] > p[top])
+                    top = k;
+            double lobe = 0.0, moment = 0.0;
+            for (size_t k = std::max<size_t>(top, 3) - 2; k <= std::min(top + 2, bins - 1); k++)
+            {
+                lobe += p[k];
+                moment += p[k] * k;
+            }
+            if (lobe > 1e-12)
+                row.values = {moment / lobe * binHz, analyzer_detail::toDb(lobe / 1.5)};
+            else
+                row.values = {kNaN, kNaN};
+
+            // Octave band power; Hann spreads a sine over 1.5 bins of noise bandwidth
+            for (double centre : kOctaveCentres)
+            {
+                size_t lo = static_cast<size_t>(std::ceil(centre / std::sqrt(2.0) / binHz));
+                double hiHz = centre * std::sqrt(2.0);
+                size_t hi = static_cast<size_t>(std::ceil(hiHz / binHz));
+                if (hiHz > wav.rate() / 2.0 || hi <= lo)
+                {
+                    row.values.push_back(kNaN);
+                    continue;
+                }
+                double band = 0.0;
+                for (size_t k = lo; k < hi; k++)
+                    band += p[k];
+                row.values.push_back(analyzer_detail::toDb(band / 1.5));
+            }
+        }
+        result.rows.push_back(std::move(row));
+    }
+}
+
+inline void analyzeImpulseResponse(const MappedWav &wav, const File &file, const BatchOptions &options,
+                                   Scratch &scratch, Result &result)
+{
+    int channels = wav.channels(), rate = wav.rate();
+    std::vector<std::vector<double>> recording(channels, std::vector<double>(wav.frames()));
+    forEachBlock(wav, scratch.interleaved, scratch.planar, [&](int c, const float *x, size_t n, uint64_t first)
+    {
+        std::copy(x, x + n, recording[c].begin() + first);
+    });
+
+    double f1 = options.f1 > 0.0 ? options.f1 : rate / 2.0;
+    for (int c = 0; c < channels; c++)
+    {
+        // One thread per file: the pool already keeps every core busy
+        SweepResponse sweep = deconvolveSweep(recording[c], rate, options.sweepSeconds, options.f0, f1, 1);
+        long peak = sweep.origin + sweep.delay;
+        Row row{c, {double(sweep.delay), 1000.0 * sweep.delay / rate, kNaN}, {}};
+        if (peak < static_cast<long>(sweep.response.size()))
+            row.values[2] = 20.0 * std::log10(std::max(std::fabs(sweep.response[peak]), 1e-12));
+
+        if (!options.irDir.empty())
+        {
+            long preFrames = rate / 1000; // 1 ms before the onset, like the ir command
+            long length = static_cast<long>(options.irMs * rate / 1000.0) + preFrames;
+            std::vector<float> ir(length, 0.0f);
+            for (long i = 0; i < length; i++)
+            {
+                long at = peak - preFrames + i;
+                if (at >= 0 && at < static_cast<long>(sweep.response.size()))
+                    ir[i] = static_cast<float>(sweep.response[at]);
+            }
+            std::string stem = file.name;
+            std::replace(stem.begin(), stem.end(), '/', '_');
+            stem = stem.substr(0, stem.size() - 4);
+            row.irFile = (std::filesystem::path(options.irDir) / (stem + "_ch" + std::to_string(c) + "_ir.wav")).string();
+            writeWavFloat(row.irFile, ir, rate, 1);
+        }
+        result.rows.push_back(std::move(row));
+    }
+}
+
+inline void analyzeFile(const File &file, const BatchOptions &options, Scratch &scratch, Result &result)
+{
+    MappedWav wav;
+    if (!wav.open(file.path.string()))
+    {
+        result.error = "unreadable";
+        return;
+    }
+    result.rate = wav.rate();
+    result.frames = wav.frames();
+    switch (options.analysis)
+    {
+    case BatchAnalysis::Levels:
+        analyzeLevels(wav, scratch, result);
+        break;
+    case BatchAnalysis::Clipping:
+        analyzeClipping(wav, options, scratch, result);
+        break;
+    case BatchAnalysis::Spectrum:
+        if (wav.frames() < kMinSpectrumFrames)
+            result.error = "shorter than one FFT frame";
+        else
+            analyzeSpectrum(wav, options, scratch, result);
+        break;
+    case BatchAnalysis::ImpulseResponse:
+        if (wav.frames() < options.sweepSeconds * wav.rate())
+            result.error = "shorter than the sweep";
+        else
+            analyzeImpulseResponse(wav, file, options, scratch, result);
+        break;
+    }
+}
+
+inline std::vector<File> findWavFiles(const std::string &directory)
+{
+    namespace fs = std::filesystem;
+    std::vector<File> files;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(directory, fs::directory_options::skip_permission_denied, ec), end;
+         !ec && it != end; it.increment(ec))
+    {
+        if (!it->is_regular_file(ec))
+            continue;
+        std::string ext = it->path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext != ".wav")
+            continue;
+        files.push_back({it->path(), fs::relative(it->path(), directory, ec).generic_string(), it->file_size(ec)});
+    }
+    std::sort(files.begin(), files.end(), [](const File &a, const File &b) { return a.name < b.name; });
+    return files;
+}
+
+inline std::string csvField(const std::string &text)
+{
+    if (text.find_first_of(",\"\n") == std::string::npos)
+        return text;
+    std::string quoted = "\"";
+    for (char ch : text)
+        quoted += ch == '"' ? std::string("\"\"") : std::string(1, ch);
+    return quoted + "\"";
+}
+
+inline std::string jsonString(const std::string &text)
+{
+    std::ostringstream out;
+    out << '"';
+    for (unsigned char ch : text)
+    {
+        if (ch == '"' || ch == '\\')
+            out << '\\' << ch;
+        else if (ch < 0x20)
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(ch) << std::dec;
+        else
+            out << ch;
+    }
+    out << '"';
+    return out.str();
+}
+
+inline std::string number(double value, const char *missing)
+{
+    if (!std::isfinite(value))
+        return missing;
+    std::ostringstream out;
+    out << std::setprecision(10) << value;
+    return out.str();
+}
+
+struct Summary
+{
+    double seconds = 0.0, megabytes = 0.0;
+    size_t errors = 0;
+    int threads = 0;
+};
+
+inline bool writeReport(const std::string &path, const std::vector<File> &files, const std::vector<Result> &results,
+                        const BatchOptions &options, const Summary &summary)
+{
+    bool json = std::filesystem::path(path).extension() == ".json";
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cerr << "Unable to write " << path << "\n";
+        return false;
+    }
+    std::vector<std::string> names = columns(options);
+    bool ir = options.analysis == BatchAnalysis::ImpulseResponse && !options.irDir.empty();
+
+    if (!json)
+    {
+        out << "file,channel,rate,frames,seconds";
+        for (const std::string &name : names)
+            out << "," << name;
+        out << (ir ? ",ir_file" : "") << ",error\n";
+        for (size_t f = 0; f < files.size(); f++)
+        {
+            const Result &r = results[f];
+            std::string common = csvField(files[f].name);
+            auto head = [&](int channel)
+            {
+                out << common << "," << channel << "," << r.rate << "," << r.frames << ","
+                    << number(r.rate ? double(r.frames) / r.rate : kNaN, "");
+            };
+            if (!r.error.empty())
+            {
+                head(0);
+                for (size_t i = 0; i < names.size() + (ir ? 1 : 0); i++)
+                    out << ",";
+                out << "," << csvField(r.error) << "\n";
+            }
+            for (const Row &row : r.rows)
+            {
+                head(row.channel);
+                for (double v : row.values)
+                    out << "," << number(v, "");
+                out << (ir ? "," + csvField(row.irFile) : "") << ",\n";
+            }
+        }
+    }
+    else
+    {
+        out << "{\n  \"analysis\": \"" << batchAnalysisName(options.analysis) << "\",\n  \"files\": " << files.size()
+            << ",\n  \"errors\": " << summary.errors << ",\n  \"threads\": " << summary.threads
+            << ",\n  \"elapsed_s\": " << number(summary.seconds, "null")
+            << ",\n  \"files_per_s\": " << number(files.size() / std::max(summary.seconds, 1e-9), "null")
+            << ",\n  \"mb_per_s\": " << number(summary.megabytes / std::max(summary.seconds, 1e-9), "null")
+            << ",\n  \"rows\": [";
+        bool firstRow = true;
+        auto begin = [&](size_t f, int channel)
+        {
+            const Result &r = results[f];
+            out << (firstRow ? "\n" : ",\n") << "    {\"file\": " << jsonString(files[f].name)
+                << ", \"channel\": " << channel << ", \"rate\": " << r.rate << ", \"frames\": " << r.frames
+                << ", \"seconds\": " << number(r.rate ? double(r.frames) / r.rate : kNaN, "null");
+            firstRow = false;
+        };
+        for (size_t f = 0; f < files.size(); f++)
+        {
+            if (!results[f].error.empty())
+            {
+                begin(f, 0);
+                out << ", \"error\": " << jsonString(results[f].error) << "}";
+            }
+            for (const Row &row : results[f].rows)
+            {
+                begin(f, row.channel);
+                for (size_t i = 0; i < names.size(); i++)
+                    out << ", \"" << names[i] << "\": " << number(row.values[i], "null");
+                if (ir)
+                    out << ", \"ir_file\": " << jsonString(row.irFile);
+                out << "}";
+            }
+        }
+        out << "\n  ]\n}\n";
+    }
+    return static_cast<bool>(out);
+}
+
+} // namespace batch_detail
+
+// Analyse every WAV under `directory` and write the report to `reportPath`
+// (.csv or .json); false if nothing could be analysed or written
+inline bool runBatch(const std::string &directory, const std::string &reportPath, const BatchOptions &options)
+{
+    using namespace batch_detail;
+    std::string ext = std::filesystem::path(reportPath).extension().string();
+    if (ext != ".csv" && ext != ".json")
+    {
+        std::cerr << "Report must be a .csv or .json file: " << reportPath << "\n";
+        return false;
+    }
+    std::vector<File> files = findWavFiles(directory);
+    if (files.empty())
+    {
+        std::cerr << "No .wav files under " << directory << "\n";
+        return false;
+    }
+    if (!options.irDir.empty())
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(options.irDir, ec);
+    }
+    stopLockingNewMappings(); // with --rt, don't pin every mapped file
+
+    // Largest first; results stay in path order
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return files[a].bytes > files[b].bytes; });
+    uint64_t totalBytes = 0;
+    for (const File &file : files)
+        totalBytes += file.bytes;
+
+    std::vector<Result> results(files.size());
+    std::atomic<size_t> filesDone{0};
+    std::atomic<uint64_t> bytesDone{0};
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&] { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    WorkStealingPool pool(options.threads);
+    std::vector<Scratch> scratch(pool.threads());
+    for (size_t index : order)
+    {
+        pool.submit([&, index]
+        {
+            analyzeFile(files[index], options, scratch[pool.workerIndex()], results[index]);
+            bytesDone.fetch_add(files[index].bytes, std::memory_order_relaxed);
+            filesDone.fetch_add(1, std::memory_order_release);
+        });
+    }
+
+    std::cout << "Analysing " << files.size() << " files (" << std::fixed << std::setprecision(1)
+              << totalBytes / 1e6 << " MB) on " << pool.threads() << " threads: " << batchAnalysisName(options.analysis)
+              << "\n";
+    auto lastPrint = std::chrono::steady_clock::now();
+    while (filesDone.load(std::memory_order_acquire) < files.size())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (std::chrono::steady_clock::now() - lastPrint < std::chrono::milliseconds(250))
+            continue;
+        lastPrint = std::chrono::steady_clock::now();
+        double t = elapsed();
+        size_t done = filesDone.load(std::memory_order_relaxed);
+        std::cerr << "\r  " << done << "/" << files.size() << " files  " << std::fixed << std::setprecision(1)
+                  << done / t << " files/s  " << bytesDone.load(std::memory_order_relaxed) / 1e6 / t << " MB/s\033[K"
+                  << std::flush;
+    }
+    pool.wait();
+    std::cerr << "\n";
+
+    Summary summary;
+    summary.seconds = elapsed();
+    summary.megabytes = totalBytes / 1e6;
+    summary.threads = pool.threads();
+    for (const Result &r : results)
+        summary.errors += !r.error.empty();
+
+    std::cout << "Done in " << std::setprecision(2) << summary.seconds << "s: " << std::setprecision(1)
+              << files.size() / std::max(summary.seconds, 1e-9) << " files/s, "
+              << summary.megabytes / std::max(summary.seconds, 1e-9) << " MB/s, " << pool.stolen()
+              << " jobs stolen, " << summary.errors << " errors\n";
+    if (!writeReport(reportPath, files, results, options, summary))
+        return false;
+    std::cout << "Report: " << reportPath << "\n";
+    return summary.errors < files.size();
+}
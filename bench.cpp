@@ -0,0 +1,757 @@
+// Hardware-free benchmarks for the generators, WAV I/O and the PCM engine loops.
+//
+//   g++ -std=c++20 -O2 -g bench.cpp -o cpp_audio_bench -lasound -lpthread -ldl -lm
+//   ./cpp_audio_bench [filter=all] [seconds=30] [period=512] [device=null] > results.json
+//
+// Device benchmarks run the same engine setup as record/passthrough/play
+// against ALSA's `null` PCM and the `file` plugin (playback written to a raw
+// file), so no sound card is needed. Everything else runs on in-memory
+// buffers. Results go to stdout as one JSON document; a one-line summary per
+// benchmark goes to stderr.
+
+#include <alsa/asoundlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dsp.h"
+#include "flac_stream.h"
+#include "generators.h"
+#include "metrics.h"
+#include "pcm_engine.h"
+#include "pcm_setup.h"
+#include "resampler.h"
+#include "sample_format.h"
+#include "spsc_ring.h"
+#include "thread_pool.h"
+#include "wav_file.h"
+#include "wav_stream.h"
+
+// --- Allocation counting: every operator new in the process goes through here ---
+// The replacements are kept out of line: inlined into callers, GCC sees
+// free() applied to what operator new returned and warns about a mismatch.
+std::atomic<uint64_t> allocationCount{0};
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void *operator new(size_t size, std::align_val_t align)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    size_t a = static_cast<size_t>(align);
+    if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+// --- Result reporting ---
+struct BenchResult
+{
+    BenchResult(std::string name, std::string target) : name(std::move(name)), target(std::move(target)) {}
+
+    std::string name;
+    std::string target;       // "memory" or the PCM device
+    uint64_t frames = 0;
+    double seconds = 0;
+    uint64_t allocations = 0; // during the timed section only
+    std::string latencyJson;  // per-period (or per-block) time distribution, ns
+    std::string extraJson;    // benchmark-specific fields, already formatted
+    std::string skipped;      // non-empty if the benchmark could not run
+};
+
+struct BenchConfig
+{
+    int seconds = 30;
+    int rate = 48000;
+    int period = 512;
+    std::string device = "null";
+    std::string tmpDir = "/tmp";
+};
+
+std::vector<BenchResult> results;
+int failures = 0; // correctness checks that failed; the exit status
+
+void report(BenchResult r)
+{
+    if (!r.skipped.empty())
+        std::cerr << r.name << " [" << r.target << "]: skipped, " << r.skipped << "\n";
+    else
+        std::cerr << r.name << " [" << r.target << "]: " << r.frames / r.seconds / 1e6 << " Mframes/s, "
+                  << r.allocations << " allocations\n";
+    results.push_back(std::move(r));
+}
+
+void writeResults(std::ostream &os, const BenchConfig &cfg)
+{
+    os << "{\"simd\": \"" << simdIsaName(activeSimdIsa()) << "\", \"rate\": " << cfg.rate << ", \"period\": "
+       << cfg.period << ", \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        os << (i ? ",\n" : "") << "  {\"name\": \"" << r.name << "\", \"target\": \"" << r.target << "\"";
+        if (!r.skipped.empty())
+        {
+            os << ", \"skipped\": \"" << r.skipped << "\"}";
+            continue;
+        }
+        os << ", \"frames\": " << r.frames << ", \"seconds\": " << r.seconds << ", \"frames_per_sec\": "
+           << r.frames / r.seconds << ", \"allocations\": " << r.allocations;
+        if (!r.extraJson.empty())
+            os << ", " << r.extraJson;
+        if (!r.latencyJson.empty())
+            os << ",\n   \"latency_ns\": " << r.latencyJson;
+        os << "}";
+    }
+    os << "\n]}\n";
+}
+
+// Times fn() and counts the allocations it makes
+template <typename Fn>
+void timed(BenchResult &r, Fn &&fn)
+{
+    uint64_t allocsBefore = allocationCount.load(std::memory_order_relaxed);
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    r.allocations = allocationCount.load(std::memory_order_relaxed) - allocsBefore;
+}
+
+std::string histogramJson(const Log2Histogram &h)
+{
+    std::ostringstream os;
+    h.writeJson(os);
+    return os.str();
+}
+
+// --- Generators: render a period, convert to interleaved S16 stereo ---
+template <typename Generator>
+void benchGenerator(const std::string &name, Generator gen, const BenchConfig &cfg)
+{
+    BenchResult r{name, "memory"};
+    std::vector<float> block(cfg.period), stereo(cfg.period * 2);
+    std::vector<short> out(cfg.period * 2);
+    Log2Histogram perPeriod;
+    long total = static_cast<long>(cfg.rate) * cfg.seconds;
+
+    timed(r, [&]()
+    {
+        for (long done = 0; done < total; done += cfg.period)
+        {
+            uint64_t start = metricsNow();
+            gen.render(block.data(), cfg.period);
+            duplicateChannels(block.data(), stereo.data(), cfg.period, 2);
+            encodeSamples(SampleFormat::S16, stereo.data(), out.data(), cfg.period * 2);
+            perPeriod.record(metricsNow() - start);
+        }
+    });
+    r.frames = total;
+    r.latencyJson = histogramJson(perPeriod);
+    report(std::move(r));
+}
+
+// --- Sample format conversion: 8 interleaved channels per period, both directions ---
+void benchConvert(SampleFormat format, bool dither, const BenchConfig &cfg)
+{
+    const int channels = 8;
+    BenchResult r{std::string("convert_") + sampleFormatName(format) + (dither ? "_dither" : ""), "memory"};
+    size_t samples = static_cast<size_t>(cfg.period) * channels;
+    std::vector<float> in(samples), back(samples);
+    std::vector<uint8_t> encoded(samples * 4);
+    for (size_t i = 0; i < samples; i++)
+        in[i] = 0.9f * std::sin(0.01f * i);
+    TpdfDither state;
+    Log2Histogram perPeriod;
+    long total = static_cast<long>(cfg.rate) * cfg.seconds;
+
+    timed(r, [&]()
+    {
+        for (long done = 0; done < total; done += cfg.period)
+        {
+            uint64_t start = metricsNow();
+            encodeSamples(format, in.data(), encoded.data(), samples, dither ? &state : nullptr);
+            decodeSamples(format, encoded.data(), back.data(), samples);
+            perPeriod.record(metricsNow() - start);
+        }
+    });
+    r.frames = total;
+    r.latencyJson = histogramJson(perPeriod);
+    std::ostringstream extra;
+    extra << "\"channels\": " << channels << ", \"core_share_realtime\": " << cfg.rate * r.seconds / total;
+    r.extraJson = extra.str();
+    report(std::move(r));
+}
+
+// --- Sample-rate conversion: stereo periods through the polyphase converter ---
+void benchResample(unsigned inRate, unsigned outRate, const BenchConfig &cfg)
+{
+    const int channels = 2;
+    BenchResult r{"resample_" + std::to_string(inRate) + "_" + std::to_string(outRate), "memory"};
+    PolyphaseResampler converter(inRate, outRate, channels, cfg.period);
+    std::vector<float> in(cfg.period * channels), out(converter.maxOutputFor(cfg.period) * channels);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = 0.9f * std::sin(0.01f * i);
+    Log2Histogram perPeriod;
+    long total = static_cast<long>(inRate) * cfg.seconds;
+    uint64_t produced = 0;
+
+    timed(r, [&]()
+    {
+        for (long done = 0; done < total; done += cfg.period)
+        {
+            uint64_t start = metricsNow();
+            produced += converter.process(in.data(), cfg.period, out.data(), converter.outputFor(cfg.period));
+            perPeriod.record(metricsNow() - start);
+        }
+    });
+    r.frames = total;
+    r.latencyJson = histogramJson(perPeriod);
+    std::ostringstream extra;
+    extra << "\"channels\": " << channels << ", \"taps\": " << converter.taps() << ", \"output_frames\": "
+          << produced << ", \"core_share_realtime\": " << inRate * r.seconds / total;
+    r.extraJson = extra.str();
+    report(std::move(r));
+}
+
+// --- DSP chain: every passthrough stage enabled, mono like the passthrough ---
+void benchDspChain(const BenchConfig &cfg)
+{
+    BenchResult r{"dsp_chain", "memory"};
+    PassthroughChain chain;
+    for (const char *arg : {"--hpf=80", "--eq=200:-3", "--eq=3000:4:1.4", "--highshelf=8000:2", "--gain=3",
+                            "--compress=-20:4", "--limit=-1"})
+        parseDspOption(arg, chain);
+    chain.prepare(cfg.rate, 1);
+    std::vector<float> block(cfg.period);
+    SineGenerator sine(440.0, cfg.rate);
+    Log2Histogram perPeriod;
+    long total = static_cast<long>(cfg.rate) * cfg.seconds;
+
+    timed(r, [&]()
+    {
+        for (long done = 0; done < total; done += cfg.period)
+        {
+            sine.render(block.data(), cfg.period);
+            uint64_t start = metricsNow();
+            chain.process(block.data(), cfg.period);
+            perPeriod.record(metricsNow() - start);
+        }
+    });
+    r.frames = total;
+    r.latencyJson = histogramJson(perPeriod);
+    std::ostringstream extra;
+    extra << "\"stages\": " << chain.kStages << ", \"core_share_realtime\": "
+          << perPeriod.mean() * (total / cfg.period) / 1e9 / cfg.seconds;
+    r.extraJson = extra.str();
+    chain.report(std::cerr, cfg.period);
+    report(std::move(r));
+}
+
+// --- WAV I/O ---
+void benchWavFile(const BenchConfig &cfg)
+{
+    std::string path = cfg.tmpDir + "/cpp_audio_bench.wav";
+    std::vector<short> samples(static_cast<size_t>(cfg.rate) * cfg.seconds * 2);
+    for (size_t i = 0; i < samples.size(); i++)
+        samples[i] = static_cast<short>(i * 7919);
+
+    BenchResult w{"wav_write", "memory"};
+    timed(w, [&]() { writeWav(path, samples, cfg.rate, 2); });
+    w.frames = samples.size() / 2;
+    report(std::move(w));
+
+    BenchResult rd{"wav_read", "memory"};
+    std::vector<short> back;
+    int rate = 0, channels = 0;
+    bool ok = false;
+    timed(rd, [&]() { ok = readWav(path, back, rate, channels); });
+    rd.frames = back.size() / 2;
+    if (!ok || back != samples)
+        rd.skipped = "read back mismatch";
+    report(std::move(rd));
+
+    std::remove(path.c_str());
+}
+
+// The capture side of `record`: periods from memory into the streaming writer
+void benchWavStream(const BenchConfig &cfg)
+{
+    std::string path = cfg.tmpDir + "/cpp_audio_bench_stream.wav";
+    BenchResult r{"wav_stream_write", "memory"};
+    WavStreamWriter sink;
+    if (!sink.open(path, cfg.rate, 1))
+    {
+        r.skipped = "cannot open " + path;
+        report(std::move(r));
+        return;
+    }
+
+    std::vector<short> period(cfg.period);
+    for (int i = 0; i < cfg.period; i++)
+        period[i] = static_cast<short>(i * 31);
+    Log2Histogram perPeriod;
+    long total = static_cast<long>(cfg.rate) * cfg.seconds;
+
+    timed(r, [&]()
+    {
+        for (long done = 0; done < total; done += cfg.period)
+        {
+            uint64_t start = metricsNow();
+            sink.write(period.data(), cfg.period);
+            perPeriod.record(metricsNow() - start);
+        }
+    });
+    sink.close();
+    r.frames = total;
+    r.latencyJson = histogramJson(perPeriod);
+    r.extraJson = "\"dropped_frames\": " + std::to_string(sink.droppedFrames());
+    report(std::move(r));
+    std::remove(path.c_str());
+}
+
+// `record take.flac`: the same feed into the FLAC writer, whose blocks are
+// encoded on a 4-thread pool. Every frame has to end up either in the file
+// or in the dropped count; anything else means an encode job went missing.
+void benchFlacStream(const BenchConfig &cfg)
+{
+    std::string path = cfg.tmpDir + "/cpp_audio_bench_stream.flac";
+    BenchResult r{"flac_stream_write", "memory"};
+    FlacStreamWriter sink(4096, 64, 4);
+    if (!sink.open(path, cfg.rate, 1))
+    {
+        r.skipped = "cannot open " + path;
+        report(std::move(r));
+        return;
+    }
+
+    std::vector<short> period(cfg.period);
+    Log2Histogram perPeriod;
+    long total = static_cast<long>(cfg.rate) * cfg.seconds;
+
+    timed(r, [&]()
+    {
+        for (long done = 0; done < total; done += cfg.period)
+        {
+            for (int i = 0; i < cfg.period; i++)
+                period[i] = static_cast<short>(8000 * std::sin((done + i) * 0.031));
+            uint64_t start = metricsNow();
+            sink.write(period.data(), cfg.period);
+            perPeriod.record(metricsNow() - start);
+        }
+    });
+    sink.close();
+    r.frames = total;
+    r.latencyJson = histogramJson(perPeriod);
+    r.extraJson = "\"dropped_frames\": " + std::to_string(sink.droppedFrames()) +
+                  ", \"ratio\": " + std::to_string(sink.compressionRatio());
+    uint64_t accounted = sink.framesWritten() + sink.droppedFrames();
+    if (accounted != static_cast<uint64_t>((total + cfg.period - 1) / cfg.period * cfg.period))
+    {
+        std::cerr << "flac_stream_write: " << accounted << " frames written or dropped of " << total << "\n";
+        failures++;
+    }
+    report(std::move(r));
+    std::remove(path.c_str());
+}
+
+// The ring between capture and playback threads in passthrough-threaded
+void benchRing(const BenchConfig &cfg)
+{
+    BenchResult r{"ring_passthrough", "memory"};
+    SpscRing<short> ring(cfg.period * 16);
+    long total = static_cast<long>(cfg.rate) * cfg.seconds;
+    Log2Histogram perPeriod;
+
+    timed(r, [&]()
+    {
+        std::thread producer([&]()
+        {
+            std::vector<short> in(cfg.period, 1);
+            for (long done = 0; done < total;)
+            {
+                size_t n = ring.write(in.data(), std::min<long>(cfg.period, total - done));
+                if (n == 0)
+                    std::this_thread::yield();
+                done += n;
+            }
+        });
+
+        std::vector<short> out(cfg.period);
+        for (long done = 0; done < total;)
+        {
+            uint64_t start = metricsNow();
+            size_t n = ring.read(out.data(), cfg.period);
+            if (n == 0)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            perPeriod.record(metricsNow() - start);
+            done += n;
+        }
+        producer.join();
+    });
+    r.frames = total;
+    r.latencyJson = histogramJson(perPeriod);
+    report(std::move(r));
+}
+
+// The batch/FLAC work-stealing pool under churn: rounds of tiny jobs, half
+// of which submit a child from inside a worker, on more threads than cores.
+// Every job has to run exactly once and wait() has to see all of them.
+void benchPool(const BenchConfig &cfg)
+{
+    BenchResult r{"pool_stress", "memory"};
+    const int threads = 8, jobs = 2000, rounds = 50 * cfg.seconds;
+    WorkStealingPool pool(threads);
+    std::atomic<long> ran{0};
+    long lost = 0;
+
+    timed(r, [&]()
+    {
+        for (int round = 0; round < rounds; round++)
+        {
+            ran.store(0, std::memory_order_relaxed);
+            for (int j = 0; j < jobs; j++)
+            {
+                pool.submit([&, j]()
+                {
+                    ran.fetch_add(1, std::memory_order_relaxed);
+                    if (j % 2)
+                        pool.submit([&]() { ran.fetch_add(1, std::memory_order_relaxed); });
+                });
+            }
+            pool.wait();
+            lost += jobs + jobs / 2 - ran.load(std::memory_order_relaxed);
+        }
+    });
+    r.frames = static_cast<uint64_t>(rounds) * (jobs + jobs / 2);
+    r.extraJson = "\"threads\": " + std::to_string(threads) + ", \"lost_jobs\": " + std::to_string(lost) +
+                  ", \"stolen\": " + std::to_string(pool.stolen());
+    if (lost != 0)
+    {
+        std::cerr << "pool_stress: " << lost << " jobs did not run\n";
+        failures++;
+    }
+    report(std::move(r));
+}
+
+// --- PCM engine loops against virtual devices ---
+
+snd_pcm_t *openBenchPcm(const std::string &device, snd_pcm_stream_t stream, int channels, const BenchConfig &cfg,
+                        PcmConfig &config)
+{
+    return openPcm(device, {.stream = stream, .rate = unsigned(cfg.rate), .channels = unsigned(channels),
+                            .period = snd_pcm_uframes_t(cfg.period), .buffer = snd_pcm_uframes_t(cfg.period * 4)},
+                   config);
+}
+
+// Engine per-period stats for `handle`, taken from the metrics registry
+std::string engineLatencyJson(snd_pcm_t *handle, snd_pcm_uframes_t period)
+{
+    std::ostringstream os;
+    pcmMetrics(handle, period).writeJson(os);
+    return os.str();
+}
+
+// `record`: capture -> WavStreamWriter
+void benchRecord(const BenchConfig &cfg)
+{
+    metrics().clear();
+    BenchResult r{"engine_record", cfg.device};
+    PcmConfig inConfig;
+    snd_pcm_t *in = openBenchPcm(cfg.device, SND_PCM_STREAM_CAPTURE, 1, cfg, inConfig);
+    std::string path = cfg.tmpDir + "/cpp_audio_bench_record.wav";
+    WavStreamWriter sink;
+    if (!in || !sink.open(path, inConfig.rate, 1))
+    {
+        r.skipped = in ? "cannot open " + path : "cannot open capture device";
+        if (in)
+            snd_pcm_close(in);
+        report(std::move(r));
+        return;
+    }
+
+    long total = static_cast<long>(inConfig.rate) * cfg.seconds, recorded = 0;
+    PcmEngine engine;
+    engine.addCapture(in, 1, inConfig.period, inConfig.mmap, [&](void *samples, snd_pcm_uframes_t frames)
+    {
+        sink.write(static_cast<short *>(samples), frames);
+        recorded += frames;
+        return recorded < total;
+    });
+    timed(r, [&]() { engine.run(); });
+    sink.close();
+
+    r.frames = recorded;
+    r.extraJson = "\"dropped_frames\": " + std::to_string(sink.droppedFrames());
+    r.latencyJson = engineLatencyJson(in, inConfig.period);
+    snd_pcm_close(in);
+    std::remove(path.c_str());
+    report(std::move(r));
+}
+
+// `passthrough`: capture -> ring -> playback on one poll loop
+void benchPassthrough(const BenchConfig &cfg, const std::string &outDevice)
+{
+    metrics().clear();
+    BenchResult r{"engine_passthrough", cfg.device + " -> " + outDevice};
+    PcmConfig inConfig, outConfig;
+    snd_pcm_t *in = openBenchPcm(cfg.device, SND_PCM_STREAM_CAPTURE, 1, cfg, inConfig);
+    snd_pcm_t *out = in ? openBenchPcm(outDevice, SND_PCM_STREAM_PLAYBACK, 1, cfg, outConfig) : nullptr;
+    if (!in || !out)
+    {
+        r.skipped = "cannot open devices";
+        if (in)
+            snd_pcm_close(in);
+        report(std::move(r));
+        return;
+    }
+
+    long total = static_cast<long>(inConfig.rate) * cfg.seconds, captured = 0;
+    SpscRing<short> ring(inConfig.period * 8);
+    PcmEngine engine;
+    engine.addCapture(in, 1, inConfig.period, inConfig.mmap, [&](void *samples, snd_pcm_uframes_t frames)
+    {
+        ring.write(static_cast<short *>(samples), frames);
+        captured += frames;
+        return captured < total;
+    });
+    engine.addPlayback(out, 1, outConfig.period, outConfig.mmap, [&](void *buffer, snd_pcm_uframes_t frames)
+    {
+        short *samples = static_cast<short *>(buffer);
+        size_t got = ring.read(samples, frames);
+        std::fill(samples + got, samples + frames, 0);
+        return captured < total;
+    });
+    timed(r, [&]() { engine.run(); });
+
+    r.frames = captured;
+    r.latencyJson = "{\"capture\": " + engineLatencyJson(in, inConfig.period) +
+                    ",\n    \"playback\": " + engineLatencyJson(out, outConfig.period) + "}";
+    snd_pcm_close(out);
+    snd_pcm_close(in);
+    report(std::move(r));
+}
+
+// alsa-lib's plug over the null device pinned to `deviceRate`, so its rate
+// plugin (whatever defaults.pcm.rate_converter selects) converts the stream
+snd_pcm_t *openPlugOverNull(unsigned deviceRate, const BenchConfig &cfg, PcmConfig &config)
+{
+    const std::string name = "cpp_audio_bench_plug";
+    std::string text = "pcm." + name + " { type plug slave { pcm { type null } rate " + std::to_string(deviceRate) + " } }";
+
+    snd_config_t *top = nullptr;
+    snd_input_t *input = nullptr;
+    snd_pcm_t *handle = nullptr;
+    if (snd_config_update() < 0 || snd_config_copy(&top, snd_config) < 0)
+        return nullptr;
+    bool opened = snd_input_buffer_open(&input, text.c_str(), text.size()) >= 0 && snd_config_load(top, input) >= 0 &&
+                  snd_pcm_open_lconf(&handle, name.c_str(), SND_PCM_STREAM_PLAYBACK, 0, top) >= 0;
+    if (input)
+        snd_input_close(input);
+    snd_config_delete(top);
+    if (!opened)
+        return nullptr;
+
+    if (!configurePcm(handle, "plug:null@" + std::to_string(deviceRate),
+                      {.rate = unsigned(cfg.rate), .channels = 2, .period = snd_pcm_uframes_t(cfg.period),
+                       .buffer = snd_pcm_uframes_t(cfg.period * 4)},
+                      config))
+    {
+        snd_pcm_close(handle);
+        return nullptr;
+    }
+    return handle;
+}
+
+// `play` at the pipeline rate into a device running at `deviceRate`:
+// converted by the polyphase stage (`play --resample` on hw:) or by
+// alsa-lib's plug path (`play` on plughw:)
+void benchPlayConvert(const BenchConfig &cfg, unsigned deviceRate, bool inProcess)
+{
+    metrics().clear();
+    BenchResult r{inProcess ? "engine_play_resample" : "engine_play_plug",
+                  "null@" + std::to_string(deviceRate)};
+    PcmConfig outConfig;
+    snd_pcm_t *out = inProcess ? openPcm("null", {.rate = deviceRate, .channels = 2,
+                                                  .period = snd_pcm_uframes_t(cfg.period),
+                                                  .buffer = snd_pcm_uframes_t(cfg.period * 4)},
+                                         outConfig)
+                               : openPlugOverNull(deviceRate, cfg, outConfig);
+    if (!out)
+    {
+        r.skipped = "cannot open playback device";
+        report(std::move(r));
+        return;
+    }
+
+    std::unique_ptr<PolyphaseResampler> converter;
+    size_t maxInput = outConfig.period;
+    if (inProcess)
+    {
+        maxInput = outConfig.period * (double(cfg.rate) / outConfig.rate) + 2;
+        converter = std::make_unique<PolyphaseResampler>(cfg.rate, outConfig.rate, 2, maxInput);
+    }
+
+    long total = static_cast<long>(cfg.rate) * cfg.seconds, played = 0;
+    SineGenerator sine(440.0, cfg.rate);
+    std::vector<float> block(maxInput), stereo(maxInput * 2), converted(outConfig.period * 2);
+    PcmEngine engine;
+    engine.addPlayback(out, 2, outConfig.period, outConfig.mmap, [&](void *samples, snd_pcm_uframes_t frames)
+    {
+        size_t n = converter ? converter->inputFor(frames) : frames;
+        sine.render(block.data(), n);
+        duplicateChannels(block.data(), stereo.data(), n, 2);
+        const float *source = stereo.data();
+        if (converter)
+        {
+            converter->process(stereo.data(), n, converted.data(), frames);
+            source = converted.data();
+        }
+        encodeSamples(SampleFormat::S16, source, samples, frames * 2);
+        played += n;
+        return played < total;
+    });
+    timed(r, [&]() { engine.run(); });
+
+    r.frames = played;
+    std::ostringstream extra;
+    extra << "\"stream_rate\": " << cfg.rate << ", \"device_rate\": " << outConfig.rate
+          << ", \"core_share_realtime\": " << cfg.rate * r.seconds / played;
+    r.extraJson = extra.str();
+    r.latencyJson = engineLatencyJson(out, outConfig.period);
+    snd_pcm_close(out);
+    report(std::move(r));
+}
+
+// `play`: sine into a playback device
+void benchPlay(const BenchConfig &cfg, const std::string &outDevice)
+{
+    metrics().clear();
+    BenchResult r{"engine_play", outDevice};
+    PcmConfig outConfig;
+    snd_pcm_t *out = openBenchPcm(outDevice, SND_PCM_STREAM_PLAYBACK, 2, cfg, outConfig);
+    if (!out)
+    {
+        r.skipped = "cannot open playback device";
+        report(std::move(r));
+        return;
+    }
+
+    long total = static_cast<long>(outConfig.rate) * cfg.seconds, played = 0;
+    SineGenerator sine(440.0, outConfig.rate);
+    std::vector<float> block(outConfig.period), stereo(outConfig.period * 2);
+    PcmEngine engine;
+    engine.addPlayback(out, 2, outConfig.period, outConfig.mmap, [&](void *samples, snd_pcm_uframes_t frames)
+    {
+        sine.render(block.data(), frames);
+        duplicateChannels(block.data(), stereo.data(), frames, 2);
+        encodeSamples(SampleFormat::S16, stereo.data(), samples, frames * 2);
+        played += frames;
+        return played < total;
+    });
+    timed(r, [&]() { engine.run(); });
+
+    r.frames = played;
+    r.latencyJson = engineLatencyJson(out, outConfig.period);
+    snd_pcm_close(out);
+    report(std::move(r));
+}
+
+int main(int argc, char *argv[])
+{
+    std::string filter = argc > 1 ? argv[1] : "all";
+    BenchConfig cfg;
+    if (argc > 2)
+        cfg.seconds = atoi(argv[2]);
+    if (argc > 3)
+        cfg.period = atoi(argv[3]);
+    if (argc > 4)
+        cfg.device = argv[4];
+    if (const char *tmp = std::getenv("TMPDIR"))
+        cfg.tmpDir = tmp;
+    if (cfg.seconds <= 0 || cfg.period <= 0)
+    {
+        std::cerr << "Usage: cpp_audio_bench [filter=all] [seconds=30] [period=512] [device=null]\n";
+        return 1;
+    }
+
+    // Benchmarks must not read or write the user's negotiated-parameter cache
+    pcmCacheEnabled() = false;
+    std::string fileDevice = "file:FILE=" + cfg.tmpDir + "/cpp_audio_bench.raw,FORMAT=raw";
+
+    auto want = [&](const std::string &name) { return filter == "all" || name.find(filter) != std::string::npos; };
+
+    if (want("gen_sine"))
+        benchGenerator("gen_sine", SineGenerator(440.0, cfg.rate), cfg);
+    if (want("gen_linear_sweep"))
+        benchGenerator("gen_linear_sweep", LinearSweepGenerator(20.0, cfg.rate / 2.0, cfg.seconds, cfg.rate), cfg);
+    if (want("gen_log_sweep"))
+        benchGenerator("gen_log_sweep", LogSweepGenerator(20.0, cfg.rate / 2.0, cfg.seconds, cfg.rate), cfg);
+    for (SampleFormat f : {SampleFormat::S16, SampleFormat::S24_3, SampleFormat::S32, SampleFormat::Float})
+    {
+        if (want(std::string("convert_") + sampleFormatName(f)))
+            benchConvert(f, false, cfg);
+        bool ditherable = f == SampleFormat::S16 || f == SampleFormat::S24_3;
+        if (ditherable && want(std::string("convert_") + sampleFormatName(f) + "_dither"))
+            benchConvert(f, true, cfg);
+    }
+    for (auto [from, to] : {std::pair{44100u, 48000u}, {48000u, 44100u}, {48000u, 96000u}, {96000u, 48000u}})
+    {
+        if (want("resample_" + std::to_string(from) + "_" + std::to_string(to)))
+            benchResample(from, to, cfg);
+    }
+    if (want("dsp_chain"))
+        benchDspChain(cfg);
+    if (want("wav_write") || want("wav_read"))
+        benchWavFile(cfg);
+    if (want("wav_stream"))
+        benchWavStream(cfg);
+    if (want("flac_stream"))
+        benchFlacStream(cfg);
+    if (want("ring"))
+        benchRing(cfg);
+    if (want("pool_stress"))
+        benchPool(cfg);
+    if (want("engine_record"))
+        benchRecord(cfg);
+    if (want("engine_passthrough"))
+    {
+        benchPassthrough(cfg, cfg.device);
+        benchPassthrough(cfg, fileDevice);
+    }
+    if (want("engine_play"))
+    {
+        benchPlay(cfg, cfg.device);
+        benchPlay(cfg, fileDevice);
+    }
+    // Both paths into a 44.1k device, the usual reason to convert
+    if (want("engine_play_resample"))
+        benchPlayConvert(cfg, 44100, true);
+    if (want("engine_play_plug"))
+        benchPlayConvert(cfg, 44100, false);
+    std::remove((cfg.tmpDir + "/cpp_audio_bench.raw").c_str());
+
+    writeResults(std::cout, cfg);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <poll.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "analyzer.h"
+#include "sample_format.h"
+#include "wav_file.h"
+
+// Continuous "black box" capture: the last N seconds are always kept in a
+// preallocated circular history, and a trigger saves them to a WAV file.
+//
+// The capture thread only copies each block into the history, in the
+// device format, and publishes the total frame count. The oldest frames are
+// overwritten, so memory stays constant however long it runs. Triggers
+// come from SIGUSR1, a line on stdin, or a block peak at or above a
+// threshold. A trigger sets one atomic slot per source and posts a
+// semaphore, which is safe from the audio thread and from a signal handler.
+// A dump thread waits for the post-trigger time, copies the window into a
+// preallocated snapshot and writes it out. It then checks the frame counter
+// (seqlock style) to detect frames the capture overwrote during the copy.
+// Capture never waits for the dump. The history holds one second more than
+// a dump window, so that overwrite only happens when the dump thread is
+// starved or dumps queue up behind a slow disk; the lost frames are then
+// trimmed from the start and reported.
+
+struct BlackBoxOptions
+{
+    double historySeconds = 60.0; // saved before each trigger
+    double postSeconds = 0.0;     // and after it
+    bool levelTrigger = false;
+    double levelDb = -1.0;        // block peak in dBFS that triggers a dump
+    bool stdinTrigger = true;     // a line on stdin triggers, "q" stops
+    std::string prefix = "blackbox"; // dumps are PREFIX_NNNN_SOURCE_YYYYmmdd-HHMMSS.wav
+};
+
+class BlackBox
+{
+public:
+    enum Trigger
+    {
+        Signal,
+        Level,
+        Input,
+        TriggerCount
+    };
+
+    // `maxBlock` is the largest block push() will see
+    BlackBox(const BlackBoxOptions &options, SampleFormat deviceFormat, SampleFormat fileFormat, int rate,
+             int channels, size_t maxBlock)
+        : options_(options), deviceFormat_(deviceFormat), fileFormat_(fileFormat), rate_(rate), channels_(channels),
+          frameBytes_(sampleBytes(deviceFormat) * channels), maxBlock_(maxBlock),
+          windowFrames_(static_cast<uint64_t>((options.historySeconds + options.postSeconds) * rate)),
+          capacity_(windowFrames_ + rate + maxBlock), history_(capacity_ * frameBytes_),
+          snapshot_(windowFrames_ * frameBytes_), levelScratch_(options.levelTrigger ? maxBlock * channels : 0),
+          levelThreshold_(static_cast<float>(std::pow(10.0, options.levelDb / 20.0)))
+    {
+        if (fileFormat_ != deviceFormat_)
+        {
+            convertIn_.assign(kConvertFrames * channels, 0.0f);
+            convertOut_.assign(kConvertFrames * channels * sampleBytes(fileFormat_), 0);
+        }
+        sem_init(&wake_, 0, 0);
+    }
+
+    ~BlackBox()
+    {
+        stop();
+        sem_destroy(&wake_);
+    }
+
+    BlackBox(const BlackBox &) = delete;
+    BlackBox &operator=(const BlackBox &) = delete;
+
+    // Largest window whose dump still fits a plain RIFF file
+    static double maxSeconds(SampleFormat format, int rate, int channels)
+    {
+        return double(0xFFFFFFFFu - 36) / (double(sampleBytes(format)) * channels * rate);
+    }
+
+    void setDither(bool enabled) { dither_ = enabled; }
+
+    // Starts the dump (and stdin) threads and takes SIGUSR1, SIGINT and SIGTERM
+    void start()
+    {
+        active().store(this);
+        struct sigaction action{};
+        action.sa_handler = &BlackBox::onSignal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, &savedUsr1_);
+        sigaction(SIGINT, &action, &savedInt_);
+        sigaction(SIGTERM, &action, &savedTerm_);
+        dumper_ = std::thread(&BlackBox::dumpLoop, this);
+        if (options_.stdinTrigger)
+            input_ = std::thread(&BlackBox::inputLoop, this);
+    }
+
+    // Finishes queued dumps (cutting post-trigger waits short) and restores the signals
+    void stop()
+    {
+        if (!dumper_.joinable())
+            return;
+        stopRequested_.store(true, std::memory_order_release);
+        stopping_.store(true, std::memory_order_release);
+        sem_post(&wake_);
+        dumper_.join();
+        if (input_.joinable())
+            input_.join();
+        sigaction(SIGUSR1, &savedUsr1_, nullptr);
+        sigaction(SIGINT, &savedInt_, nullptr);
+        sigaction(SIGTERM, &savedTerm_, nullptr);
+        active().store(nullptr);
+    }
+
+    // Set by SIGINT/SIGTERM or "q" on stdin; the capture loop polls it
+    bool stopRequested() const { return stopRequested_.load(std::memory_order_acquire); }
+
+    // Audio thread: append a block of interleaved device-format frames.
+    // A memcpy into the history and, with a level trigger, one peak scan.
+    void push(const void *frames, size_t n)
+    {
+        const uint8_t *src = static_cast<const uint8_t *>(frames);
+        uint64_t written = written_.load(std::memory_order_relaxed);
+        size_t at = written % capacity_;
+        size_t first = std::min<size_t>(n, capacity_ - at);
+        std::memcpy(history_.data() + at * frameBytes_, src, first * frameBytes_);
+        std::memcpy(history_.data(), src + first * frameBytes_, (n - first) * frameBytes_);
+        written_.store(written + n, std::memory_order_release);
+
+        if (options_.levelTrigger && written >= levelHoldUntil_)
+        {
+            decodeSamples(deviceFormat_, src, levelScratch_.data(), n * channels_);
+            double sum = 0.0;
+            float peak = 0.0f;
+            analyzer_detail::levels(levelScratch_.data(), n * channels_, sum, peak);
+            if (peak >= levelThreshold_)
+            {
+                trigger(Level, written);
+                levelHoldUntil_ = written + windowFrames_; // one dump per window of loud audio
+            }
+        }
+    }
+
+    // Any thread or a signal handler: request a dump of the window around
+    // `frame` (default: now). A second trigger from the same source before
+    // the first is taken is merged into it.
+    void trigger(Trigger source, uint64_t frame = UINT64_MAX)
+    {
+        if (frame == UINT64_MAX)
+            frame = written_.load(std::memory_order_acquire);
+        uint64_t expected = 0;
+        if (pending_[source].compare_exchange_strong(expected, frame + 1, std::memory_order_acq_rel))
+            sem_post(&wake_);
+        else
+            merged_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t framesCaptured() const { return written_.load(std::memory_order_relaxed); }
+    uint64_t dumps() const { return dumps_.load(std::memory_order_relaxed); }
+    uint64_t lostFrames() const { return lostFrames_.load(std::memory_order_relaxed); }
+    uint64_t mergedTriggers() const { return merged_.load(std::memory_order_relaxed); }
+    size_t memoryBytes() const { return history_.size() + snapshot_.size() + convertOut_.size() + convertIn_.size() * 4; }
+
+private:
+    static constexpr size_t kConvertFrames = 4096;
+
+    static std::atomic<BlackBox *> &active()
+    {
+        static std::atomic<BlackBox *> box{nullptr};
+        return box;
+    }
+
+    // Async-signal-safe: atomics and sem_post only
+    static void onSignal(int sig)
+    {
+        BlackBox *box = active().load();
+        if (!box)
+            return;
+        if (sig == SIGUSR1)
+            box->trigger(Signal);
+        else
+            box->stopRequested_.store(true, std::memory_order_release);
+    }
+
+    static const char *triggerName(int source)
+    {
+        static const char *names[] = {"signal", "level", "input"};
+        return names[source];
+    }
+
+    void inputLoop()
+    {
+        std::string line;
+        char chunk[256];
+        while (!stopping_.load(std::memory_order_acquire))
+        {
+            pollfd fd{STDIN_FILENO, POLLIN, 0};
+            if (poll(&fd, 1, 100) <= 0)
+                continue;
+            ssize_t n = ::read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (n <= 0)
+                return; // stdin closed (e.g. run from a service): SIGUSR1 still works
+            for (ssize_t i = 0; i < n; i++)
+            {
+                if (chunk[i] != '\n')
+                {
+                    line += chunk[i];
+                    continue;
+                }
+                if (line == "q" || line == "quit")
+                    stopRequested_.store(true, std::memory_order_release);
+                else
+                    trigger(Input);
+                line.clear();
+            }
+        }
+    }
+
+    void dumpLoop()
+    {
+        for (;;)
+        {
+            bool any = false;
+            for (int source = 0; source < TriggerCount; source++)
+            {
+                uint64_t frame = pending_[source].exchange(0, std::memory_order_acq_rel);
+                if (frame)
+                {
+                    dump(source, frame - 1);
+                    any = true;
+                }
+            }
+            if (any)
+                continue;
+            if (stopping_.load(std::memory_order_acquire))
+                return;
+            while (sem_wait(&wake_) != 0 && errno == EINTR)
+                ;
+        }
+    }
+
+    void dump(int source, uint64_t triggerFrame)
+    {
+        // Wait for the post-trigger part; at shutdown take what there is
+        uint64_t end = triggerFrame + static_cast<uint64_t>(options_.postSeconds * rate_);
+        while (written_.load(std::memory_order_acquire) < end && !stopping_.load(std::memory_order_acquire))
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        end = std::min(end, written_.load(std::memory_order_acquire));
+        uint64_t begin = end > windowFrames_ ? end - windowFrames_ : 0;
+        auto copyStart = std::chrono::steady_clock::now();
+
+        // Oldest first, in at most two pieces
+        uint64_t frames = end - begin;
+        size_t at = begin % capacity_;
+        size_t first = std::min<uint64_t>(frames, capacity_ - at);
+        std::memcpy(snapshot_.data(), history_.data() + at * frameBytes_, first * frameBytes_);
+        std::memcpy(snapshot_.data() + first * frameBytes_, history_.data(), (frames - first) * frameBytes_);
+
+        // Anything the capture may have overwritten meanwhile (including a
+        // block being copied in right now) is dropped from the start
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = written_.load(std::memory_order_acquire);
+        uint64_t oldestIntact = now + maxBlock_ > capacity_ ? now + maxBlock_ - capacity_ : 0;
+        uint64_t lost = oldestIntact > begin ? std::min(oldestIntact - begin, frames) : 0;
+        lostFrames_.fetch_add(lost, std::memory_order_relaxed);
+        double copyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - copyStart).count();
+
+        // Wall-clock time of the trigger, from how far capture has moved on since
+        auto wall = std::chrono::system_clock::now() -
+                    std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                        std::chrono::duration<double>(double(now - std::min(now, triggerFrame)) / rate_));
+        std::time_t t = std::chrono::system_clock::to_time_t(wall);
+        std::tm local{};
+        localtime_r(&t, &local);
+        std::ostringstream name;
+        uint64_t index = dumps_.fetch_add(1, std::memory_order_relaxed) + 1;
+        name << options_.prefix << "_" << std::setw(4) << std::setfill('0') << index << "_" << triggerName(source)
+             << "_" << std::put_time(&local, "%Y%m%d-%H%M%S") << ".wav";
+
+        if (!write(name.str(), snapshot_.data() + lost * frameBytes_, frames - lost))
+        {
+            std::cerr << "Unable to write " << name.str() << "\n";
+            return;
+        }
+        std::cout << "Dump " << index << " (" << triggerName(source) << "): " << name.str() << ", " << std::fixed
+                  << std::setprecision(1) << double(frames - lost) / rate_ << " s, copied in " << std::setprecision(2)
+                  << copyMs << " ms" << (lost ? ", " + std::to_string(lost) + " frames overwritten before the copy" : "")
+                  << "\n" << std::flush;
+    }
+
+    bool write(const std::string &path, const uint8_t *data, uint64_t frames)
+    {
+        std::ofstream out(path, std::ios::binary);
+        if (!out)
+            return false;
+        writeWavHeader(out, rate_, channels_, fileFormat_, static_cast<uint32_t>(frames * channels_ * sampleBytes(fileFormat_)));
+        if (fileFormat_ == deviceFormat_)
+            out.write(reinterpret_cast<const char *>(data), frames * frameBytes_);
+        else
+        {
+            for (uint64_t done = 0; done < frames; done += kConvertFrames)
+            {
+                size_t n = static_cast<size_t>(std::min<uint64_t>(kConvertFrames, frames - done)) * channels_;
+                decodeSamples(deviceFormat_, data + done * frameBytes_, convertIn_.data(), n);
+                encodeSamples(fileFormat_, convertIn_.data(), convertOut_.data(), n, dither_ ? &ditherState_ : nullptr);
+                out.write(reinterpret_cast<const char *>(convertOut_.data()), n * sampleBytes(fileFormat_));
+            }
+        }
+        return static_cast<bool>(out);
+    }
+
+    BlackBoxOptions options_;
+    SampleFormat deviceFormat_, fileFormat_;
+    int rate_, channels_;
+    size_t frameBytes_, maxBlock_;
+    uint64_t windowFrames_, capacity_;
+    std::vector<uint8_t> history_;  // capacity_ frames, written by the capture thread
+    std::vector<uint8_t> snapshot_; // windowFrames_ frames, dump thread only
+    std::vector<float> levelScratch_;
+    float levelThreshold_;
+    uint64_t levelHoldUntil_ = 0; // capture thread only
+
+    std::vector<float> convertIn_; // dump thread only
+    std::vector<uint8_t> convertOut_;
+    bool dither_ = false;
+    TpdfDither ditherState_;
+
+    std::atomic<uint64_t> written_{0};
+    std::atomic<uint64_t> pending_[TriggerCount] = {}; // trigger frame + 1, 0 = none
+    std::atomic<uint64_t> dumps_{0}, lostFrames_{0}, merged_{0};
+    std::atomic<bool> stopping_{false}, stopRequested_{false};
+    sem_t wake_;
+    std::thread dumper_, input_;
+    struct sigaction savedUsr1_{}, savedInt_{}, savedTerm_{};
+};
@@ -0,0 +1,618 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "generators.h"
+#include "metrics.h"
+
+// Block-based DSP chain for the passthrough path.
+//
+// Stages process whole periods of interleaved float frames in place. A chain
+// is a DspChain<Stage...>: its composition is fixed at compile time, each
+// stage is called directly (no virtual dispatch) once per block, and a
+// disabled stage costs one branch. Stages keep all state in fixed-size
+// members, so nothing is allocated once the chain is constructed. Every
+// enabled stage's processing time per block goes into a Log2Histogram.
+//
+// A stage provides:
+//   const char *name() const;
+//   bool enabled() const;
+//   void prepare(double rate, int channels);   // before the first block
+//   void process(float *samples, size_t frames);
+
+constexpr int kDspMaxChannels = 8;
+
+namespace dsp_detail
+{
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef int32_t v8si __attribute__((vector_size(32)));
+
+// x[i] *= g0 + dg * i
+template <typename VF, int W>
+__attribute__((always_inline)) inline size_t rampGainBody(float *x, size_t n, float g0, float dg)
+{
+    VF lane;
+    for (int k = 0; k < W; k++)
+        lane[k] = static_cast<float>(k);
+    size_t i = 0;
+    for (; i + W <= n; i += W)
+    {
+        VF v;
+        std::memcpy(&v, x + i, sizeof(v));
+        v *= g0 + dg * (lane + static_cast<float>(i));
+        std::memcpy(x + i, &v, sizeof(v));
+    }
+    return i;
+}
+
+// max |x[i]|
+template <typename VF, typename VI, int W>
+__attribute__((always_inline)) inline float peakBody(const float *x, size_t n, size_t &done)
+{
+    VF peak = {};
+    size_t i = 0;
+    for (; i + W <= n; i += W)
+    {
+        VF v;
+        std::memcpy(&v, x + i, sizeof(v));
+        v = (VF)((VI)v & 0x7fffffff);
+        peak = v > peak ? v : peak;
+    }
+    done = i;
+    float m = 0.0f;
+    for (int k = 0; k < W; k++)
+        m = std::max(m, peak[k]);
+    return m;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) inline size_t rampGainAvx2(float *x, size_t n, float g0, float dg)
+{
+    return rampGainBody<v8sf, 8>(x, n, g0, dg);
+}
+
+__attribute__((target("avx2"))) inline float peakAvx2(const float *x, size_t n, size_t &done)
+{
+    return peakBody<v8sf, v8si, 8>(x, n, done);
+}
+#endif
+
+inline size_t rampGainVec4(float *x, size_t n, float g0, float dg)
+{
+    return rampGainBody<v4sf, 4>(x, n, g0, dg);
+}
+
+inline float peakVec4(const float *x, size_t n, size_t &done)
+{
+    return peakBody<v4sf, v4si, 4>(x, n, done);
+}
+
+inline void rampGain(float *x, size_t n, float g0, float dg)
+{
+    size_t done = 0;
+    switch (activeSimdIsa())
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SimdIsa::Avx2:
+        done = rampGainAvx2(x, n, g0, dg);
+        break;
+    case SimdIsa::Sse:
+        done = rampGainVec4(x, n, g0, dg);
+        break;
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    case SimdIsa::Neon:
+        done = rampGainVec4(x, n, g0, dg);
+        break;
+#endif
+    default:
+        break;
+    }
+    for (size_t i = done; i < n; i++)
+        x[i] *= g0 + dg * static_cast<float>(i);
+}
+
+inline float peak(const float *x, size_t n)
+{
+    size_t done = 0;
+    float m = 0.0f;
+    switch (activeSimdIsa())
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SimdIsa::Avx2:
+        m = peakAvx2(x, n, done);
+        break;
+    case SimdIsa::Sse:
+        m = peakVec4(x, n, done);
+        break;
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    case SimdIsa::Neon:
+        m = peakVec4(x, n, done);
+        break;
+#endif
+    default:
+        break;
+    }
+    for (size_t i = done; i < n; i++)
+        m = std::max(m, std::abs(x[i]));
+    return m;
+}
+
+inline float dbToGain(double db)
+{
+    return static_cast<float>(std::pow(10.0, db / 20.0));
+}
+
+} // namespace dsp_detail
+
+// --- Stages ---
+
+// Second-order IIR section (RBJ cookbook designs), transposed direct form II
+// with one state pair per channel. The recursion is serial in time, so the
+// loop runs frame by frame with the channels innermost.
+class Biquad
+{
+public:
+    enum class Type
+    {
+        HighPass,
+        LowPass,
+        Peaking,
+        LowShelf,
+        HighShelf
+    };
+
+    Biquad() = default;
+    Biquad(Type type, double frequency, double gainDb = 0.0, double q = M_SQRT1_2)
+        : type_(type), frequency_(frequency), gainDb_(gainDb), q_(q), enabled_(true)
+    {
+    }
+
+    const char *name() const { return "biquad"; }
+    bool enabled() const { return enabled_; }
+
+    // Frames are `channels` wide; DspChain::prepare rejects more than
+    // kDspMaxChannels, any beyond that would pass through unfiltered
+    void prepare(double rate, int channels)
+    {
+        stride_ = channels;
+        channels_ = std::min(channels, kDspMaxChannels);
+        state_ = {};
+
+        double w = 2.0 * M_PI * std::min(frequency_, 0.49 * rate) / rate;
+        double cw = std::cos(w), alpha = std::sin(w) / (2.0 * q_);
+        double a = std::pow(10.0, gainDb_ / 40.0);
+        double b0, b1, b2, a0, a1, a2;
+        switch (type_)
+        {
+        case Type::HighPass:
+            b0 = (1 + cw) / 2, b1 = -(1 + cw), b2 = (1 + cw) / 2;
+            a0 = 1 + alpha, a1 = -2 * cw, a2 = 1 - alpha;
+            break;
+        case Type::LowPass:
+            b0 = (1 - cw) / 2, b1 = 1 - cw, b2 = (1 - cw) / 2;
+            a0 = 1 + alpha, a1 = -2 * cw, a2 = 1 - alpha;
+            break;
+        case Type::Peaking:
+            b0 = 1 + alpha * a, b1 = -2 * cw, b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a, a1 = -2 * cw, a2 = 1 - alpha / a;
+            break;
+        case Type::LowShelf:
+        {
+            double s = 2 * std::sqrt(a) * alpha;
+            b0 = a * ((a + 1) - (a - 1) * cw + s), b1 = 2 * a * ((a - 1) - (a + 1) * cw);
+            b2 = a * ((a + 1) - (a - 1) * cw - s);
+            a0 = (a + 1) + (a - 1) * cw + s, a1 = -2 * ((a - 1) + (a + 1) * cw), a2 = (a + 1) + (a - 1) * cw - s;
+            break;
+        }
+        default: // HighShelf
+        {
+            double s = 2 * std::sqrt(a) * alpha;
+            b0 = a * ((a + 1) + (a - 1) * cw + s), b1 = -2 * a * ((a - 1) + (a + 1) * cw);
+            b2 = a * ((a + 1) + (a - 1) * cw - s);
+            a0 = (a + 1) - (a - 1) * cw + s, a1 = 2 * ((a - 1) - (a + 1) * cw), a2 = (a + 1) - (a - 1) * cw - s;
+            break;
+        }
+        }
+        b0_ = b0 / a0, b1_ = b1 / a0, b2_ = b2 / a0, a1_ = a1 / a0, a2_ = a2 / a0;
+    }
+
+    void process(float *x, size_t frames)
+    {
+        for (int c = 0; c < channels_; c++)
+        {
+            // State in locals for the whole block
+            float s1 = state_[c][0], s2 = state_[c][1];
+            for (size_t i = 0; i < frames; i++)
+            {
+                float in = x[i * stride_ + c];
+                float out = b0_ * in + s1;
+                s1 = b1_ * in - a1_ * out + s2;
+                s2 = b2_ * in - a2_ * out;
+                x[i * stride_ + c] = out;
+            }
+            state_[c] = {s1, s2};
+        }
+    }
+
+private:
+    Type type_ = Type::Peaking;
+    double frequency_ = 1000.0, gainDb_ = 0.0, q_ = M_SQRT1_2;
+    bool enabled_ = false;
+    int channels_ = 1, stride_ = 1;
+    float b0_ = 1, b1_ = 0, b2_ = 0, a1_ = 0, a2_ = 0;
+    std::array<std::array<float, 2>, kDspMaxChannels> state_ = {};
+};
+
+// 2nd-order Butterworth high-pass, for rumble and DC
+class HighPass
+{
+public:
+    const char *name() const { return "highpass"; }
+    bool enabled() const { return filter_.enabled(); }
+
+    void configure(double frequency) { filter_ = Biquad(Biquad::Type::HighPass, frequency); }
+    void prepare(double rate, int channels) { filter_.prepare(rate, channels); }
+    void process(float *x, size_t frames) { filter_.process(x, frames); }
+
+private:
+    Biquad filter_;
+};
+
+// Up to kMaxBands biquads in series, each run over the whole block in turn
+class Equalizer
+{
+public:
+    static constexpr int kMaxBands = 8;
+
+    const char *name() const { return "eq"; }
+    bool enabled() const { return bands_ > 0; }
+
+    // False once all bands are taken
+    bool addBand(const Biquad &band)
+    {
+        if (bands_ == kMaxBands)
+            return false;
+        filters_[bands_++] = band;
+        return true;
+    }
+
+    void prepare(double rate, int channels)
+    {
+        for (int b = 0; b < bands_; b++)
+            filters_[b].prepare(rate, channels);
+    }
+
+    void process(float *x, size_t frames)
+    {
+        for (int b = 0; b < bands_; b++)
+            filters_[b].process(x, frames);
+    }
+
+private:
+    std::array<Biquad, kMaxBands> filters_;
+    int bands_ = 0;
+};
+
+// Static gain in dB
+class Gain
+{
+public:
+    const char *name() const { return "gain"; }
+    bool enabled() const { return enabled_; }
+
+    void configure(double db)
+    {
+        gain_ = dsp_detail::dbToGain(db);
+        enabled_ = true;
+    }
+    void prepare(double, int channels) { channels_ = channels; }
+    void process(float *x, size_t frames) { dsp_detail::rampGain(x, frames * channels_, gain_, 0.0f); }
+
+private:
+    float gain_ = 1.0f;
+    bool enabled_ = false;
+    int channels_ = 1;
+};
+
+// Feed-forward peak compressor. Level detection and gain computation run
+// once per sub-block of kSubBlock frames: the sub-block peak (vectorized)
+// drives an attack/release envelope, and the gain moves linearly to its new
+// value across the sub-block, applied with a vectorized ramp.
+class Compressor
+{
+public:
+    static constexpr size_t kSubBlock = 16;
+
+    const char *name() const { return "compressor"; }
+    bool enabled() const { return enabled_; }
+
+    void configure(double thresholdDb, double ratio, double attackMs = 5.0, double releaseMs = 100.0,
+                   double makeupDb = 0.0)
+    {
+        threshold_ = dsp_detail::dbToGain(thresholdDb);
+        slope_ = static_cast<float>(1.0 / std::max(ratio, 1.0) - 1.0);
+        attackMs_ = attackMs;
+        releaseMs_ = releaseMs;
+        makeup_ = dsp_detail::dbToGain(makeupDb);
+        enabled_ = true;
+    }
+
+    void prepare(double rate, int channels)
+    {
+        channels_ = channels;
+        double blockSeconds = kSubBlock / rate;
+        attack_ = static_cast<float>(std::exp(-blockSeconds / (attackMs_ / 1000.0)));
+        release_ = static_cast<float>(std::exp(-blockSeconds / (releaseMs_ / 1000.0)));
+        envelope_ = 0.0f;
+        gain_ = makeup_;
+        minGain_ = 1.0f;
+    }
+
+    void process(float *x, size_t frames)
+    {
+        for (size_t i = 0; i < frames; i += kSubBlock)
+        {
+            size_t n = std::min(kSubBlock, frames - i) * channels_;
+            float *block = x + i * channels_;
+            float level = dsp_detail::peak(block, n);
+            float coef = level > envelope_ ? attack_ : release_;
+            envelope_ = level + coef * (envelope_ - level);
+
+            // (env / threshold)^(1/ratio - 1) above the threshold
+            float reduction = envelope_ > threshold_ ? std::exp(slope_ * std::log(envelope_ / threshold_)) : 1.0f;
+            minGain_ = std::min(minGain_, reduction);
+            float target = reduction * makeup_;
+            dsp_detail::rampGain(block, n, gain_, (target - gain_) / n);
+            gain_ = target;
+        }
+    }
+
+    // Deepest gain reduction so far, in dB (<= 0)
+    double maxReductionDb() const { return 20.0 * std::log10(minGain_); }
+
+private:
+    float threshold_ = 1.0f, slope_ = 0.0f, makeup_ = 1.0f;
+    double attackMs_ = 5.0, releaseMs_ = 100.0;
+    float attack_ = 0.0f, release_ = 0.0f;
+    float envelope_ = 0.0f, gain_ = 1.0f, minGain_ = 1.0f;
+    bool enabled_ = false;
+    int channels_ = 1;
+};
+
+// Peak limiter with instant attack: the envelope follows every sample that
+// exceeds it and decays with the release time, and the gain is
+// ceiling / envelope above the ceiling, so no output sample exceeds it.
+// The envelope is shared across channels to keep the stereo image.
+class Limiter
+{
+public:
+    const char *name() const { return "limiter"; }
+    bool enabled() const { return enabled_; }
+
+    void configure(double ceilingDb, double releaseMs = 50.0)
+    {
+        ceiling_ = dsp_detail::dbToGain(ceilingDb);
+        releaseMs_ = releaseMs;
+        enabled_ = true;
+    }
+
+    void prepare(double rate, int channels)
+    {
+        channels_ = channels;
+        release_ = static_cast<float>(std::exp(-1.0 / (releaseMs_ / 1000.0 * rate)));
+        envelope_ = 0.0f;
+        minGain_ = 1.0f;
+    }
+
+    void process(float *x, size_t frames)
+    {
+        float env = envelope_, minGain = minGain_;
+        for (size_t i = 0; i < frames; i++)
+        {
+            float *frame = x + i * channels_;
+            float level = 0.0f;
+            for (int c = 0; c < channels_; c++)
+                level = std::max(level, std::abs(frame[c]));
+            env = std::max(level, env * release_);
+            if (env > ceiling_)
+            {
+                float g = ceiling_ / env;
+                minGain = std::min(minGain, g);
+                for (int c = 0; c < channels_; c++)
+                    frame[c] *= g;
+            }
+        }
+        envelope_ = env;
+        minGain_ = minGain;
+    }
+
+    double maxReductionDb() const { return 20.0 * std::log10(minGain_); }
+
+private:
+    float ceiling_ = 1.0f;
+    double releaseMs_ = 50.0;
+    float release_ = 0.0f, envelope_ = 0.0f, minGain_ = 1.0f;
+    bool enabled_ = false;
+    int channels_ = 1;
+};
+
+// --- Chain ---
+
+template <typename... Stages>
+class DspChain
+{
+public:
+    static constexpr size_t kStages = sizeof...(Stages);
+
+    template <size_t I>
+    auto &stage()
+    {
+        return std::get<I>(stages_);
+    }
+
+    template <typename Stage>
+    Stage &stage()
+    {
+        return std::get<Stage>(stages_);
+    }
+
+    bool enabled() const
+    {
+        return std::apply([](const auto &...s) { return (s.enabled() || ...); }, stages_);
+    }
+
+    // False, leaving the chain unprepared, for more channels than the
+    // stages keep state for
+    bool prepare(double rate, int channels)
+    {
+        if (channels < 1 || channels > kDspMaxChannels)
+        {
+            std::cerr << "DSP processing supports 1 to " << kDspMaxChannels << " channels, not " << channels
+                      << ".\n";
+            return false;
+        }
+        rate_ = rate;
+        std::apply([&](auto &...s) { (s.prepare(rate, channels), ...); }, stages_);
+        return true;
+    }
+
+    // Runs every enabled stage over the block in order
+    void process(float *samples, size_t frames) { run(samples, frames, std::index_sequence_for<Stages...>{}); }
+
+    // Per-stage time per block: mean, p99 and max in us, and the mean as a
+    // share of the block duration (`frames` per block)
+    void report(std::ostream &os, size_t frames) const
+    {
+        double blockUs = frames * 1e6 / rate_;
+        os << "DSP stage        mean us   p99 us   max us   % of period\n" << std::fixed << std::setprecision(2);
+        reportStages(os, blockUs, std::index_sequence_for<Stages...>{});
+        os << std::defaultfloat;
+    }
+
+private:
+    template <size_t... I>
+    void run(float *samples, size_t frames, std::index_sequence<I...>)
+    {
+        (runStage<I>(samples, frames), ...);
+    }
+
+    template <size_t I>
+    void runStage(float *samples, size_t frames)
+    {
+        auto &s = std::get<I>(stages_);
+        if (!s.enabled())
+            return;
+        uint64_t start = metricsNow();
+        s.process(samples, frames);
+        times_[I].record(metricsNow() - start);
+    }
+
+    template <size_t... I>
+    void reportStages(std::ostream &os, double blockUs, std::index_sequence<I...>) const
+    {
+        (reportStage(os, std::get<I>(stages_).name(), times_[I], blockUs), ...);
+    }
+
+    static void reportStage(std::ostream &os, const char *name, const Log2Histogram &h, double blockUs)
+    {
+        if (h.count() == 0)
+            return;
+        double mean = h.mean() / 1000.0;
+        os << std::left << std::setw(15) << name << std::right << std::setw(9) << mean << std::setw(9)
+           << h.quantile(0.99) / 1000.0 << std::setw(9) << h.max() / 1000.0 << std::setw(12)
+           << 100.0 * mean / blockUs << "\n";
+    }
+
+    std::tuple<Stages...> stages_;
+    std::array<Log2Histogram, kStages> times_;
+    double rate_ = 48000.0;
+};
+
+// The chain between capture and playback in passthrough
+using PassthroughChain = DspChain<HighPass, Equalizer, Gain, Compressor, Limiter>;
+
+// --- Command line ---
+
+// Splits "a:b:c" into up to `max` numbers; returns how many were read
+inline int parseDspFields(const std::string &text, double *out, int max)
+{
+    int n = 0;
+    size_t pos = 0;
+    while (n < max && pos <= text.size())
+    {
+        size_t end = text.find(':', pos);
+        std::string field = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        char *stop = nullptr;
+        out[n] = std::strtod(field.c_str(), &stop);
+        if (field.empty() || *stop != '\0')
+            return -1;
+        n++;
+        if (end == std::string::npos)
+            break;
+        pos = end + 1;
+    }
+    return n;
+}
+
+// Applies one of the DSP flags to `chain`; false if `arg` isn't one. A
+// malformed value or an EQ band past the last is reported and ignored.
+//   --hpf=HZ                          high-pass
+//   --eq=HZ:DB[:Q]                    peaking band (repeatable, up to 8)
+//   --lowshelf=HZ:DB  --highshelf=HZ:DB
+//   --gain=DB
+//   --compress=THRESHOLD_DB:RATIO[:ATTACK_MS[:RELEASE_MS[:MAKEUP_DB]]]
+//   --limit=CEILING_DB[:RELEASE_MS]
+inline bool parseDspOption(const std::string &arg, PassthroughChain &chain)
+{
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos)
+        return false;
+    std::string flag = arg.substr(0, eq), value = arg.substr(eq + 1);
+    bool band = flag == "--eq" || flag == "--lowshelf" || flag == "--highshelf";
+    if (!band && flag != "--hpf" && flag != "--gain" && flag != "--compress" && flag != "--limit")
+        return false;
+
+    double v[5];
+    int n = parseDspFields(value, v, 5);
+    if (n < ((band || flag == "--compress") ? 2 : 1))
+    {
+        std::cerr << "Ignoring malformed " << arg << "\n";
+        return true;
+    }
+
+    if (flag == "--hpf")
+        chain.stage<HighPass>().configure(v[0]);
+    else if (flag == "--gain")
+        chain.stage<Gain>().configure(v[0]);
+    else if (flag == "--compress")
+        chain.stage<Compressor>().configure(v[0], v[1], n > 2 ? v[2] : 5.0, n > 3 ? v[3] : 100.0, n > 4 ? v[4] : 0.0);
+    else if (flag == "--limit")
+        chain.stage<Limiter>().configure(v[0], n > 1 ? v[1] : 50.0);
+    else
+    {
+        Biquad::Type type = flag == "--eq"         ? Biquad::Type::Peaking
+                            : flag == "--lowshelf" ? Biquad::Type::LowShelf
+                                                   : Biquad::Type::HighShelf;
+        Biquad filter = flag == "--eq" ? Biquad(type, v[0], v[1], n > 2 ? v[2] : 1.0) : Biquad(type, v[0], v[1]);
+        if (!chain.stage<Equalizer>().addBand(filter))
+            std::cerr << "Ignoring " << arg << ": at most " << Equalizer::kMaxBands << " EQ bands\n";
+    }
+    return true;
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "generators.h"
+
+// Radix-2 complex FFT on split real/imaginary arrays.
+//
+// forwardScrambled() is a decimation-in-frequency transform that leaves its
+// output in bit-reversed order, inverseScrambled() is a decimation-in-time
+// transform that takes bit-reversed input. Convolution only needs pointwise
+// products in between, so the bit-reversal permutation is skipped entirely.
+//
+// Both transforms split work across threads: the wide stages are divided
+// along the butterfly index, the narrow stages by independent sub-blocks.
+// Within a block, float and double butterflies run W at a time with
+// AVX2/SSE/NEON vectors; the last stages (fewer than 4 butterflies per
+// block) stay scalar.
+
+// Run fn(begin, end) over [0, count) on up to `threads` threads
+template <typename Fn>
+void parallelFor(int threads, size_t count, Fn &&fn)
+{
+    if (threads <= 1 || count < 2)
+    {
+        fn(size_t(0), count);
+        return;
+    }
+    threads = static_cast<int>(std::min<size_t>(threads, count));
+    std::vector<std::thread> pool;
+    size_t chunk = (count + threads - 1) / threads;
+    for (int t = 1; t < threads; t++)
+    {
+        size_t begin = t * chunk;
+        size_t end = std::min(count, begin + chunk);
+        if (begin < end)
+            pool.emplace_back([&fn, begin, end]() { fn(begin, end); });
+    }
+    fn(size_t(0), std::min(count, chunk));
+    for (auto &th : pool)
+        th.join();
+}
+
+namespace fft_detail
+{
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef double v2df __attribute__((vector_size(16)));
+typedef double v4df __attribute__((vector_size(32)));
+
+// Butterflies j in [begin, end) of one block, W at a time; returns where the
+// scalar loop takes over. `re2`/`im2` are the block's second half.
+template <typename V, typename T, int W>
+__attribute__((always_inline)) inline size_t difBody(T *__restrict re, T *__restrict im, T *__restrict re2,
+                                                     T *__restrict im2, const T *__restrict wr,
+                                                     const T *__restrict wi, size_t begin, size_t end)
+{
+    size_t j = begin;
+    for (; j + W <= end; j += W)
+    {
+        V ar, ai, br, bi, c, s;
+        std::memcpy(&ar, re + j, sizeof(V));
+        std::memcpy(&ai, im + j, sizeof(V));
+        std::memcpy(&br, re2 + j, sizeof(V));
+        std::memcpy(&bi, im2 + j, sizeof(V));
+        std::memcpy(&c, wr + j, sizeof(V));
+        std::memcpy(&s, wi + j, sizeof(V));
+        V sr = ar + br, si = ai + bi, dr = ar - br, di = ai - bi;
+        V tr = dr * c - di * s, ti = dr * s + di * c;
+        std::memcpy(re + j, &sr, sizeof(V));
+        std::memcpy(im + j, &si, sizeof(V));
+        std::memcpy(re2 + j, &tr, sizeof(V));
+        std::memcpy(im2 + j, &ti, sizeof(V));
+    }
+    return j;
+}
+
+template <typename V, typename T, int W>
+__attribute__((always_inline)) inline size_t ditBody(T *__restrict re, T *__restrict im, T *__restrict re2,
+                                                     T *__restrict im2, const T *__restrict wr,
+                                                     const T *__restrict wi, size_t begin, size_t end)
+{
+    size_t j = begin;
+    for (; j + W <= end; j += W)
+    {
+        V ar, ai, xr, xi, c, s;
+        std::memcpy(&ar, re + j, sizeof(V));
+        std::memcpy(&ai, im + j, sizeof(V));
+        std::memcpy(&xr, re2 + j, sizeof(V));
+        std::memcpy(&xi, im2 + j, sizeof(V));
+        std::memcpy(&c, wr + j, sizeof(V));
+        std::memcpy(&s, wi + j, sizeof(V));
+        V br = xr * c + xi * s, bi = xi * c - xr * s;
+        V sr = ar + br, si = ai + bi, dr = ar - br, di = ai - bi;
+        std::memcpy(re + j, &sr, sizeof(V));
+        std::memcpy(im + j, &si, sizeof(V));
+        std::memcpy(re2 + j, &dr, sizeof(V));
+        std::memcpy(im2 + j, &di, sizeof(V));
+    }
+    return j;
+}
+
+#define FFT_BUTTERFLY_ARGS T *re, T *im, T *re2, T *im2, const T *wr, const T *wi, size_t begin, size_t end
+
+#if defined(__x86_64__) || defined(__i386__)
+template <typename T, typename V, int W>
+__attribute__((target("avx2,fma"))) inline size_t difAvx2(FFT_BUTTERFLY_ARGS)
+{
+    return difBody<V, T, W>(re, im, re2, im2, wr, wi, begin, end);
+}
+
+template <typename T, typename V, int W>
+__attribute__((target("avx2,fma"))) inline size_t ditAvx2(FFT_BUTTERFLY_ARGS)
+{
+    return ditBody<V, T, W>(re, im, re2, im2, wr, wi, begin, end);
+}
+#endif
+
+// Vector types per element type: 256-bit for AVX2, 128-bit otherwise
+template <typename T>
+struct Lanes;
+template <>
+struct Lanes<float>
+{
+    using Wide = v8sf;
+    using Narrow = v4sf;
+    static constexpr int kWide = 8, kNarrow = 4;
+};
+template <>
+struct Lanes<double>
+{
+    using Wide = v4df;
+    using Narrow = v2df;
+    static constexpr int kWide = 4, kNarrow = 2;
+};
+
+template <typename T, bool Dit>
+inline size_t butterflies(FFT_BUTTERFLY_ARGS)
+{
+    if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>)
+    {
+        if (end - begin < 4)
+            return begin;
+        using L = Lanes<T>;
+        switch (activeSimdIsa())
+        {
+#if defined(__x86_64__) || defined(__i386__)
+        case SimdIsa::Avx2:
+            return Dit ? ditAvx2<T, typename L::Wide, L::kWide>(re, im, re2, im2, wr, wi, begin, end)
+                       : difAvx2<T, typename L::Wide, L::kWide>(re, im, re2, im2, wr, wi, begin, end);
+        case SimdIsa::Sse:
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+        case SimdIsa::Neon:
+#endif
+            return Dit ? ditBody<typename L::Narrow, T, L::kNarrow>(re, im, re2, im2, wr, wi, begin, end)
+                       : difBody<typename L::Narrow, T, L::kNarrow>(re, im, re2, im2, wr, wi, begin, end);
+        default:
+            break;
+        }
+    }
+    return begin;
+}
+
+#undef FFT_BUTTERFLY_ARGS
+
+} // namespace fft_detail
+
+inline size_t nextPowerOfTwo(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+inline size_t bitReverse(size_t x, int bits)
+{
+    size_t r = 0;
+    for (int i = 0; i < bits; i++)
+    {
+        r = (r << 1) | (x & 1);
+        x >>= 1;
+    }
+    return r;
+}
+
+template <typename T>
+class FftPlan
+{
+public:
+    // n must be a power of two
+    explicit FftPlan(size_t n) : n_(n), cos_(n), sin_(n)
+    {
+        while ((size_t(1) << log2n_) < n)
+            log2n_++;
+
+        // Twiddles for a stage of size m are stored contiguously at [m/2, m)
+        for (size_t m = 2; m <= n; m <<= 1)
+        {
+            for (size_t j = 0; j < m / 2; j++)
+            {
+                double angle = -2.0 * M_PI * double(j) / double(m);
+                cos_[m / 2 + j] = static_cast<T>(std::cos(angle));
+                sin_[m / 2 + j] = static_cast<T>(std::sin(angle));
+            }
+        }
+    }
+
+    size_t size() const { return n_; }
+    int log2Size() const { return log2n_; }
+
+    // Natural order in, bit-reversed order out
+    void forwardScrambled(T *re, T *im, int threads = 1) const
+    {
+        size_t m = n_;
+        // Wide stages: fewer blocks than threads, split each block's butterflies
+        for (; m >= 2 && n_ / m < static_cast<size_t>(threads); m >>= 1)
+        {
+            for (size_t block = 0; block < n_; block += m)
+                parallelFor(threads, m / 2, [&](size_t b, size_t e) { difButterflies(re + block, im + block, m, b, e); });
+        }
+        // Narrow stages: each thread finishes its own set of independent blocks
+        if (m >= 2)
+        {
+            size_t top = m;
+            parallelFor(threads, n_ / top, [&](size_t b, size_t e)
+            {
+                for (size_t mm = top; mm >= 2; mm >>= 1)
+                    for (size_t block = b * top; block < e * top; block += mm)
+                        difButterflies(re + block, im + block, mm, 0, mm / 2);
+            });
+        }
+    }
+
+    // Bit-reversed order in, natural order out, unscaled (multiply by 1/n)
+    void inverseScrambled(T *re, T *im, int threads = 1) const
+    {
+        // Narrow stages first, each thread owning independent blocks
+        size_t top = 2;
+        while (top < n_ && n_ / (top * 2) >= static_cast<size_t>(threads))
+            top <<= 1;
+        parallelFor(threads, n_ / top, [&](size_t b, size_t e)
+        {
+            for (size_t mm = 2; mm <= top; mm <<= 1)
+                for (size_t block = b * top; block < e * top; block += mm)
+                    ditButterflies(re + block, im + block, mm, 0, mm / 2);
+        });
+        // Wide stages: split each block's butterflies
+        for (size_t m = top * 2; m <= n_; m <<= 1)
+        {
+            for (size_t block = 0; block < n_; block += m)
+                parallelFor(threads, m / 2, [&](size_t b, size_t e) { ditButterflies(re + block, im + block, m, b, e); });
+        }
+    }
+
+    // Natural order in and out
+    void forward(T *re, T *im, int threads = 1) const
+    {
+        forwardScrambled(re, im, threads);
+        unscramble(re, im);
+    }
+
+    void unscramble(T *re, T *im) const
+    {
+        for (size_t i = 0; i < n_; i++)
+        {
+            size_t j = bitReverse(i, log2n_);
+            if (j > i)
+            {
+                std::swap(re[i], re[j]);
+                std::swap(im[i], im[j]);
+            }
+        }
+    }
+
+private:
+    void difButterflies(T *__restrict re, T *__restrict im, size_t m, size_t begin, size_t end) const
+    {
+        size_t half = m / 2;
+        const T *__restrict wr = &cos_[half];
+        const T *__restrict wi = &sin_[half];
+        T *__restrict re2 = re + half;
+        T *__restrict im2 = im + half;
+        begin = fft_detail::butterflies<T, false>(re, im, re2, im2, wr, wi, begin, end);
+        for (size_t j = begin; j < end; j++)
+        {
+            T ar = re[j], ai = im[j];
+            T br = re2[j], bi = im2[j];
+            re[j] = ar + br;
+            im[j] = ai + bi;
+            T dr = ar - br, di = ai - bi;
+            re2[j] = dr * wr[j] - di * wi[j];
+            im2[j] = dr * wi[j] + di * wr[j];
+        }
+    }
+
+    void ditButterflies(T *__restrict re, T *__restrict im, size_t m, size_t begin, size_t end) const
+    {
+        size_t half = m / 2;
+        const T *__restrict wr = &cos_[half];
+        const T *__restrict wi = &sin_[half];
+        T *__restrict re2 = re + half;
+        T *__restrict im2 = im + half;
+        begin = fft_detail::butterflies<T, true>(re, im, re2, im2, wr, wi, begin, end);
+        for (size_t j = begin; j < end; j++)
+        {
+            // Conjugate twiddle for the inverse
+            T br = re2[j] * wr[j] + im2[j] * wi[j];
+            T bi = im2[j] * wr[j] - re2[j] * wi[j];
+            T ar = re[j], ai = im[j];
+            re[j] = ar + br;
+            im[j] = ai + bi;
+            re2[j] = ar - br;
+            im2[j] = ai - bi;
+        }
+    }
+
+    size_t n_;
+    int log2n_ = 0;
+    std::vector<T> cos_, sin_;
+};
+
+// Linear convolution of two real signals. Both are packed into one complex
+// transform (x + i*h) and separated in the frequency domain, so the whole
+// convolution costs one forward and one inverse FFT.
+template <typename T>
+std::vector<T> fftConvolve(const std::vector<T> &x, const std::vector<T> &h, int threads = 1)
+{
+    if (x.empty() || h.empty())
+        return {};
+
+    size_t outLen = x.size() + h.size() - 1;
+    size_t n = nextPowerOfTwo(outLen);
+    FftPlan<T> plan(n);
+    int bits = plan.log2Size();
+
+    std::vector<T> re(n, T(0)), im(n, T(0));
+    std::copy(x.begin(), x.end(), re.begin());
+    std::copy(h.begin(), h.end(), im.begin());
+    plan.forwardScrambled(re.data(), im.data(), threads);
+
+    // Y[k] = X[k] * H[k] with X = (Z[k] + conj Z[n-k]) / 2, H = (Z[k] - conj Z[n-k]) / 2i.
+    // Bins k and n-k are handled together so the update can be done in place.
+    std::vector<T> yr(n), yi(n);
+    parallelFor(threads, n, [&](size_t b, size_t e)
+    {
+        for (size_t p = b; p < e; p++)
+        {
+            size_t k = bitReverse(p, bits);
+            size_t q = bitReverse((n - k) & (n - 1), bits);
+            T zr = re[p], zi = im[p];
+            T cr = re[q], ci = -im[q];
+            T xr = (zr + cr) / 2, xi = (zi + ci) / 2;
+            T hr = (zi - ci) / 2, hi = -(zr - cr) / 2;
+            yr[p] = (xr * hr - xi * hi) / T(n);
+            yi[p] = (xr * hi + xi * hr) / T(n);
+        }
+    });
+
+    plan.inverseScrambled(yr.data(), yi.data(), threads);
+    yr.resize(outLen);
+    return yr;
+}
+
+// --- Exponential sweep deconvolution (Farina) ---
+
+struct SweepResponse
+{
+    std::vector<double> response; // recording convolved with the inverse sweep
+    long origin = 0;              // index where the linear IR of a zero-delay system starts
+    long delay = 0;               // frames from origin to the linear IR peak
+    double K = 0.0;               // sweep rate constant: harmonic n leads by K*ln(n) seconds
+};
+
+// Convolve a recording of LogSweepGenerator(f0, f1, seconds, rate) with its
+// inverse filter: the time-reversed sweep with a -6 dB/octave envelope,
+// normalised to unit gain at 1 kHz (geometric mean of f0, f1 if out of band).
+inline SweepResponse deconvolveSweep(const std::vector<double> &recording, int rate, double seconds, double f0,
+                                     double f1, int threads = 1)
+{
+    SweepResponse result;
+    int sweepFrames = static_cast<int>(seconds * rate);
+    LogSweepGenerator generator(f0, f1, seconds, rate);
+    std::vector<float> sweep(sweepFrames);
+    generator.render(sweep.data(), sweepFrames);
+    result.K = generator.K();
+
+    std::vector<double> inverse(sweepFrames);
+    for (int n = 0; n < sweepFrames; n++)
+        inverse[n] = sweep[sweepFrames - 1 - n] * std::exp(-double(n) / (result.K * rate));
+
+    double fRef = (f0 < 1000.0 && f1 > 1000.0) ? 1000.0 : std::sqrt(f0 * f1);
+    std::complex<double> sweepBin = 0, inverseBin = 0;
+    std::complex<double> rot = std::polar(1.0, -2 * M_PI * fRef / rate), w = 1;
+    for (int n = 0; n < sweepFrames; n++, w *= rot)
+    {
+        sweepBin += double(sweep[n]) * w;
+        inverseBin += inverse[n] * w;
+    }
+    double gain = 1.0 / std::abs(sweepBin * inverseBin);
+    for (double &v : inverse)
+        v *= gain;
+
+    result.response = fftConvolve(recording, inverse, threads);
+
+    // The linear IR starts at sweepFrames - 1; the system delay is the peak within a second after it
+    result.origin = sweepFrames - 1;
+    long searchEnd = std::min<long>(result.response.size(), result.origin + rate);
+    long peak = result.origin;
+    for (long i = result.origin; i < searchEnd; i++)
+        if (std::fabs(result.response[i]) > std::fabs(result.response[peak]))
+            peak = i;
+    result.delay = peak - result.origin;
+    return result;
+}
@@ -0,0 +1,916 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio_sink.h"
+#include "sample_format.h"
+#include "spsc_ring.h"
+#include "thread_pool.h"
+
+// Streaming FLAC writer (16 or 24-bit), encoded in-tree.
+//
+// The capture side is the same as WavStreamWriter's: frames are converted
+// to the file format as they are copied into fixed-size blocks from a
+// preallocated pool, and full blocks go to a writer thread through a
+// lock-free queue. The writer hands each block to a work-stealing pool.
+// Each block becomes one FLAC frame, encoded in parallel into that block's
+// preallocated output buffer. The writer then appends the frames in order,
+// feeds the raw samples to the STREAMINFO MD5 and returns the block to the
+// pool. If the encoders fall behind, the pool runs dry and the capture
+// thread drops and counts frames; it never waits.
+//
+// Encoding uses FLAC's fixed polynomial predictors (order 0-4, the best
+// chosen per channel and frame) with partitioned Rice residual coding.
+// Stereo frames pick the cheapest of left/right, left/side, side/right and
+// mid/side. Silent channels become CONSTANT subframes, incompressible ones
+// VERBATIM. That is roughly `flac -1`; LPC is not implemented.
+
+namespace flac_detail
+{
+
+inline const uint8_t *crc8Table()
+{
+    static uint8_t table[256];
+    static bool ready = [] {
+        for (int i = 0; i < 256; i++)
+        {
+            uint8_t c = static_cast<uint8_t>(i);
+            for (int b = 0; b < 8; b++)
+                c = static_cast<uint8_t>((c & 0x80) ? (c << 1) ^ 0x07 : c << 1);
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)ready;
+    return table;
+}
+
+inline const uint16_t *crc16Table()
+{
+    static uint16_t table[256];
+    static bool ready = [] {
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t c = static_cast<uint16_t>(i << 8);
+            for (int b = 0; b < 8; b++)
+                c = static_cast<uint16_t>((c & 0x8000) ? (c << 1) ^ 0x8005 : c << 1);
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)ready;
+    return table;
+}
+
+inline uint8_t crc8(const uint8_t *data, size_t n)
+{
+    const uint8_t *table = crc8Table();
+    uint8_t crc = 0;
+    for (size_t i = 0; i < n; i++)
+        crc = table[crc ^ data[i]];
+    return crc;
+}
+
+inline uint16_t crc16(const uint8_t *data, size_t n)
+{
+    const uint16_t *table = crc16Table();
+    uint16_t crc = 0;
+    for (size_t i = 0; i < n; i++)
+        crc = static_cast<uint16_t>((crc << 8) ^ table[(crc >> 8) ^ data[i]]);
+    return crc;
+}
+
+// MSB-first bit packer into a caller-sized buffer
+class BitWriter
+{
+public:
+    explicit BitWriter(uint8_t *out) : begin_(out), out_(out) {}
+
+    void put(uint32_t value, int bits)
+    {
+        acc_ = (acc_ << bits) | (bits == 32 ? value : value & ((1u << bits) - 1));
+        count_ += bits;
+        while (count_ >= 8)
+        {
+            count_ -= 8;
+            *out_++ = static_cast<uint8_t>(acc_ >> count_);
+        }
+    }
+
+    // q zero bits, a one, then the low k bits of u
+    void putRice(uint32_t u, int k)
+    {
+        uint32_t q = u >> k;
+        if (q + 1 + k <= 32)
+        {
+            put((1u << k) | (k ? u & ((1u << k) - 1) : 0), static_cast<int>(q) + 1 + k);
+            return;
+        }
+        for (; q >= 32; q -= 32)
+            put(0, 32);
+        put(1, static_cast<int>(q) + 1);
+        if (k)
+            put(u, k);
+    }
+
+    void align()
+    {
+        if (count_)
+            put(0, 8 - count_);
+    }
+
+    size_t bytes() const { return out_ - begin_; }
+    const uint8_t *data() const { return begin_; }
+
+private:
+    uint8_t *begin_, *out_;
+    uint64_t acc_ = 0;
+    int count_ = 0;
+};
+
+// Frame numbers and sample numbers use FLAC's extended UTF-8 coding
+inline void putUtf8(BitWriter &bits, uint64_t v)
+{
+    if (v < 0x80)
+    {
+        bits.put(static_cast<uint32_t>(v), 8);
+        return;
+    }
+    int bytes = v < 0x800 ? 2 : v < 0x10000 ? 3 : v < 0x200000 ? 4 : v < 0x4000000 ? 5 : v < 0x80000000ull ? 6 : 7;
+    int shift = (bytes - 1) * 6;
+    bits.put(((0xFF00u >> bytes) & 0xFF) | static_cast<uint32_t>(v >> shift), 8);
+    for (int i = bytes - 2; i >= 0; i--)
+        bits.put(0x80 | static_cast<uint32_t>((v >> (6 * i)) & 0x3F), 8);
+}
+
+inline uint32_t zigzag(int32_t r)
+{
+    return (static_cast<uint32_t>(r) << 1) ^ static_cast<uint32_t>(r >> 31);
+}
+
+const int kMaxPartitionOrder = 8;
+
+// How one channel of a frame will be coded
+struct SubframePlan
+{
+    enum Type
+    {
+        Constant,
+        Verbatim,
+        Fixed
+    } type = Verbatim;
+    int order = 0;          // fixed predictor order
+    int partitionOrder = 0;
+    int method = 0;         // 0: 4-bit Rice parameters, 1: 5-bit
+    uint8_t params[1 << kMaxPartitionOrder] = {};
+    uint64_t bits = 0;      // estimated size
+};
+
+// Rice parameter and estimated bits for `n` residuals whose zigzag sum is `sum`
+inline int riceParameter(uint64_t sum, size_t n, uint64_t &bits)
+{
+    uint64_t mean = n ? sum / n : 0;
+    int k = 0;
+    while (k < 30 && (mean >> (k + 1)) > 0)
+        k++;
+    bits = n * (k + 1) + (sum >> k);
+    if (k > 0 && n * k + (sum >> (k - 1)) < bits) // n*(k-1+1)
+    {
+        k--;
+        bits = n * (k + 1) + (sum >> k);
+    }
+    return k;
+}
+
+// Best fixed predictor and partitioning for x[0..n); residual left in `residual`
+inline void planFixed(const int32_t *x, size_t n, int bps, int32_t *residual, uint64_t *partitionSums,
+                      SubframePlan &plan)
+{
+    // Order by total |residual|: each order is the difference of the one below
+    uint64_t total[5] = {};
+    if (n > 4)
+    {
+        int64_t last0 = x[3], last1 = int64_t(x[3]) - x[2], last2 = last1 - (int64_t(x[2]) - x[1]),
+                last3 = last2 - ((int64_t(x[2]) - x[1]) - (int64_t(x[1]) - x[0]));
+        for (size_t i = 4; i < n; i++)
+        {
+            int64_t e0 = x[i], e1 = e0 - last0, e2 = e1 - last1, e3 = e2 - last2, e4 = e3 - last3;
+            total[0] += std::abs(e0);
+            total[1] += std::abs(e1);
+            total[2] += std::abs(e2);
+            total[3] += std::abs(e3);
+            total[4] += std::abs(e4);
+            last0 = e0;
+            last1 = e1;
+            last2 = e2;
+            last3 = e3;
+        }
+    }
+    int order = 0;
+    for (int o = 1; o <= 4 && n > 4; o++)
+        if (total[o] < total[order])
+            order = o;
+    plan.order = order;
+
+    for (size_t i = order; i < n; i++)
+    {
+        int64_t e;
+        switch (order)
+        {
+        case 0:
+            e = x[i];
+            break;
+        case 1:
+            e = int64_t(x[i]) - x[i - 1];
+            break;
+        case 2:
+            e = int64_t(x[i]) - 2 * int64_t(x[i - 1]) + x[i - 2];
+            break;
+        case 3:
+            e = int64_t(x[i]) - 3 * int64_t(x[i - 1]) + 3 * int64_t(x[i - 2]) - x[i - 3];
+            break;
+        default:
+            e = int64_t(x[i]) - 4 * int64_t(x[i - 1]) + 6 * int64_t(x[i - 2]) - 4 * int64_t(x[i - 3]) + x[i - 4];
+            break;
+        }
+        residual[i] = static_cast<int32_t>(e);
+    }
+
+    // Finest usable partitioning: equal partitions, the first longer than the warm-up
+    int maxOrder = 0;
+    while (maxOrder < kMaxPartitionOrder && (n % (size_t(2) << maxOrder)) == 0 &&
+           (n >> (maxOrder + 1)) > size_t(order))
+        maxOrder++;
+    size_t parts = size_t(1) << maxOrder, size = n >> maxOrder;
+    for (size_t p = 0; p < parts; p++)
+    {
+        uint64_t sum = 0;
+        for (size_t i = std::max(p * size, size_t(order)); i < (p + 1) * size; i++)
+            sum += zigzag(residual[i]);
+        partitionSums[p] = sum;
+    }
+
+    // Merge pairs upward and keep the cheapest partition order
+    plan.bits = UINT64_MAX;
+    uint8_t params[1 << kMaxPartitionOrder];
+    for (int po = maxOrder;; po--)
+    {
+        size_t count = size_t(1) << po, length = n >> po;
+        uint64_t bits = 2 + 4;
+        int maxK = 0;
+        for (size_t p = 0; p < count; p++)
+        {
+            uint64_t partBits;
+            int k = riceParameter(partitionSums[p], length - (p == 0 ? order : 0), partBits);
+            params[p] = static_cast<uint8_t>(k);
+            maxK = std::max(maxK, k);
+            bits += partBits;
+        }
+        int method = maxK > 14 ? 1 : 0;
+        bits += count * (method ? 5 : 4);
+        if (bits < plan.bits)
+        {
+            plan.bits = bits;
+            plan.partitionOrder = po;
+            plan.method = method;
+            std::memcpy(plan.params, params, count);
+        }
+        if (po == 0)
+            break;
+        for (size_t p = 0; p < count / 2; p++)
+            partitionSums[p] = partitionSums[2 * p] + partitionSums[2 * p + 1];
+    }
+    plan.bits += 8 + uint64_t(order) * bps;
+    plan.type = SubframePlan::Fixed;
+
+    uint64_t verbatim = 8 + uint64_t(n) * bps;
+    if (plan.bits >= verbatim)
+    {
+        plan.type = SubframePlan::Verbatim;
+        plan.bits = verbatim;
+    }
+}
+
+inline void planSubframe(const int32_t *x, size_t n, int bps, int32_t *residual, uint64_t *partitionSums,
+                         SubframePlan &plan)
+{
+    if (std::all_of(x, x + n, [&](int32_t v) { return v == x[0]; }))
+    {
+        plan.type = SubframePlan::Constant;
+        plan.bits = 8 + bps;
+        return;
+    }
+    planFixed(x, n, bps, residual, partitionSums, plan);
+}
+
+inline void writeSubframe(BitWriter &bits, const int32_t *x, size_t n, int bps, const int32_t *residual,
+                          const SubframePlan &plan)
+{
+    bits.put(0, 1);
+    switch (plan.type)
+    {
+    case SubframePlan::Constant:
+        bits.put(0, 6);
+        bits.put(0, 1);
+        bits.put(static_cast<uint32_t>(x[0]), bps);
+        return;
+    case SubframePlan::Verbatim:
+        bits.put(1, 6);
+        bits.put(0, 1);
+        for (size_t i = 0; i < n; i++)
+            bits.put(static_cast<uint32_t>(x[i]), bps);
+        return;
+    case SubframePlan::Fixed:
+        break;
+    }
+    bits.put(8 | plan.order, 6);
+    bits.put(0, 1);
+    for (int i = 0; i < plan.order; i++)
+        bits.put(static_cast<uint32_t>(x[i]), bps);
+
+    bits.put(plan.method, 2);
+    bits.put(plan.partitionOrder, 4);
+    size_t count = size_t(1) << plan.partitionOrder, length = n >> plan.partitionOrder;
+    for (size_t p = 0; p < count; p++)
+    {
+        int k = plan.params[p];
+        bits.put(k, plan.method ? 5 : 4);
+        for (size_t i = std::max(p * length, size_t(plan.order)); i < (p + 1) * length; i++)
+            bits.putRice(zigzag(residual[i]), k);
+    }
+}
+
+inline int sampleRateCode(int rate)
+{
+    switch (rate)
+    {
+    case 88200: return 1;
+    case 176400: return 2;
+    case 192000: return 3;
+    case 8000: return 4;
+    case 16000: return 5;
+    case 22050: return 6;
+    case 24000: return 7;
+    case 32000: return 8;
+    case 44100: return 9;
+    case 48000: return 10;
+    case 96000: return 11;
+    default: return 0; // from STREAMINFO
+    }
+}
+
+// Per-thread working memory for encodeFrame()
+struct EncoderScratch
+{
+    explicit EncoderScratch(size_t blockFrames = 0, int channels = 0)
+        : samples(std::max(channels, 4) * blockFrames), residual(std::max(channels, 4) * blockFrames),
+          partitionSums(1 << kMaxPartitionOrder), plans(std::max(channels, 4))
+    {
+    }
+
+    std::vector<int32_t> samples, residual; // one blockFrames slice per channel or stereo candidate
+    std::vector<uint64_t> partitionSums;
+    std::vector<SubframePlan> plans;
+};
+
+// Worst-case encoded size of a frame (all VERBATIM, side channel one bit wider)
+inline size_t maxFrameBytes(size_t blockFrames, int channels, int bps)
+{
+    return 18 + channels * (1 + (blockFrames * (bps + 1) + 7) / 8) + 2;
+}
+
+// One FLAC frame from interleaved little-endian 16 or 24-bit samples; returns its size
+inline size_t encodeFrame(const uint8_t *interleaved, size_t n, int channels, int bps, int rate,
+                          uint64_t frameNumber, EncoderScratch &scratch, uint8_t *out)
+{
+    // De-interleave into one int32 array per channel
+    for (int c = 0; c < channels; c++)
+    {
+        int32_t *x = scratch.samples.data() + c * n;
+        if (bps == 16)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                int16_t v;
+                std::memcpy(&v, interleaved + (i * channels + c) * 2, 2);
+                x[i] = v;
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                const uint8_t *p = interleaved + (i * channels + c) * 3;
+                x[i] = static_cast<int32_t>((uint32_t(p[0]) << 8) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 24)) >> 8;
+            }
+        }
+    }
+
+    // Stereo: slots 0 L, 1 R, 2 side, 3 mid; pick the cheapest pair
+    int assignment = channels - 1; // independent
+    const int32_t *sources[8];
+    int widths[8];
+    int planIndex[8];
+    for (int c = 0; c < channels; c++)
+    {
+        planSubframe(scratch.samples.data() + c * n, n, bps, scratch.residual.data() + c * n,
+                     scratch.partitionSums.data(), scratch.plans[c]);
+        sources[c] = scratch.samples.data() + c * n;
+        widths[c] = bps;
+        planIndex[c] = c;
+    }
+    if (channels == 2)
+    {
+        int32_t *l = scratch.samples.data(), *r = l + n, *side = r + n, *mid = side + n;
+        for (size_t i = 0; i < n; i++)
+        {
+            side[i] = l[i] - r[i];
+            mid[i] = (l[i] + r[i]) >> 1;
+        }
+        planSubframe(side, n, bps + 1, scratch.residual.data() + 2 * n, scratch.partitionSums.data(), scratch.plans[2]);
+        planSubframe(mid, n, bps, scratch.residual.data() + 3 * n, scratch.partitionSums.data(), scratch.plans[3]);
+        uint64_t cost[4] = {scratch.plans[0].bits + scratch.plans[1].bits, scratch.plans[0].bits + scratch.plans[2].bits,
+                            scratch.plans[2].bits + scratch.plans[1].bits, scratch.plans[3].bits + scratch.plans[2].bits};
+        static const int pairs[4][2] = {{0, 1}, {0, 2}, {2, 1}, {3, 2}};
+        int best = static_cast<int>(std::min_element(cost, cost + 4) - cost);
+        if (best > 0)
+        {
+            assignment = 7 + best; // 8 left/side, 9 side/right, 10 mid/side
+            for (int c = 0; c < 2; c++)
+            {
+                int slot = pairs[best][c];
+                sources[c] = scratch.samples.data() + slot * n;
+                widths[c] = slot == 2 ? bps + 1 : bps;
+                planIndex[c] = slot;
+            }
+        }
+    }
+
+    BitWriter bits(out);
+    bits.put(0x3FFE, 14);
+    bits.put(0, 1); // reserved
+    bits.put(0, 1); // fixed block size: the header carries the frame number
+    int blockCode = 7;
+    for (int code = 8; code <= 15; code++)
+        if (n == size_t(256) << (code - 8))
+            blockCode = code;
+    bits.put(blockCode, 4);
+    bits.put(sampleRateCode(rate), 4);
+    bits.put(assignment, 4);
+    bits.put(bps == 16 ? 4 : 6, 3);
+    bits.put(0, 1);
+    putUtf8(bits, frameNumber);
+    if (blockCode == 7)
+        bits.put(static_cast<uint32_t>(n - 1), 16);
+    bits.put(crc8(bits.data(), bits.bytes()), 8);
+
+    for (int c = 0; c < channels; c++)
+        writeSubframe(bits, sources[c], n, widths[c], scratch.residual.data() + planIndex[c] * n,
+                      scratch.plans[planIndex[c]]);
+    bits.align();
+    uint16_t crc = crc16(bits.data(), bits.bytes());
+    bits.put(crc, 16);
+    return bits.bytes();
+}
+
+// RFC 1321, for the STREAMINFO signature of the unencoded samples
+class Md5
+{
+public:
+    void update(const uint8_t *data, size_t n)
+    {
+        total_ += n;
+        if (fill_)
+        {
+            size_t take = std::min(n, sizeof(buffer_) - fill_);
+            std::memcpy(buffer_ + fill_, data, take);
+            fill_ += take;
+            data += take;
+            n -= take;
+            if (fill_ < sizeof(buffer_))
+                return;
+            transform(buffer_);
+            fill_ = 0;
+        }
+        for (; n >= 64; data += 64, n -= 64)
+            transform(data);
+        std::memcpy(buffer_, data, n);
+        fill_ = n;
+    }
+
+    void finish(uint8_t digest[16])
+    {
+        uint64_t bitsTotal = total_ * 8;
+        uint8_t pad[72] = {0x80};
+        size_t padLength = (fill_ < 56 ? 56 : 120) - fill_;
+        update(pad, padLength);
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++)
+            length[i] = static_cast<uint8_t>(bitsTotal >> (8 * i));
+        update(length, 8);
+        for (int i = 0; i < 4; i++)
+            for (int b = 0; b < 4; b++)
+                digest[i * 4 + b] = static_cast<uint8_t>(state_[i] >> (8 * b));
+    }
+
+private:
+    static uint32_t rotl(uint32_t x, int c) { return (x << c) | (x >> (32 - c)); }
+
+    void transform(const uint8_t *block)
+    {
+        static const uint32_t K[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+        static const int S[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+        uint32_t m[16];
+        for (int i = 0; i < 16; i++)
+            m[i] = uint32_t(block[i * 4]) | uint32_t(block[i * 4 + 1]) << 8 | uint32_t(block[i * 4 + 2]) << 16 |
+                   uint32_t(block[i * 4 + 3]) << 24;
+        uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t f;
+            int g;
+            if (i < 16)
+            {
+                f = (b & c) | (~b & d);
+                g = i;
+            }
+            else if (i < 32)
+            {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) & 15;
+            }
+            else if (i < 48)
+            {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) & 15;
+            }
+            else
+            {
+                f = c ^ (b | ~d);
+                g = (7 * i) & 15;
+            }
+            uint32_t next = d;
+            d = c;
+            c = b;
+            b = b + rotl(a + f + K[i] + m[g], S[(i / 16) * 4 + i % 4]);
+            a = next;
+        }
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+    }
+
+    uint32_t state_[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    uint8_t buffer_[64] = {};
+    size_t fill_ = 0;
+    uint64_t total_ = 0;
+};
+
+} // namespace flac_detail
+
+class FlacStreamWriter : public AudioSink
+{
+public:
+    // `threads` encoders, 0 = all cores but one (left for capture)
+    explicit FlacStreamWriter(size_t blockFrames = 4096, size_t blockCount = 64, int threads = 0)
+        : blockFrames_(blockFrames), blockCount_(blockCount), threads_(threads), freeBlocks_(blockCount),
+          fullBlocks_(blockCount)
+    {
+        if (threads_ <= 0)
+            threads_ = static_cast<int>(std::max(2u, std::thread::hardware_concurrency()) - 1);
+    }
+
+    ~FlacStreamWriter() override { close(); }
+
+    FlacStreamWriter(const FlacStreamWriter &) = delete;
+    FlacStreamWriter &operator=(const FlacStreamWriter &) = delete;
+
+    bool open(const std::string &filename, int sampleRate, int channels,
+              SampleFormat format = SampleFormat::S16) override
+    {
+        if (format != SampleFormat::S16 && format != SampleFormat::S24_3)
+        {
+            std::cerr << "FLAC output is 16 or 24-bit (--wav-format=s16|s24).\n";
+            return false;
+        }
+        if (channels < 1 || channels > 8)
+        {
+            std::cerr << "FLAC supports 1 to 8 channels.\n";
+            return false;
+        }
+        out_.open(filename, std::ios::binary | std::ios::trunc);
+        if (!out_)
+            return false;
+
+        sampleRate_ = sampleRate;
+        channels_ = channels;
+        format_ = format;
+        bps_ = format == SampleFormat::S16 ? 16 : 24;
+        sampleBytes_ = sampleBytes(format);
+        blockSamples_ = blockFrames_ * channels;
+        frameCapacity_ = flac_detail::maxFrameBytes(blockFrames_, channels, bps_);
+
+        storage_.assign(blockSamples_ * sampleBytes_ * blockCount_, 0);
+        encoded_.assign(frameCapacity_ * blockCount_, 0);
+        slots_ = std::make_unique<Slot[]>(blockCount_);
+        if (format != SampleFormat::S16)
+            scratch_.assign(blockSamples_, 0.0f);
+        for (int i = 0; i < static_cast<int>(blockCount_); i++)
+            freeBlocks_.write(&i, 1);
+        pool_ = std::make_unique<WorkStealingPool>(threads_);
+        encoderScratch_.clear();
+        for (int i = 0; i < pool_->threads(); i++)
+            encoderScratch_.emplace_back(blockFrames_, channels);
+
+        current_ = -1;
+        currentFill_ = 0;
+        framesWritten_ = 0;
+        bytesWritten_ = 0;
+        minFrame_ = UINT32_MAX;
+        maxFrame_ = 0;
+        md5_ = flac_detail::Md5();
+        droppedFrames_.store(0);
+        encodeNs_.store(0);
+        events_.store(0);
+        closing_.store(false);
+        started_ = std::chrono::steady_clock::now();
+
+        out_.write("fLaC", 4);
+        writeStreamInfo(nullptr);
+        writer_ = std::thread(&FlacStreamWriter::writerLoop, this);
+        return true;
+    }
+
+    void setDither(bool enabled) override { dither_ = enabled; }
+
+    // Called from the capture thread. Never blocks or allocates; frames that
+    // don't fit because the encoders fell behind are dropped and counted.
+    void write(const short *samples, size_t frames) override
+    {
+        append(frames, [&](uint8_t *dst, size_t done, size_t n)
+        {
+            if (format_ == SampleFormat::S16)
+            {
+                std::memcpy(dst, samples + done, n * sizeof(short));
+                return;
+            }
+            decodeSamples(SampleFormat::S16, samples + done, scratch_.data(), n);
+            encodeSamples(format_, scratch_.data(), dst, n);
+        });
+    }
+
+    void writeFloat(const float *samples, size_t frames) override
+    {
+        append(frames, [&](uint8_t *dst, size_t done, size_t n)
+                       { encodeSamples(format_, samples + done, dst, n, dither_ ? &ditherState_ : nullptr); });
+    }
+
+    // Flushes the partial block, waits for the encoders and finalizes STREAMINFO
+    void close() override
+    {
+        if (!writer_.joinable())
+            return;
+
+        if (current_ >= 0 && currentFill_ > 0)
+            submitCurrent();
+        closing_.store(true, std::memory_order_release);
+        notifyWriter();
+        writer_.join();
+        pool_.reset();
+
+        uint8_t digest[16];
+        md5_.finish(digest);
+        writeStreamInfo(digest);
+        out_.close();
+        elapsed_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_).count();
+    }
+
+    uint64_t framesWritten() const override { return framesWritten_; }
+    uint64_t droppedFrames() const override { return droppedFrames_.load(); }
+
+    // Raw PCM bytes over FLAC bytes
+    double compressionRatio() const
+    {
+        return bytesWritten_ ? double(framesWritten_ * channels_ * sampleBytes_) / bytesWritten_ : 0.0;
+    }
+
+    // Unencoded MB per second of encoder CPU time, summed over threads
+    double encoderMBps() const
+    {
+        double seconds = encodeNs_.load() * 1e-9;
+        return seconds > 0 ? framesWritten_ * channels_ * sampleBytes_ / 1e6 / seconds : 0.0;
+    }
+
+    void describe(std::ostream &out) const override
+    {
+        double raw = framesWritten_ * channels_ * sampleBytes_ / 1e6;
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(2) << " (FLAC " << bps_ << "-bit, " << bytesWritten_ / 1e6 << " MB, ratio "
+            << compressionRatio() << ", " << 100.0 * bytesWritten_ / std::max(1.0, raw * 1e6)
+            << "% of PCM; encoder " << std::setprecision(1) << encoderMBps() << " MB/s per thread on "
+            << threads_ << " threads, capture " << (elapsed_ > 0 ? raw / elapsed_ : 0.0) << " MB/s)";
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+private:
+    struct Block
+    {
+        int index;
+        size_t samples;
+    };
+
+    struct Slot
+    {
+        std::atomic<bool> done{false};
+        size_t samples = 0;
+        size_t bytes = 0;
+    };
+
+    // Hands out space for up to a block at a time: fill(dst, samplesDone, n)
+    template <typename Fill>
+    void append(size_t frames, Fill &&fill)
+    {
+        size_t total = frames * channels_, done = 0;
+        while (done < total)
+        {
+            if (current_ < 0 && freeBlocks_.read(&current_, 1) == 0)
+            {
+                current_ = -1;
+                droppedFrames_.fetch_add((total - done) / channels_, std::memory_order_relaxed);
+                return;
+            }
+
+            size_t n = std::min(total - done, blockSamples_ - currentFill_);
+            fill(&storage_[(current_ * blockSamples_ + currentFill_) * sampleBytes_], done, n);
+            currentFill_ += n;
+            done += n;
+
+            if (currentFill_ == blockSamples_)
+                submitCurrent();
+        }
+    }
+
+    void submitCurrent()
+    {
+        Block block{current_, currentFill_};
+        fullBlocks_.write(&block, 1);
+        current_ = -1;
+        currentFill_ = 0;
+        notifyWriter();
+    }
+
+    void notifyWriter()
+    {
+        events_.fetch_add(1, std::memory_order_release);
+        events_.notify_one();
+    }
+
+    void encode(int index, uint64_t frameNumber)
+    {
+        auto start = std::chrono::steady_clock::now();
+        Slot &slot = slots_[index];
+        size_t frames = slot.samples / channels_;
+        slot.bytes = flac_detail::encodeFrame(&storage_[index * blockSamples_ * sampleBytes_], frames, channels_, bps_,
+                                              sampleRate_, frameNumber, encoderScratch_[pool_->workerIndex()],
+                                              &encoded_[index * frameCapacity_]);
+        encodeNs_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(),
+                            std::memory_order_relaxed);
+        slot.done.store(true, std::memory_order_release);
+        notifyWriter();
+    }
+
+    // Dispatches full blocks to the encoders and writes finished frames in order
+    void writerLoop()
+    {
+        std::deque<int> inFlight;
+        uint64_t frameNumber = 0;
+        int framesSincePatch = 0;
+        while (true)
+        {
+            uint64_t seen = events_.load(std::memory_order_acquire);
+
+            Block block;
+            while (fullBlocks_.read(&block, 1) == 1)
+            {
+                Slot &slot = slots_[block.index];
+                slot.samples = block.samples;
+                slot.done.store(false, std::memory_order_relaxed);
+                inFlight.push_back(block.index);
+                pool_->submit([this, index = block.index, frameNumber] { encode(index, frameNumber); });
+                frameNumber++;
+            }
+
+            while (!inFlight.empty() && slots_[inFlight.front()].done.load(std::memory_order_acquire))
+            {
+                int index = inFlight.front();
+                inFlight.pop_front();
+                Slot &slot = slots_[index];
+                out_.write(reinterpret_cast<const char *>(&encoded_[index * frameCapacity_]), slot.bytes);
+                md5_.update(&storage_[index * blockSamples_ * sampleBytes_], slot.samples * sampleBytes_);
+                framesWritten_ += slot.samples / channels_;
+                bytesWritten_ += slot.bytes;
+                minFrame_ = std::min<uint32_t>(minFrame_, slot.bytes);
+                maxFrame_ = std::max<uint32_t>(maxFrame_, slot.bytes);
+                freeBlocks_.write(&index, 1);
+
+                // Keep the sample count roughly current so a crash loses little
+                if (++framesSincePatch >= 64)
+                {
+                    writeStreamInfo(nullptr);
+                    framesSincePatch = 0;
+                }
+            }
+
+            if (closing_.load(std::memory_order_acquire) && fullBlocks_.readAvailable() == 0 && inFlight.empty())
+                break;
+            events_.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    // "fLaC" is followed by the only metadata block; rewritten in place
+    void writeStreamInfo(const uint8_t *md5)
+    {
+        std::streampos end = out_.tellp();
+        uint8_t block[38] = {};
+        flac_detail::BitWriter bits(block);
+        bits.put(1, 1); // last metadata block
+        bits.put(0, 7); // STREAMINFO
+        bits.put(34, 24);
+        bits.put(static_cast<uint32_t>(blockFrames_), 16); // min block size (the last block may be shorter)
+        bits.put(static_cast<uint32_t>(blockFrames_), 16);
+        bits.put(maxFrame_ ? minFrame_ : 0, 24);
+        bits.put(maxFrame_, 24);
+        bits.put(sampleRate_, 20);
+        bits.put(channels_ - 1, 3);
+        bits.put(bps_ - 1, 5);
+        bits.put(static_cast<uint32_t>(framesWritten_ >> 32), 4);
+        bits.put(static_cast<uint32_t>(framesWritten_), 32);
+        if (md5)
+            std::memcpy(block + 22, md5, 16); // zero means "not computed" until close
+        out_.seekp(4);
+        out_.write(reinterpret_cast<const char *>(block), sizeof(block));
+        if (end > 4)
+            out_.seekp(end);
+        out_.flush();
+    }
+
+    size_t blockFrames_;
+    size_t blockCount_;
+    int threads_;
+    size_t blockSamples_ = 0;
+    SampleFormat format_ = SampleFormat::S16;
+    int sampleBytes_ = 2, bps_ = 16;
+    size_t frameCapacity_ = 0;
+    std::vector<uint8_t> storage_; // raw samples, blockSamples_ per block
+    std::vector<uint8_t> encoded_; // one frame of frameCapacity_ per block
+    std::unique_ptr<Slot[]> slots_;
+    SpscRing<int> freeBlocks_;
+    SpscRing<Block> fullBlocks_;
+
+    // Capture-thread state.
+    int current_ = -1;
+    size_t currentFill_ = 0;
+    std::vector<float> scratch_;
+    bool dither_ = false;
+    TpdfDither ditherState_;
+
+    // Writer-thread state.
+    std::ofstream out_;
+    int sampleRate_ = 0;
+    int channels_ = 0;
+    uint64_t framesWritten_ = 0, bytesWritten_ = 0;
+    uint32_t minFrame_ = UINT32_MAX, maxFrame_ = 0;
+    flac_detail::Md5 md5_;
+    std::unique_ptr<WorkStealingPool> pool_;
+    std::vector<flac_detail::EncoderScratch> encoderScratch_;
+    std::thread writer_;
+
+    std::atomic<uint64_t> droppedFrames_{0}, encodeNs_{0}, events_{0};
+    std::atomic<bool> closing_{false};
+    std::chrono::steady_clock::time_point started_;
+    double elapsed_ = 0.0;
+};
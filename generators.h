@@ -0,0 +1,458 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Block signal generators (sine, linear sweep, logarithmic sweep, stepped
+// sine, white noise).
+//
+// Every generator is evaluated as   out[k] = amp * sin(phase0 + rel(k))
+// where phase0 is the exact phase at the start of a chunk, kept in double
+// precision and wrapped to [-pi, pi), and
+//
+//     rel(k) = w*k + c*k^2 + b*(exp(a*k) - 1)
+//
+// is the phase advance inside the chunk, evaluated in float SIMD lanes.
+// Chunks are at most kChunk frames, so the float phase error stays below
+// ~1e-4 rad regardless of how long the signal runs.
+//
+// The kernel body is written once with GCC vector extensions and compiled
+// for SSE2, AVX2+FMA and NEON; the ISA is picked at runtime.
+
+enum class SimdIsa
+{
+    Scalar,
+    Sse,
+    Avx2,
+    Neon
+};
+
+inline const char *simdIsaName(SimdIsa isa)
+{
+    switch (isa)
+    {
+    case SimdIsa::Sse:
+        return "sse";
+    case SimdIsa::Avx2:
+        return "avx2";
+    case SimdIsa::Neon:
+        return "neon";
+    default:
+        return "scalar";
+    }
+}
+
+// Best instruction set available on this CPU
+inline SimdIsa detectSimdIsa()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdIsa::Avx2;
+    return SimdIsa::Sse;
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    return SimdIsa::Neon;
+#else
+    return SimdIsa::Scalar;
+#endif
+}
+
+inline SimdIsa &activeSimdIsa()
+{
+    static SimdIsa isa = detectSimdIsa();
+    return isa;
+}
+
+namespace gen_detail
+{
+
+constexpr int kChunk = 256;
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int32_t v8si __attribute__((vector_size(32)));
+typedef uint32_t v8su __attribute__((vector_size(32)));
+
+// out[k] = amp * sin(phase0 + w*k + c*k^2 + b*expm1(a*k)), k = 0..n-1
+template <typename VF, typename VI, int W>
+__attribute__((always_inline)) inline void phaseSinBody(float *out, int n, float phase0, float w, float c,
+                                                        float b, float a, float amp)
+{
+    const float inv2pi = 0.15915494309189535f;
+    const float twoPiHi = 6.28318548202514648f;  // float(2*pi)
+    const float twoPiLo = -1.7484555e-7f;         // 2*pi - twoPiHi
+    const float pi = 3.14159265358979f;
+    const float halfPi = 1.57079632679490f;
+    const float magic = 12582912.0f;              // 1.5 * 2^23, round to nearest
+
+    VF lane;
+    for (int i = 0; i < W; i++)
+        lane[i] = static_cast<float>(i);
+
+    for (int k = 0; k < n; k += W)
+    {
+        VF kk = lane + static_cast<float>(k);
+
+        // expm1 via Taylor series, a*k stays small inside one chunk
+        VF x = kk * a;
+        VF em1 = x * (1.0f + x * (0.5f + x * (1.0f / 6 + x * (1.0f / 24 + x * (1.0f / 120)))));
+        VF ph = phase0 + kk * (w + kk * c) + b * em1;
+
+        // Reduce to [-pi, pi], then fold to [-pi/2, pi/2]
+        VF q = (ph * inv2pi + magic) - magic;
+        VF r = (ph - q * twoPiHi) - q * twoPiLo;
+        VI bits = (VI)r;
+        VI signBit = bits & static_cast<int32_t>(0x80000000u);
+        VF absR = (VF)(bits & 0x7fffffff);
+        VF piVec = pi - VF{};
+        VF folded = (VF)((VI)piVec | signBit) - r; // copysign(pi, r) - r
+        r = absR > halfPi ? folded : r;
+
+        // sin on [-pi/2, pi/2], Taylor to r^11 (error < 6e-8)
+        VF r2 = r * r;
+        VF s = r * (1.0f + r2 * (-1.0f / 6 + r2 * (1.0f / 120 + r2 * (-1.0f / 5040 +
+                   r2 * (1.0f / 362880 + r2 * (-1.0f / 39916800))))));
+        s *= amp;
+
+        int m = n - k < W ? n - k : W;
+        std::memcpy(out + k, &s, m * sizeof(float));
+    }
+}
+
+inline void phaseSinScalar(float *out, int n, float phase0, float w, float c, float b, float a, float amp)
+{
+    for (int k = 0; k < n; k++)
+    {
+        float kk = static_cast<float>(k);
+        out[k] = amp * std::sin(phase0 + kk * (w + kk * c) + b * std::expm1(kk * a));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) inline void phaseSinAvx2(float *out, int n, float phase0, float w, float c,
+                                                            float b, float a, float amp)
+{
+    phaseSinBody<v8sf, v8si, 8>(out, n, phase0, w, c, b, a, amp);
+}
+#endif
+
+inline void phaseSinVec4(float *out, int n, float phase0, float w, float c, float b, float a, float amp)
+{
+    phaseSinBody<v4sf, v4si, 4>(out, n, phase0, w, c, b, a, amp);
+}
+
+inline void phaseSin(SimdIsa isa, float *out, int n, double phase0, double w, double c, double b, double a,
+                     double amp)
+{
+    switch (isa)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SimdIsa::Avx2:
+        phaseSinAvx2(out, n, phase0, w, c, b, a, amp);
+        return;
+    case SimdIsa::Sse:
+        phaseSinVec4(out, n, phase0, w, c, b, a, amp);
+        return;
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    case SimdIsa::Neon:
+        phaseSinVec4(out, n, phase0, w, c, b, a, amp);
+        return;
+#endif
+    default:
+        phaseSinScalar(out, n, phase0, w, c, b, a, amp);
+        return;
+    }
+}
+
+// Eight xorshift32 streams, one per output lane of each group of 8 samples.
+// A sample is the sum of four uniforms (Irwin-Hall), centred and scaled to
+// unit variance: close to Gaussian, and bounded by 2*sqrt(3). The output is
+// the same for every ISA. n must be a multiple of 8.
+template <typename VF, typename VI, typename VU, int W>
+__attribute__((always_inline)) inline void noiseBody(float *out, int n, uint32_t *state, float amp)
+{
+    const float scale = amp * 1.7320508075688772f / 16777216.0f; // sqrt(3) / 2^24
+    const float centre = 2.0f * 16777216.0f;
+    for (int k = 0; k < n; k += 8)
+    {
+        for (int half = 0; half < 8; half += W)
+        {
+            VU s;
+            std::memcpy(&s, state + half, sizeof(s));
+            VI sum = VI{};
+            for (int i = 0; i < 4; i++)
+            {
+                s ^= s << 13;
+                s ^= s >> 17;
+                s ^= s << 5;
+                sum += (VI)(s >> 8);
+            }
+            std::memcpy(state + half, &s, sizeof(s));
+            VF x = (__builtin_convertvector(sum, VF) - centre) * scale;
+            std::memcpy(out + k + half, &x, sizeof(x));
+        }
+    }
+}
+
+inline void noiseScalar(float *out, int n, uint32_t *state, float amp)
+{
+    const float scale = amp * 1.7320508075688772f / 16777216.0f;
+    for (int k = 0; k < n; k += 8)
+    {
+        for (int lane = 0; lane < 8; lane++)
+        {
+            uint32_t &s = state[lane];
+            int32_t sum = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                s ^= s << 13;
+                s ^= s >> 17;
+                s ^= s << 5;
+                sum += static_cast<int32_t>(s >> 8);
+            }
+            out[k + lane] = (static_cast<float>(sum) - 2.0f * 16777216.0f) * scale;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) inline void noiseAvx2(float *out, int n, uint32_t *state, float amp)
+{
+    noiseBody<v8sf, v8si, v8su, 8>(out, n, state, amp);
+}
+#endif
+
+inline void noiseVec4(float *out, int n, uint32_t *state, float amp)
+{
+    noiseBody<v4sf, v4si, v4su, 4>(out, n, state, amp);
+}
+
+inline void noise(SimdIsa isa, float *out, int n, uint32_t *state, float amp)
+{
+    switch (isa)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SimdIsa::Avx2:
+        noiseAvx2(out, n, state, amp);
+        return;
+    case SimdIsa::Sse:
+        noiseVec4(out, n, state, amp);
+        return;
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    case SimdIsa::Neon:
+        noiseVec4(out, n, state, amp);
+        return;
+#endif
+    default:
+        noiseScalar(out, n, state, amp);
+        return;
+    }
+}
+
+// Wrap a double phase to [-pi, pi)
+inline double wrapPhase(double phase)
+{
+    return phase - 2 * M_PI * std::floor(phase / (2 * M_PI) + 0.5);
+}
+
+} // namespace gen_detail
+
+// Constant-frequency sine
+class SineGenerator
+{
+public:
+    SineGenerator(double frequency, double sampleRate, double amplitude = 1.0)
+        : step_(2 * M_PI * frequency / sampleRate), amp_(amplitude)
+    {
+    }
+
+    void render(float *out, int frames)
+    {
+        for (int done = 0; done < frames; done += gen_detail::kChunk)
+        {
+            int n = std::min(frames - done, gen_detail::kChunk);
+            gen_detail::phaseSin(activeSimdIsa(), out + done, n, phase_, step_, 0, 0, 0, amp_);
+            phase_ = gen_detail::wrapPhase(phase_ + n * step_);
+        }
+    }
+
+private:
+    double phase_ = 0.0;
+    double step_;
+    double amp_;
+};
+
+// Linear sweep f0 -> f1 over `seconds`
+class LinearSweepGenerator
+{
+public:
+    LinearSweepGenerator(double f0, double f1, double seconds, double sampleRate, double amplitude = 1.0)
+        : f0_(f0), slope_((f1 - f0) / seconds), fs_(sampleRate), amp_(amplitude)
+    {
+    }
+
+    void render(float *out, int frames)
+    {
+        for (int done = 0; done < frames; done += gen_detail::kChunk)
+        {
+            int n = std::min(frames - done, gen_detail::kChunk);
+            double t = double(index_) / fs_;
+            double phase0 = 2 * M_PI * (f0_ * t + 0.5 * slope_ * t * t);
+            double w = 2 * M_PI * (f0_ + slope_ * t) / fs_;
+            double c = M_PI * slope_ / (fs_ * fs_);
+            gen_detail::phaseSin(activeSimdIsa(), out + done, n, gen_detail::wrapPhase(phase0), w, c, 0, 0, amp_);
+            index_ += n;
+        }
+    }
+
+private:
+    uint64_t index_ = 0;
+    double f0_, slope_, fs_, amp_;
+};
+
+// Exponential (Farina) sweep: phase = 2*pi*f0*K*(exp(t/K) - 1), K = T / ln(f1/f0)
+class LogSweepGenerator
+{
+public:
+    LogSweepGenerator(double f0, double f1, double seconds, double sampleRate, double amplitude = 1.0)
+        : f0_(f0), K_(seconds / std::log(f1 / f0)), fs_(sampleRate), amp_(amplitude)
+    {
+    }
+
+    void render(float *out, int frames)
+    {
+        for (int done = 0; done < frames; done += gen_detail::kChunk)
+        {
+            int n = std::min(frames - done, gen_detail::kChunk);
+            double t = double(index_) / fs_;
+            double growth = std::exp(t / K_);
+            double phase0 = 2 * M_PI * f0_ * K_ * (growth - 1);
+            double b = 2 * M_PI * f0_ * K_ * growth;
+            gen_detail::phaseSin(activeSimdIsa(), out + done, n, gen_detail::wrapPhase(phase0), 0, 0, b,
+                                 1.0 / (K_ * fs_), amp_);
+            index_ += n;
+        }
+    }
+
+    double K() const { return K_; }
+
+private:
+    uint64_t index_ = 0;
+    double f0_, K_, fs_, amp_;
+};
+
+// Sine stepped through log-spaced frequencies f0, f0 * 2^(1/perOctave), ...
+// up to f1, holding each for `stepSeconds`. The phase runs on across steps,
+// so there are no clicks; after the last step it starts over.
+class SteppedSineGenerator
+{
+public:
+    SteppedSineGenerator(double f0, double f1, double perOctave, double stepSeconds, double sampleRate,
+                         double amplitude = 1.0)
+        : stepFrames_(std::max<uint64_t>(1, static_cast<uint64_t>(stepSeconds * sampleRate))), fs_(sampleRate),
+          amp_(amplitude)
+    {
+        for (int i = 0;; i++)
+        {
+            double f = f0 * std::pow(2.0, i / perOctave);
+            if (f > f1 * (1 + 1e-9) || f >= sampleRate / 2)
+                break;
+            frequencies_.push_back(f);
+        }
+        if (frequencies_.empty())
+            frequencies_.push_back(f0);
+    }
+
+    void render(float *out, int frames)
+    {
+        for (int done = 0; done < frames;)
+        {
+            int n = static_cast<int>(std::min<uint64_t>({uint64_t(frames - done), uint64_t(gen_detail::kChunk),
+                                                         stepFrames_ - inStep_}));
+            double w = 2 * M_PI * frequencies_[step_] / fs_;
+            gen_detail::phaseSin(activeSimdIsa(), out + done, n, phase_, w, 0, 0, 0, amp_);
+            phase_ = gen_detail::wrapPhase(phase_ + n * w);
+            done += n;
+            if ((inStep_ += n) == stepFrames_)
+            {
+                inStep_ = 0;
+                step_ = (step_ + 1) % frequencies_.size();
+            }
+        }
+    }
+
+    const std::vector<double> &frequencies() const { return frequencies_; }
+    uint64_t stepFrames() const { return stepFrames_; }
+
+private:
+    std::vector<double> frequencies_;
+    uint64_t stepFrames_;
+    double fs_, amp_;
+    double phase_ = 0.0;
+    size_t step_ = 0;
+    uint64_t inStep_ = 0;
+};
+
+// White noise with unit variance times `amplitude`, peaks within +/- 2*sqrt(3)
+// times that. Generated 8 samples at a time; the sequence only depends on the
+// seed, not on the block sizes or the ISA.
+class WhiteNoiseGenerator
+{
+public:
+    explicit WhiteNoiseGenerator(uint32_t seed = 1, double amplitude = 1.0) : amp_(static_cast<float>(amplitude))
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            state_[i] = (seed + 1) * 0x9E3779B9u + 0x6D2B79F5u * (i + 1);
+            if (state_[i] == 0)
+                state_[i] = 1;
+        }
+    }
+
+    void render(float *out, int frames)
+    {
+        int done = 0;
+        for (; done < frames && spare_ > 0; spare_--)
+            out[done++] = spareBlock_[8 - spare_];
+        int bulk = (frames - done) & ~7;
+        gen_detail::noise(activeSimdIsa(), out + done, bulk, state_, amp_);
+        done += bulk;
+        if (done < frames)
+        {
+            gen_detail::noise(activeSimdIsa(), spareBlock_, 8, state_, amp_);
+            for (spare_ = 8; done < frames; spare_--)
+                out[done++] = spareBlock_[8 - spare_];
+        }
+    }
+
+private:
+    uint32_t state_[8];
+    float spareBlock_[8] = {};
+    int spare_ = 0;
+    float amp_;
+};
+
+// Maximum-length sequence of period 2^order - 1 as +/-1 values (Galois LFSR)
+inline std::vector<float> maximumLengthSequence(int order)
+{
+    // Feedback masks of maximal-length polynomials for orders 2..24
+    static const uint32_t masks[] = {0, 0, 0x3, 0x6, 0xC, 0x14, 0x30, 0x60, 0xB8, 0x110, 0x240,
+                                     0x500, 0x829, 0x100D, 0x2015, 0x6000, 0xD008, 0x12000, 0x20400,
+                                     0x40023, 0x90000, 0x140000, 0x300000, 0x420000, 0xE10000};
+    order = std::clamp(order, 2, 24);
+    uint32_t state = 1;
+    std::vector<float> seq((1u << order) - 1);
+    for (float &v : seq)
+    {
+        v = (state & 1) ? 1.0f : -1.0f;
+        state = (state >> 1) ^ ((state & 1) ? masks[order] : 0);
+    }
+    return seq;
+}
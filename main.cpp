@@ -5,6 +5,33 @@
 #include <alsa/asoundlib.h>
 #include <fstream>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <complex>
+#include <iomanip>
+#include <cstdint>
+#include <memory>
+
+#include "activity_gate.h"
+#include "analyzer.h"
+#include "batch.h"
+#include "blackbox.h"
+#include "dsp.h"
+#include "fft.h"
+#include "flac_stream.h"
+#include "generators.h"
+#include "metrics.h"
+#include "pcm_engine.h"
+#include "pcm_setup.h"
+#include "resampler.h"
+#include "shm_ring.h"
+#include "spsc_ring.h"
+#include "stimulus.h"
+#include "wav_file.h"
+#include "wav_mmap.h"
+#include "wav_stream.h"
 
 
 
@@ -13,42 +40,271 @@ struct DeviceInfo {
     std::string desc;
 };
 
-// Write raw PCM data to simple WAV file
-void writeWav(const std::string &filename, const std::vector<short> &samples, int sampleRate, int channels)
+// Command-line flags (--name[=value]) shared by all modes
+struct Options {
+    bool mmap = false;            // use SND_PCM_ACCESS_MMAP_INTERLEAVED where the device allows it
+    snd_pcm_uframes_t period = 0; // --period=N frames, 0 = driver default
+    snd_pcm_uframes_t buffer = 0; // --buffer=N frames, 0 = driver default
+    std::string metricsFile;      // --metrics=FILE, JSON stream statistics written at exit
+    std::string traceFile;        // --trace=FILE, Chrome trace of every period
+    SampleFormat format = SampleFormat::S16;    // --format=, device format for play/record/playrecord
+    SampleFormat wavFormat = SampleFormat::S16; // --wav-format=, recording file format
+    bool dither = false;                        // --dither, TPDF dither when reducing to 16/24 bits
+    bool driftComp = false;                     // --drift-comp, resample passthrough to follow clock drift
+    bool resample = false;                      // --resample, convert to/from the device's native rate in-process
+    PassthroughChain dsp;                       // --hpf= --eq= --gain= --compress= --limit=, passthrough processing
+    RealtimeConfig realtime;                    // --rt[=PRIORITY] --rt-cpu=LIST, SCHED_FIFO/pinned audio threads
+    AnalyzerOptions analyzer;                   // --analyze[=FILE] --analyze-fft=N, live levels and spectrum
+    std::string publish;                        // --publish=NAME, share the capture through shared memory
+    GateOptions gate;                           // --gate=THRESH_DB[:PREROLL_MS[:HANGOVER_MS]], record only activity
+};
+
+Options options;
+
+// Unsigned value of a --flag=N option; false, leaving `value` alone, if it isn't one
+bool parseCount(const std::string &text, unsigned long &value)
 {
-    std::ofstream out(filename, std::ios::binary);
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0])))
+        return false;
+    errno = 0;
+    char *end = nullptr;
+    unsigned long parsed = std::strtoul(text.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE)
+        return false;
+    value = parsed;
+    return true;
+}
 
-    int byteRate = sampleRate * channels * 2;
-    int dataSize = samples.size() * 2;
+// Strip --flags out of argv into `options`; returns the remaining argc
+int parseOptions(int argc, char *argv[])
+{
+    int kept = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+        {
+            argv[kept++] = argv[i];
+            continue;
+        }
 
-    // RIFF header
-    out.write("RIFF", 4);
-    int chunkSize = 36 + dataSize;
-    out.write(reinterpret_cast<const char *>(&chunkSize), 4);
-    out.write("WAVE", 4);
+        if (arg == "--mmap")
+            options.mmap = true;
+        else if (arg == "--no-pcm-cache")
+            pcmCacheEnabled() = false;
+        else if (arg.rfind("--period=", 0) == 0 && parseCount(arg.substr(9), options.period))
+            ;
+        else if (arg.rfind("--buffer=", 0) == 0 && parseCount(arg.substr(9), options.buffer))
+            ;
+        else if (arg.rfind("--metrics=", 0) == 0)
+            options.metricsFile = arg.substr(10);
+        else if (arg.rfind("--trace=", 0) == 0)
+            options.traceFile = arg.substr(8);
+        else if (arg.rfind("--format=", 0) == 0 && parseSampleFormat(arg.substr(9), options.format))
+            ;
+        else if (arg.rfind("--wav-format=", 0) == 0 && parseSampleFormat(arg.substr(13), options.wavFormat))
+            ;
+        else if (arg == "--dither")
+            options.dither = true;
+        else if (arg == "--drift-comp")
+            options.driftComp = true;
+        else if (arg == "--resample")
+            options.resample = true;
+        else if (parseDspOption(arg, options.dsp))
+            ;
+        else if (arg == "--rt")
+            options.realtime.enabled = true;
+        else if (arg.rfind("--rt=", 0) == 0)
+        {
+            unsigned long priority = 0;
+            if (parseCount(arg.substr(5), priority))
+            {
+                options.realtime.enabled = true;
+                options.realtime.priority = static_cast<int>(std::clamp<unsigned long>(priority, 1, 99));
+            }
+            else
+                std::cerr << "Ignoring malformed " << arg << "\n";
+        }
+        else if (arg.rfind("--rt-cpu=", 0) == 0 && parseCpuList(arg.substr(9), options.realtime.cpus))
+            ;
+        else if (arg == "--analyze")
+            options.analyzer.enabled = true;
+        else if (arg.rfind("--analyze=", 0) == 0)
+        {
+            options.analyzer.enabled = true;
+            options.analyzer.streamFile = arg.substr(10);
+        }
+        else if (arg.rfind("--analyze-fft=", 0) == 0)
+        {
+            unsigned long size = 0;
+            if (parseCount(arg.substr(14), size))
+                options.analyzer.fftSize = std::clamp<size_t>(size, 256, 65536);
+            else
+                std::cerr << "Ignoring malformed " << arg << "\n";
+        }
+        else if (arg.rfind("--publish=", 0) == 0)
+            options.publish = arg.substr(10);
+        else if (arg.rfind("--gate=", 0) == 0)
+        {
+            double v[3];
+            int n = parseDspFields(arg.substr(7), v, 3);
+            if (n < 1)
+            {
+                std::cerr << "Ignoring malformed " << arg << "\n";
+                continue;
+            }
+            options.gate.enabled = true;
+            options.gate.thresholdDb = std::min(v[0], 0.0);
+            if (n > 1)
+                options.gate.preRollMs = std::max(v[1], 0.0);
+            if (n > 2)
+                options.gate.hangoverMs = std::max(v[2], 0.0);
+        }
+        else if (arg.rfind("--period=", 0) == 0 || arg.rfind("--buffer=", 0) == 0)
+            std::cerr << "Ignoring malformed " << arg << "\n";
+        else
+            std::cerr << "Ignoring unknown option " << arg << "\n";
+    }
+    return kept;
+}
 
-    // fmt subchunk
-    out.write("fmt ", 4);
-    int subchunk1Size = 16;
-    short audioFormat = 1; // PCM
-    short numChannels = channels;
-    int sampleRate_ = sampleRate;
-    short bitsPerSample = 16;
-    short blockAlign = numChannels * bitsPerSample / 8;
+// Frames moved per read/write: the negotiated period when --period was given, else 512
+int transferFrames(const PcmConfig &config)
+{
+    return options.period ? static_cast<int>(config.period) : 512;
+}
 
-    out.write(reinterpret_cast<const char *>(&subchunk1Size), 4);
-    out.write(reinterpret_cast<const char *>(&audioFormat), 2);
-    out.write(reinterpret_cast<const char *>(&numChannels), 2);
-    out.write(reinterpret_cast<const char *>(&sampleRate_), 4);
-    out.write(reinterpret_cast<const char *>(&byteRate), 4);
-    out.write(reinterpret_cast<const char *>(&blockAlign), 2);
-    out.write(reinterpret_cast<const char *>(&bitsPerSample), 2);
+// --resample: converter from `from` to `to` Hz taking up to `maxInput`
+// frames per call, or nullptr if the rates match, the flag is off or the
+// ratio has no table (the pipeline then runs at the device rate)
+std::unique_ptr<PolyphaseResampler> rateConverter(unsigned from, unsigned to, int channels, size_t maxInput)
+{
+    if (!options.resample || from == to)
+        return nullptr;
+    if (!PolyphaseResampler::supported(from, to))
+    {
+        std::cerr << "No converter for " << from << " -> " << to << " Hz, running at the device rate.\n";
+        return nullptr;
+    }
+    auto converter = std::make_unique<PolyphaseResampler>(from, to, channels, maxInput);
+    std::cout << "Converting " << from << " -> " << to << " Hz (" << converter->taps() << " taps per phase)\n";
+    return converter;
+}
 
-    // data subchunk
-    out.write("data", 4);
-    out.write(reinterpret_cast<const char *>(&dataSize), 4);
-    out.write(reinterpret_cast<const char *>(samples.data()), dataSize);
-    out.close();
+// Streaming sink for a recording: FLAC for a ".flac" path, WAV otherwise.
+// Opened with --wav-format and --dither; nullptr (reported) on failure.
+std::unique_ptr<AudioSink> openSink(const std::string &path, int sampleRate, int channels)
+{
+    bool flac = path.size() >= 5 && path.compare(path.size() - 5, 5, ".flac") == 0;
+    std::unique_ptr<AudioSink> sink;
+    if (flac)
+        sink = std::make_unique<FlacStreamWriter>();
+    else
+        sink = std::make_unique<WavStreamWriter>();
+    sink->setDither(options.dither);
+    if (!sink->open(path, sampleRate, channels, options.wavFormat))
+    {
+        std::cerr << "Unable to open output file: " << path << "\n";
+        return nullptr;
+    }
+    return sink;
+}
+
+// Hand captured frames in the device format to the sink. S16 goes in
+// directly, other formats through `scratch` (at least frames * channels
+// floats). With a `converter` the frames are resampled into `converted`
+// (converter->maxOutputFor(frames) frames) first.
+// Returns the number of frames handed to the sink.
+size_t writeCaptured(AudioSink &sink, SampleFormat deviceFormat, const void *in, size_t frames, int channels,
+                     std::vector<float> &scratch, PolyphaseResampler *converter = nullptr,
+                     float *converted = nullptr)
+{
+    if (deviceFormat == SampleFormat::S16 && !converter)
+    {
+        sink.write(static_cast<const short *>(in), frames);
+        return frames;
+    }
+    decodeSamples(deviceFormat, in, scratch.data(), frames * channels);
+    if (!converter)
+    {
+        sink.writeFloat(scratch.data(), frames);
+        return frames;
+    }
+    size_t n = converter->process(scratch.data(), frames, converted, converter->outputFor(frames));
+    sink.writeFloat(converted, n);
+    return n;
+}
+
+// Analysis side-channel for --analyze, started; nullptr when off or it failed
+std::unique_ptr<LiveAnalyzer> startAnalyzer(unsigned int rate, size_t maxBlock)
+{
+    if (!options.analyzer.enabled)
+        return nullptr;
+    auto analyzer = std::make_unique<LiveAnalyzer>(options.analyzer, rate, maxBlock);
+    if (!analyzer->start())
+        return nullptr;
+    return analyzer;
+}
+
+void stopAnalyzer(std::unique_ptr<LiveAnalyzer> &analyzer)
+{
+    if (!analyzer)
+        return;
+    analyzer->stop();
+    std::cout << "Analyzer: " << analyzer->analyzedFrames() << " frames analyzed, " << analyzer->droppedFrames()
+              << " dropped\n";
+}
+
+// Shared-memory ring `name` for --publish or the publish command, created;
+// nullptr when `name` is empty or it failed. One slot per transfer, about
+// two seconds of them, so a reader can fall that far behind before it loses audio.
+std::unique_ptr<ShmRingWriter> startPublisher(const std::string &name, unsigned int rate, int channels,
+                                              SampleFormat format, size_t maxBlock)
+{
+    if (name.empty())
+        return nullptr;
+    auto ring = std::make_unique<ShmRingWriter>();
+    if (!ring->create(name, rate, channels, format, maxBlock, std::max<size_t>(16, 2 * rate / maxBlock)))
+        return nullptr;
+    std::cout << "Publishing capture as " << ring->name() << ": " << ring->slotCount() << " slots of " << maxBlock
+              << " frames, " << ring->memoryBytes() / 1024 << " KB\n";
+    return ring;
+}
+
+void stopPublisher(std::unique_ptr<ShmRingWriter> &ring)
+{
+    if (!ring)
+        return;
+    ring->close();
+    std::cout << "Published " << ring->framesPublished() << " frames in " << ring->periodsPublished()
+              << " periods\n";
+}
+
+// Ctrl-C and SIGTERM end the open-ended modes (publish, subscribe) cleanly
+std::atomic<bool> &interrupted()
+{
+    static std::atomic<bool> flag{false};
+    return flag;
+}
+
+void stopOnSignals()
+{
+    interrupted();
+    struct sigaction action = {};
+    action.sa_handler = [](int) { interrupted().store(true); };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+
+// Summary line for a passthrough run with --drift-comp
+void reportDrift(const DriftTracker &drift)
+{
+    if (!drift.locked())
+        return;
+    std::cout << std::fixed << std::setprecision(1) << "Drift compensation: " << drift.driftPpm()
+              << " ppm, latency " << drift.target() * 1000.0 << " ms held to within "
+              << drift.maxError() * 1000.0 << " ms\n" << std::defaultfloat;
 }
 
 // List available devices
@@ -81,103 +337,320 @@ void listDevices()
     snd_device_name_free_hint(hints);
 }
 
-// Play sine tone on device
-void playTone(const std::string &device, int sampleRate, double frequency, int seconds)
+// Play a test signal on device
+void playStimulus(const std::string &device, int sampleRate, const StimulusSpec &spec, double seconds)
 {
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *params;
+    PcmConfig config;
+    snd_pcm_t *handle = openPcm(device, {.stream = SND_PCM_STREAM_PLAYBACK, .rate = unsigned(sampleRate),
+                                         .channels = unsigned(spec.channels), .format = alsaFormat(options.format), .mmap = options.mmap,
+                                         .period = options.period, .buffer = options.buffer,
+                                         .formatFallback = true}, config);
+    if (!handle)
+        return;
+    std::cout << "Playback: " << config << "\n";
+    SampleFormat deviceFormat = sampleFormatOf(config.format);
+    bool useMmap = config.mmap;
     int rc;
 
-    rc = snd_pcm_open(&handle, device.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
-    if (rc < 0)
+    int framesPerBuffer = transferFrames(config);
+    std::vector<char> buffer(snd_pcm_frames_to_bytes(handle, framesPerBuffer));
+
+    // Generate at the rate the device really runs at, unless --resample converts
+    size_t maxInput = framesPerBuffer * (sampleRate / double(config.rate)) + 2;
+    int channels = spec.channels;
+    auto converter = rateConverter(sampleRate, config.rate, channels, maxInput);
+    if (!converter)
     {
-        std::cerr << "Unable to open playback device: " << snd_strerror(rc) << "\n";
-        return;
+        sampleRate = config.rate;
+        maxInput = framesPerBuffer;
     }
 
-    snd_pcm_hw_params_malloc(&params);
-    snd_pcm_hw_params_any(handle, params);
-    snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
-    unsigned int rate = sampleRate;
-    snd_pcm_hw_params_set_rate_near(handle, params, &rate, nullptr);
-    snd_pcm_hw_params_set_channels(handle, params, 2);
-    snd_pcm_hw_params(handle, params);
-    snd_pcm_hw_params_free(params);
-    snd_pcm_prepare(handle);
+    Stimulus stimulus(spec, sampleRate, seconds, maxInput);
+    std::cout << "Stimulus: ";
+    stimulus.describe(std::cout);
+    std::cout << "\n";
+    std::vector<float> block(maxInput * channels), converted(framesPerBuffer * channels);
+    TpdfDither dither;
+
+    auto render = [&](void *out, snd_pcm_uframes_t, snd_pcm_uframes_t frames)
+    {
+        size_t n = converter ? converter->inputFor(frames) : frames;
+        stimulus.render(block.data(), n);
+        const float *samples = block.data();
+        if (converter)
+        {
+            converter->process(block.data(), n, converted.data(), frames);
+            samples = converted.data();
+        }
+        encodeSamples(deviceFormat, samples, out, frames * channels, options.dither ? &dither : nullptr);
+    };
+
+    StreamMetrics &stats = pcmMetrics(handle, framesPerBuffer);
+    long totalFrames = static_cast<long>(config.rate * seconds);
+    {
+        RealtimeThread rt(options.realtime);
+        NoAllocScope audioLoop;
+        for (long i = 0; i < totalFrames; i += framesPerBuffer)
+        {
+            // Only the rendering counts as processing time, not the wait in the device
+            WorkTimer work;
+            if (useMmap)
+            {
+                // Render straight into the DMA buffer
+                rc = mmapTransfer(handle, framesPerBuffer,
+                                  [&](void *out, snd_pcm_uframes_t done, snd_pcm_uframes_t frames)
+                                  {
+                                      work.start();
+                                      render(out, done, frames);
+                                      work.stop();
+                                  });
+            }
+            else
+            {
+                work.start();
+                render(buffer.data(), 0, framesPerBuffer);
+                work.stop();
+                rc = snd_pcm_writei(handle, buffer.data(), framesPerBuffer);
+            }
+            if (rc < 0)
+                recoverPcm(handle, rc, stats);
+            else
+                recordPeriod(handle, stats, work.begin(), work.end());
+        }
+    }
 
-    int framesPerBuffer = 512;
-    std::vector<short> buffer(framesPerBuffer * 2);
+    snd_pcm_drain(handle);
+    snd_pcm_close(handle);
+    std::cout << "Playback finished.\n";
+}
 
-    double phase = 0.0;
-    double step = 2 * M_PI * frequency / sampleRate;
+// Play a WAV file of any size from a memory mapping
+void playFile(const std::string &device, const std::string &path)
+{
+    stopLockingNewMappings();
+    MappedWav wav;
+    if (!wav.open(path))
+        return;
+    std::cout << path << ": " << wav.frames() << " frames, " << wav.rate() << " Hz, " << wav.channels() << " ch, "
+              << sampleFormatName(wav.format()) << (wav.isRf64() ? " (RF64)" : "") << "\n";
 
-    int totalFrames = sampleRate * seconds;
-    for (int i = 0; i < totalFrames; i += framesPerBuffer)
+    PcmConfig config;
+    snd_pcm_t *handle = openPcm(device, {.stream = SND_PCM_STREAM_PLAYBACK, .rate = unsigned(wav.rate()),
+                                         .channels = unsigned(wav.channels()), .format = alsaFormat(wav.format()),
+                                         .mmap = options.mmap, .period = options.period, .buffer = options.buffer,
+                                         .formatFallback = true}, config);
+    if (!handle)
+        return;
+    std::cout << "Playback: " << config << "\n";
+    SampleFormat deviceFormat = sampleFormatOf(config.format);
+    int channels = wav.channels();
+    int framesPerBuffer = transferFrames(config);
+
+    // Other rates play at the wrong speed unless --resample converts
+    size_t maxInput = framesPerBuffer * (wav.rate() / double(config.rate)) + 2;
+    auto converter = rateConverter(wav.rate(), config.rate, channels, maxInput);
+    if (!converter)
+    {
+        if (unsigned(wav.rate()) != config.rate)
+            std::cerr << "Warning: playing a " << wav.rate() << " Hz file at " << config.rate << " Hz.\n";
+        maxInput = framesPerBuffer;
+    }
+
+    // Same format and rate: the mapped samples go to the device untouched
+    bool direct = deviceFormat == wav.format() && !converter;
+    std::cout << (direct ? "Copying samples straight from the mapping.\n" : "Converting samples.\n");
+    std::vector<float> decoded(direct ? 0 : maxInput * channels), converted(converter ? framesPerBuffer * channels : 0);
+    std::vector<char> buffer(config.mmap ? 0 : snd_pcm_frames_to_bytes(handle, framesPerBuffer));
+    TpdfDither dither;
+    size_t frameBytes = wav.frameBytes();
+    size_t deviceFrameBytes = snd_pcm_frames_to_bytes(handle, 1);
+    uint64_t position = 0;
+
+    // `frames` device frames from the file into `out`, silence past the end
+    auto render = [&](void *out, snd_pcm_uframes_t, snd_pcm_uframes_t frames)
     {
-        for (int j = 0; j < framesPerBuffer; j++)
+        uint8_t *dst = static_cast<uint8_t *>(out);
+        size_t needed = converter ? converter->inputFor(frames) : frames;
+        size_t n = std::min<uint64_t>(needed, wav.frames() - position);
+        if (direct)
+        {
+            std::memcpy(dst, wav.data(position), n * frameBytes);
+            std::memset(dst + n * frameBytes, 0, (frames - n) * frameBytes);
+        }
+        else
         {
-            short value = static_cast<short>(std::sin(phase) * 32767);
-            buffer[j * 2] = value;     // Left
-            buffer[j * 2 + 1] = value; // Right
-            phase += step;
-            if (phase > 2 * M_PI)
-                phase -= 2 * M_PI;
+            decodeSamples(wav.format(), wav.data(position), decoded.data(), n * channels);
+            std::fill(decoded.begin() + n * channels, decoded.begin() + needed * channels, 0.0f);
+            const float *samples = decoded.data();
+            if (converter)
+            {
+                converter->process(decoded.data(), needed, converted.data(), frames);
+                samples = converted.data();
+            }
+            encodeSamples(deviceFormat, samples, dst, frames * channels, options.dither ? &dither : nullptr);
         }
+        position += n;
+        wav.setPosition(position);
+    };
 
-        snd_pcm_writei(handle, buffer.data(), framesPerBuffer);
+    StreamMetrics &stats = pcmMetrics(handle, framesPerBuffer);
+    wav.startReadahead();
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        RealtimeThread rt(options.realtime);
+        NoAllocScope audioLoop;
+        while (position < wav.frames())
+        {
+            // Only our own work counts as processing time, not the wait in the device
+            WorkTimer work;
+            int rc;
+            if (config.mmap)
+                rc = mmapTransfer(handle, framesPerBuffer,
+                                  [&](void *out, snd_pcm_uframes_t done, snd_pcm_uframes_t frames)
+                                  {
+                                      work.start();
+                                      render(out, done, frames);
+                                      work.stop();
+                                  });
+            else if (direct && position + framesPerBuffer <= wav.frames())
+            {
+                // Read/write access: ALSA copies from the mapping itself
+                rc = snd_pcm_writei(handle, wav.data(position), framesPerBuffer);
+                if (rc > 0)
+                {
+                    work.start();
+                    position += rc;
+                    wav.setPosition(position);
+                    work.stop();
+                }
+            }
+            else
+            {
+                work.start();
+                render(buffer.data(), 0, framesPerBuffer);
+                work.stop();
+                rc = snd_pcm_writei(handle, buffer.data(), framesPerBuffer);
+            }
+            if (rc < 0)
+                recoverPcm(handle, rc, stats);
+            else if (work.begin())
+                recordPeriod(handle, stats, work.begin(), work.end());
+        }
     }
 
     snd_pcm_drain(handle);
     snd_pcm_close(handle);
-    std::cout << "Tone finished.\n";
+    wav.stopReadahead();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "Played " << position << " frames (" << position * deviceFrameBytes / (1024.0 * 1024.0)
+              << " MB to the device) in " << elapsed << " s.\n";
 }
 
 // Record from device
 void recordAudio(const std::string &device, int sampleRate, int seconds, const std::string &outfile)
 {
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *params;
-    int rc = snd_pcm_open(&handle, device.c_str(), SND_PCM_STREAM_CAPTURE, 0);
-    if (rc < 0)
+    PcmConfig config;
+    snd_pcm_t *handle = openPcm(device, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                         .channels = 1, .format = alsaFormat(options.format), .mmap = options.mmap,
+                                         .period = options.period, .buffer = options.buffer,
+                                         .formatFallback = true}, config);
+    if (!handle)
+        return;
+    std::cout << "Capture: " << config << "\n";
+    SampleFormat deviceFormat = sampleFormatOf(config.format);
+    bool useMmap = config.mmap;
+    int rc;
+
+    int framesPerBuffer = transferFrames(config);
+    std::vector<char> buffer(snd_pcm_frames_to_bytes(handle, framesPerBuffer));
+    std::vector<float> scratch(framesPerBuffer);
+
+    // Label the WAV with the negotiated rate, unless --resample converts
+    auto converter = rateConverter(config.rate, sampleRate, 1, framesPerBuffer);
+    if (!converter)
+        sampleRate = config.rate;
+    std::vector<float> converted(converter ? converter->maxOutputFor(framesPerBuffer) : 0);
+
+    // Blocks are streamed to disk by a writer thread while recording.
+    auto sink = openSink(outfile, sampleRate, 1);
+    if (!sink)
     {
-        std::cerr << "Unable to open capture device: " << snd_strerror(rc) << "\n";
+        snd_pcm_close(handle);
         return;
     }
 
-    snd_pcm_hw_params_malloc(&params);
-    snd_pcm_hw_params_any(handle, params);
-    snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
-    unsigned int rate = sampleRate;
-    snd_pcm_hw_params_set_rate_near(handle, params, &rate, nullptr);
-    snd_pcm_hw_params_set_channels(handle, params, 1);
-    snd_pcm_hw_params(handle, params);
-    snd_pcm_hw_params_free(params);
-    snd_pcm_prepare(handle);
-
-    int framesPerBuffer = 512;
-    std::vector<short> buffer(framesPerBuffer);
-    std::vector<short> recorded;
-    recorded.reserve(sampleRate * seconds);
+    // 64-bit: an S16 mono recording reaches 2^31 frames at 4 GiB, where RF64 takes over
+    long totalFrames = static_cast<long>(config.rate) * seconds;
+    long recordedFrames = 0; // <-- counter
+    auto analyzer = startAnalyzer(config.rate, framesPerBuffer);
+    auto publisher = startPublisher(options.publish, config.rate, 1, deviceFormat, framesPerBuffer);
 
-    int totalFrames = sampleRate * seconds;
-    int recordedFrames = 0; // <-- counter
+    // With --gate only active segments reach the sink
+    std::unique_ptr<ActivityGate> gate;
+    if (options.gate.enabled)
+        gate = std::make_unique<ActivityGate>(options.gate, deviceFormat, config.rate, 1, framesPerBuffer,
+                                              totalFrames + framesPerBuffer);
+    auto store = [&](const void *in, size_t frames)
+    {
+        auto write = [&](const void *block, size_t n)
+        { return writeCaptured(*sink, deviceFormat, block, n, 1, scratch, converter.get(), converted.data()); };
+        if (gate)
+            gate->push(in, frames, write);
+        else
+            write(in, frames);
+    };
+    auto started = std::chrono::system_clock::now();
 
-    for (int i = 0; i < totalFrames; i += framesPerBuffer)
+    StreamMetrics &stats = pcmMetrics(handle, framesPerBuffer);
     {
-        rc = snd_pcm_readi(handle, buffer.data(), framesPerBuffer);
-        if (rc < 0)
-        {
-            rc = snd_pcm_recover(handle, rc, 0);
-        }
-        if (rc > 0)
+        RealtimeThread rt(options.realtime);
+        NoAllocScope audioLoop;
+        for (long i = 0; i < totalFrames; i += framesPerBuffer)
         {
-            recorded.insert(recorded.end(), buffer.begin(), buffer.begin() + rc);
-            recordedFrames += rc;
+            if (useMmap)
+            {
+                // Hand captured frames to the sink directly from the DMA buffer
+                WorkTimer work;
+                rc = mmapTransfer(handle, framesPerBuffer,
+                                  [&](void *in, snd_pcm_uframes_t, snd_pcm_uframes_t frames)
+                                  {
+                                      work.start();
+                                      store(in, frames);
+                                      if (analyzer)
+                                          analyzer->publish(deviceFormat, in, frames, 1);
+                                      if (publisher)
+                                          publisher->publish(in, frames);
+                                      recordedFrames += frames;
+                                      work.stop();
+                                  });
+                if (rc < 0)
+                    recoverPcm(handle, rc, stats);
+                else
+                    recordPeriod(handle, stats, work.begin(), work.end());
+                continue;
+            }
+
+            rc = snd_pcm_readi(handle, buffer.data(), framesPerBuffer);
+            if (rc < 0)
+            {
+                rc = recoverPcm(handle, rc, stats);
+            }
+            if (rc > 0)
+            {
+                uint64_t start = metricsNow(); // after the blocking read
+                store(buffer.data(), rc);
+                if (analyzer)
+                    analyzer->publish(deviceFormat, buffer.data(), rc, 1);
+                if (publisher)
+                    publisher->publish(buffer.data(), rc);
+                recordedFrames += rc;
+                recordPeriod(handle, stats, start);
+            }
         }
     }
 
+    stopAnalyzer(analyzer);
+    stopPublisher(publisher);
     std::cout << "Captured frames: " << recordedFrames << "\n"; // <-- print frames
     if (recordedFrames == 0)
         std::cerr << "Warning: No audio was captured! Check your input device.\n";
@@ -185,104 +658,708 @@ void recordAudio(const std::string &device, int sampleRate, int seconds, const s
     snd_pcm_drain(handle);
     snd_pcm_close(handle);
 
-    writeWav(outfile, recorded, sampleRate, 1);
-    std::cout << "Saved recording to " << outfile << "\n";
+    sink->close();
+    if (sink->droppedFrames() > 0)
+        std::cerr << "Warning: writer fell behind, dropped " << sink->droppedFrames() << " frames.\n";
+    std::cout << "Saved recording to " << outfile;
+    sink->describe(std::cout);
+    std::cout << "\n";
+
+    if (gate)
+    {
+        gate->finish();
+        gate->describe(std::cout);
+        std::cout << "\n";
+        std::string index = outfile + ".segments.csv";
+        if (gate->writeIndex(index, sampleRate, started))
+            std::cout << "Segment index: " << index << "\n";
+    }
 }
 
-// --- Simultaneous playback + record ---
-void playAndRecord(const std::string &playDevice, const std::string &captureDevice,
-                   int sampleRate, int seconds, const std::string &outfile)
+// --- Black box: endless capture into a circular history, dumped on triggers ---
+void blackboxCapture(const std::string &device, int sampleRate, int channels, const BlackBoxOptions &settings,
+                     double runSeconds)
 {
-    snd_pcm_t *playHandle, *recHandle;
-    snd_pcm_hw_params_t *playParams, *recParams;
-    int rc;
+    PcmConfig config;
+    snd_pcm_t *handle = openPcm(device, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                         .channels = unsigned(channels), .format = alsaFormat(options.format),
+                                         .mmap = options.mmap, .period = options.period, .buffer = options.buffer,
+                                         .formatFallback = true}, config);
+    if (!handle)
+        return;
+    std::cout << "Capture: " << config << "\n";
+    SampleFormat deviceFormat = sampleFormatOf(config.format);
+    channels = config.channels;
 
-    // --- Open capture ---
-    rc = snd_pcm_open(&recHandle, captureDevice.c_str(), SND_PCM_STREAM_CAPTURE, 0);
-    if (rc < 0)
+    double limit = BlackBox::maxSeconds(options.wavFormat, config.rate, channels);
+    if (settings.historySeconds + settings.postSeconds > limit)
     {
-        std::cerr << "Cannot open capture device: " << snd_strerror(rc) << "\n";
-        snd_pcm_close(playHandle);
+        std::cerr << "History too long: a dump must stay under 4 GB (" << int(limit) << " s here).\n";
+        snd_pcm_close(handle);
+        return;
+    }
+
+    int framesPerBuffer = transferFrames(config);
+    std::vector<char> buffer(snd_pcm_frames_to_bytes(handle, framesPerBuffer));
+    BlackBox box(settings, deviceFormat, options.wavFormat, config.rate, channels, framesPerBuffer);
+    box.setDither(options.dither);
+    auto analyzer = startAnalyzer(config.rate, framesPerBuffer);
+
+    std::cout << "Keeping the last " << settings.historySeconds << " s (+" << settings.postSeconds << " s after each trigger) in "
+              << box.memoryBytes() / (1024.0 * 1024.0) << " MB. Dump with: kill -USR1 " << getpid()
+              << (settings.stdinTrigger ? ", Enter" : "");
+    if (settings.levelTrigger)
+        std::cout << ", peak >= " << settings.levelDb << " dBFS";
+    std::cout << ". Stop with Ctrl-C" << (settings.stdinTrigger ? " or q" : "") << ".\n";
+
+    long totalFrames = runSeconds > 0 ? static_cast<long>(runSeconds * config.rate) : -1;
+    StreamMetrics &stats = pcmMetrics(handle, framesPerBuffer);
+    box.start();
+    {
+        RealtimeThread rt(options.realtime);
+        NoAllocScope audioLoop;
+        while (!box.stopRequested() && (totalFrames < 0 || long(box.framesCaptured()) < totalFrames))
+        {
+            // Only our own work counts as processing time, not the wait in the device
+            WorkTimer work;
+            int rc;
+            if (config.mmap)
+                rc = mmapTransfer(handle, framesPerBuffer,
+                                  [&](void *in, snd_pcm_uframes_t, snd_pcm_uframes_t frames)
+                                  {
+                                      work.start();
+                                      box.push(in, frames);
+                                      if (analyzer)
+                                          analyzer->publish(deviceFormat, in, frames, channels);
+                                      work.stop();
+                                  });
+            else
+            {
+                rc = snd_pcm_readi(handle, buffer.data(), framesPerBuffer);
+                if (rc > 0)
+                {
+                    work.start();
+                    box.push(buffer.data(), rc);
+                    if (analyzer)
+                        analyzer->publish(deviceFormat, buffer.data(), rc, channels);
+                    work.stop();
+                }
+            }
+            if (rc < 0)
+                recoverPcm(handle, rc, stats);
+            else if (work.begin())
+                recordPeriod(handle, stats, work.begin(), work.end());
+        }
+    }
+
+    snd_pcm_drop(handle);
+    snd_pcm_close(handle);
+    stopAnalyzer(analyzer);
+    box.stop();
+    std::cout << "Captured " << box.framesCaptured() << " frames, " << box.dumps() << " dumps";
+    if (box.mergedTriggers() > 0)
+        std::cout << ", " << box.mergedTriggers() << " triggers merged into pending dumps";
+    std::cout << ".\n";
+    if (box.lostFrames() > 0)
+        std::cerr << "Warning: " << box.lostFrames() << " frames were overwritten before they could be dumped.\n";
+}
+
+// --- Publish: capture only into a shared-memory ring for other processes ---
+void publishCapture(const std::string &device, const std::string &name, int sampleRate, int channels,
+                    double runSeconds)
+{
+    PcmConfig config;
+    snd_pcm_t *handle = openPcm(device, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                         .channels = unsigned(channels), .format = alsaFormat(options.format),
+                                         .mmap = options.mmap, .period = options.period, .buffer = options.buffer,
+                                         .formatFallback = true}, config);
+    if (!handle)
+        return;
+    std::cout << "Capture: " << config << "\n";
+    SampleFormat deviceFormat = sampleFormatOf(config.format);
+    channels = config.channels;
+
+    int framesPerBuffer = transferFrames(config);
+    std::vector<char> buffer(snd_pcm_frames_to_bytes(handle, framesPerBuffer));
+    auto publisher = startPublisher(name, config.rate, channels, deviceFormat, framesPerBuffer);
+    if (!publisher)
+    {
+        snd_pcm_close(handle);
+        return;
+    }
+    auto analyzer = startAnalyzer(config.rate, framesPerBuffer);
+    std::cout << "Follow it with: cpp_audio subscribe " << name << " meter. Stop with Ctrl-C.\n";
+    stopOnSignals();
+
+    long totalFrames = runSeconds > 0 ? static_cast<long>(runSeconds * config.rate) : -1;
+    StreamMetrics &stats = pcmMetrics(handle, framesPerBuffer);
+    {
+        RealtimeThread rt(options.realtime);
+        NoAllocScope audioLoop;
+        while (!interrupted().load() && (totalFrames < 0 || long(publisher->framesPublished()) < totalFrames))
+        {
+            // Only our own work counts as processing time, not the wait in the device
+            WorkTimer work;
+            int rc;
+            if (config.mmap)
+                rc = mmapTransfer(handle, framesPerBuffer,
+                                  [&](void *in, snd_pcm_uframes_t, snd_pcm_uframes_t frames)
+                                  {
+                                      work.start();
+                                      publisher->publish(in, frames);
+                                      if (analyzer)
+                                          analyzer->publish(deviceFormat, in, frames, channels);
+                                      work.stop();
+                                  });
+            else
+            {
+                rc = snd_pcm_readi(handle, buffer.data(), framesPerBuffer);
+                if (rc > 0)
+                {
+                    work.start();
+                    publisher->publish(buffer.data(), rc);
+                    if (analyzer)
+                        analyzer->publish(deviceFormat, buffer.data(), rc, channels);
+                    work.stop();
+                }
+            }
+            if (rc < 0)
+                recoverPcm(handle, rc, stats);
+            else if (work.begin())
+                recordPeriod(handle, stats, work.begin(), work.end());
+        }
+    }
+
+    snd_pcm_drop(handle);
+    snd_pcm_close(handle);
+    stopAnalyzer(analyzer);
+    stopPublisher(publisher);
+}
+
+// --- Subscribe: follow a published capture from another process ---
+// `mode` is "meter" (levels once a second), "raw" (interleaved frames in the
+// published format to stdout) or a .wav/.flac file to record into.
+void subscribe(const std::string &name, const std::string &mode, double seconds)
+{
+    ShmRingReader reader;
+    if (!reader.open(name))
+        return;
+    int rate = reader.rate(), channels = reader.channels();
+    SampleFormat format = reader.format();
+    std::cerr << "Following " << name << ": " << rate << " Hz, " << channels << " ch, " << sampleFormatName(format)
+              << ", " << reader.slotCount() << " slots of " << reader.slotFrames() << " frames\n";
+
+    bool meter = mode == "meter", raw = mode == "raw";
+    std::unique_ptr<AudioSink> sink;
+    if (!meter && !raw && !(sink = openSink(mode, rate, channels)))
         return;
+    if (raw)
+        signal(SIGPIPE, SIG_IGN); // a closed pipe ends the run through fwrite
+    stopOnSignals();
+
+    std::vector<uint8_t> copy(reader.slotFrames() * reader.frameBytes());
+    std::vector<float> samples(reader.slotFrames() * channels);
+    std::vector<double> sum(channels);
+    std::vector<float> peak(channels);
+    uint64_t frames = 0, meterFrames = 0, latencyNs = 0;
+    uint64_t limit = seconds > 0 ? static_cast<uint64_t>(seconds * rate) : UINT64_MAX;
+
+    while (!interrupted().load() && frames < limit)
+    {
+        ShmRingReader::Period period;
+        ShmRingReader::Status status = reader.next(period, 500);
+        if (status == ShmRingReader::Status::Closed)
+        {
+            std::cerr << "Publisher stopped.\n";
+            break;
+        }
+        if (status == ShmRingReader::Status::Timeout)
+            continue;
+        latencyNs = std::max(latencyNs, shm_detail::monotonicNs() - period.timestampNs);
+
+        if (raw)
+        {
+            // Copy out first: nothing torn may reach the pipe
+            if (!reader.copy(period, copy.data()))
+            {
+                reader.discard(period);
+                continue;
+            }
+            if (std::fwrite(copy.data(), reader.frameBytes(), period.frames, stdout) != period.frames)
+                break;
+            frames += period.frames;
+            continue;
+        }
+
+        // Decode straight from the shared slot, keep it only if it wasn't overwritten meanwhile
+        decodeSamples(format, period.data, samples.data(), period.frames * channels);
+        if (!reader.intact(period))
+        {
+            reader.discard(period);
+            continue;
+        }
+        frames += period.frames;
+        if (sink)
+        {
+            sink->writeFloat(samples.data(), period.frames);
+            continue;
+        }
+
+        for (size_t i = 0; i < period.frames; i++)
+            for (int c = 0; c < channels; c++)
+            {
+                float x = samples[i * channels + c];
+                sum[c] += double(x) * x;
+                peak[c] = std::max(peak[c], std::fabs(x));
+            }
+        meterFrames += period.frames;
+        if (meterFrames >= uint64_t(rate))
+        {
+            std::cout << std::fixed << std::setprecision(1) << "t=" << double(period.firstFrame + period.frames) / rate
+                      << "s";
+            for (int c = 0; c < channels; c++)
+                std::cout << "  ch" << c << " " << analyzer_detail::toDb(sum[c] / meterFrames) << " rms "
+                          << analyzer_detail::toDb(double(peak[c]) * peak[c]) << " peak";
+            std::cout << "  lag " << reader.lag() << ", latency <= " << latencyNs / 1e6 << " ms, lost "
+                      << reader.lostFrames() << " frames" << std::defaultfloat << std::endl;
+            std::fill(sum.begin(), sum.end(), 0.0);
+            std::fill(peak.begin(), peak.end(), 0.0f);
+            meterFrames = 0;
+            latencyNs = 0;
+        }
+    }
+
+    if (sink)
+    {
+        sink->close();
+        std::cerr << "Saved " << mode;
+        sink->describe(std::cerr);
+        std::cerr << "\n";
+    }
+    std::cerr << "Received " << frames << " frames, " << reader.overruns() << " overruns, " << reader.lostFrames()
+              << " frames lost\n";
+}
+
+// --- Multi-device capture on a shared timeline ---
+
+// One capture device in multirecord. The capture thread owns the handle and
+// fills `ring`; the writer thread only reads `ring` and the atomics.
+struct CaptureDevice
+{
+    std::string name;
+    int channels = 1;
+    snd_pcm_t *handle = nullptr;
+    PcmConfig config;
+    std::unique_ptr<SpscRing<short>> ring;
+
+    double origin = 0.0;               // capture time of frame 0 in seconds, valid once `started`
+    std::atomic<bool> started{false};
+    std::atomic<bool> done{false};
+    std::atomic<long> lostFrames{0};    // missed in xruns, replaced by silence
+    std::atomic<long> droppedFrames{0}; // ring full because the writer fell behind
+
+    // Writer-thread state
+    long pad = 0;       // leading silence still to emit
+    long debt = 0;      // silence emitted while stalled, skipped once data arrives
+    long stallFrames = 0;
+};
+
+// Capture time of frame `position` (frames read so far) from the status htstamp:
+// the newest captured frame, position + avail, was taken at htstamp
+double captureOrigin(snd_pcm_t *handle, snd_pcm_status_t *status, long position, unsigned int rate)
+{
+    snd_htimestamp_t ts;
+    snd_pcm_status(handle, status);
+    snd_pcm_status_get_htstamp(status, &ts);
+    long avail = snd_pcm_status_get_avail(status);
+    return ts.tv_sec + ts.tv_nsec * 1e-9 - double(position + avail) / rate;
+}
+
+void captureDeviceLoop(CaptureDevice &dev, long totalFrames)
+{
+    RealtimeThread rt(options.realtime);
+    int framesPerBuffer = dev.config.period;
+    std::vector<short> buffer(framesPerBuffer * dev.channels);
+    std::vector<short> silence(framesPerBuffer * dev.channels, 0);
+    snd_pcm_status_t *status;
+    snd_pcm_status_malloc(&status);
+    StreamMetrics &stats = pcmMetrics(dev.handle, framesPerBuffer);
+    unsigned int rate = dev.config.rate;
+
+    auto push = [&](const short *samples, long frames)
+    {
+        size_t pushed = dev.ring->write(samples, frames * dev.channels) / dev.channels;
+        if (pushed < static_cast<size_t>(frames))
+            dev.droppedFrames.fetch_add(frames - pushed, std::memory_order_relaxed);
+    };
+
+    long position = 0;
+    bool resync = false;
+    NoAllocScope audioLoop;
+    snd_pcm_start(dev.handle);
+    while (position < totalFrames)
+    {
+        int got = snd_pcm_readi(dev.handle, buffer.data(), std::min<long>(framesPerBuffer, totalFrames - position));
+        if (got < 0)
+        {
+            if (recoverPcm(dev.handle, got, stats) < 0)
+                break;
+            snd_pcm_start(dev.handle);
+            resync = true;
+            continue;
+        }
+        uint64_t start = metricsNow(); // after the blocking read
+
+        if (!dev.started.load(std::memory_order_relaxed))
+        {
+            dev.origin = captureOrigin(dev.handle, status, position + got, rate);
+            dev.started.store(true, std::memory_order_release);
+        }
+        else if (resync)
+        {
+            // Fill the frames lost in the xrun with silence so the timeline stays aligned
+            double now = captureOrigin(dev.handle, status, 0, rate);
+            long lost = std::min(std::lround((now - dev.origin) * rate) - (position + got), totalFrames - position);
+            for (long n = lost; n > 0; n -= framesPerBuffer)
+                push(silence.data(), std::min<long>(n, framesPerBuffer));
+            if (lost > 0)
+            {
+                dev.lostFrames.fetch_add(lost, std::memory_order_relaxed);
+                position += lost;
+            }
+            resync = false;
+        }
+
+        got = std::min<long>(got, totalFrames - position);
+        push(buffer.data(), got);
+        position += got;
+        recordPeriod(dev.handle, stats, start);
     }
-    unsigned int rate = sampleRate;
-    snd_pcm_hw_params_malloc(&recParams);
-    snd_pcm_hw_params_any(recHandle, recParams);
-    snd_pcm_hw_params_set_access(recHandle, recParams, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(recHandle, recParams, SND_PCM_FORMAT_S16_LE);
-    snd_pcm_hw_params_set_rate_near(recHandle, recParams, &rate, nullptr);
-    snd_pcm_hw_params_set_channels(recHandle, recParams, 1);
-    snd_pcm_hw_params(recHandle, recParams);
-    snd_pcm_hw_params_free(recParams);
-    snd_pcm_prepare(recHandle);
+
+    snd_pcm_status_free(status);
+    dev.done.store(true, std::memory_order_release);
+}
+
+void multiRecord(const std::vector<std::string> &devices, int sampleRate, int seconds, const std::string &out,
+                 bool split)
+{
+    // "device@N" records N channels from that device
+    std::vector<std::unique_ptr<CaptureDevice>> devs;
+    for (const std::string &spec : devices)
+    {
+        auto dev = std::make_unique<CaptureDevice>();
+        size_t at = spec.rfind('@');
+        dev->name = spec.substr(0, at);
+        if (at != std::string::npos)
+            dev->channels = std::max(1, atoi(spec.c_str() + at + 1));
+
+        dev->handle = openPcm(dev->name, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                          .channels = unsigned(dev->channels), .period = options.period,
+                                          .buffer = options.buffer}, dev->config);
+        if (!dev->handle)
+        {
+            for (auto &d : devs)
+                snd_pcm_close(d->handle);
+            return;
+        }
+        std::cout << "Capture " << devs.size() << " (" << dev->name << "): " << dev->config << "\n";
+        if (!devs.empty() && dev->config.rate != devs[0]->config.rate)
+            std::cerr << "Warning: " << dev->name << " runs at a different rate, its track will drift.\n";
+
+        // Timestamps for the alignment
+        snd_pcm_sw_params_t *swParams;
+        snd_pcm_sw_params_malloc(&swParams);
+        snd_pcm_sw_params_current(dev->handle, swParams);
+        snd_pcm_sw_params_set_tstamp_mode(dev->handle, swParams, SND_PCM_TSTAMP_ENABLE);
+        snd_pcm_sw_params_set_tstamp_type(dev->handle, swParams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+        snd_pcm_sw_params(dev->handle, swParams);
+        snd_pcm_sw_params_free(swParams);
+
+        // Two seconds of slack between the capture thread and the writer
+        dev->ring = std::make_unique<SpscRing<short>>(size_t(dev->config.rate) * 2 * dev->channels);
+        devs.push_back(std::move(dev));
+    }
+    sampleRate = devs[0]->config.rate;
+
+    // Channel offset of each device in the interleaved file
+    int totalChannels = 0, maxChannels = 0;
+    std::vector<int> firstChannel;
+    for (auto &d : devs)
+    {
+        firstChannel.push_back(totalChannels);
+        totalChannels += d->channels;
+        maxChannels = std::max(maxChannels, d->channels);
+    }
+
+    // Split files are PREFIX_<n>.wav, or PREFIX_<n>.flac for a "PREFIX.flac" argument
+    auto endsWith = [&](const char *suffix) { return out.size() >= std::strlen(suffix) &&
+                                                     out.compare(out.size() - std::strlen(suffix), std::string::npos, suffix) == 0; };
+    std::string extension = endsWith(".flac") ? ".flac" : ".wav";
+    std::string stem = endsWith(extension.c_str()) ? out.substr(0, out.size() - extension.size()) : out;
+    std::vector<std::unique_ptr<AudioSink>> sinks;
+    for (size_t i = 0; i < (split ? devs.size() : 1); i++)
+    {
+        std::string file = split ? stem + "_" + std::to_string(i) + extension : out;
+        sinks.push_back(openSink(file, sampleRate, split ? devs[i]->channels : totalChannels));
+        if (!sinks.back())
+        {
+            for (auto &d : devs)
+                snd_pcm_close(d->handle);
+            return;
+        }
+    }
+
+    long totalFrames = static_cast<long>(sampleRate) * seconds;
+    std::cout << "Recording " << devs.size() << " devices (" << totalChannels << " channels) for " << seconds
+              << "s...\n";
+
+    std::vector<std::thread> threads;
+    for (auto &d : devs)
+        threads.emplace_back(captureDeviceLoop, std::ref(*d), totalFrames);
+
+    // --- Align: devices that started later get leading silence ---
+    auto waitUntil = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (std::any_of(devs.begin(), devs.end(), [](auto &d) { return !d->started && !d->done; }) &&
+           std::chrono::steady_clock::now() < waitUntil)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double firstOrigin = 1e300;
+    for (auto &d : devs)
+        if (d->started)
+            firstOrigin = std::min(firstOrigin, d->origin);
+    for (size_t i = 0; i < devs.size(); i++)
+    {
+        CaptureDevice &d = *devs[i];
+        d.pad = d.started ? std::lround((d.origin - firstOrigin) * sampleRate) : 0;
+        if (!d.started)
+            std::cerr << "Warning: device " << i << " has not delivered any audio yet, its track is not aligned.\n";
+        std::cout << "  device " << i << " starts at +" << 1000.0 * d.pad / sampleRate << " ms\n";
+    }
+
+    // --- Writer: interleave (or split) whatever every device has ready ---
+    const long chunk = 1024;
+    const long stallLimit = static_cast<long>(sampleRate); // a device 1 s behind the rest is stalled
+    std::vector<short> devBuf(chunk * maxChannels);
+    std::vector<short> outBuf(chunk * totalChannels);
+    std::vector<long> supply(devs.size());
+
+    while (true)
+    {
+        long ready = chunk, most = 0;
+        bool anyLive = false;
+        for (size_t i = 0; i < devs.size(); i++)
+        {
+            CaptureDevice &d = *devs[i];
+            bool finished = d.done.load(std::memory_order_acquire);
+
+            // Frames that arrive after a stall replace the silence already written
+            while (d.debt > 0 && d.ring->readAvailable() > 0)
+                d.debt -= d.ring->read(devBuf.data(), std::min(d.debt, chunk) * d.channels) / d.channels;
+
+            supply[i] = d.pad + static_cast<long>(d.ring->readAvailable() / d.channels);
+            if (finished && supply[i] == 0)
+            {
+                supply[i] = -1; // ended, pads with silence
+                continue;
+            }
+            anyLive = true;
+            ready = std::min(ready, supply[i]);
+            most = std::max(most, supply[i]);
+        }
+        if (!anyLive)
+            break;
+
+        if (ready == 0)
+        {
+            if (most < stallLimit)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                continue;
+            }
+            // Somebody is far behind: carry on without them so the others' rings don't overflow
+            ready = chunk;
+            for (long s : supply)
+                if (s > 0)
+                    ready = std::min(ready, s);
+        }
+
+        for (size_t i = 0; i < devs.size(); i++)
+        {
+            CaptureDevice &d = *devs[i];
+            long n = 0;
+            if (supply[i] > 0)
+            {
+                long padded = std::min(d.pad, ready);
+                std::fill(devBuf.begin(), devBuf.begin() + padded * d.channels, 0);
+                d.pad -= padded;
+                n = padded + d.ring->read(devBuf.data() + padded * d.channels, (ready - padded) * d.channels) /
+                                 d.channels;
+            }
+            if (n < ready)
+            {
+                std::fill(devBuf.begin() + n * d.channels, devBuf.begin() + ready * d.channels, 0);
+                if (supply[i] == 0)
+                {
+                    d.debt += ready - n;
+                    d.stallFrames += ready - n;
+                }
+            }
+
+            if (split)
+            {
+                sinks[i]->write(devBuf.data(), ready);
+                continue;
+            }
+            for (long f = 0; f < ready; f++)
+                for (int c = 0; c < d.channels; c++)
+                    outBuf[f * totalChannels + firstChannel[i] + c] = devBuf[f * d.channels + c];
+        }
+        if (!split)
+            sinks[0]->write(outBuf.data(), ready);
+    }
+
+    for (auto &t : threads)
+        t.join();
+    for (auto &s : sinks)
+        s->close();
+
+    for (size_t i = 0; i < devs.size(); i++)
+    {
+        CaptureDevice &d = *devs[i];
+        snd_pcm_drop(d.handle);
+        snd_pcm_close(d.handle);
+        if (d.lostFrames || d.droppedFrames || d.stallFrames)
+            std::cerr << "Device " << i << " (" << d.name << "): " << d.lostFrames << " frames lost in xruns, "
+                      << d.droppedFrames << " dropped (ring full), " << d.stallFrames << " filled while stalled\n";
+    }
+    for (auto &s : sinks)
+        if (s->droppedFrames() > 0)
+            std::cerr << "Warning: writer fell behind, dropped " << s->droppedFrames() << " frames.\n";
+    std::cout << "Saved " << (split ? stem + "_<n>" + extension : out);
+    if (!split)
+        sinks[0]->describe(std::cout);
+    std::cout << "\n";
+}
+
+// --- Simultaneous playback + record ---
+void playAndRecord(const std::string &playDevice, const std::string &captureDevice,
+                   int sampleRate, int seconds, const std::string &outfile, const StimulusSpec &spec)
+{
+    // --- Open capture ---
+    PcmConfig recConfig, playConfig;
+    snd_pcm_t *recHandle = openPcm(captureDevice, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                                   .channels = 1, .format = alsaFormat(options.format),
+                                                   .mmap = options.mmap, .period = options.period,
+                                                   .buffer = options.buffer, .formatFallback = true}, recConfig);
+    if (!recHandle)
+        return;
 
     // --- Open playback ---
-    rc = snd_pcm_open(&playHandle, playDevice.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
-    if (rc < 0)
+    snd_pcm_t *playHandle = openPcm(playDevice, {.stream = SND_PCM_STREAM_PLAYBACK, .rate = unsigned(sampleRate),
+                                                 .channels = unsigned(spec.channels), .format = alsaFormat(options.format),
+                                                 .mmap = options.mmap, .period = options.period,
+                                                 .buffer = options.buffer, .formatFallback = true}, playConfig);
+    if (!playHandle)
     {
-        std::cerr << "Cannot open playback device: " << snd_strerror(rc) << "\n";
+        snd_pcm_close(recHandle);
         return;
     }
-    snd_pcm_hw_params_malloc(&playParams);
-    snd_pcm_hw_params_any(playHandle, playParams);
-    snd_pcm_hw_params_set_access(playHandle, playParams, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(playHandle, playParams, SND_PCM_FORMAT_S16_LE);
-    snd_pcm_hw_params_set_rate_near(playHandle, playParams, &rate, nullptr);
-    snd_pcm_hw_params_set_channels(playHandle, playParams, 2);
-    snd_pcm_hw_params(playHandle, playParams);
-    snd_pcm_hw_params_free(playParams);
-    snd_pcm_prepare(playHandle);
+    std::cout << "Capture: " << recConfig << "\nPlayback: " << playConfig << "\n";
+    bool recMmap = recConfig.mmap;
+    bool playMmap = playConfig.mmap;
+    SampleFormat recFormat = sampleFormatOf(recConfig.format);
+    SampleFormat playFormat = sampleFormatOf(playConfig.format);
 
-    
+    int framesPerBuffer = transferFrames(recConfig);
 
-    int framesPerBuffer = 512;
-    std::vector<short> playBuf(framesPerBuffer * 2);
-    std::vector<short> recBuf(framesPerBuffer);
-    std::vector<short> recorded;
-    recorded.reserve(sampleRate * seconds);
+    // With --resample the stimulus is generated and recorded at the requested
+    // rate and converted to and from each device's own rate
+    int playChannels = spec.channels;
+    size_t playInput = framesPerBuffer * (sampleRate / double(playConfig.rate)) + 2;
+    std::unique_ptr<PolyphaseResampler> playConverter, recConverter;
+    if (options.resample && PolyphaseResampler::supported(sampleRate, playConfig.rate) &&
+        PolyphaseResampler::supported(recConfig.rate, sampleRate))
+    {
+        playConverter = rateConverter(sampleRate, playConfig.rate, playChannels, playInput);
+        recConverter = rateConverter(recConfig.rate, sampleRate, 1, framesPerBuffer);
+    }
+    else
+    {
+        if (options.resample)
+            std::cerr << "No converter for these rates, running at the device rate.\n";
+        playInput = framesPerBuffer;
+        if (recConfig.rate != playConfig.rate)
+            std::cerr << "Warning: capture and playback rates differ.\n";
+        sampleRate = recConfig.rate;
+    }
+
+    auto sink = openSink(outfile, sampleRate, 1);
+    if (!sink)
+    {
+        snd_pcm_close(playHandle);
+        snd_pcm_close(recHandle);
+        return;
+    }
 
-    // --- Generate logarithmic sine sweep parameters ---
-    double f0 = 20.0;          // start frequency
-    double f1 = sampleRate/2;  // end frequency
-    double T = seconds;        // total time
-    double K = T / log(f1/f0);
+    Stimulus stimulus(spec, sampleRate, seconds, playInput);
+    std::cout << "Stimulus: ";
+    stimulus.describe(std::cout);
+    std::cout << "\n";
+    std::vector<float> playBlock(playInput * playChannels), scratch(framesPerBuffer);
+    std::vector<float> playConverted(framesPerBuffer * playChannels);
+    std::vector<float> recConverted(recConverter ? recConverter->maxOutputFor(framesPerBuffer) : 0);
+    TpdfDither dither;
 
     std::cout << "Starting simultaneous playback and recording...\n";
 
-    for (int i = 0; i < sampleRate * seconds; i += framesPerBuffer)
+    // Both devices are serviced from one poll loop, neither waits on the other
+    long totalFrames = static_cast<long>(sampleRate) * seconds;
+    long recorded = 0;
+    PcmEngine engine;
+
+    int playStream = engine.addPlayback(playHandle, playChannels, framesPerBuffer, playMmap,
+                                        [&](void *out, snd_pcm_uframes_t frames)
     {
-        // Fill playback buffer with sweep
-        for (int j = 0; j < framesPerBuffer; j++)
+        // Fill playback buffer with the stimulus, silence after the end
+        long needed = playConverter ? playConverter->inputFor(frames) : frames;
+        stimulus.render(playBlock.data(), needed);
+        const float *samples = playBlock.data();
+        if (playConverter)
         {
-            int n = i + j;
-            double t = double(n)/sampleRate;
-            double phase = 2*M_PI*f0*K*(exp(t/K)-1);
-            short sample = static_cast<short>(std::sin(phase) * 32767);
-            playBuf[j*2] = sample;
-            playBuf[j*2+1] = sample;
+            playConverter->process(playBlock.data(), needed, playConverted.data(), frames);
+            samples = playConverted.data();
         }
+        encodeSamples(playFormat, samples, out, frames * playChannels, options.dither ? &dither : nullptr);
+        return recorded < totalFrames;
+    });
 
-        // --- Playback ---
-        rc = snd_pcm_writei(playHandle, playBuf.data(), framesPerBuffer);
-        if (rc < 0)
-            rc = snd_pcm_recover(playHandle, rc, 0);
+    int recStream = engine.addCapture(recHandle, 1, framesPerBuffer, recMmap,
+                                      [&](void *in, snd_pcm_uframes_t frames)
+    {
+        // Converted output may run up to a period past the end
+        long n = recConverter ? frames : std::min<long>(frames, totalFrames - recorded);
+        recorded += writeCaptured(*sink, recFormat, in, n, 1, scratch, recConverter.get(), recConverted.data());
+        return recorded < totalFrames;
+    });
 
-        // --- Record ---
-        rc = snd_pcm_readi(recHandle, recBuf.data(), framesPerBuffer);
-        if (rc < 0)
-            rc = snd_pcm_recover(recHandle, rc, 0);
-        if (rc > 0)
-            recorded.insert(recorded.end(), recBuf.begin(), recBuf.begin()+rc);
+    {
+        RealtimeThread rt(options.realtime);
+        engine.run();
     }
 
-    snd_pcm_drain(playHandle);
-    snd_pcm_close(playHandle);
+    if (engine.failed())
+        std::cerr << "Stopped early after a device error; the recording is incomplete.\n";
+    if (engine.xruns(playStream) || engine.xruns(recStream))
+        std::cerr << "Xruns: playback " << engine.xruns(playStream) << ", capture " << engine.xruns(recStream) << "\n";
 
-    snd_pcm_drain(recHandle);
+    snd_pcm_close(playHandle);
     snd_pcm_close(recHandle);
 
-    writeWav(outfile, recorded, sampleRate, 1);
-    std::cout << "Finished playback and recording. Saved to " << outfile << "\n";
+    sink->close();
+    if (sink->droppedFrames() > 0)
+        std::cerr << "Warning: writer fell behind, dropped " << sink->droppedFrames() << " frames.\n";
+    std::cout << "Finished playback and recording. Saved to " << outfile;
+    sink->describe(std::cout);
+    std::cout << "\n";
 }
 
 
@@ -290,85 +1367,937 @@ void playAndRecord(const std::string &playDevice, const std::string &captureDevi
 void micPassthrough(const std::string &inputDevice, const std::string &outputDevice,
                     int sampleRate, int seconds)
 {
-    snd_pcm_t *inHandle, *outHandle;
-    snd_pcm_hw_params_t *inParams, *outParams;
-    int rc;
-
     // --- Open input ---
-    rc = snd_pcm_open(&inHandle, inputDevice.c_str(), SND_PCM_STREAM_CAPTURE, 0);
-    if (rc < 0)
-    {
-        std::cerr << "Cannot open input device: " << snd_strerror(rc) << "\n";
+    PcmConfig inConfig, outConfig;
+    snd_pcm_t *inHandle = openPcm(inputDevice, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                                .channels = 1, .mmap = options.mmap,
+                                                .period = options.period, .buffer = options.buffer}, inConfig);
+    if (!inHandle)
         return;
-    }
-    snd_pcm_hw_params_malloc(&inParams);
-    snd_pcm_hw_params_any(inHandle, inParams);
-    snd_pcm_hw_params_set_access(inHandle, inParams, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(inHandle, inParams, SND_PCM_FORMAT_S16_LE);
-    unsigned int rate = sampleRate;
-    snd_pcm_hw_params_set_rate_near(inHandle, inParams, &rate, nullptr);
-    snd_pcm_hw_params_set_channels(inHandle, inParams, 1);
-    snd_pcm_hw_params(inHandle, inParams);
-    snd_pcm_hw_params_free(inParams);
-    snd_pcm_prepare(inHandle);
 
     // --- Open output ---
-    rc = snd_pcm_open(&outHandle, outputDevice.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
-    if (rc < 0)
+    snd_pcm_t *outHandle = openPcm(outputDevice, {.stream = SND_PCM_STREAM_PLAYBACK, .rate = unsigned(sampleRate),
+                                                  .channels = 1, .mmap = options.mmap,
+                                                  .period = options.period, .buffer = options.buffer}, outConfig);
+    if (!outHandle)
     {
-        std::cerr << "Cannot open output device: " << snd_strerror(rc) << "\n";
         snd_pcm_close(inHandle);
         return;
     }
-    snd_pcm_hw_params_malloc(&outParams);
-    snd_pcm_hw_params_any(outHandle, outParams);
-    snd_pcm_hw_params_set_access(outHandle, outParams, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(outHandle, outParams, SND_PCM_FORMAT_S16_LE);
-    snd_pcm_hw_params_set_rate_near(outHandle, outParams, &rate, nullptr);
-    snd_pcm_hw_params_set_channels(outHandle, outParams, 1);
-    snd_pcm_hw_params(outHandle, outParams);
-    snd_pcm_hw_params_free(outParams);
-    snd_pcm_prepare(outHandle);
+    std::cout << "Input: " << inConfig << "\nOutput: " << outConfig << "\n";
+    if (inConfig.rate != outConfig.rate && !options.driftComp)
+        std::cerr << "Warning: input and output rates differ.\n";
+    sampleRate = inConfig.rate;
+    bool inMmap = inConfig.mmap;
+    bool outMmap = outConfig.mmap;
 
     // --- Processing loop ---
-    int framesPerBuffer = 512;
-    std::vector<short> buffer(framesPerBuffer);
+    int framesPerBuffer = transferFrames(inConfig);
+
+    // With --drift-comp the playback side pulls through a resampler whose
+    // ratio follows the capture/playback clock mismatch
+    double nominalRatio = static_cast<double>(inConfig.rate) / outConfig.rate;
+    AdaptiveResampler resampler(1, framesPerBuffer, nominalRatio * (1.0 + DriftTracker::kMaxCorrection));
+    DriftTracker drift;
+    std::vector<short> driftIn(resampler.maxInput());
+    std::vector<float> driftInFloat(resampler.maxInput()), driftOut(framesPerBuffer);
+
+    // Processing runs on float copies of each capture block
+    PassthroughChain &dsp = options.dsp;
+    bool processing = dsp.enabled() && dsp.prepare(inConfig.rate, 1);
+    std::vector<float> dspBlock(framesPerBuffer);
+    std::vector<short> dspOut(framesPerBuffer);
 
     std::cout << "Starting mic passthrough (" << seconds << "s)...\n";
-    int totalFrames = sampleRate * seconds;
+    long totalFrames = static_cast<long>(sampleRate) * seconds;
+    long captured = 0;
 
-    for (int i = 0; i < totalFrames; i += framesPerBuffer)
+    // Both streams run from one poll loop; a small ring absorbs the phase
+    // difference between the capture and playback period boundaries
+    SpscRing<short> ring(framesPerBuffer * 8);
+    PcmEngine engine;
+    auto analyzer = startAnalyzer(inConfig.rate, framesPerBuffer);
+    auto publisher = startPublisher(options.publish, inConfig.rate, 1, SampleFormat::S16, framesPerBuffer);
+
+    bool primed = false;
+    auto playCompensated = [&](short *out, snd_pcm_uframes_t frames)
     {
-        rc = snd_pcm_readi(inHandle, buffer.data(), framesPerBuffer);
-        if (rc < 0)
-            rc = snd_pcm_recover(inHandle, rc, 0);
+        // Hold one extra period in the ring first: the capture period phase
+        // walks as the clocks drift, the ring needs that much headroom to
+        // absorb it without running dry
+        if (!primed && ring.readAvailable() < 2 * frames)
+        {
+            std::fill(out, out + frames, 0);
+            return;
+        }
+        primed = true;
+
+        // End-to-end latency: frames still in the capture device, queued in
+        // the ring and the resampler, and not yet played
+        snd_pcm_sframes_t inDelay = 0, outDelay = 0;
+        snd_pcm_delay(inHandle, &inDelay);
+        snd_pcm_delay(outHandle, &outDelay);
+        double latency = (std::max<snd_pcm_sframes_t>(inDelay, 0) + ring.readAvailable() + resampler.buffered()) /
+                             inConfig.rate +
+                         static_cast<double>(std::max<snd_pcm_sframes_t>(outDelay, 0)) / outConfig.rate;
+        resampler.setRatio(nominalRatio * drift.update(latency, static_cast<double>(frames) / outConfig.rate));
 
-        if (rc > 0)
+        size_t need = resampler.inputFor(frames);
+        size_t got = ring.read(driftIn.data(), need);
+        std::fill(driftIn.begin() + got, driftIn.begin() + need, 0);
+        decodeSamples(SampleFormat::S16, driftIn.data(), driftInFloat.data(), need);
+        resampler.process(driftInFloat.data(), need, driftOut.data(), frames);
+        encodeSamples(SampleFormat::S16, driftOut.data(), out, frames);
+    };
+
+    int inStream = engine.addCapture(inHandle, 1, framesPerBuffer, inMmap,
+                                     [&](void *in, snd_pcm_uframes_t frames)
+    {
+        short *samples = static_cast<short *>(in);
+        if (publisher)
+            publisher->publish(samples, frames);
+        if (processing)
         {
-            int written = snd_pcm_writei(outHandle, buffer.data(), rc);
-            if (written < 0)
-                snd_pcm_recover(outHandle, written, 0);
+            decodeSamples(SampleFormat::S16, samples, dspBlock.data(), frames);
+            dsp.process(dspBlock.data(), frames);
+            encodeSamples(SampleFormat::S16, dspBlock.data(), dspOut.data(), frames);
+            samples = dspOut.data();
+        }
+        ring.write(samples, frames);
+        if (analyzer)
+            analyzer->publish(SampleFormat::S16, samples, frames, 1);
+        captured += frames;
+        return captured < totalFrames;
+    });
+
+    int outStream = engine.addPlayback(outHandle, 1, framesPerBuffer, outMmap,
+                                       [&](void *samples, snd_pcm_uframes_t frames)
+    {
+        short *out = static_cast<short *>(samples);
+        if (options.driftComp)
+        {
+            playCompensated(out, frames);
+            return captured < totalFrames;
         }
+        size_t got = ring.read(out, frames);
+        std::fill(out + got, out + frames, 0);
+        return captured < totalFrames || ring.readAvailable() > 0;
+    });
+
+    {
+        RealtimeThread rt(options.realtime);
+        engine.run();
     }
 
-    snd_pcm_drain(outHandle);
+    stopAnalyzer(analyzer);
+    stopPublisher(publisher);
+    if (engine.failed())
+        std::cerr << "Passthrough stopped early after a device error.\n";
+    if (engine.xruns(inStream) || engine.xruns(outStream))
+        std::cerr << "Xruns: capture " << engine.xruns(inStream) << ", playback " << engine.xruns(outStream) << "\n";
+
     snd_pcm_close(outHandle);
     snd_pcm_close(inHandle);
 
+    if (processing)
+        dsp.report(std::cout, framesPerBuffer);
+    if (options.driftComp)
+        reportDrift(drift);
     std::cout << "Mic passthrough finished.\n";
 }
 
 
+// --- Threaded passthrough: capture and playback decoupled by a lock-free ring ---
+void micPassthroughThreaded(const std::string &inputDevice, const std::string &outputDevice,
+                            int sampleRate, int seconds, double latencyMs, int ringPeriods)
+{
+    int framesPerBuffer = options.period ? options.period : 512;
+    snd_pcm_uframes_t deviceBuffer = options.buffer ? options.buffer : framesPerBuffer * 2;
+
+    // --- Open input ---
+    PcmConfig inConfig, outConfig;
+    snd_pcm_t *inHandle = openPcm(inputDevice, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                                .channels = 1, .period = snd_pcm_uframes_t(framesPerBuffer)},
+                                  inConfig);
+    if (!inHandle)
+        return;
+
+    // --- Open output (small device buffer, the ring holds the latency budget) ---
+    snd_pcm_t *outHandle = openPcm(outputDevice, {.stream = SND_PCM_STREAM_PLAYBACK, .rate = unsigned(sampleRate),
+                                                  .channels = 1, .period = snd_pcm_uframes_t(framesPerBuffer),
+                                                  .buffer = deviceBuffer},
+                                   outConfig);
+    if (!outHandle)
+    {
+        snd_pcm_close(inHandle);
+        return;
+    }
+    std::cout << "Input: " << inConfig << "\nOutput: " << outConfig << "\n";
+    if (inConfig.rate != outConfig.rate && !options.driftComp)
+        std::cerr << "Warning: input and output rates differ.\n";
+    sampleRate = inConfig.rate;
+    snd_pcm_uframes_t bufferSize = outConfig.buffer;
+    framesPerBuffer = inConfig.period;
+
+    // The playback device already buffers bufferSize frames; the ring is
+    // prefilled with whatever is left of the latency target.
+    int targetFrames = static_cast<int>(latencyMs * sampleRate / 1000.0);
+    int prefillFrames = std::max(0, targetFrames - static_cast<int>(bufferSize));
+    if (options.driftComp)
+        prefillFrames = std::max(prefillFrames, 2 * framesPerBuffer); // headroom for the capture phase to walk
+
+    size_t ringFrames = static_cast<size_t>(std::max(ringPeriods, 2)) * framesPerBuffer;
+    if (ringFrames < static_cast<size_t>(prefillFrames + 2 * framesPerBuffer))
+    {
+        ringFrames = prefillFrames + 2 * framesPerBuffer;
+        std::cerr << "Ring too small for latency target, using " << ringFrames << " frames.\n";
+    }
+    SpscRing<short> ring(ringFrames);
+
+    std::atomic<bool> captureDone{false};
+    std::atomic<long> droppedFrames{0};
+
+    // --drift-comp: the capture thread publishes when its stream's frame 0
+    // was captured (from its own snd_pcm_delay), so the playback thread can
+    // tell how many frames exist by now without touching the capture handle.
+    std::atomic<uint64_t> captureOriginNs{0};
+    double nominalRatio = static_cast<double>(inConfig.rate) / outConfig.rate;
+    AdaptiveResampler resampler(1, framesPerBuffer, nominalRatio * (1.0 + DriftTracker::kMaxCorrection));
+    DriftTracker drift;
+
+    // Fill statistics, only touched by the playback thread.
+    long underruns = 0;
+    size_t fillMin = ring.capacity(), fillMax = 0;
+    double fillSum = 0.0;
+    long fillCount = 0;
+
+    std::cout << "Starting threaded passthrough (" << seconds << "s, target "
+              << latencyMs << " ms, ring " << ring.capacity() << " frames)...\n";
+
+    StreamMetrics &inStats = pcmMetrics(inHandle, framesPerBuffer);
+    StreamMetrics &outStats = pcmMetrics(outHandle, framesPerBuffer);
+
+    PassthroughChain &dsp = options.dsp;
+    bool processing = dsp.enabled() && dsp.prepare(inConfig.rate, 1);
+    auto analyzer = startAnalyzer(inConfig.rate, framesPerBuffer);
+    auto publisher = startPublisher(options.publish, inConfig.rate, 1, SampleFormat::S16, framesPerBuffer);
+
+    std::thread captureThread([&]()
+    {
+        RealtimeThread rt(options.realtime);
+        std::vector<short> buffer(framesPerBuffer);
+        std::vector<float> dspBlock(framesPerBuffer);
+        long totalFrames = static_cast<long>(sampleRate) * seconds;
+        long queued = 0;
+        NoAllocScope audioLoop;
+        for (long i = 0; i < totalFrames; i += framesPerBuffer)
+        {
+            int got = snd_pcm_readi(inHandle, buffer.data(), framesPerBuffer);
+            if (got < 0)
+                got = recoverPcm(inHandle, got, inStats);
+            if (got > 0)
+            {
+                uint64_t start = metricsNow(); // after the blocking read
+                if (publisher)
+                    publisher->publish(buffer.data(), got);
+                if (processing)
+                {
+                    decodeSamples(SampleFormat::S16, buffer.data(), dspBlock.data(), got);
+                    dsp.process(dspBlock.data(), got);
+                    encodeSamples(SampleFormat::S16, dspBlock.data(), buffer.data(), got);
+                }
+                size_t pushed = ring.write(buffer.data(), got);
+                if (analyzer)
+                    analyzer->publish(SampleFormat::S16, buffer.data(), got, 1);
+                if (pushed < static_cast<size_t>(got))
+                    droppedFrames.fetch_add(got - pushed, std::memory_order_relaxed);
+                recordPeriod(inHandle, inStats, start);
+
+                queued += pushed;
+                snd_pcm_sframes_t delay = 0;
+                if (options.driftComp && snd_pcm_delay(inHandle, &delay) == 0)
+                    captureOriginNs.store(metricsNow() - uint64_t((queued + delay) * 1e9 / sampleRate),
+                                          std::memory_order_relaxed);
+            }
+        }
+        captureDone.store(true, std::memory_order_release);
+    });
+
+    std::thread playbackThread([&]()
+    {
+        RealtimeThread rt(options.realtime);
+        std::vector<short> buffer(framesPerBuffer);
+        std::vector<short> driftIn(resampler.maxInput());
+        std::vector<float> driftInFloat(resampler.maxInput()), driftOut(framesPerBuffer);
+        long consumed = 0;
+        NoAllocScope audioLoop;
+
+        // Wait for the ring to reach the prefill level before starting output.
+        while (ring.readAvailable() < static_cast<size_t>(prefillFrames) &&
+               !captureDone.load(std::memory_order_acquire))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        while (true)
+        {
+            size_t fill = ring.readAvailable();
+            if (fill == 0 && captureDone.load(std::memory_order_acquire))
+                break;
+
+            fillMin = std::min(fillMin, fill);
+            fillMax = std::max(fillMax, fill);
+            fillSum += fill;
+            fillCount++;
+
+            uint64_t start = metricsNow();
+            uint64_t origin = captureOriginNs.load(std::memory_order_relaxed);
+            snd_pcm_sframes_t outDelay = 0;
+            if (options.driftComp && origin != 0 && snd_pcm_delay(outHandle, &outDelay) == 0)
+            {
+                // Frames captured so far but not played yet
+                double captured = (start - origin) * 1e-9 * inConfig.rate;
+                double latency = (captured - consumed + resampler.buffered()) / inConfig.rate +
+                                 static_cast<double>(outDelay) / outConfig.rate;
+                resampler.setRatio(nominalRatio *
+                                   drift.update(latency, static_cast<double>(framesPerBuffer) / outConfig.rate));
+            }
+
+            size_t need = options.driftComp ? resampler.inputFor(framesPerBuffer) : framesPerBuffer;
+            short *in = options.driftComp ? driftIn.data() : buffer.data();
+            size_t got = ring.read(in, need);
+            consumed += got;
+            if (got < need)
+            {
+                std::fill(in + got, in + need, 0);
+                if (!captureDone.load(std::memory_order_acquire))
+                    underruns++;
+            }
+            if (options.driftComp)
+            {
+                decodeSamples(SampleFormat::S16, driftIn.data(), driftInFloat.data(), need);
+                resampler.process(driftInFloat.data(), need, driftOut.data(), framesPerBuffer);
+                encodeSamples(SampleFormat::S16, driftOut.data(), buffer.data(), framesPerBuffer);
+            }
+
+            uint64_t end = metricsNow(); // the blocking write is not processing time
+            int written = snd_pcm_writei(outHandle, buffer.data(), framesPerBuffer);
+            if (written < 0)
+                recoverPcm(outHandle, written, outStats);
+            else
+                recordPeriod(outHandle, outStats, start, end);
+        }
+    });
+
+    captureThread.join();
+    playbackThread.join();
+    stopAnalyzer(analyzer);
+    stopPublisher(publisher);
+
+    snd_pcm_drain(outHandle);
+    snd_pcm_close(outHandle);
+    snd_pcm_close(inHandle);
+
+    double msPerFrame = 1000.0 / sampleRate;
+    double fillMean = fillCount ? fillSum / fillCount : 0.0;
+    if (fillCount == 0)
+        fillMin = 0;
+    std::cout << "Ring fill (frames): min " << fillMin << ", mean " << fillMean
+              << ", max " << fillMax << " of " << ring.capacity() << "\n";
+    std::cout << "Ring fill (ms): min " << fillMin * msPerFrame << ", mean " << fillMean * msPerFrame
+              << ", max " << fillMax * msPerFrame << "\n";
+    std::cout << "Playback underruns: " << underruns << ", dropped capture frames: "
+              << droppedFrames.load() << "\n";
+    if (processing)
+        dsp.report(std::cout, framesPerBuffer);
+    if (options.driftComp)
+        reportDrift(drift);
+    std::cout << "Threaded passthrough finished.\n";
+}
+
+
+// --- Autotune: smallest period/buffer that runs a trial without xruns ---
+
+// Threads that each keep `load` (0..1) of a core busy, to emulate a loaded host
+class CpuStress
+{
+public:
+    CpuStress(int threads, double load)
+    {
+        for (int t = 0; t < threads; t++)
+        {
+            workers_.emplace_back([this, load]()
+            {
+                volatile double sink = 0;
+                while (!stop_.load(std::memory_order_relaxed))
+                {
+                    auto busyUntil = std::chrono::steady_clock::now() + std::chrono::microseconds(int(load * 10000));
+                    while (std::chrono::steady_clock::now() < busyUntil)
+                        sink = sink + std::sqrt(sink + 1.0);
+                    std::this_thread::sleep_for(std::chrono::microseconds(int((1.0 - load) * 10000)));
+                }
+            });
+        }
+    }
+
+    ~CpuStress()
+    {
+        stop_ = true;
+        for (auto &w : workers_)
+            w.join();
+    }
+
+private:
+    std::atomic<bool> stop_{false};
+    std::vector<std::thread> workers_;
+};
+
+// One passthrough or playrecord trial with a fixed period/buffer request.
+// Returns the number of xruns, or -1 if the devices refused the configuration
+// or failed during the trial.
+long runXrunTrial(const std::string &inputDevice, const std::string &outputDevice, bool playrecord,
+                  int sampleRate, double seconds, snd_pcm_uframes_t period, snd_pcm_uframes_t buffer,
+                  PcmConfig &inConfig, PcmConfig &outConfig)
+{
+    snd_pcm_t *inHandle = openPcm(inputDevice, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                                .channels = 1, .mmap = options.mmap, .period = period,
+                                                .buffer = buffer}, inConfig);
+    if (!inHandle)
+        return -1;
+    snd_pcm_t *outHandle = openPcm(outputDevice, {.stream = SND_PCM_STREAM_PLAYBACK, .rate = unsigned(sampleRate),
+                                                  .channels = playrecord ? 2u : 1u, .mmap = options.mmap,
+                                                  .period = period, .buffer = buffer}, outConfig);
+    if (!outHandle)
+    {
+        snd_pcm_close(inHandle);
+        return -1;
+    }
+
+    long totalFrames = static_cast<long>(inConfig.rate * seconds);
+    long captured = 0;
+    SpscRing<short> ring(inConfig.period * 8);
+    LogSweepGenerator sweep(20.0, inConfig.rate / 2.0, seconds, inConfig.rate);
+    std::vector<float> sweepBlock(outConfig.period), stereo(outConfig.period * 2);
+
+    PcmEngine engine;
+    int inStream = engine.addCapture(inHandle, 1, inConfig.period, inConfig.mmap,
+                                     [&](void *in, snd_pcm_uframes_t frames)
+    {
+        if (!playrecord)
+            ring.write(static_cast<short *>(in), frames);
+        captured += frames;
+        return captured < totalFrames;
+    });
+    int outStream = engine.addPlayback(outHandle, playrecord ? 2 : 1, outConfig.period, outConfig.mmap,
+                                       [&](void *samples, snd_pcm_uframes_t frames)
+    {
+        short *out = static_cast<short *>(samples);
+        if (playrecord)
+        {
+            sweep.render(sweepBlock.data(), frames);
+            duplicateChannels(sweepBlock.data(), stereo.data(), frames, 2);
+            encodeSamples(SampleFormat::S16, stereo.data(), out, frames * 2);
+        }
+        else
+        {
+            size_t got = ring.read(out, frames);
+            std::fill(out + got, out + frames, 0);
+        }
+        return captured < totalFrames;
+    });
+    {
+        RealtimeThread rt(options.realtime);
+        engine.run();
+    }
+
+    long xruns = engine.failed() ? -1 : engine.xruns(inStream) + engine.xruns(outStream);
+    snd_pcm_close(outHandle);
+    snd_pcm_close(inHandle);
+    return xruns;
+}
+
+void autotune(const std::string &inputDevice, const std::string &outputDevice, bool playrecord,
+              int sampleRate, double trialSeconds, int stressThreads, double stressLoad)
+{
+    const snd_pcm_uframes_t periods[] = {2048, 1024, 512, 256, 128, 64, 32, 16};
+    const int multipliers[] = {2, 3, 4};
+
+    std::cout << "Autotuning " << (playrecord ? "playrecord" : "passthrough") << " on " << inputDevice << " -> "
+              << outputDevice << ", " << trialSeconds << "s per trial";
+    if (stressThreads > 0)
+        std::cout << ", " << stressThreads << " stress threads at " << stressLoad * 100 << "% load";
+    std::cout << "\n  period  buffer   latency(ms)  xruns\n";
+
+    CpuStress stress(stressThreads, std::clamp(stressLoad, 0.0, 1.0));
+
+    bool found = false;
+    PcmConfig best;
+    for (snd_pcm_uframes_t period : periods)
+    {
+        bool periodOk = false;
+        bool atFloor = false;
+        for (int mult : multipliers)
+        {
+            PcmConfig inConfig, outConfig;
+            long xruns = runXrunTrial(inputDevice, outputDevice, playrecord, sampleRate, trialSeconds,
+                                      period, period * mult, inConfig, outConfig);
+            if (xruns < 0)
+                continue;
+            if (found && outConfig.period >= best.period)
+            {
+                // The driver will not go any smaller than what already passed
+                atFloor = true;
+                break;
+            }
+
+            double latencyMs = 1000.0 * (outConfig.buffer + inConfig.period) / outConfig.rate;
+            std::cout << "  " << std::setw(6) << outConfig.period << "  " << std::setw(6) << outConfig.buffer
+                      << "  " << std::setw(12) << latencyMs << "  " << std::setw(5) << xruns << "\n";
+            if (xruns == 0)
+            {
+                best = outConfig;
+                found = periodOk = true;
+                break;
+            }
+        }
+        if (atFloor || !periodOk)
+            break;
+    }
+
+    if (!found)
+    {
+        std::cout << "No xrun-free configuration found.\n";
+        return;
+    }
+    std::cout << "Smallest xrun-free configuration: --period=" << best.period << " --buffer=" << best.buffer
+              << " (" << 1000.0 * best.buffer / best.rate << " ms playback buffer)\n";
+}
+
+// --- Round-trip latency measurement by probe cross-correlation ---
+void measureLatency(const std::string &playDevice, const std::string &captureDevice,
+                    int sampleRate, int repetitions, const std::string &probeType)
+{
+    snd_pcm_sw_params_t *swParams;
+    int rc;
+
+    PcmConfig recConfig, playConfig;
+    snd_pcm_t *recHandle = openPcm(captureDevice, {.stream = SND_PCM_STREAM_CAPTURE, .rate = unsigned(sampleRate),
+                                                   .channels = 1, .period = options.period,
+                                                   .buffer = options.buffer}, recConfig);
+    if (!recHandle)
+        return;
+    snd_pcm_t *playHandle = openPcm(playDevice, {.stream = SND_PCM_STREAM_PLAYBACK, .rate = unsigned(sampleRate),
+                                                 .channels = 2, .period = options.period,
+                                                 .buffer = options.buffer}, playConfig);
+    if (!playHandle)
+    {
+        snd_pcm_close(recHandle);
+        return;
+    }
+    std::cout << "Capture: " << recConfig << "\nPlayback: " << playConfig << "\n";
+    sampleRate = recConfig.rate;
+    unsigned int rate = recConfig.rate;
+
+    // Start both streams explicitly, never on the playback fill level
+    snd_pcm_sw_params_malloc(&swParams);
+    snd_pcm_sw_params_current(playHandle, swParams);
+    snd_pcm_sw_params_set_start_threshold(playHandle, swParams, ~0UL >> 1);
+    snd_pcm_sw_params_set_tstamp_mode(playHandle, swParams, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params(playHandle, swParams);
+    snd_pcm_sw_params_current(recHandle, swParams);
+    snd_pcm_sw_params_set_tstamp_mode(recHandle, swParams, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params(recHandle, swParams);
+    snd_pcm_sw_params_free(swParams);
+
+    // Linked streams start on the same trigger; otherwise trigger timestamps correct the offset
+    bool linked = snd_pcm_link(recHandle, playHandle) == 0;
+
+    // --- Probe: MLS or linear chirp at -6 dBFS ---
+    std::vector<float> probe;
+    if (probeType == "mls")
+    {
+        probe = maximumLengthSequence(14);
+    }
+    else
+    {
+        probe.resize(sampleRate / 4);
+        LinearSweepGenerator chirp(100.0, std::min(16000.0, 0.45 * sampleRate), 0.25, sampleRate);
+        chirp.render(probe.data(), probe.size());
+        int fade = sampleRate / 200;
+        for (int i = 0; i < fade; i++)
+        {
+            float g = 0.5f - 0.5f * std::cos(M_PI * i / fade);
+            probe[i] *= g;
+            probe[probe.size() - 1 - i] *= g;
+        }
+    }
+    for (float &v : probe)
+        v *= 0.5f;
+
+    int framesPerBuffer = transferFrames(recConfig);
+    int prefillFrames = 2 * framesPerBuffer;
+    int probeStart = prefillFrames + sampleRate / 10;
+    int totalFrames = probeStart + probe.size() + sampleRate; // 1 s window for the echo
+
+    std::vector<short> playBuf(framesPerBuffer * 2);
+    std::vector<short> recBuf(framesPerBuffer);
+    std::vector<double> captured(totalFrames);
+    std::vector<double> reversedProbe(probe.rbegin(), probe.rend());
+
+    StreamMetrics &playStats = pcmMetrics(playHandle, framesPerBuffer);
+    StreamMetrics &recStats = pcmMetrics(recHandle, framesPerBuffer);
+
+    std::vector<double> lags;
+    double playDelaySum = 0, recDelaySum = 0;
+    long delayCount = 0;
+
+    std::cout << "Measuring latency with " << (probeType == "mls" ? "MLS" : "chirp") << " probe, "
+              << repetitions << " runs" << (linked ? " (linked streams)" : "") << "...\n";
+
+    for (int run = 0; run < repetitions; run++)
+    {
+        snd_pcm_drop(playHandle);
+        snd_pcm_drop(recHandle);
+        snd_pcm_prepare(recHandle);
+        snd_pcm_prepare(playHandle);
+
+        // Playback frame index -> probe sample
+        auto render = [&](int first, int frames)
+        {
+            for (int j = 0; j < frames; j++)
+            {
+                int n = first + j - probeStart;
+                float v = (n >= 0 && n < static_cast<int>(probe.size())) ? probe[n] : 0.0f;
+                playBuf[j * 2] = playBuf[j * 2 + 1] = static_cast<short>(v * 32767);
+            }
+        };
+
+        bool xrun = false;
+        {
+            RealtimeThread rt(options.realtime);
+            NoAllocScope audioLoop;
+            for (int i = 0; i < prefillFrames; i += framesPerBuffer)
+            {
+                render(i, framesPerBuffer);
+                snd_pcm_writei(playHandle, playBuf.data(), framesPerBuffer);
+            }
+            snd_pcm_start(playHandle);
+            if (!linked)
+                snd_pcm_start(recHandle);
+
+            int played = prefillFrames, recorded = 0;
+            while (recorded < totalFrames)
+            {
+                uint64_t start = metricsNow();
+                render(played, framesPerBuffer);
+                uint64_t end = metricsNow(); // the blocking write is not processing time
+                rc = snd_pcm_writei(playHandle, playBuf.data(), framesPerBuffer);
+                if (rc < 0)
+                {
+                    playStats.xrun(metricsNow());
+                    xrun = true;
+                    break;
+                }
+                played += rc;
+                recordPeriod(playHandle, playStats, start, end);
+
+                rc = snd_pcm_readi(recHandle, recBuf.data(), framesPerBuffer);
+                if (rc < 0)
+                {
+                    recStats.xrun(metricsNow());
+                    xrun = true;
+                    break;
+                }
+                start = metricsNow(); // after the blocking read
+                for (int j = 0; j < rc && recorded < totalFrames; j++)
+                    captured[recorded++] = recBuf[j] / 32768.0;
+                recordPeriod(recHandle, recStats, start);
+
+                snd_pcm_sframes_t playDelay, recDelay;
+                if (snd_pcm_delay(playHandle, &playDelay) == 0 && snd_pcm_delay(recHandle, &recDelay) == 0)
+                {
+                    playDelaySum += playDelay;
+                    recDelaySum += recDelay;
+                    delayCount++;
+                }
+            }
+        }
+        if (xrun)
+        {
+            std::cerr << "  run " << run + 1 << ": xrun, discarded\n";
+            continue;
+        }
+
+        // Capture started (recStart - playStart) seconds after playback
+        double startOffset = 0.0;
+        if (!linked)
+        {
+            snd_pcm_status_t *status;
+            snd_htimestamp_t playTs, recTs;
+            snd_pcm_status_malloc(&status);
+            snd_pcm_status(playHandle, status);
+            snd_pcm_status_get_trigger_htstamp(status, &playTs);
+            snd_pcm_status(recHandle, status);
+            snd_pcm_status_get_trigger_htstamp(status, &recTs);
+            snd_pcm_status_free(status);
+            startOffset = (recTs.tv_sec - playTs.tv_sec) + (recTs.tv_nsec - playTs.tv_nsec) * 1e-9;
+        }
+
+        // Cross-correlate with the probe and refine the peak by parabolic interpolation
+        std::vector<double> corr = fftConvolve(captured, reversedProbe);
+        size_t peak = 0;
+        double energy = 0;
+        for (size_t i = 0; i < corr.size(); i++)
+        {
+            energy += corr[i] * corr[i];
+            if (std::fabs(corr[i]) > std::fabs(corr[peak]))
+                peak = i;
+        }
+        double frac = 0.0;
+        if (peak > 0 && peak + 1 < corr.size())
+        {
+            double a = std::fabs(corr[peak - 1]), b = std::fabs(corr[peak]), c = std::fabs(corr[peak + 1]);
+            double denom = a - 2 * b + c;
+            if (denom != 0)
+                frac = 0.5 * (a - c) / denom;
+        }
+        double peakToRms = std::fabs(corr[peak]) / std::sqrt(energy / corr.size());
+
+        double lag = double(peak) - (probe.size() - 1) - probeStart + frac + startOffset * rate;
+        lags.push_back(lag);
+        std::cout << "  run " << run + 1 << ": " << lag << " frames (" << 1000.0 * lag / rate << " ms)";
+        if (peakToRms < 10)
+            std::cout << " [weak correlation peak, check levels]";
+        std::cout << "\n";
+    }
+
+    snd_pcm_drop(playHandle);
+    snd_pcm_drop(recHandle);
+    if (linked)
+        snd_pcm_unlink(recHandle);
+    snd_pcm_close(playHandle);
+    snd_pcm_close(recHandle);
+
+    if (lags.empty())
+    {
+        std::cerr << "No valid measurements.\n";
+        return;
+    }
+
+    double minLag = *std::min_element(lags.begin(), lags.end());
+    double maxLag = *std::max_element(lags.begin(), lags.end());
+    double meanLag = 0;
+    for (double l : lags)
+        meanLag += l;
+    meanLag /= lags.size();
+    double playDelay = delayCount ? playDelaySum / delayCount : 0;
+    double recDelay = delayCount ? recDelaySum / delayCount : 0;
+
+    std::cout << "Round-trip (converter + transport) latency over " << lags.size() << " runs at " << rate << " Hz:\n"
+              << "  min " << minLag << " frames (" << 1000.0 * minLag / rate << " ms)\n"
+              << "  mean " << meanLag << " frames (" << 1000.0 * meanLag / rate << " ms)\n"
+              << "  max " << maxLag << " frames (" << 1000.0 * maxLag / rate << " ms)\n";
+    std::cout << "Mean snd_pcm_delay: playback " << playDelay << " frames, capture " << recDelay << " frames\n";
+    std::cout << "Estimated end-to-end latency with these buffers: " << meanLag + playDelay + recDelay
+              << " frames (" << 1000.0 * (meanLag + playDelay + recDelay) / rate << " ms)\n";
+}
+
+// --- Impulse response from an exponential sweep recording (Farina deconvolution) ---
+void extractImpulseResponse(const std::string &infile, double seconds, const std::string &outPrefix,
+                            double f0, double f1, int harmonics, double irMs)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<float> raw;
+    int sampleRate = 0, channels = 0;
+    if (!readWavFloat(infile, raw, sampleRate, channels))
+    {
+        std::cerr << "Unable to read " << infile << "\n";
+        return;
+    }
+    if (f1 <= 0)
+        f1 = sampleRate / 2;
+
+    // First channel of the recording
+    std::vector<double> recording(raw.size() / channels);
+    for (size_t i = 0; i < recording.size(); i++)
+        recording[i] = raw[i * channels];
+
+    // Regenerate the sweep exactly as playAndRecord plays it and deconvolve
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    SweepResponse sweep = deconvolveSweep(recording, sampleRate, seconds, f0, f1, threads);
+    const std::vector<double> &response = sweep.response;
+    long origin = sweep.origin, delay = sweep.delay;
+    double K = sweep.K;
+    long irFrames = static_cast<long>(irMs * sampleRate / 1000.0);
+    long preFrames = sampleRate / 1000; // keep 1 ms before each onset
+
+    auto writeSegment = [&](const std::string &name, long begin, long length)
+    {
+        std::vector<float> segment(std::max(0L, length), 0.0f);
+        for (long i = 0; i < length; i++)
+            if (begin + i >= 0 && begin + i < static_cast<long>(response.size()))
+                segment[i] = static_cast<float>(response[begin + i]);
+        writeWavFloat(name, segment, sampleRate, 1);
+        std::cout << "  " << name << " (" << segment.size() << " frames)\n";
+    };
+
+    std::cout << "System delay: " << delay << " frames (" << 1000.0 * delay / sampleRate << " ms)\n";
+    writeSegment(outPrefix + "_linear.wav", origin + delay - preFrames, irFrames + preFrames);
+
+    // Harmonic n appears K*ln(n) seconds before the linear response
+    for (int h = 2; h <= harmonics; h++)
+    {
+        long onset = origin + delay - static_cast<long>(std::lround(K * std::log(double(h)) * sampleRate));
+        long gap = static_cast<long>(K * std::log(double(h) / (h - 1)) * sampleRate);
+        long length = std::min(irFrames, gap) + preFrames;
+        writeSegment(outPrefix + "_h" + std::to_string(h) + ".wav", onset - preFrames, length);
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double audioSeconds = double(recording.size()) / sampleRate;
+    std::cout << "Deconvolved " << audioSeconds << "s of audio in " << elapsed << "s ("
+              << audioSeconds / elapsed << "x real time, " << threads << " threads)\n";
+}
+
+// --- Generator throughput benchmark (no audio device needed) ---
+void benchmarkGenerators(int channels, int sampleRate, int seconds)
+{
+    const int framesPerBuffer = 512;
+    long totalFrames = static_cast<long>(sampleRate) * seconds;
+    std::vector<float> block(framesPerBuffer);
+    std::vector<float> check(sampleRate);
+
+    SimdIsa best = detectSimdIsa();
+    std::vector<SimdIsa> isas = {SimdIsa::Scalar};
+    if (best == SimdIsa::Avx2)
+        isas.push_back(SimdIsa::Sse);
+    if (best != SimdIsa::Scalar)
+        isas.push_back(best);
+
+    double f1 = sampleRate / 2.0;
+    double K = seconds / log(f1 / 20.0);
+
+    std::cout << "Generating " << channels << " channels at " << sampleRate << " Hz for " << seconds << "s\n";
+    for (SimdIsa isa : isas)
+    {
+        activeSimdIsa() = isa;
+        for (int kind = 0; kind < 3; kind++)
+        {
+            const char *name = kind == 0 ? "sine" : kind == 1 ? "linsweep" : "logsweep";
+
+            // Throughput: one generator per channel, rendered block by block
+            std::vector<SineGenerator> sines(channels, SineGenerator(997.0, sampleRate));
+            std::vector<LinearSweepGenerator> lins(channels, LinearSweepGenerator(20, f1, seconds, sampleRate));
+            std::vector<LogSweepGenerator> logs(channels, LogSweepGenerator(20, f1, seconds, sampleRate));
+
+            auto start = std::chrono::steady_clock::now();
+            for (long i = 0; i < totalFrames; i += framesPerBuffer)
+            {
+                int n = static_cast<int>(std::min<long>(framesPerBuffer, totalFrames - i));
+                for (int c = 0; c < channels; c++)
+                {
+                    if (kind == 0)
+                        sines[c].render(block.data(), n);
+                    else if (kind == 1)
+                        lins[c].render(block.data(), n);
+                    else
+                        logs[c].render(block.data(), n);
+                }
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double samplesPerSec = double(totalFrames) * channels / elapsed;
+
+            // Accuracy: first second against a double-precision reference
+            SineGenerator sine(997.0, sampleRate);
+            LinearSweepGenerator lin(20, f1, seconds, sampleRate);
+            LogSweepGenerator logSweep(20, f1, seconds, sampleRate);
+            if (kind == 0)
+                sine.render(check.data(), sampleRate);
+            else if (kind == 1)
+                lin.render(check.data(), sampleRate);
+            else
+                logSweep.render(check.data(), sampleRate);
+            double maxErr = 0.0;
+            for (int n = 0; n < sampleRate; n++)
+            {
+                double t = double(n) / sampleRate;
+                double phase = kind == 0 ? 2 * M_PI * 997.0 * t
+                             : kind == 1 ? 2 * M_PI * (20 * t + 0.5 * (f1 - 20) / seconds * t * t)
+                                         : 2 * M_PI * 20 * K * (exp(t / K) - 1);
+                maxErr = std::max(maxErr, std::fabs(check[n] - std::sin(phase)));
+            }
+
+            std::cout << "  " << simdIsaName(isa) << " " << name << ": "
+                      << samplesPerSec / 1e6 << " Msamples/s, "
+                      << 100.0 * channels * sampleRate / samplesPerSec << "% of a core, max error "
+                      << maxErr << "\n";
+        }
+    }
+    activeSimdIsa() = best;
+
+    // Complete stimuli as play renders them: interleaved over all channels,
+    // periodic ones built once (timed separately) and then looped
+    std::cout << "Stimuli (" << simdIsaName(best) << ", " << channels << " channels):\n";
+    std::vector<float> interleaved(framesPerBuffer * channels);
+    for (StimulusKind kind : {StimulusKind::Sine, StimulusKind::LogSweep, StimulusKind::SteppedSine,
+                              StimulusKind::WhiteNoise, StimulusKind::PinkNoise, StimulusKind::Mls,
+                              StimulusKind::Multitone})
+    {
+        StimulusSpec spec;
+        spec.kind = kind;
+        spec.channels = channels;
+        auto buildStart = std::chrono::steady_clock::now();
+        Stimulus stimulus(spec, sampleRate, seconds, framesPerBuffer);
+        double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < totalFrames; i += framesPerBuffer)
+            stimulus.render(interleaved.data(), std::min<long>(framesPerBuffer, totalFrames - i));
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double samplesPerSec = double(totalFrames) * channels / elapsed;
+
+        std::cout << "  " << stimulusName(kind) << ": " << samplesPerSec / 1e6 << " Msamples/s, "
+                  << 100.0 * channels * sampleRate / samplesPerSec << "% of a core, built in " << build * 1e3
+                  << " ms\n";
+    }
+}
+
 
 int main(int argc, char *argv[])
 {
+    argc = parseOptions(argc, argv);
+    metrics().configure(options.metricsFile, options.traceFile);
+    if (options.realtime.enabled)
+        lockMemory();
     if (argc < 2)
     {
-        std::cout << "Usage:\n"
+        std::cout << "Usage: cpp_audio [--mmap] [--no-pcm-cache] [--period=N] [--buffer=N]\n"
+          << "                 [--metrics=FILE.json] [--trace=FILE.json] [--format=s16|s24|s32|float]\n"
+          << "                 [--wav-format=s16|s24|s32|float] [--dither] [--drift-comp]\n"
+          << "                 [--resample] [--hpf=HZ] [--eq=HZ:DB[:Q]] [--lowshelf=HZ:DB] [--highshelf=HZ:DB]\n"
+          << "                 [--gain=DB] [--compress=THRESH_DB:RATIO[:ATTACK_MS[:RELEASE_MS[:MAKEUP_DB]]]]\n"
+          << "                 [--limit=CEILING_DB[:RELEASE_MS]] [--rt[=PRIORITY]] [--rt-cpu=LIST]\n"
+          << "                 [--analyze[=FILE.jsonl]] [--analyze-fft=N] [--publish=NAME]\n"
+          << "                 [--gate=THRESH_DB[:PREROLL_MS[:HANGOVER_MS]]] <command> ...\n"
           << "  cpp_audio list\n"
-          << "  cpp_audio play <device> [freq=440] [seconds=3]\n"
-          << "  cpp_audio record <device> <seconds> <outfile.wav>\n"
-          << "  cpp_audio playrecord <play_device> <rec_device> <seconds> <outfile.wav>\n";
+          << "  cpp_audio play <device> [freq|stimulus=440] [seconds=3]\n"
+          << "  cpp_audio playfile <device> <file.wav>\n"
+          << "  cpp_audio record <device> <seconds> <outfile.wav|outfile.flac>\n"
+          << "  cpp_audio blackbox <device> <history_seconds> <out_prefix> [channels=1] [trigger_dbfs=off] [post_seconds=0] [run_seconds=0]\n"
+          << "  cpp_audio publish <device> <name> [channels=1] [run_seconds=0]\n"
+          << "  cpp_audio subscribe <name> <meter|raw|outfile.wav|outfile.flac> [seconds=0]\n"
+          << "  cpp_audio multirecord <seconds> <interleaved|split> <outfile.wav|.flac|out_prefix> <device[@channels]>...\n"
+          << "  cpp_audio playrecord <play_device> <rec_device> <seconds> <outfile.wav|outfile.flac> [stimulus=logsweep]\n"
+          << "  cpp_audio passthrough <in_device> <out_device> <seconds>\n"
+          << "  cpp_audio passthrough-threaded <in_device> <out_device> <seconds> [latency_ms=20] [ring_periods=16]\n"
+          << "  cpp_audio autotune <in_device> <out_device> [passthrough|playrecord] [trial_seconds=5] [stress_threads=0] [stress_load=0.8]\n"
+          << "  cpp_audio latency <play_device> <rec_device> [repetitions=10] [chirp|mls]\n"
+          << "  cpp_audio ir <recording.wav> <sweep_seconds> <out_prefix> [f0=20] [f1=rate/2] [harmonics=5] [ir_ms=500]\n"
+          << "  cpp_audio batch <directory> <levels|clipping|spectrum|ir> <report.csv|report.json> [threads=cores]\n"
+          << "                   [sweep_seconds=5] [f0=20] [f1=rate/2] [ir_dir]\n"
+          << "  cpp_audio genbench [channels=8] [rate=192000] [seconds=10]\n"
+          << "Stimulus: sine|logsweep|linsweep|steps|white|pink|mls|multitone[:key=value]...\n"
+          << "          keys f f0 f1 per_octave step order period seed level fade fade_in fade_out ch map\n";
+        return 0;
     }
 
     std::string cmd = argv[1];
@@ -378,10 +2307,25 @@ int main(int argc, char *argv[])
     }
     else if (cmd == "play" && argc >= 3)
     {
+        // A bare number is a sine at that frequency, as before
         std::string dev = argv[2];
-        double freq = argc > 3 ? atof(argv[3]) : 440.0;
-        int secs = argc > 4 ? atoi(argv[4]) : 3;
-        playTone(dev, 48000, freq, secs);
+        StimulusSpec spec;
+        spec.frequency = 440.0;
+        if (argc > 3)
+        {
+            char *end = nullptr;
+            double freq = std::strtod(argv[3], &end);
+            if (*end == '\0')
+                spec.frequency = freq;
+            else if (!parseStimulus(argv[3], spec))
+                return 1;
+        }
+        double secs = argc > 4 ? atof(argv[4]) : 3.0;
+        playStimulus(dev, 48000, spec, secs);
+    }
+    else if (cmd == "playfile" && argc >= 4)
+    {
+        playFile(argv[2], argv[3]);
     }
     else if (cmd == "record" && argc >= 5)
     {
@@ -390,13 +2334,50 @@ int main(int argc, char *argv[])
         std::string outfile = argv[4];
         recordAudio(dev, 48000, secs, outfile);
     }
+    else if (cmd == "blackbox" && argc >= 5)
+    {
+        BlackBoxOptions box;
+        box.historySeconds = atof(argv[3]);
+        box.prefix = argv[4];
+        int channels = argc > 5 ? atoi(argv[5]) : 1;
+        if (argc > 6 && std::string(argv[6]) != "off")
+        {
+            box.levelTrigger = true;
+            box.levelDb = atof(argv[6]);
+        }
+        box.postSeconds = argc > 7 ? atof(argv[7]) : 0.0;
+        double runSeconds = argc > 8 ? atof(argv[8]) : 0.0;
+        blackboxCapture(argv[2], 48000, channels, box, runSeconds);
+    }
+    else if (cmd == "publish" && argc >= 4)
+    {
+        int channels = argc > 4 ? atoi(argv[4]) : 1;
+        double runSeconds = argc > 5 ? atof(argv[5]) : 0.0;
+        publishCapture(argv[2], argv[3], 48000, channels, runSeconds);
+    }
+    else if (cmd == "subscribe" && argc >= 4)
+    {
+        subscribe(argv[2], argv[3], argc > 4 ? atof(argv[4]) : 0.0);
+    }
+    else if (cmd == "multirecord" && argc >= 6)
+    {
+        int secs = atoi(argv[2]);
+        bool split = std::string(argv[3]) == "split";
+        std::string out = argv[4];
+        std::vector<std::string> devices(argv + 5, argv + argc);
+        multiRecord(devices, 48000, secs, out, split);
+    }
     else if (cmd == "playrecord" && argc >= 6)
     {
         std::string playDev = argv[2];
         std::string recDev = argv[3];
         int secs = atoi(argv[4]);
         std::string outfile = argv[5];
-        playAndRecord(playDev, recDev, 48000, secs, outfile);
+        StimulusSpec spec;
+        spec.kind = StimulusKind::LogSweep;
+        if (argc > 6 && !parseStimulus(argv[6], spec))
+            return 1;
+        playAndRecord(playDev, recDev, 48000, secs, outfile, spec);
     }
     else if (cmd == "passthrough" && argc >= 5)
     {
@@ -405,10 +2386,73 @@ int main(int argc, char *argv[])
         int secs = atoi(argv[4]);
         micPassthrough(inDev, outDev, 48000, secs);
     }
+    else if (cmd == "passthrough-threaded" && argc >= 5)
+    {
+        std::string inDev = argv[2];
+        std::string outDev = argv[3];
+        int secs = atoi(argv[4]);
+        double latencyMs = argc > 5 ? atof(argv[5]) : 20.0;
+        int ringPeriods = argc > 6 ? atoi(argv[6]) : 16;
+        micPassthroughThreaded(inDev, outDev, 48000, secs, latencyMs, ringPeriods);
+    }
+    else if (cmd == "autotune" && argc >= 4)
+    {
+        std::string inDev = argv[2];
+        std::string outDev = argv[3];
+        bool playrecord = argc > 4 && std::string(argv[4]) == "playrecord";
+        double trial = argc > 5 ? atof(argv[5]) : 5.0;
+        int stressThreads = argc > 6 ? atoi(argv[6]) : 0;
+        double stressLoad = argc > 7 ? atof(argv[7]) : 0.8;
+        autotune(inDev, outDev, playrecord, 48000, trial, stressThreads, stressLoad);
+    }
+    else if (cmd == "latency" && argc >= 4)
+    {
+        std::string playDev = argv[2];
+        std::string recDev = argv[3];
+        int reps = argc > 4 ? atoi(argv[4]) : 10;
+        std::string probe = argc > 5 ? argv[5] : "chirp";
+        measureLatency(playDev, recDev, 48000, reps, probe);
+    }
+    else if (cmd == "ir" && argc >= 5)
+    {
+        std::string infile = argv[2];
+        double secs = atof(argv[3]);
+        std::string prefix = argv[4];
+        double f0 = argc > 5 ? atof(argv[5]) : 20.0;
+        double f1 = argc > 6 ? atof(argv[6]) : 0.0;
+        int harmonics = argc > 7 ? atoi(argv[7]) : 5;
+        double irMs = argc > 8 ? atof(argv[8]) : 500.0;
+        extractImpulseResponse(infile, secs, prefix, f0, f1, harmonics, irMs);
+    }
+    else if (cmd == "batch" && argc >= 5)
+    {
+        BatchOptions batch;
+        if (!parseBatchAnalysis(argv[3], batch.analysis))
+        {
+            std::cerr << "Unknown analysis " << argv[3] << " (levels, clipping, spectrum or ir).\n";
+            return 1;
+        }
+        batch.threads = argc > 5 ? atoi(argv[5]) : 0;
+        batch.fftSize = options.analyzer.fftSize;
+        batch.sweepSeconds = argc > 6 ? atof(argv[6]) : 5.0;
+        batch.f0 = argc > 7 ? atof(argv[7]) : 20.0;
+        batch.f1 = argc > 8 ? atof(argv[8]) : 0.0;
+        batch.irDir = argc > 9 ? argv[9] : "";
+        if (!runBatch(argv[2], argv[4], batch))
+            return 1;
+    }
+    else if (cmd == "genbench")
+    {
+        int channels = argc > 2 ? atoi(argv[2]) : 8;
+        int rate = argc > 3 ? atoi(argv[3]) : 192000;
+        int secs = argc > 4 ? atoi(argv[4]) : 10;
+        benchmarkGenerators(channels, rate, secs);
+    }
     else
     {
         std::cerr << "Invalid arguments.\n";
     }
 
+    metrics().finish();
     return 0;
 }
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "realtime.h"
+
+// Real-time instrumentation for the capture and playback loops.
+//
+// Every stream gets a StreamMetrics with xrun/suspend counters and log2
+// histograms of per-period processing time, wakeup interval, snd_pcm_delay
+// and avail. The hot path only does relaxed atomic adds and, when a trace
+// file was requested, writes one event into a preallocated ring; nothing
+// allocates, locks or does I/O. Registration and dumping happen outside the
+// loops: streams are registered when a mode sets up, and the registry writes
+// a JSON summary (and optionally a Chrome trace, chrome://tracing or
+// Perfetto) when the program exits.
+
+// `text` as a JSON string literal, quotes included (PCM names are user input)
+inline void writeJsonString(std::ostream &os, const std::string &text)
+{
+    os << '"';
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+            os << escaped;
+        }
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+inline uint64_t metricsNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+// Bucket i counts values in [2^(i-1), 2^i); bucket 0 counts zero
+class Log2Histogram
+{
+public:
+    static constexpr int kBuckets = 48;
+
+    void record(uint64_t value)
+    {
+        int bucket = value ? 64 - __builtin_clzll(value) : 0;
+        buckets_[bucket < kBuckets ? bucket : kBuckets - 1].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        uint64_t seen = max_.load(std::memory_order_relaxed);
+        while (value > seen && !max_.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    double mean() const
+    {
+        uint64_t n = count();
+        return n ? double(sum_.load(std::memory_order_relaxed)) / n : 0.0;
+    }
+
+    // Upper bound of the bucket holding the q-quantile
+    uint64_t quantile(double q) const
+    {
+        uint64_t total = count();
+        if (total == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1, seen = 0;
+        for (int i = 0; i < kBuckets; i++)
+        {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(upperBound(i), max());
+        }
+        return max();
+    }
+
+    void writeJson(std::ostream &os) const
+    {
+        os << "{\"count\": " << count() << ", \"mean\": " << mean()
+           << ", \"p50\": " << quantile(0.5) << ", \"p99\": " << quantile(0.99) << ", \"p999\": " << quantile(0.999)
+           << ", \"max\": " << max() << ", \"buckets\": [";
+        bool first = true;
+        for (int i = 0; i < kBuckets; i++)
+        {
+            uint64_t c = buckets_[i].load(std::memory_order_relaxed);
+            if (c == 0)
+                continue;
+            os << (first ? "" : ", ") << "{\"le\": " << upperBound(i) << ", \"count\": " << c << "}";
+            first = false;
+        }
+        os << "]}";
+    }
+
+private:
+    static uint64_t upperBound(int bucket) { return bucket ? (uint64_t(1) << bucket) - 1 : 0; }
+
+    std::atomic<uint64_t> buckets_[kBuckets] = {};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+class StreamMetrics
+{
+public:
+    enum class Event : uint8_t
+    {
+        Period,
+        Xrun,
+        Suspend
+    };
+
+    StreamMetrics(std::string name, const void *owner, size_t traceCapacity, bool sampleDelay)
+        : name_(std::move(name)), owner_(owner), trace_(traceCapacity), sampleDelay_(sampleDelay)
+    {
+    }
+
+    const std::string &name() const { return name_; }
+    const void *owner() const { return owner_; }
+    uint64_t xruns() const { return xruns_.load(std::memory_order_relaxed); }
+    uint64_t suspends() const { return suspends_.load(std::memory_order_relaxed); }
+
+    // Whether the loops should query snd_pcm_delay/avail for this stream
+    bool sampleDelay() const { return sampleDelay_; }
+
+    // Period size and rate give the deadline the processing time is compared to
+    void setPeriod(uint64_t frames, unsigned int rate)
+    {
+        periodFrames_ = frames;
+        rate_ = rate;
+    }
+
+    void xrun(uint64_t now)
+    {
+        xruns_.fetch_add(1, std::memory_order_relaxed);
+        trace(Event::Xrun, now, 0, -1);
+    }
+
+    void suspend(uint64_t now)
+    {
+        suspends_.fetch_add(1, std::memory_order_relaxed);
+        trace(Event::Suspend, now, 0, -1);
+    }
+
+    // One serviced period: [startNs, endNs) spent in the loop body. delay and
+    // avail are in frames, negative when not sampled.
+    void period(uint64_t startNs, uint64_t endNs, long delay, long avail)
+    {
+        periods_.fetch_add(1, std::memory_order_relaxed);
+        processNs_.record(endNs - startNs);
+        uint64_t last = lastStartNs_.exchange(startNs, std::memory_order_relaxed);
+        if (last)
+            intervalNs_.record(startNs - last);
+        if (delay >= 0)
+            delay_.record(delay);
+        if (avail >= 0)
+            avail_.record(avail);
+        trace(Event::Period, startNs, endNs - startNs, delay);
+    }
+
+    void writeJson(std::ostream &os) const
+    {
+        uint64_t deadlineNs = rate_ ? periodFrames_ * 1000000000ull / rate_ : 0;
+        os << "{\"name\": ";
+        writeJsonString(os, name_);
+        os << ", \"period_frames\": " << periodFrames_ << ", \"rate\": " << rate_
+           << ", \"deadline_ns\": " << deadlineNs << ", \"periods\": " << periods_.load(std::memory_order_relaxed)
+           << ", \"xruns\": " << xruns() << ", \"suspends\": " << suspends() << ", \"max_load\": "
+           << (deadlineNs ? double(processNs_.max()) / deadlineNs : 0.0) << ",\n     \"process_ns\": ";
+        processNs_.writeJson(os);
+        os << ",\n     \"interval_ns\": ";
+        intervalNs_.writeJson(os);
+        os << ",\n     \"delay_frames\": ";
+        delay_.writeJson(os);
+        os << ",\n     \"avail_frames\": ";
+        avail_.writeJson(os);
+        os << "}";
+    }
+
+    // Chrome trace events for the part of the ring that was not overwritten
+    void writeTrace(std::ostream &os, int tid, uint64_t originNs, bool first) const
+    {
+        uint64_t end = traceNext_.load(std::memory_order_acquire);
+        uint64_t begin = end > trace_.size() ? end - trace_.size() : 0;
+        os << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+           << ", \"args\": {\"name\": ";
+        writeJsonString(os, name_);
+        os << "}}";
+        for (uint64_t i = begin; i < end; i++)
+        {
+            const TraceEvent &e = trace_[i % trace_.size()];
+            double ts = (e.startNs - originNs) / 1000.0;
+            if (e.kind == Event::Period)
+                os << ",\n{\"name\": \"period\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid << ", \"ts\": " << ts
+                   << ", \"dur\": " << e.durNs / 1000.0 << ", \"args\": {\"delay\": " << e.delay << "}}";
+            else
+                os << ",\n{\"name\": \"" << (e.kind == Event::Xrun ? "xrun" : "suspend")
+                   << "\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": " << tid << ", \"ts\": " << ts << "}";
+        }
+    }
+
+    uint64_t firstTraceNs() const
+    {
+        uint64_t end = traceNext_.load(std::memory_order_acquire);
+        if (end == 0)
+            return UINT64_MAX;
+        uint64_t begin = end > trace_.size() ? end - trace_.size() : 0;
+        return trace_[begin % trace_.size()].startNs;
+    }
+
+private:
+    struct TraceEvent
+    {
+        uint64_t startNs;
+        uint32_t durNs;
+        int32_t delay;
+        Event kind;
+    };
+
+    // Single writer per stream; the oldest events are overwritten
+    void trace(Event kind, uint64_t startNs, uint64_t durNs, long delay)
+    {
+        if (trace_.empty())
+            return;
+        uint64_t i = traceNext_.load(std::memory_order_relaxed);
+        trace_[i % trace_.size()] = {startNs, static_cast<uint32_t>(durNs), static_cast<int32_t>(delay), kind};
+        traceNext_.store(i + 1, std::memory_order_release);
+    }
+
+    std::string name_;
+    const void *owner_;
+    uint64_t periodFrames_ = 0;
+    unsigned int rate_ = 0;
+
+    std::atomic<uint64_t> xruns_{0};
+    std::atomic<uint64_t> suspends_{0};
+    std::atomic<uint64_t> periods_{0};
+    std::atomic<uint64_t> lastStartNs_{0};
+    Log2Histogram processNs_, intervalNs_, delay_, avail_;
+
+    std::vector<TraceEvent> trace_;
+    std::atomic<uint64_t> traceNext_{0};
+    bool sampleDelay_;
+};
+
+// Owns every StreamMetrics. Each owner (a PCM handle) gets its own entry,
+// and so its own single-writer trace ring; a second owner under a name
+// already taken is registered as "NAME #2", "NAME #3", ...
+class MetricsRegistry
+{
+public:
+    // Empty paths disable the JSON dump / trace. Call before any stream is registered.
+    void configure(const std::string &jsonPath, const std::string &tracePath, size_t traceEvents = 1 << 16)
+    {
+        jsonPath_ = jsonPath;
+        tracePath_ = tracePath;
+        traceEvents_ = traceEvents;
+    }
+
+    StreamMetrics &stream(const std::string &name, const void *owner)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int sameName = 0;
+        for (auto &s : streams_)
+        {
+            if (s->name() != name && s->name().rfind(name + " #", 0) != 0)
+                continue;
+            if (s->owner() == owner)
+                return *s;
+            sameName++;
+        }
+        std::string unique = sameName ? name + " #" + std::to_string(sameName + 1) : name;
+        bool sampleDelay = !jsonPath_.empty() || !tracePath_.empty();
+        streams_.push_back(
+            std::make_unique<StreamMetrics>(unique, owner, tracePath_.empty() ? 0 : traceEvents_, sampleDelay));
+        return *streams_.back();
+    }
+
+    // Forget every stream; only valid while no loop holds a StreamMetrics
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streams_.clear();
+    }
+
+    // Print xrun totals and write the requested files; call once the loops have stopped
+    void finish()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto &s : streams_)
+            if (s->xruns() || s->suspends())
+                std::cerr << s->name() << ": " << s->xruns() << " xruns, " << s->suspends() << " suspends\n";
+
+        if (!jsonPath_.empty())
+        {
+            std::ofstream out(jsonPath_);
+            out << "{\"streams\": [\n";
+            for (size_t i = 0; i < streams_.size(); i++)
+            {
+                out << (i ? ",\n" : "") << "    ";
+                streams_[i]->writeJson(out);
+            }
+            out << "\n]}\n";
+            if (!out)
+                std::cerr << "Unable to write metrics to " << jsonPath_ << "\n";
+        }
+
+        if (!tracePath_.empty())
+        {
+            uint64_t origin = UINT64_MAX;
+            for (auto &s : streams_)
+                origin = std::min(origin, s->firstTraceNs());
+            std::ofstream out(tracePath_);
+            out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+            for (size_t i = 0; i < streams_.size(); i++)
+                streams_[i]->writeTrace(out, i + 1, origin == UINT64_MAX ? 0 : origin, i == 0);
+            out << "\n]}\n";
+            if (!out)
+                std::cerr << "Unable to write trace to " << tracePath_ << "\n";
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::deque<std::unique_ptr<StreamMetrics>> streams_;
+    std::string jsonPath_, tracePath_;
+    size_t traceEvents_ = 1 << 16;
+};
+
+inline MetricsRegistry &metrics()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// Register the stream behind `handle`, named "<capture|playback>:<pcm name>"
+inline StreamMetrics &pcmMetrics(snd_pcm_t *handle, snd_pcm_uframes_t period)
+{
+    bool capture = snd_pcm_stream(handle) == SND_PCM_STREAM_CAPTURE;
+    StreamMetrics &m =
+        metrics().stream(std::string(capture ? "capture:" : "playback:") + snd_pcm_name(handle), handle);
+
+    unsigned int rate = 0;
+    int dir = 0;
+    snd_pcm_hw_params_t *params;
+    snd_pcm_hw_params_malloc(&params);
+    if (snd_pcm_hw_params_current(handle, params) == 0)
+        snd_pcm_hw_params_get_rate(params, &rate, &dir);
+    snd_pcm_hw_params_free(params);
+    m.setPeriod(period, rate);
+    return m;
+}
+
+// snd_pcm_recover() that counts what it recovered from
+inline int recoverPcm(snd_pcm_t *handle, int err, StreamMetrics &m)
+{
+    AllowAllocScope recovering; // the glitch already happened, alsa-lib may log
+    if (err == -EPIPE)
+        m.xrun(metricsNow());
+    else if (err == -ESTRPIPE)
+        m.suspend(metricsNow());
+    return snd_pcm_recover(handle, err, 1);
+}
+
+// Close one period whose processing ran from `startNs` to `endNs` (now when
+// 0), sampling delay/avail if wanted. Only the work on the samples belongs in
+// that range: time blocked in readi/writei or waiting for the device would
+// make every blocking loop read as fully loaded.
+inline void recordPeriod(snd_pcm_t *handle, StreamMetrics &m, uint64_t startNs, uint64_t endNs = 0)
+{
+    if (!endNs)
+        endNs = metricsNow();
+    long delay = -1, avail = -1;
+    if (m.sampleDelay())
+    {
+        snd_pcm_sframes_t a, d;
+        if (snd_pcm_avail_delay(handle, &a, &d) == 0)
+        {
+            avail = a;
+            delay = d;
+        }
+    }
+    m.period(startNs, endNs, delay, avail);
+}
+
+// Adds up the processing time of one mmapTransfer(), whose callback may run
+// several times with waits for the device in between. start()/stop() bracket
+// each callback; the period is then recorded as [begin(), end()).
+class WorkTimer
+{
+public:
+    void start()
+    {
+        since_ = metricsNow();
+        if (!begin_)
+            begin_ = since_;
+    }
+    void stop() { busy_ += metricsNow() - since_; }
+
+    uint64_t begin() const { return begin_; }
+    uint64_t end() const { return begin_ + busy_; }
+
+private:
+    uint64_t begin_ = 0;
+    uint64_t busy_ = 0;
+    uint64_t since_ = 0;
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "metrics.h"
+
+// Transfer `frames` frames in place through the mmap area. `fn(samples, done, n)`
+// is called for each contiguous chunk with a pointer straight into the DMA
+// buffer (in the device's sample format): playback callbacks render into it,
+// capture callbacks consume it.
+// Returns the number of frames transferred or a negative error code.
+template <typename Fn>
+snd_pcm_sframes_t mmapTransfer(snd_pcm_t *handle, snd_pcm_uframes_t frames, Fn &&fn)
+{
+    bool capture = snd_pcm_stream(handle) == SND_PCM_STREAM_CAPTURE;
+    snd_pcm_uframes_t done = 0;
+
+    while (done < frames)
+    {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+        if (avail < 0)
+            return avail;
+
+        if (avail == 0)
+        {
+            // Capture has to be started explicitly, playback once the buffer is full.
+            if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+            {
+                int err = snd_pcm_start(handle);
+                if (err < 0)
+                    return err;
+            }
+            int err = snd_pcm_wait(handle, 1000);
+            if (err < 0)
+                return err;
+            continue;
+        }
+        if (capture && snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+            snd_pcm_start(handle);
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t n = frames - done;
+        int err = snd_pcm_mmap_begin(handle, &areas, &offset, &n);
+        if (err < 0)
+            return err;
+
+        void *samples = static_cast<char *>(areas[0].addr) + (areas[0].first + offset * areas[0].step) / 8;
+        fn(samples, done, n);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(handle, offset, n);
+        if (committed < 0)
+            return committed;
+        if (static_cast<snd_pcm_uframes_t>(committed) != n)
+            return -EPIPE;
+        done += n;
+    }
+    return done;
+}
+
+// Non-blocking event loop servicing any number of PCM streams from one thread.
+//
+// Each stream is put in non-blocking mode and its poll descriptors are merged
+// into a single poll() set. Whenever a stream becomes ready, whole periods are
+// moved with its callback: playback callbacks fill `frames` frames, capture
+// callbacks consume them, interleaved in the stream's sample format. A callback returns false when its stream is done;
+// run() returns once every stream has finished or stop() was called. Streams
+// are usually paired (a playback callback waits for its capture), so an
+// unrecoverable error on any of them stops the whole run; failed() reports it.
+// Every stream reports xruns and per-period timing to its StreamMetrics.
+// The loop runs under a NoAllocScope: callbacks must not allocate.
+class PcmEngine
+{
+public:
+    using Callback = std::function<bool(void *samples, snd_pcm_uframes_t frames)>;
+
+    // Returns a stream id for xruns()
+    int addPlayback(snd_pcm_t *handle, int channels, snd_pcm_uframes_t period, bool mmap, Callback callback)
+    {
+        return addStream(handle, false, channels, period, mmap, std::move(callback));
+    }
+
+    int addCapture(snd_pcm_t *handle, int channels, snd_pcm_uframes_t period, bool mmap, Callback callback)
+    {
+        return addStream(handle, true, channels, period, mmap, std::move(callback));
+    }
+
+    void stop() { stopRequested_ = true; }
+
+    // True when run() ended because a stream or poll() failed
+    bool failed() const { return failed_; }
+
+    long xruns(int id) const { return streams_[id].xruns; }
+
+    void run()
+    {
+        std::vector<pollfd> fds;
+        for (Stream &s : streams_)
+        {
+            snd_pcm_nonblock(s.handle, 1);
+            int count = snd_pcm_poll_descriptors_count(s.handle);
+            s.fdOffset = fds.size();
+            s.fdCount = count > 0 ? count : 0;
+            fds.resize(fds.size() + s.fdCount);
+            if (s.fdCount > 0)
+                snd_pcm_poll_descriptors(s.handle, &fds[s.fdOffset], s.fdCount);
+        }
+
+        {
+            NoAllocScope audioLoop;
+
+            // Prefill playback buffers and get capture running before waiting on anything
+            for (Stream &s : streams_)
+            {
+                if (s.capture)
+                    snd_pcm_start(s.handle);
+                else
+                    service(s);
+            }
+
+            while (!stopRequested_ && active() > 0)
+            {
+                for (Stream &s : streams_)
+                    if (s.finished)
+                        unwatch(s, fds);
+                int rc = poll(fds.data(), fds.size(), 1000);
+                if (rc < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    std::cerr << "poll failed: " << strerror(errno) << "\n";
+                    failed_ = true;
+                    break;
+                }
+                if (rc == 0)
+                    continue;
+
+                for (Stream &s : streams_)
+                {
+                    if (stopRequested_)
+                        break;
+                    if (s.finished || s.fdCount == 0)
+                        continue;
+                    unsigned short revents = 0;
+                    snd_pcm_poll_descriptors_revents(s.handle, &fds[s.fdOffset], s.fdCount, &revents);
+                    if (revents & POLLERR)
+                        recover(s, snd_pcm_state(s.handle) == SND_PCM_STATE_SUSPENDED ? -ESTRPIPE : -EPIPE);
+                    if (revents & (s.capture ? POLLIN : POLLOUT))
+                        service(s);
+                }
+            }
+        }
+
+        // Let finished playback streams play out what they have buffered
+        for (Stream &s : streams_)
+        {
+            snd_pcm_nonblock(s.handle, 0);
+            if (s.capture)
+                snd_pcm_drop(s.handle);
+            else
+                snd_pcm_drain(s.handle);
+        }
+    }
+
+private:
+    struct Stream
+    {
+        snd_pcm_t *handle;
+        bool capture;
+        bool mmap;
+        int channels;
+        snd_pcm_uframes_t period;
+        Callback callback;
+        StreamMetrics *metrics;
+        std::vector<char> scratch;
+        size_t fdOffset = 0;
+        int fdCount = 0;
+        bool finished = false;
+        long xruns = 0;
+    };
+
+    int addStream(snd_pcm_t *handle, bool capture, int channels, snd_pcm_uframes_t period, bool mmap,
+                  Callback callback)
+    {
+        Stream s{handle, capture, mmap, channels, period, std::move(callback), &pcmMetrics(handle, period), {}};
+        if (!mmap)
+            s.scratch.resize(snd_pcm_frames_to_bytes(handle, period));
+        streams_.push_back(std::move(s));
+        return streams_.size() - 1;
+    }
+
+    // A finished device stays ready (capture keeps filling, drained playback
+    // stays writable), so poll() must stop watching it or the loop spins
+    static void unwatch(const Stream &s, std::vector<pollfd> &fds)
+    {
+        for (int i = 0; i < s.fdCount; i++)
+            fds[s.fdOffset + i].fd = -1;
+    }
+
+    int active() const
+    {
+        int n = 0;
+        for (const Stream &s : streams_)
+            n += !s.finished;
+        return n;
+    }
+
+    void recover(Stream &s, int err)
+    {
+        AllowAllocScope recovering;
+        s.xruns++;
+        if (recoverPcm(s.handle, err, *s.metrics) < 0)
+        {
+            std::cerr << "Unrecoverable error on " << snd_pcm_name(s.handle) << ": " << snd_strerror(err) << "\n";
+            s.finished = true;
+            failed_ = true;
+            stop(); // the other streams' callbacks may be waiting on this one
+            return;
+        }
+        if (s.capture)
+            snd_pcm_start(s.handle);
+    }
+
+    // Move as many whole periods as the device can take right now
+    void service(Stream &s)
+    {
+        while (!s.finished)
+        {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(s.handle);
+            if (avail < 0)
+            {
+                recover(s, avail);
+                return;
+            }
+            if (static_cast<snd_pcm_uframes_t>(avail) < s.period)
+            {
+                // mmap playback does not start on its own once the buffer is full
+                if (!s.capture && s.mmap && snd_pcm_state(s.handle) == SND_PCM_STATE_PREPARED)
+                    snd_pcm_start(s.handle);
+                return;
+            }
+
+            bool more = true;
+            snd_pcm_sframes_t rc;
+            uint64_t start = metricsNow();
+            if (s.mmap)
+            {
+                rc = mmapTransfer(s.handle, s.period, [&](void *samples, snd_pcm_uframes_t, snd_pcm_uframes_t n)
+                                  { more = s.callback(samples, n) && more; });
+            }
+            else if (s.capture)
+            {
+                rc = snd_pcm_readi(s.handle, s.scratch.data(), s.period);
+                if (rc > 0)
+                    more = s.callback(s.scratch.data(), rc);
+            }
+            else
+            {
+                more = s.callback(s.scratch.data(), s.period);
+                rc = snd_pcm_writei(s.handle, s.scratch.data(), s.period);
+            }
+
+            if (rc == -EAGAIN)
+                return;
+            if (rc < 0)
+            {
+                recover(s, rc);
+                return;
+            }
+            recordPeriod(s.handle, *s.metrics, start);
+            if (!more)
+                s.finished = true;
+        }
+    }
+
+    std::vector<Stream> streams_;
+    std::atomic<bool> stopRequested_{false};
+    bool failed_ = false;
+};
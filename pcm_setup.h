@@ -0,0 +1,317 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sample_format.h"
+
+// Shared PCM open + hw_params negotiation.
+//
+// openPcm() checks every ALSA call and reports what the device actually
+// agreed to, so callers label and generate audio at the negotiated rate
+// instead of the requested one. Parameters that worked are remembered in a
+// per-device cache file; the next run applies them exactly and skips the
+// _near() refinement and the mmap/RW fallback probing.
+
+// What a mode asks for. period/buffer of 0 leave the driver defaults.
+struct PcmRequest
+{
+    snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK;
+    unsigned int rate = 48000;
+    unsigned int channels = 2;
+    snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+    bool mmap = false;
+    snd_pcm_uframes_t period = 0;
+    snd_pcm_uframes_t buffer = 0;
+    bool formatFallback = false; // accept another pipeline format if `format` is refused
+};
+
+// What the device negotiated
+struct PcmConfig
+{
+    unsigned int rate = 0;
+    unsigned int channels = 0;
+    snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+    bool mmap = false;
+    snd_pcm_uframes_t period = 0;
+    snd_pcm_uframes_t buffer = 0;
+    bool fromCache = false;
+};
+
+inline bool &pcmCacheEnabled()
+{
+    static bool enabled = true;
+    return enabled;
+}
+
+// $XDG_CACHE_HOME/cpp_audio/pcm.cache, falling back to ~/.cache
+inline std::string pcmCachePath()
+{
+    std::string dir;
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"))
+        dir = xdg;
+    else if (const char *home = std::getenv("HOME"))
+        dir = std::string(home) + "/.cache";
+    else
+        return "";
+    return dir + "/cpp_audio/pcm.cache";
+}
+
+inline std::string pcmCacheKey(const std::string &device, const PcmRequest &req)
+{
+    std::ostringstream key;
+    key << device << '|' << (req.stream == SND_PCM_STREAM_CAPTURE ? "capture" : "playback") << '|' << req.rate
+        << '|' << req.channels << '|' << int(req.format) << '|' << req.mmap << '|' << req.period << '|'
+        << req.buffer << (req.formatFallback ? "|any" : "");
+    return key.str();
+}
+
+// One line per entry: <key> <rate> <channels> <format> <mmap> <period> <buffer>
+inline std::map<std::string, PcmConfig> loadPcmCache()
+{
+    std::map<std::string, PcmConfig> cache;
+    std::ifstream in(pcmCachePath());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string key;
+        PcmConfig c;
+        int format;
+        if (fields >> key >> c.rate >> c.channels >> format >> c.mmap >> c.period >> c.buffer)
+        {
+            c.format = static_cast<snd_pcm_format_t>(format);
+            cache[key] = c;
+        }
+    }
+    return cache;
+}
+
+inline void storePcmCache(const std::string &key, const PcmConfig &config)
+{
+    std::string path = pcmCachePath();
+    if (path.empty())
+        return;
+
+    auto cache = loadPcmCache();
+    cache[key] = config;
+
+    std::string dir = path.substr(0, path.rfind('/'));
+    mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+
+    // Write a temp file and rename so concurrent runs never see a torn cache
+    std::string tmp = path + "." + std::to_string(getpid());
+    {
+        std::ofstream out(tmp);
+        for (const auto &[k, c] : cache)
+            out << k << ' ' << c.rate << ' ' << c.channels << ' ' << int(c.format) << ' ' << c.mmap << ' '
+                << c.period << ' ' << c.buffer << '\n';
+    }
+    std::rename(tmp.c_str(), path.c_str());
+}
+
+// Device formats the float pipeline converts to and from
+inline snd_pcm_format_t alsaFormat(SampleFormat format)
+{
+    switch (format)
+    {
+    case SampleFormat::S24_3:
+        return SND_PCM_FORMAT_S24_3LE;
+    case SampleFormat::S32:
+        return SND_PCM_FORMAT_S32_LE;
+    case SampleFormat::Float:
+        return SND_PCM_FORMAT_FLOAT_LE;
+    default:
+        return SND_PCM_FORMAT_S16_LE;
+    }
+}
+
+inline SampleFormat sampleFormatOf(snd_pcm_format_t format)
+{
+    switch (format)
+    {
+    case SND_PCM_FORMAT_S24_3LE:
+        return SampleFormat::S24_3;
+    case SND_PCM_FORMAT_S32_LE:
+        return SampleFormat::S32;
+    case SND_PCM_FORMAT_FLOAT_LE:
+        return SampleFormat::Float;
+    default:
+        return SampleFormat::S16;
+    }
+}
+
+namespace pcm_detail
+{
+
+inline bool check(int rc, const std::string &device, const char *what)
+{
+    if (rc < 0)
+    {
+        std::cerr << device << ": " << what << " failed: " << snd_strerror(rc) << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Apply a cached configuration exactly; any refusal means the cache is stale
+inline bool applyExact(snd_pcm_t *handle, snd_pcm_hw_params_t *params, const PcmConfig &c)
+{
+    return snd_pcm_hw_params_any(handle, params) >= 0 &&
+           snd_pcm_hw_params_set_access(handle, params,
+                                        c.mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED) >= 0 &&
+           snd_pcm_hw_params_set_format(handle, params, c.format) >= 0 &&
+           snd_pcm_hw_params_set_channels(handle, params, c.channels) >= 0 &&
+           snd_pcm_hw_params_set_rate(handle, params, c.rate, 0) >= 0 &&
+           snd_pcm_hw_params_set_period_size(handle, params, c.period, 0) >= 0 &&
+           snd_pcm_hw_params_set_buffer_size(handle, params, c.buffer) >= 0 &&
+           snd_pcm_hw_params(handle, params) >= 0;
+}
+
+// Full negotiation from the request
+inline bool negotiate(snd_pcm_t *handle, snd_pcm_hw_params_t *params, const std::string &device,
+                      const PcmRequest &req)
+{
+    if (!check(snd_pcm_hw_params_any(handle, params), device, "hw_params_any"))
+        return false;
+
+    bool mmapOk = false;
+    if (req.mmap)
+    {
+        mmapOk = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+        if (!mmapOk)
+            std::cerr << "mmap access not supported by " << device << ", using read/write.\n";
+    }
+    if (!mmapOk && !check(snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED), device,
+                          "set_access"))
+        return false;
+
+    snd_pcm_format_t format = req.format;
+    if (req.formatFallback && snd_pcm_hw_params_test_format(handle, params, format) < 0)
+    {
+        // Highest resolution the pipeline can convert to
+        for (snd_pcm_format_t f : {SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_3LE,
+                                   SND_PCM_FORMAT_S16_LE})
+        {
+            if (snd_pcm_hw_params_test_format(handle, params, f) == 0)
+            {
+                std::cerr << device << ": " << snd_pcm_format_name(req.format) << " not supported, using "
+                          << snd_pcm_format_name(f) << ".\n";
+                format = f;
+                break;
+            }
+        }
+    }
+    if (!check(snd_pcm_hw_params_set_format(handle, params, format), device, "set_format") ||
+        !check(snd_pcm_hw_params_set_channels(handle, params, req.channels), device, "set_channels"))
+        return false;
+
+    unsigned int rate = req.rate;
+    if (!check(snd_pcm_hw_params_set_rate_near(handle, params, &rate, nullptr), device, "set_rate_near"))
+        return false;
+
+    if (req.period > 0)
+    {
+        snd_pcm_uframes_t period = req.period;
+        if (!check(snd_pcm_hw_params_set_period_size_near(handle, params, &period, nullptr), device,
+                   "set_period_size_near"))
+            return false;
+    }
+    if (req.buffer > 0)
+    {
+        snd_pcm_uframes_t buffer = req.buffer;
+        if (!check(snd_pcm_hw_params_set_buffer_size_near(handle, params, &buffer), device,
+                   "set_buffer_size_near"))
+            return false;
+    }
+
+    return check(snd_pcm_hw_params(handle, params), device, "hw_params");
+}
+
+} // namespace pcm_detail
+
+// Negotiate and prepare an already opened PCM; `device` names it in messages
+// and the cache. Returns false (after printing why) on failure, the caller
+// closes the handle.
+inline bool configurePcm(snd_pcm_t *handle, const std::string &device, const PcmRequest &req, PcmConfig &config)
+{
+    snd_pcm_hw_params_t *params;
+    snd_pcm_hw_params_malloc(&params);
+
+    std::string key = pcmCacheKey(device, req);
+    bool cacheable = pcmCacheEnabled() && key.find_first_of(" \t\n") == std::string::npos;
+    config = PcmConfig{};
+    if (cacheable)
+    {
+        auto cache = loadPcmCache();
+        auto hit = cache.find(key);
+        if (hit != cache.end() && pcm_detail::applyExact(handle, params, hit->second))
+        {
+            config = hit->second;
+            config.fromCache = true;
+        }
+    }
+
+    if (!config.fromCache)
+    {
+        if (!pcm_detail::negotiate(handle, params, device, req))
+        {
+            snd_pcm_hw_params_free(params);
+            return false;
+        }
+
+        snd_pcm_access_t access;
+        int dir = 0;
+        snd_pcm_hw_params_get_access(params, &access);
+        snd_pcm_hw_params_get_format(params, &config.format);
+        snd_pcm_hw_params_get_channels(params, &config.channels);
+        snd_pcm_hw_params_get_rate(params, &config.rate, &dir);
+        snd_pcm_hw_params_get_period_size(params, &config.period, &dir);
+        snd_pcm_hw_params_get_buffer_size(params, &config.buffer);
+        config.mmap = access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+        if (cacheable)
+            storePcmCache(key, config);
+    }
+    snd_pcm_hw_params_free(params);
+
+    if (config.rate != req.rate)
+        std::cerr << "Note: " << device << " runs at " << config.rate << " Hz (requested " << req.rate << " Hz).\n";
+
+    return pcm_detail::check(snd_pcm_prepare(handle), device, "prepare");
+}
+
+// Open and configure `device`; returns nullptr (after printing why) on failure
+inline snd_pcm_t *openPcm(const std::string &device, const PcmRequest &req, PcmConfig &config)
+{
+    snd_pcm_t *handle = nullptr;
+    int rc = snd_pcm_open(&handle, device.c_str(), req.stream, 0);
+    if (rc < 0)
+    {
+        std::cerr << "Cannot open " << (req.stream == SND_PCM_STREAM_CAPTURE ? "capture" : "playback")
+                  << " device " << device << ": " << snd_strerror(rc) << "\n";
+        return nullptr;
+    }
+    if (!configurePcm(handle, device, req, config))
+    {
+        snd_pcm_close(handle);
+        return nullptr;
+    }
+    return handle;
+}
+
+inline std::ostream &operator<<(std::ostream &os, const PcmConfig &c)
+{
+    return os << c.rate << " Hz, " << c.channels << " ch, " << snd_pcm_format_name(c.format) << ", period "
+              << c.period << ", buffer " << c.buffer << (c.mmap ? ", mmap" : "") << (c.fromCache ? " (cached)" : "");
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <alloca.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+// Real-time mode for the audio loops.
+//
+// With --rt every audio thread (the loop in single-threaded modes, the
+// capture/playback threads in the threaded ones) runs SCHED_FIFO for the
+// duration of its loop, optionally pinned with --rt-cpu. All memory is
+// locked with mlockall and the heap is kept from shrinking, so the loops
+// never take a page fault: buffers are value-initialized (every page
+// written) when they are sized, and each audio thread prefaults its stack
+// on entry.
+//
+// The loops themselves do not allocate: every buffer is sized before the
+// loop starts. NoAllocScope marks those sections; building with
+// -DCPP_AUDIO_ALLOC_GUARD replaces operator new so that an allocation inside
+// one aborts with a message, which makes regressions show up in testing
+// rather than as occasional xruns.
+
+struct RealtimeConfig
+{
+    bool enabled = false; // --rt[=PRIORITY]
+    int priority = 70;    // SCHED_FIFO priority, 1..99
+    std::vector<int> cpus; // --rt-cpu=LIST, audio threads may only run there
+};
+
+// "3", "2,3" or "2-3"; false if malformed
+inline bool parseCpuList(const std::string &text, std::vector<int> &cpus)
+{
+    cpus.clear();
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t end = text.find(',', pos);
+        std::string item = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        char *stop = nullptr;
+        long first = std::strtol(item.c_str(), &stop, 10), last = first;
+        if (*stop == '-')
+            last = std::strtol(stop + 1, &stop, 10);
+        if (item.empty() || *stop != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long c = first; c <= last; c++)
+            cpus.push_back(static_cast<int>(c));
+        if (end == std::string::npos)
+            break;
+        pos = end + 1;
+    }
+    return !cpus.empty();
+}
+
+// --- Allocation guard ---
+
+namespace realtime_detail
+{
+
+inline thread_local int noAllocDepth = 0;
+
+inline void warnOnce(std::atomic<bool> &warned, const std::string &message)
+{
+    if (!warned.exchange(true))
+        std::cerr << message << "\n";
+}
+
+} // namespace realtime_detail
+
+// Marks a section of the calling thread that must not allocate
+class NoAllocScope
+{
+public:
+    NoAllocScope() { realtime_detail::noAllocDepth++; }
+    ~NoAllocScope() { realtime_detail::noAllocDepth--; }
+    NoAllocScope(const NoAllocScope &) = delete;
+    NoAllocScope &operator=(const NoAllocScope &) = delete;
+};
+
+// Lifts the guard for an error path (xrun recovery, messages) inside one
+class AllowAllocScope
+{
+public:
+    AllowAllocScope() : saved_(realtime_detail::noAllocDepth) { realtime_detail::noAllocDepth = 0; }
+    ~AllowAllocScope() { realtime_detail::noAllocDepth = saved_; }
+    AllowAllocScope(const AllowAllocScope &) = delete;
+    AllowAllocScope &operator=(const AllowAllocScope &) = delete;
+
+private:
+    int saved_;
+};
+
+#ifdef CPP_AUDIO_ALLOC_GUARD
+// Replacement operator new: defined here because main.cpp is the only
+// translation unit that includes this header with the guard enabled.
+namespace realtime_detail
+{
+
+inline void *guardedAlloc(size_t size, size_t align)
+{
+    if (noAllocDepth > 0)
+    {
+        static const char msg[] = "cpp_audio: heap allocation inside an audio loop (NoAllocScope)\n";
+        ssize_t rc = ::write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        (void)rc;
+        std::abort();
+    }
+    void *p = align ? std::aligned_alloc(align, (size + align - 1) / align * align) : std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+} // namespace realtime_detail
+
+void *operator new(size_t size) { return realtime_detail::guardedAlloc(size, 0); }
+void *operator new[](size_t size) { return realtime_detail::guardedAlloc(size, 0); }
+void *operator new(size_t size, std::align_val_t align)
+{
+    return realtime_detail::guardedAlloc(size, static_cast<size_t>(align));
+}
+void *operator new[](size_t size, std::align_val_t align)
+{
+    return realtime_detail::guardedAlloc(size, static_cast<size_t>(align));
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+#endif
+
+// --- Memory locking ---
+
+inline bool &memoryLocked()
+{
+    static bool locked = false;
+    return locked;
+}
+
+// Lock current and future pages and stop malloc from returning memory to
+// the system, so buffers allocated before a loop stay resident. Skipped
+// with a warning when RLIMIT_MEMLOCK would make later allocations (thread
+// stacks, buffers) fail once MCL_FUTURE is in effect.
+inline bool lockMemory()
+{
+    rlimit limit{};
+    getrlimit(RLIMIT_MEMLOCK, &limit);
+    if (limit.rlim_cur != RLIM_INFINITY && geteuid() != 0)
+    {
+        std::cerr << "Not locking memory: memlock limit is " << limit.rlim_cur / 1024
+                  << " KiB (set it to unlimited, e.g. '@audio - memlock unlimited' in limits.conf).\n";
+        return false;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        std::cerr << "mlockall failed: " << strerror(errno) << "\n";
+        return false;
+    }
+    mallopt(M_TRIM_THRESHOLD, -1); // never give freed heap back
+    mallopt(M_MMAP_MAX, 0);        // large blocks come from the (locked) heap too
+    memoryLocked() = true;
+    return true;
+}
+
+// Keep what is locked but stop locking new mappings. Call before mapping a
+// large file, which MCL_FUTURE would otherwise read in and pin whole.
+// Memory allocated afterwards is no longer locked.
+inline void stopLockingNewMappings()
+{
+    if (memoryLocked())
+        mlockall(MCL_CURRENT);
+}
+
+// Touch `bytes` of stack below the caller so the loop never grows into new pages
+__attribute__((noinline)) inline void prefaultStack(size_t bytes = 256 * 1024)
+{
+    volatile char *stack = static_cast<volatile char *>(alloca(bytes));
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < bytes; i += page)
+        stack[i] = 0;
+}
+
+// --- Scheduling ---
+
+// Puts the calling thread on SCHED_FIFO and the configured CPUs for its
+// lifetime, restoring the previous policy and affinity afterwards. Does
+// nothing unless --rt or --rt-cpu was given; failures are reported once and
+// the thread carries on at normal priority.
+class RealtimeThread
+{
+public:
+    explicit RealtimeThread(const RealtimeConfig &config)
+    {
+        static std::atomic<bool> schedWarned{false}, affinityWarned{false};
+        pthread_t self = pthread_self();
+
+        if (!config.cpus.empty())
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int c : config.cpus)
+                CPU_SET(c, &set);
+            pthread_getaffinity_np(self, sizeof(savedCpus_), &savedCpus_);
+            int rc = pthread_setaffinity_np(self, sizeof(set), &set);
+            if (rc == 0)
+                pinned_ = true;
+            else
+                realtime_detail::warnOnce(affinityWarned, std::string("Cannot pin audio thread: ") + strerror(rc));
+        }
+
+        if (config.enabled)
+        {
+            pthread_getschedparam(self, &savedPolicy_, &savedParam_);
+            sched_param param{};
+            param.sched_priority = config.priority;
+            int rc = pthread_setschedparam(self, SCHED_FIFO, &param);
+            if (rc == 0)
+                scheduled_ = true;
+            else
+                realtime_detail::warnOnce(schedWarned, std::string("Cannot use SCHED_FIFO: ") + strerror(rc) +
+                                                           " (needs CAP_SYS_NICE or an rtprio limit)");
+            prefaultStack();
+        }
+    }
+
+    ~RealtimeThread()
+    {
+        pthread_t self = pthread_self();
+        if (scheduled_)
+            pthread_setschedparam(self, savedPolicy_, &savedParam_);
+        if (pinned_)
+            pthread_setaffinity_np(self, sizeof(savedCpus_), &savedCpus_);
+    }
+
+    RealtimeThread(const RealtimeThread &) = delete;
+    RealtimeThread &operator=(const RealtimeThread &) = delete;
+
+private:
+    bool scheduled_ = false, pinned_ = false;
+    int savedPolicy_ = SCHED_OTHER;
+    sched_param savedParam_{};
+    cpu_set_t savedCpus_;
+};
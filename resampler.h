@@ -0,0 +1,493 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "generators.h"
+
+// Sample-rate conversion.
+//
+// PolyphaseResampler converts between fixed rates (44.1k <-> 48k <-> 96k and
+// the like) with SIMD filter kernels, so hw: devices can run at their native
+// rate. AdaptiveResampler converts at a ratio that may change every block;
+// DriftTracker measures how far two devices' clocks have drifted apart and
+// produces the ratio that keeps the latency between them constant.
+
+namespace resample_detail
+{
+
+inline double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// Kaiser window over |r| <= 1
+inline double kaiser(double r, double beta)
+{
+    return r * r < 1.0 ? besselI0(beta * std::sqrt(1.0 - r * r)) / besselI0(beta) : 0.0;
+}
+
+inline double sinc(double x)
+{
+    return x == 0.0 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+}
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+
+// sum(a[i] * b[i]) over n floats, n a multiple of 2 * W
+template <typename VF, int W>
+__attribute__((always_inline)) inline float dotBody(const float *a, const float *b, int n)
+{
+    VF acc0 = {}, acc1 = {};
+    for (int i = 0; i < n; i += 2 * W)
+    {
+        VF a0, a1, b0, b1;
+        std::memcpy(&a0, a + i, sizeof(VF));
+        std::memcpy(&a1, a + i + W, sizeof(VF));
+        std::memcpy(&b0, b + i, sizeof(VF));
+        std::memcpy(&b1, b + i + W, sizeof(VF));
+        acc0 += a0 * b0;
+        acc1 += a1 * b1;
+    }
+    acc0 += acc1;
+    float sum = 0.0f;
+    for (int k = 0; k < W; k++)
+        sum += acc0[k];
+    return sum;
+}
+
+inline float dotScalar(const float *a, const float *b, int n)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) inline float dotAvx2(const float *a, const float *b, int n)
+{
+    return dotBody<v8sf, 8>(a, b, n);
+}
+#endif
+
+inline float dotVec4(const float *a, const float *b, int n)
+{
+    return dotBody<v4sf, 4>(a, b, n);
+}
+
+inline float dot(SimdIsa isa, const float *a, const float *b, int n)
+{
+    switch (isa)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SimdIsa::Avx2:
+        return dotAvx2(a, b, n);
+    case SimdIsa::Sse:
+        return dotVec4(a, b, n);
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    case SimdIsa::Neon:
+        return dotVec4(a, b, n);
+#endif
+    default:
+        return dotScalar(a, b, n);
+    }
+}
+
+} // namespace resample_detail
+
+// Filter for an up/down rational converter: `up` phases of `taps`
+// coefficients each, stored in convolution order so each output is one
+// contiguous dot product with the input history.
+struct PolyphaseTable
+{
+    int up = 1, down = 1;
+    int taps = 0;
+    std::vector<float> coefs;
+
+    const float *phase(int p) const { return &coefs[static_cast<size_t>(p) * taps]; }
+};
+
+// Largest up factor a table is built for (44.1k -> 96k needs 320)
+constexpr int kMaxPolyphaseUp = 1024;
+
+// The table for inRate -> outRate, computed on first use and shared by
+// every converter with the same ratio. Returns nullptr if the reduced ratio
+// needs more than kMaxPolyphaseUp phases.
+//
+// Kaiser-windowed sinc with 90 dB stopband. The cutoff sits at the lower
+// Nyquist frequency and the transition is symmetric around it, so the
+// passband is flat to 20 kHz at 44.1k and what little aliases lands above
+// that. Taps per phase grow with the down factor to keep the transition
+// when decimating.
+inline const PolyphaseTable *polyphaseTable(unsigned inRate, unsigned outRate)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<unsigned, unsigned>, std::unique_ptr<PolyphaseTable>> tables;
+
+    unsigned g = std::gcd(inRate, outRate);
+    if (g == 0)
+        return nullptr;
+    int up = outRate / g, down = inRate / g;
+    if (up > kMaxPolyphaseUp)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &slot = tables[{up, down}];
+    if (slot)
+        return slot.get();
+
+    const double attenuation = 90.0; // dB
+    const double passband = 0.907;   // of the lower Nyquist frequency
+    const double beta = 0.1102 * (attenuation - 8.7);
+    int k = std::max(up, down);
+    double width = 2.0 * M_PI * (1.0 - passband) / k; // transition, rad/sample at the upsampled rate
+    int taps = static_cast<int>(std::ceil((attenuation - 8.0) / (2.285 * width) / up));
+    taps = (taps + 15) / 16 * 16; // whole vectors for the SIMD kernels
+
+    auto table = std::make_unique<PolyphaseTable>();
+    table->up = up;
+    table->down = down;
+    table->taps = taps;
+    table->coefs.resize(static_cast<size_t>(up) * taps);
+
+    // Prototype lowpass at the upsampled rate, length up * taps, centred
+    double cutoff = 0.5 / k; // of the upsampled rate
+    double centre = (static_cast<double>(up) * taps - 1) / 2;
+    for (int p = 0; p < up; p++)
+    {
+        float *row = &table->coefs[static_cast<size_t>(p) * taps];
+        for (int t = 0; t < taps; t++)
+        {
+            // Output at phase p reads history[i - t] through tap p + up * t
+            double j = p + static_cast<double>(up) * t;
+            double h = 2.0 * cutoff * resample_detail::sinc(2.0 * cutoff * (j - centre)) *
+                       resample_detail::kaiser((j - centre) / (centre + 1), beta);
+            row[taps - 1 - t] = static_cast<float>(h * up);
+        }
+    }
+    slot = std::move(table);
+    return slot.get();
+}
+
+// Fixed-ratio converter for interleaved float frames. Input is
+// de-interleaved into per-channel histories so every output sample is one
+// vectorized dot product with a phase of the shared table. Storage is
+// allocated in the constructor; process() never allocates.
+class PolyphaseResampler
+{
+public:
+    // Whether a converter can be built for this pair of rates
+    static bool supported(unsigned inRate, unsigned outRate) { return polyphaseTable(inRate, outRate) != nullptr; }
+
+    // `maxBlock` is the most input frames a single process() call will get
+    PolyphaseResampler(unsigned inRate, unsigned outRate, int channels, size_t maxBlock)
+        : table_(polyphaseTable(inRate, outRate)), channels_(channels)
+    {
+        capacity_ = table_->taps + 2 * maxBlock + 1;
+        history_.resize(static_cast<size_t>(channels) * capacity_);
+        reset();
+    }
+
+    int taps() const { return table_->taps; }
+    double ratio() const { return static_cast<double>(table_->up) / table_->down; }
+
+    // Buffer sizes: most outputs `inFrames` inputs can give, most inputs
+    // `outFrames` outputs can take
+    size_t maxOutputFor(size_t inFrames) const { return (inFrames * table_->up + table_->down - 1) / table_->down + 1; }
+    size_t maxInputFor(size_t outFrames) const { return (outFrames * table_->down + table_->up - 1) / table_->up + 1; }
+
+    // Forget all history; the next output starts from silence
+    void reset()
+    {
+        std::fill(history_.begin(), history_.end(), 0.0f);
+        count_ = table_->taps - 1;
+        next_ = table_->taps - 1;
+        phase_ = 0;
+    }
+
+    // Input frames needed before `outFrames` more outputs can be produced
+    size_t inputFor(size_t outFrames) const
+    {
+        if (outFrames == 0)
+            return 0;
+        size_t last = next_ + (phase_ + (outFrames - 1) * table_->down) / table_->up;
+        return last + 1 > count_ ? last + 1 - count_ : 0;
+    }
+
+    // Most outputs `inFrames` more input frames allow
+    size_t outputFor(size_t inFrames) const
+    {
+        size_t end = count_ + inFrames; // first index not available
+        if (end <= next_)
+            return 0;
+        size_t span = (end - next_) * table_->up - phase_; // upsampled positions left
+        return (span + table_->down - 1) / table_->down;
+    }
+
+    // Appends `inFrames` interleaved frames and produces up to `maxOut`
+    // frames into `out`; returns the number produced. Input the outputs
+    // didn't reach yet stays buffered for the next call.
+    size_t process(const float *in, size_t inFrames, float *out, size_t maxOut)
+    {
+        for (int c = 0; c < channels_; c++)
+        {
+            float *h = &history_[c * capacity_ + count_];
+            for (size_t i = 0; i < inFrames; i++)
+                h[i] = in[i * channels_ + c];
+        }
+        count_ += inFrames;
+
+        SimdIsa isa = activeSimdIsa();
+        int taps = table_->taps;
+        size_t produced = 0;
+        while (produced < maxOut && next_ < count_)
+        {
+            const float *coefs = table_->phase(phase_);
+            size_t first = next_ - (taps - 1);
+            for (int c = 0; c < channels_; c++)
+                out[produced * channels_ + c] =
+                    resample_detail::dot(isa, coefs, &history_[c * capacity_ + first], taps);
+            produced++;
+
+            phase_ += table_->down;
+            next_ += phase_ / table_->up;
+            phase_ %= table_->up;
+        }
+
+        // Keep the taps - 1 frames before the next output
+        size_t drop = std::min(next_, count_) - (taps - 1);
+        if (drop > 0)
+        {
+            for (int c = 0; c < channels_; c++)
+            {
+                float *h = &history_[c * capacity_];
+                std::memmove(h, h + drop, (count_ - drop) * sizeof(float));
+            }
+            count_ -= drop;
+            next_ -= drop;
+        }
+        return produced;
+    }
+
+private:
+    const PolyphaseTable *table_;
+    int channels_;
+    size_t capacity_ = 0;
+    std::vector<float> history_; // channels_ planes of capacity_ frames
+    size_t count_ = 0;           // frames in each plane
+    size_t next_ = 0;            // newest input frame the next output reads
+    int phase_ = 0;              // its phase, 0 .. up - 1
+};
+
+// Windowed-sinc interpolator with a continuously variable ratio (input frames
+// per output frame). The Kaiser-windowed kernel is tabulated at kPhases
+// fractional offsets and linearly interpolated between them. All storage is
+// allocated in the constructor; process() never allocates.
+class AdaptiveResampler
+{
+public:
+    static constexpr int kTaps = 48;
+    static constexpr int kPhases = 128;
+
+    // `maxRatio` bounds setRatio(); above 1 the cutoff drops to stay below
+    // the output Nyquist frequency.
+    AdaptiveResampler(int channels, size_t maxOutFrames, double maxRatio)
+        : channels_(channels), maxRatio_(maxRatio)
+    {
+        const double beta = 7.0;
+        double cutoff = 0.45 / std::max(1.0, maxRatio); // fraction of the input rate
+        table_.resize((kPhases + 1) * kTaps);
+        for (int p = 0; p <= kPhases; p++)
+        {
+            float *row = &table_[p * kTaps];
+            double frac = static_cast<double>(p) / kPhases;
+            double sum = 0.0;
+            for (int t = 0; t < kTaps; t++)
+            {
+                double d = t - (kHalf - 1) - frac; // distance from the output position
+                double x = 2.0 * cutoff * d;
+                double r = d / kHalf;
+                row[t] = static_cast<float>(resample_detail::sinc(x) * resample_detail::kaiser(r, beta));
+                sum += row[t];
+            }
+            for (int t = 0; t < kTaps; t++)
+                row[t] = static_cast<float>(row[t] / sum); // unity gain at DC for every phase
+        }
+
+        maxInput_ = static_cast<size_t>(std::ceil(maxOutFrames * maxRatio)) + 1;
+        work_.resize((maxInput_ + 2 * kHalf + 1) * channels);
+        coef_.resize(kTaps);
+        reset();
+    }
+
+    // Forget all history; the next output starts from silence
+    void reset()
+    {
+        std::fill(work_.begin(), work_.end(), 0.0f);
+        count_ = 2 * kHalf - 1;
+        pos_ = kHalf - 1;
+    }
+
+    void setRatio(double ratio) { ratio_ = std::clamp(ratio, 1e-3, maxRatio_); }
+    double ratio() const { return ratio_; }
+
+    // Most input frames a single process() call can need
+    size_t maxInput() const { return maxInput_; }
+
+    // Input frames process() needs to produce `outFrames` at the current ratio
+    size_t inputFor(size_t outFrames) const
+    {
+        if (outFrames == 0)
+            return 0;
+        long last = static_cast<long>(std::floor(pos_ + (outFrames - 1) * ratio_));
+        return static_cast<size_t>(std::max(0L, last + kHalf + 1 - static_cast<long>(count_)));
+    }
+
+    // Input frames taken in but not yet reached by the output position,
+    // i.e. the resampler's own contribution to the latency
+    double buffered() const { return count_ - pos_; }
+
+    // `in` holds exactly inputFor(outFrames) interleaved frames
+    void process(const float *in, size_t inFrames, float *out, size_t outFrames)
+    {
+        std::memcpy(&work_[count_ * channels_], in, inFrames * channels_ * sizeof(float));
+        count_ += inFrames;
+
+        for (size_t k = 0; k < outFrames; k++)
+        {
+            double pos = pos_ + k * ratio_;
+            long i = static_cast<long>(pos);
+            double phase = (pos - i) * kPhases;
+            int p = static_cast<int>(phase);
+            float w = static_cast<float>(phase - p);
+            const float *a = &table_[p * kTaps];
+            const float *b = a + kTaps;
+            for (int t = 0; t < kTaps; t++)
+                coef_[t] = a[t] + w * (b[t] - a[t]);
+
+            const float *x = &work_[(i - (kHalf - 1)) * channels_];
+            for (int c = 0; c < channels_; c++)
+            {
+                float acc = 0.0f;
+                for (int t = 0; t < kTaps; t++)
+                    acc += coef_[t] * x[t * channels_ + c];
+                out[k * channels_ + c] = acc;
+            }
+        }
+
+        // Keep only the history the next output position still reaches
+        pos_ += outFrames * ratio_;
+        size_t drop = static_cast<size_t>(pos_) - (kHalf - 1);
+        std::memmove(work_.data(), &work_[drop * channels_], (count_ - drop) * channels_ * sizeof(float));
+        count_ -= drop;
+        pos_ -= drop;
+    }
+
+private:
+    static constexpr int kHalf = kTaps / 2;
+
+    int channels_;
+    double maxRatio_;
+    double ratio_ = 1.0;
+    size_t maxInput_ = 0;
+    std::vector<float> table_; // (kPhases + 1) rows of kTaps
+    std::vector<float> coef_;
+    std::vector<float> work_;  // interleaved history + new input
+    size_t count_ = 0;         // frames in work_
+    double pos_ = 0.0;         // next output position in work_
+};
+
+// Clock-drift estimator for a capture -> playback bridge.
+//
+// Fed the end-to-end latency (frames waiting in the capture device, in the
+// queue between the two and in the playback device, in seconds) once per
+// block, it averages the latency over the settle period, locks onto it as
+// the target and from then on returns the factor to scale the nominal
+// resampling ratio by to hold it there. The controller is a PI loop on the
+// smoothed latency error, so the integral term converges to the relative
+// clock drift; corrections are bounded to +/-kMaxCorrection.
+class DriftTracker
+{
+public:
+    static constexpr double kMaxCorrection = 0.005; // 5000 ppm, far beyond any crystal
+    static constexpr double kSmoothing = 0.5;       // seconds, latency low-pass time constant
+
+    // `bandwidthHz` is the loop's natural frequency: lower is smoother,
+    // higher pulls back to the target faster.
+    explicit DriftTracker(double settleSeconds = 1.0, double bandwidthHz = 0.05)
+        : settle_(settleSeconds)
+    {
+        double w = 2.0 * M_PI * bandwidthHz;
+        kp_ = 2.0 * 0.7 * w; // damping 0.7
+        ki_ = w * w;
+    }
+
+    // `latency` measured now, `dt` seconds since the previous call
+    double update(double latency, double dt)
+    {
+        elapsed_ += dt;
+        if (!locked_)
+        {
+            // Skip the start-up transient, average the second half
+            if (elapsed_ > settle_ / 2)
+            {
+                settleSum_ += latency * dt;
+                settleTime_ += dt;
+            }
+            if (elapsed_ >= settle_ && settleTime_ > 0.0)
+            {
+                target_ = settleSum_ / settleTime_;
+                smoothed_ = target_;
+                locked_ = true;
+            }
+            return 1.0;
+        }
+
+        smoothed_ += (latency - smoothed_) * dt / (kSmoothing + dt);
+        double error = smoothed_ - target_;
+        maxError_ = std::max(maxError_, std::abs(error));
+
+        double proportional = kp_ * error;
+        double integral = integral_ + ki_ * error * dt;
+        if (std::abs(proportional + integral) < kMaxCorrection)
+            integral_ = integral; // stop integrating while saturated
+        correction_ = std::clamp(proportional + integral_, -kMaxCorrection, kMaxCorrection);
+        return 1.0 + correction_;
+    }
+
+    bool locked() const { return locked_; }
+    double target() const { return target_; }
+    double error() const { return smoothed_ - target_; }
+    double maxError() const { return maxError_; }
+    // Estimated capture/playback clock mismatch in parts per million
+    double driftPpm() const { return integral_ * 1e6; }
+
+private:
+    double settle_;
+    double kp_, ki_;
+    double elapsed_ = 0.0;
+    double settleSum_ = 0.0, settleTime_ = 0.0;
+    bool locked_ = false;
+    double target_ = 0.0;
+    double smoothed_ = 0.0;
+    double integral_ = 0.0;
+    double correction_ = 0.0;
+    double maxError_ = 0.0;
+};
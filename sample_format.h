@@ -0,0 +1,384 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "generators.h"
+
+// Sample formats on the device and file side of the float32 pipeline.
+//
+// Signals are processed as float in [-1, 1); encodeSamples() converts to
+// the device/file format and decodeSamples() back. Integer formats scale by
+// 2^(bits-1) and clip, so a decode/encode round trip is exact. Reducing to
+// 16 or 24 bits can add TPDF dither (two uniform variables, +/-1 LSB
+// triangular). Like the generators, the kernels are written once with GCC
+// vector extensions and compiled for SSE2, AVX2 and NEON.
+
+enum class SampleFormat
+{
+    S16,   // 16-bit little endian
+    S24_3, // 24-bit packed in 3 bytes, little endian
+    S32,   // 32-bit little endian
+    Float  // IEEE float32 little endian
+};
+
+inline int sampleBytes(SampleFormat format)
+{
+    switch (format)
+    {
+    case SampleFormat::S24_3:
+        return 3;
+    case SampleFormat::S32:
+    case SampleFormat::Float:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+inline const char *sampleFormatName(SampleFormat format)
+{
+    switch (format)
+    {
+    case SampleFormat::S24_3:
+        return "s24";
+    case SampleFormat::S32:
+        return "s32";
+    case SampleFormat::Float:
+        return "float";
+    default:
+        return "s16";
+    }
+}
+
+inline bool parseSampleFormat(const std::string &name, SampleFormat &format)
+{
+    for (SampleFormat f : {SampleFormat::S16, SampleFormat::S24_3, SampleFormat::S32, SampleFormat::Float})
+    {
+        if (name == sampleFormatName(f))
+        {
+            format = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+// One xorshift32 state per SIMD lane
+struct TpdfDither
+{
+    explicit TpdfDither(uint32_t seed = 0x9E3779B9u)
+    {
+        for (int i = 0; i < 8; i++)
+            state[i] = seed + 0x6D2B79F5u * (i + 1);
+    }
+
+    uint32_t state[8];
+};
+
+namespace format_detail
+{
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+typedef int16_t v4hi __attribute__((vector_size(8)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int32_t v8si __attribute__((vector_size(32)));
+typedef uint32_t v8su __attribute__((vector_size(32)));
+typedef int16_t v8hi __attribute__((vector_size(16)));
+
+template <SampleFormat F>
+struct Scale
+{
+    static constexpr float full = F == SampleFormat::S16 ? 32768.0f : F == SampleFormat::S24_3 ? 8388608.0f : 2147483648.0f;
+    // Largest float that still fits (2^31 - 1 is not representable)
+    static constexpr float max = F == SampleFormat::S16 ? 32767.0f : F == SampleFormat::S24_3 ? 8388607.0f : 2147483520.0f;
+    static constexpr bool dithered = F == SampleFormat::S16 || F == SampleFormat::S24_3;
+};
+
+inline uint32_t xorshift(uint32_t &s)
+{
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+template <SampleFormat F>
+inline int32_t encodeOne(float x, uint32_t *dither)
+{
+    x *= Scale<F>::full;
+    if (Scale<F>::dithered && dither)
+    {
+        float r1 = (xorshift(*dither) >> 8) * (1.0f / 16777216.0f);
+        float r2 = (xorshift(*dither) >> 8) * (1.0f / 16777216.0f);
+        x += r1 - r2;
+    }
+    x = x > Scale<F>::max ? Scale<F>::max : (x < -Scale<F>::full ? -Scale<F>::full : x);
+    return static_cast<int32_t>(x + (x >= 0 ? 0.5f : -0.5f));
+}
+
+template <SampleFormat F>
+inline void encodeScalar(const float *in, uint8_t *out, size_t n, uint32_t *dither)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t v = encodeOne<F>(in[i], dither);
+        if (F == SampleFormat::S16)
+        {
+            int16_t s = static_cast<int16_t>(v);
+            std::memcpy(out + i * 2, &s, 2);
+        }
+        else
+        {
+            std::memcpy(out + i * sampleBytes(F), &v, sampleBytes(F)); // low bytes, little endian
+        }
+    }
+}
+
+template <SampleFormat F>
+inline void decodeScalar(const uint8_t *in, float *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int32_t v;
+        if (F == SampleFormat::S16)
+        {
+            int16_t s;
+            std::memcpy(&s, in + i * 2, 2);
+            v = s;
+        }
+        else if (F == SampleFormat::S24_3)
+        {
+            v = static_cast<int32_t>(uint32_t(in[i * 3]) << 8 | uint32_t(in[i * 3 + 1]) << 16 |
+                                     uint32_t(in[i * 3 + 2]) << 24) >> 8;
+        }
+        else
+        {
+            std::memcpy(&v, in + i * 4, 4);
+        }
+        out[i] = v * (1.0f / Scale<F>::full);
+    }
+}
+
+// Whole vectors only; returns how many samples were done, the caller finishes the tail
+template <SampleFormat F, typename VF, typename VI, typename VU, typename VH, int W>
+__attribute__((always_inline)) inline size_t encodeBody(const float *in, uint8_t *out, size_t n, uint32_t *dither)
+{
+    const VF full = Scale<F>::full - VF{};
+    const VF max = Scale<F>::max - VF{};
+    const VF half = 0.5f - VF{};
+    VU state = {};
+    bool dithered = Scale<F>::dithered && dither;
+    if (dithered)
+        std::memcpy(&state, dither, sizeof(state));
+
+    size_t i = 0;
+    for (; i + W <= n; i += W)
+    {
+        VF x;
+        std::memcpy(&x, in + i, sizeof(x));
+        x *= full;
+        if (dithered)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            VF r1 = __builtin_convertvector((VI)(state >> 8), VF);
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            VF r2 = __builtin_convertvector((VI)(state >> 8), VF);
+            x += (r1 - r2) * (1.0f / 16777216.0f);
+        }
+        x = x > max ? max : x;
+        x = x < -full ? -full : x;
+        VI v = __builtin_convertvector(x + (x >= 0 ? half : -half), VI);
+
+        if (F == SampleFormat::S16)
+        {
+            VH h = __builtin_convertvector(v, VH);
+            std::memcpy(out + i * 2, &h, sizeof(h));
+        }
+        else if (F == SampleFormat::S32)
+        {
+            std::memcpy(out + i * 4, &v, sizeof(v));
+        }
+        else
+        {
+            for (int k = 0; k < W; k++)
+            {
+                int32_t s = v[k];
+                std::memcpy(out + (i + k) * 3, &s, 3);
+            }
+        }
+    }
+
+    if (dithered)
+        std::memcpy(dither, &state, sizeof(state));
+    return i;
+}
+
+template <SampleFormat F, typename VF, typename VI, typename VH, int W>
+__attribute__((always_inline)) inline size_t decodeBody(const uint8_t *in, float *out, size_t n)
+{
+    const VF scale = (1.0f / Scale<F>::full) - VF{};
+    size_t i = 0;
+    for (; i + W <= n; i += W)
+    {
+        VI v;
+        if (F == SampleFormat::S16)
+        {
+            VH h;
+            std::memcpy(&h, in + i * 2, sizeof(h));
+            v = __builtin_convertvector(h, VI);
+        }
+        else if (F == SampleFormat::S32)
+        {
+            std::memcpy(&v, in + i * 4, sizeof(v));
+        }
+        else
+        {
+            for (int k = 0; k < W; k++)
+            {
+                const uint8_t *p = in + (i + k) * 3;
+                v[k] = static_cast<int32_t>(uint32_t(p[0]) << 8 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 24) >> 8;
+            }
+        }
+        VF x = __builtin_convertvector(v, VF) * scale;
+        std::memcpy(out + i, &x, sizeof(x));
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <SampleFormat F>
+__attribute__((target("avx2"))) size_t encodeAvx2(const float *in, uint8_t *out, size_t n, uint32_t *dither)
+{
+    return encodeBody<F, v8sf, v8si, v8su, v8hi, 8>(in, out, n, dither);
+}
+
+template <SampleFormat F>
+__attribute__((target("avx2"))) size_t decodeAvx2(const uint8_t *in, float *out, size_t n)
+{
+    return decodeBody<F, v8sf, v8si, v8hi, 8>(in, out, n);
+}
+#endif
+
+template <SampleFormat F>
+size_t encodeVec4(const float *in, uint8_t *out, size_t n, uint32_t *dither)
+{
+    return encodeBody<F, v4sf, v4si, v4su, v4hi, 4>(in, out, n, dither);
+}
+
+template <SampleFormat F>
+size_t decodeVec4(const uint8_t *in, float *out, size_t n)
+{
+    return decodeBody<F, v4sf, v4si, v4hi, 4>(in, out, n);
+}
+
+template <SampleFormat F>
+inline void encode(SimdIsa isa, const float *in, uint8_t *out, size_t n, TpdfDither *dither)
+{
+    uint32_t *state = dither ? dither->state : nullptr;
+    size_t done = 0;
+    switch (isa)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SimdIsa::Avx2:
+        done = encodeAvx2<F>(in, out, n, state);
+        break;
+    case SimdIsa::Sse:
+        done = encodeVec4<F>(in, out, n, state);
+        break;
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    case SimdIsa::Neon:
+        done = encodeVec4<F>(in, out, n, state);
+        break;
+#endif
+    default:
+        break;
+    }
+    encodeScalar<F>(in + done, out + done * sampleBytes(F), n - done, state);
+}
+
+template <SampleFormat F>
+inline void decode(SimdIsa isa, const uint8_t *in, float *out, size_t n)
+{
+    size_t done = 0;
+    switch (isa)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    case SimdIsa::Avx2:
+        done = decodeAvx2<F>(in, out, n);
+        break;
+    case SimdIsa::Sse:
+        done = decodeVec4<F>(in, out, n);
+        break;
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+    case SimdIsa::Neon:
+        done = decodeVec4<F>(in, out, n);
+        break;
+#endif
+    default:
+        break;
+    }
+    decodeScalar<F>(in + done * sampleBytes(F), out + done, n - done);
+}
+
+} // namespace format_detail
+
+// Float samples -> `format`; `dither` (16/24-bit only) may be null
+inline void encodeSamples(SampleFormat format, const float *in, void *out, size_t samples, TpdfDither *dither = nullptr)
+{
+    uint8_t *bytes = static_cast<uint8_t *>(out);
+    switch (format)
+    {
+    case SampleFormat::S16:
+        format_detail::encode<SampleFormat::S16>(activeSimdIsa(), in, bytes, samples, dither);
+        return;
+    case SampleFormat::S24_3:
+        format_detail::encode<SampleFormat::S24_3>(activeSimdIsa(), in, bytes, samples, dither);
+        return;
+    case SampleFormat::S32:
+        format_detail::encode<SampleFormat::S32>(activeSimdIsa(), in, bytes, samples, dither);
+        return;
+    case SampleFormat::Float:
+        std::memcpy(out, in, samples * sizeof(float));
+        return;
+    }
+}
+
+// `format` -> float samples
+inline void decodeSamples(SampleFormat format, const void *in, float *out, size_t samples)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(in);
+    switch (format)
+    {
+    case SampleFormat::S16:
+        format_detail::decode<SampleFormat::S16>(activeSimdIsa(), bytes, out, samples);
+        return;
+    case SampleFormat::S24_3:
+        format_detail::decode<SampleFormat::S24_3>(activeSimdIsa(), bytes, out, samples);
+        return;
+    case SampleFormat::S32:
+        format_detail::decode<SampleFormat::S32>(activeSimdIsa(), bytes, out, samples);
+        return;
+    case SampleFormat::Float:
+        std::memcpy(out, in, samples * sizeof(float));
+        return;
+    }
+}
+
+// Mono float duplicated into `channels` interleaved channels
+inline void duplicateChannels(const float *in, float *out, size_t frames, int channels)
+{
+    for (size_t i = 0; i < frames; i++)
+        for (int c = 0; c < channels; c++)
+            out[i * channels + c] = in[i];
+}
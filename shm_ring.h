@@ -0,0 +1,511 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+#include "sample_format.h"
+
+// Live capture shared with other processes through a POSIX shared-memory
+// ring (shm_open). The publisher writes each captured period into the next
+// of `slotCount` slots, in the device format, and never waits for readers.
+// Any number of ShmRingReader processes follow it, each at its own pace.
+//
+// Every slot has a sequence word that works like a seqlock: odd while the
+// publisher is writing period s into it, 2s + 2 once it is complete. A
+// reader takes period s in place (zero-copy) when the word says 2s + 2, and
+// calls intact() afterwards to check the slot wasn't reused meanwhile. A
+// reader that falls more than a ring behind finds newer periods in its
+// slots; it skips ahead and counts the overrun and the frames it lost.
+//
+// Readers sleep on a futex in the shared header. The publisher calls
+// FUTEX_WAKE (non-blocking) only when a reader has flagged it is waiting.
+
+namespace shm_detail
+{
+
+const uint32_t kMagic = 0x52415043; // "CPAR"
+const uint32_t kVersion = 1;
+
+enum State : uint32_t
+{
+    Live = 1,
+    Closed = 2
+};
+
+struct alignas(64) RingHeader
+{
+    std::atomic<uint32_t> magic;   // stored last, once the rest is filled in
+    uint32_t version;
+    uint32_t rate;
+    uint32_t channels;
+    uint32_t format;               // SampleFormat of the slot data
+    uint32_t slotFrames;
+    uint32_t slotCount;            // a power of two
+    uint32_t slotBytes;            // data bytes per slot, padded to a cache line
+    int32_t pid;                   // publisher, to notice it died
+    std::atomic<uint32_t> state;
+
+    alignas(64) std::atomic<uint64_t> head; // periods published
+    std::atomic<uint32_t> wake;             // futex word, bumped on every publish
+    std::atomic<uint32_t> waiters;          // readers sleeping on `wake`
+};
+
+struct alignas(64) SlotHeader
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> firstFrame;  // stream position of the slot's first frame
+    std::atomic<uint64_t> timestampNs; // CLOCK_MONOTONIC when published
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "the ring is shared between processes, its atomics must be address-free");
+
+inline size_t ringBytes(uint32_t slotCount, uint32_t slotBytes)
+{
+    return sizeof(RingHeader) + size_t(slotCount) * (sizeof(SlotHeader) + slotBytes);
+}
+
+inline SlotHeader *slotHeaders(void *base)
+{
+    return reinterpret_cast<SlotHeader *>(static_cast<uint8_t *>(base) + sizeof(RingHeader));
+}
+
+inline uint8_t *slotData(void *base, uint32_t slotCount)
+{
+    return static_cast<uint8_t *>(base) + sizeof(RingHeader) + size_t(slotCount) * sizeof(SlotHeader);
+}
+
+// shm_open names are "/name"
+inline std::string shmName(const std::string &name)
+{
+    return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+inline uint64_t monotonicNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline bool processAlive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Whether the ring at `path` belongs to a publisher that is still running;
+// `owner` is set to its pid. A ring that was closed, or that was left
+// behind by a publisher that died, is not in use. One we may not even read
+// is treated as in use.
+inline bool ringInUse(const std::string &path, pid_t &owner)
+{
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return errno == EACCES;
+    bool live = false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(RingHeader))
+    {
+        void *base = mmap(nullptr, sizeof(RingHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if (base != MAP_FAILED)
+        {
+            const RingHeader *header = static_cast<const RingHeader *>(base);
+            owner = header->pid;
+            live = header->magic.load(std::memory_order_acquire) == kMagic &&
+                   header->state.load(std::memory_order_acquire) == Live && processAlive(owner);
+            munmap(base, sizeof(RingHeader));
+        }
+    }
+    ::close(fd);
+    return live;
+}
+
+// Shared (not FUTEX_PRIVATE) so it works across processes
+inline void futexWait(std::atomic<uint32_t> &word, uint32_t expected, int timeoutMs)
+{
+    timespec ts{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+inline void futexWakeAll(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+} // namespace shm_detail
+
+// Publisher side. create() allocates and maps everything; publish() is
+// allocation-free and never blocks.
+class ShmRingWriter
+{
+public:
+    ShmRingWriter() = default;
+    ~ShmRingWriter() { close(); }
+
+    ShmRingWriter(const ShmRingWriter &) = delete;
+    ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+    // `slotFrames` per slot (one period); `slotCount` is rounded up to a power of two
+    bool create(const std::string &name, int rate, int channels, SampleFormat format, size_t slotFrames,
+                size_t slotCount)
+    {
+        using namespace shm_detail;
+        name_ = shmName(name);
+        uint32_t count = 1;
+        while (count < slotCount)
+            count <<= 1;
+        frameBytes_ = sampleBytes(format) * channels;
+        uint32_t bytes = static_cast<uint32_t>((slotFrames * frameBytes_ + 63) & ~size_t(63));
+        size_ = ringBytes(count, bytes);
+
+        // A ring left behind by a publisher that crashed is replaced, not reused:
+        // readers still attached to it see the old publisher is gone. One
+        // whose publisher is still running is left alone.
+        pid_t owner = 0;
+        if (ringInUse(name_, owner))
+        {
+            std::cerr << name_ << " is already published by process " << owner << ".\n";
+            return false;
+        }
+        shm_unlink(name_.c_str());
+        int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+        if (fd < 0)
+        {
+            std::cerr << "shm_open " << name_ << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        device_ = st.st_dev;
+        inode_ = st.st_ino;
+        if (ftruncate(fd, static_cast<off_t>(size_)) != 0)
+        {
+            std::cerr << "Unable to size shared memory " << name_ << ": " << std::strerror(errno) << "\n";
+            ::close(fd);
+            shm_unlink(name_.c_str());
+            return false;
+        }
+        void *base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED)
+        {
+            std::cerr << "Unable to map shared memory " << name_ << ": " << std::strerror(errno) << "\n";
+            shm_unlink(name_.c_str());
+            return false;
+        }
+
+        // ftruncate zero-filled the mapping, which is every atomic's initial value
+        base_ = base;
+        header_ = static_cast<RingHeader *>(base);
+        slots_ = slotHeaders(base);
+        data_ = slotData(base, count);
+        header_->version = kVersion;
+        header_->rate = rate;
+        header_->channels = channels;
+        header_->format = static_cast<uint32_t>(format);
+        header_->slotFrames = static_cast<uint32_t>(slotFrames);
+        header_->slotCount = count;
+        header_->slotBytes = bytes;
+        header_->pid = getpid();
+        header_->state.store(Live, std::memory_order_relaxed);
+        header_->magic.store(kMagic, std::memory_order_release);
+
+        slotFrames_ = slotFrames;
+        mask_ = count - 1;
+        head_ = 0;
+        position_ = 0;
+        return true;
+    }
+
+    // Called from the capture thread with interleaved frames in the ring's format.
+    // Blocks longer than a slot are split across slots.
+    void publish(const void *frames, size_t count)
+    {
+        if (!header_)
+            return;
+        const uint8_t *src = static_cast<const uint8_t *>(frames);
+        uint64_t now = shm_detail::monotonicNs();
+        while (count > 0)
+        {
+            size_t n = std::min(count, slotFrames_);
+            shm_detail::SlotHeader &slot = slots_[head_ & mask_];
+            slot.seq.store(2 * head_ + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            std::memcpy(data_ + (head_ & mask_) * header_->slotBytes, src, n * frameBytes_);
+            slot.frames.store(n, std::memory_order_relaxed);
+            slot.firstFrame.store(position_, std::memory_order_relaxed);
+            slot.timestampNs.store(now, std::memory_order_relaxed);
+            slot.seq.store(2 * head_ + 2, std::memory_order_release);
+            head_++;
+            header_->head.store(head_, std::memory_order_release);
+
+            src += n * frameBytes_;
+            position_ += n;
+            count -= n;
+        }
+        header_->wake.fetch_add(1, std::memory_order_seq_cst);
+        if (header_->waiters.load(std::memory_order_seq_cst) > 0)
+            shm_detail::futexWakeAll(header_->wake);
+    }
+
+    // Marks the stream ended, wakes readers and removes the name if it
+    // still refers to this ring (a later publisher may have replaced it).
+    // Readers keep their mapping until they close.
+    void close()
+    {
+        if (!header_)
+            return;
+        header_->state.store(shm_detail::Closed, std::memory_order_release);
+        header_->wake.fetch_add(1, std::memory_order_seq_cst);
+        shm_detail::futexWakeAll(header_->wake);
+
+        // Checked while still mapped, so no other object can have this inode
+        int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+        if (fd >= 0)
+        {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_dev == device_ && st.st_ino == inode_)
+                shm_unlink(name_.c_str());
+            ::close(fd);
+        }
+        munmap(base_, size_);
+        header_ = nullptr;
+    }
+
+    const std::string &name() const { return name_; }
+    uint64_t periodsPublished() const { return head_; }
+    uint64_t framesPublished() const { return position_; }
+    size_t slotCount() const { return mask_ + 1; }
+    size_t memoryBytes() const { return size_; }
+
+private:
+    std::string name_;
+    void *base_ = nullptr;
+    size_t size_ = 0;
+    shm_detail::RingHeader *header_ = nullptr;
+    shm_detail::SlotHeader *slots_ = nullptr;
+    uint8_t *data_ = nullptr;
+    dev_t device_ = 0; // identity of the shm object, checked before unlinking it
+    ino_t inode_ = 0;
+    size_t frameBytes_ = 0;
+    size_t slotFrames_ = 0;
+    uint64_t mask_ = 0;
+    uint64_t head_ = 0;     // next period to publish
+    uint64_t position_ = 0; // frames published
+};
+
+// Consumer side: attaches to a ring by name and follows it from the newest period.
+class ShmRingReader
+{
+public:
+    // One period, pointing into the shared mapping
+    struct Period
+    {
+        const void *data = nullptr;
+        size_t frames = 0;
+        uint64_t sequence = 0;
+        uint64_t firstFrame = 0;
+        uint64_t timestampNs = 0;
+    };
+
+    enum class Status
+    {
+        Ok,
+        Timeout,
+        Closed // the publisher closed the ring or died
+    };
+
+    ShmRingReader() = default;
+    ~ShmRingReader() { close(); }
+
+    ShmRingReader(const ShmRingReader &) = delete;
+    ShmRingReader &operator=(const ShmRingReader &) = delete;
+
+    bool open(const std::string &name)
+    {
+        using namespace shm_detail;
+        std::string path = shmName(name);
+        // Read-write only to register as a futex waiter; without it, poll
+        int fd = shm_open(path.c_str(), O_RDWR, 0);
+        writable_ = fd >= 0;
+        if (fd < 0 && errno == EACCES)
+            fd = shm_open(path.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+        {
+            std::cerr << "No capture is published as " << path << " (" << std::strerror(errno) << ").\n";
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(RingHeader))
+        {
+            std::cerr << path << " is not a capture ring.\n";
+            ::close(fd);
+            return false;
+        }
+        size_ = st.st_size;
+        base_ = mmap(nullptr, size_, writable_ ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base_ == MAP_FAILED)
+        {
+            base_ = nullptr;
+            std::cerr << "Unable to map " << path << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+
+        header_ = static_cast<RingHeader *>(base_);
+        if (header_->magic.load(std::memory_order_acquire) != kMagic || header_->version != kVersion ||
+            header_->format > uint32_t(SampleFormat::Float) || header_->channels == 0 ||
+            (header_->slotCount & (header_->slotCount - 1)) != 0 ||
+            size_ < ringBytes(header_->slotCount, header_->slotBytes))
+        {
+            std::cerr << path << " is not a capture ring (or a different version).\n";
+            close();
+            return false;
+        }
+        slots_ = slotHeaders(base_);
+        data_ = slotData(base_, header_->slotCount);
+        next_ = header_->head.load(std::memory_order_acquire);
+        expectedFrame_ = UINT64_MAX;
+        overruns_ = 0;
+        lostFrames_ = 0;
+        return true;
+    }
+
+    void close()
+    {
+        if (base_)
+            munmap(base_, size_);
+        base_ = nullptr;
+        header_ = nullptr;
+    }
+
+    int rate() const { return header_->rate; }
+    int channels() const { return header_->channels; }
+    SampleFormat format() const { return static_cast<SampleFormat>(header_->format); }
+    size_t slotFrames() const { return header_->slotFrames; }
+    size_t slotCount() const { return header_->slotCount; }
+    size_t frameBytes() const { return sampleBytes(format()) * channels(); }
+
+    // Next period in order, waiting up to `timeoutMs` for it. Skips ahead
+    // (counting an overrun) when this reader has fallen a ring behind.
+    Status next(Period &period, int timeoutMs)
+    {
+        using namespace shm_detail;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (true)
+        {
+            uint64_t head = header_->head.load(std::memory_order_acquire);
+            if (next_ < head)
+            {
+                if (take(period))
+                    return Status::Ok;
+                // The slot already holds a later period: skip to half a ring behind the publisher
+                uint64_t resume = std::max(next_ + 1, head - std::min<uint64_t>(head, header_->slotCount / 2));
+                overruns_++;
+                next_ = resume;
+                continue;
+            }
+
+            if (header_->state.load(std::memory_order_acquire) == Closed || !publisherAlive())
+                return Status::Closed;
+            int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                                 deadline - std::chrono::steady_clock::now())
+                                                 .count());
+            if (remaining <= 0)
+                return Status::Timeout;
+            wait(head, std::min(remaining, 100));
+        }
+    }
+
+    // True while `period`'s slot still holds it. Check after using the data in place.
+    bool intact(const Period &period) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slots_[period.sequence & (header_->slotCount - 1)].seq.load(std::memory_order_relaxed) ==
+               2 * period.sequence + 2;
+    }
+
+    // Copies the period out, or returns false if it was overwritten meanwhile
+    bool copy(const Period &period, void *dst) const
+    {
+        std::memcpy(dst, period.data, period.frames * frameBytes());
+        return intact(period);
+    }
+
+    // The period was overwritten while in use: count it as lost
+    void discard(const Period &period)
+    {
+        overruns_++;
+        lostFrames_ += period.frames;
+    }
+
+    uint64_t overruns() const { return overruns_; }
+    uint64_t lostFrames() const { return lostFrames_; }
+    // Periods published but not yet taken by this reader
+    uint64_t lag() const { return header_->head.load(std::memory_order_acquire) - next_; }
+
+    bool publisherAlive() const { return shm_detail::processAlive(header_->pid); }
+
+private:
+    bool take(Period &period)
+    {
+        uint64_t mask = header_->slotCount - 1;
+        shm_detail::SlotHeader &slot = slots_[next_ & mask];
+        if (slot.seq.load(std::memory_order_acquire) != 2 * next_ + 2)
+            return false;
+        period.sequence = next_;
+        period.frames = std::min<uint64_t>(slot.frames.load(std::memory_order_relaxed), header_->slotFrames);
+        period.firstFrame = slot.firstFrame.load(std::memory_order_relaxed);
+        period.timestampNs = slot.timestampNs.load(std::memory_order_relaxed);
+        period.data = data_ + (next_ & mask) * header_->slotBytes;
+        if (!intact(period))
+            return false;
+
+        // Frames between the last period taken and this one were missed
+        if (expectedFrame_ != UINT64_MAX && period.firstFrame > expectedFrame_)
+            lostFrames_ += period.firstFrame - expectedFrame_;
+        expectedFrame_ = period.firstFrame + period.frames;
+        next_++;
+        return true;
+    }
+
+    void wait(uint64_t head, int timeoutMs)
+    {
+        if (!writable_)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return;
+        }
+        header_->waiters.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t seen = header_->wake.load(std::memory_order_seq_cst);
+        if (header_->head.load(std::memory_order_seq_cst) == head &&
+            header_->state.load(std::memory_order_seq_cst) == shm_detail::Live)
+            shm_detail::futexWait(header_->wake, seen, timeoutMs);
+        header_->waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void *base_ = nullptr;
+    size_t size_ = 0;
+    bool writable_ = false;
+    shm_detail::RingHeader *header_ = nullptr;
+    shm_detail::SlotHeader *slots_ = nullptr;
+    const uint8_t *data_ = nullptr;
+    uint64_t next_ = 0;
+    uint64_t expectedFrame_ = UINT64_MAX;
+    uint64_t overruns_ = 0;
+    uint64_t lostFrames_ = 0;
+};
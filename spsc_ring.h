@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Single-producer / single-consumer lock-free ring buffer.
+// Storage is allocated once in the constructor; write() and read() never
+// allocate or block, they move as many elements as currently fit.
+template <typename T>
+class SpscRing
+{
+public:
+    // Capacity is rounded up to the next power of two.
+    explicit SpscRing(size_t minCapacity)
+    {
+        size_t cap = 1;
+        while (cap < minCapacity)
+            cap <<= 1;
+        buffer_.resize(cap);
+        mask_ = cap - 1;
+    }
+
+    size_t capacity() const { return buffer_.size(); }
+
+    // Elements ready for the consumer.
+    size_t readAvailable() const
+    {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    // Free slots for the producer.
+    size_t writeAvailable() const { return capacity() - readAvailable(); }
+
+    // Producer side. Returns the number of elements actually written.
+    size_t write(const T *src, size_t count)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        size_t space = capacity() - (head - tail);
+        if (count > space)
+            count = space;
+
+        size_t start = head & mask_;
+        size_t first = std::min(count, capacity() - start);
+        std::memcpy(&buffer_[start], src, first * sizeof(T));
+        std::memcpy(&buffer_[0], src + first, (count - first) * sizeof(T));
+
+        head_.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer side. Returns the number of elements actually read.
+    size_t read(T *dst, size_t count)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t avail = head - tail;
+        if (count > avail)
+            count = avail;
+
+        size_t start = tail & mask_;
+        size_t first = std::min(count, capacity() - start);
+        std::memcpy(dst, &buffer_[start], first * sizeof(T));
+        std::memcpy(dst + first, &buffer_[0], (count - first) * sizeof(T));
+
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+private:
+    std::vector<T> buffer_;
+    size_t mask_ = 0;
+    // Producer and consumer indices live on separate cache lines.
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
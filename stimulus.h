@@ -0,0 +1,496 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fft.h"
+#include "generators.h"
+#include "realtime.h"
+
+// Test signals for play and playrecord.
+//
+// Sines, sweeps, stepped sines and white noise are generated block by block
+// with the SIMD kernels in generators.h. MLS, pink noise and multitones are
+// periodic: one period is built once per process (cached by its parameters)
+// and played in a loop, so the audio loop only copies. Periods of pink noise
+// and multitones are a power of two long, so an FFT of one period has no
+// leakage.
+//
+// Every stimulus is scaled to a peak level in dBFS and faded in and out with
+// raised-cosine ramps. It is written to a chosen subset of the output
+// channels; the others carry silence.
+
+enum class StimulusKind
+{
+    Sine,
+    LogSweep,
+    LinearSweep,
+    SteppedSine,
+    WhiteNoise,
+    PinkNoise,
+    Mls,
+    Multitone
+};
+
+inline const char *stimulusName(StimulusKind kind)
+{
+    switch (kind)
+    {
+    case StimulusKind::Sine: return "sine";
+    case StimulusKind::LogSweep: return "logsweep";
+    case StimulusKind::LinearSweep: return "linsweep";
+    case StimulusKind::SteppedSine: return "steps";
+    case StimulusKind::WhiteNoise: return "white";
+    case StimulusKind::PinkNoise: return "pink";
+    case StimulusKind::Mls: return "mls";
+    case StimulusKind::Multitone: return "multitone";
+    }
+    return "?";
+}
+
+struct StimulusSpec
+{
+    StimulusKind kind = StimulusKind::Sine;
+    double frequency = 1000.0; // f=, sine
+    double f0 = 20.0;          // f0=, lowest frequency of sweeps, steps, multitone and pink noise
+    double f1 = 0.0;           // f1=, highest; 0 = Nyquist for sweeps, 0.45 * rate otherwise
+    double perOctave = 3.0;    // per_octave=, steps and multitone tones per octave
+    double stepSeconds = 0.5;  // step=, stepped sine hold time
+    int order = 16;            // order=, MLS period 2^order - 1
+    int periodLog2 = 0;        // period=, pink/multitone period 2^N frames; 0 = about 5 s / 0.3 s
+    uint32_t seed = 1;         // seed=, noise and pink-noise phases
+    double levelDb = 0.0;      // level=, peak level in dBFS
+    double fadeIn = 0.0;       // fade= / fade_in=, seconds
+    double fadeOut = 0.0;      // fade= / fade_out=, seconds
+    int channels = 2;          // ch=, output channels
+    std::vector<int> map;      // map=, channels carrying the signal ("0", "0,2", "1-3"); empty = all
+};
+
+// "KIND[:key=value]...", e.g. "pink:level=-20:fade=0.1" or "multitone:per_octave=6:ch=4:map=0-1"
+inline bool parseStimulus(const std::string &text, StimulusSpec &spec)
+{
+    static const StimulusKind kinds[] = {StimulusKind::Sine,        StimulusKind::LogSweep,   StimulusKind::LinearSweep,
+                                         StimulusKind::SteppedSine, StimulusKind::WhiteNoise, StimulusKind::PinkNoise,
+                                         StimulusKind::Mls,         StimulusKind::Multitone};
+    size_t colon = text.find(':');
+    std::string name = text.substr(0, colon);
+    auto kind = std::find_if(std::begin(kinds), std::end(kinds), [&](StimulusKind k) { return name == stimulusName(k); });
+    if (kind == std::end(kinds))
+    {
+        std::cerr << "Unknown stimulus \"" << name << "\" (sine, logsweep, linsweep, steps, white, pink, mls, multitone).\n";
+        return false;
+    }
+    spec.kind = *kind;
+
+    while (colon != std::string::npos)
+    {
+        size_t next = text.find(':', colon + 1);
+        std::string item = text.substr(colon + 1, next == std::string::npos ? std::string::npos : next - colon - 1);
+        colon = next;
+        size_t eq = item.find('=');
+        std::string key = item.substr(0, eq), value = eq == std::string::npos ? "" : item.substr(eq + 1);
+        char *end = nullptr;
+        double number = std::strtod(value.c_str(), &end);
+        bool numeric = !value.empty() && *end == '\0';
+
+        if (key == "map" && parseCpuList(value, spec.map))
+            continue;
+        if (!numeric)
+        {
+            std::cerr << "Bad stimulus parameter \"" << item << "\".\n";
+            return false;
+        }
+        if (key == "f")
+            spec.frequency = number;
+        else if (key == "f0")
+            spec.f0 = number;
+        else if (key == "f1")
+            spec.f1 = number;
+        else if (key == "per_octave" && number > 0)
+            spec.perOctave = number;
+        else if (key == "step" && number > 0)
+            spec.stepSeconds = number;
+        else if (key == "order")
+            spec.order = std::clamp(static_cast<int>(number), 2, 24);
+        else if (key == "period")
+            spec.periodLog2 = std::clamp(static_cast<int>(number), 10, 22);
+        else if (key == "seed")
+            spec.seed = static_cast<uint32_t>(number);
+        else if (key == "level")
+            spec.levelDb = std::min(number, 0.0);
+        else if (key == "fade")
+            spec.fadeIn = spec.fadeOut = std::max(number, 0.0);
+        else if (key == "fade_in")
+            spec.fadeIn = std::max(number, 0.0);
+        else if (key == "fade_out")
+            spec.fadeOut = std::max(number, 0.0);
+        else if (key == "ch" && number >= 1)
+            spec.channels = static_cast<int>(number);
+        else
+        {
+            std::cerr << "Unknown stimulus parameter \"" << item << "\".\n";
+            return false;
+        }
+    }
+    for (int c : spec.map)
+        if (c >= spec.channels)
+        {
+            std::cerr << "Stimulus mapped to channel " << c << " of " << spec.channels << " (use ch=N).\n";
+            return false;
+        }
+    return true;
+}
+
+namespace stimulus_detail
+{
+
+// One period per parameter set, built on first use and shared afterwards
+inline std::shared_ptr<const std::vector<float>> cachedPeriod(const std::string &key,
+                                                              const std::function<std::vector<float>()> &build)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_ptr<const std::vector<float>>> cache;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &entry = cache[key];
+    if (!entry)
+        entry = std::make_shared<const std::vector<float>>(build());
+    return entry;
+}
+
+// Real signal with the given spectrum on bins [1, n/2): magnitude and phase per bin
+inline void synthesize(const FftPlan<double> &plan, const std::vector<double> &magnitude,
+                       const std::vector<double> &phase, std::vector<double> &re, std::vector<double> &im)
+{
+    size_t n = plan.size();
+    std::fill(re.begin(), re.end(), 0.0);
+    std::fill(im.begin(), im.end(), 0.0);
+    for (size_t k = 1; k < n / 2; k++)
+    {
+        if (magnitude[k] == 0.0)
+            continue;
+        re[k] = re[n - k] = magnitude[k] * std::cos(phase[k]);
+        im[k] = magnitude[k] * std::sin(phase[k]);
+        im[n - k] = -im[k];
+    }
+    plan.unscramble(re.data(), im.data());
+    plan.inverseScrambled(re.data(), im.data());
+}
+
+inline std::vector<float> normalizedPeak(const std::vector<double> &x)
+{
+    double peak = 0.0;
+    for (double v : x)
+        peak = std::max(peak, std::fabs(v));
+    std::vector<float> out(x.size());
+    for (size_t i = 0; i < x.size(); i++)
+        out[i] = static_cast<float>(peak > 0 ? x[i] / peak : 0.0);
+    return out;
+}
+
+// 1/f power between f0 and f1 with random phases
+inline std::vector<float> pinkNoisePeriod(size_t n, double rate, double f0, double f1, uint32_t seed)
+{
+    FftPlan<double> plan(n);
+    std::vector<double> magnitude(n / 2), phase(n / 2), re(n), im(n);
+    uint32_t state = seed * 0x9E3779B9u + 0x6D2B79F5u;
+    for (size_t k = 1; k < n / 2; k++)
+    {
+        double f = k * rate / n;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        phase[k] = 2 * M_PI * (state >> 8) / 16777216.0;
+        magnitude[k] = f >= f0 && f <= f1 ? 1.0 / std::sqrt(f) : 0.0;
+    }
+    synthesize(plan, magnitude, phase, re, im);
+    return normalizedPeak(re);
+}
+
+// Equal-amplitude tones on the given bins with a low crest factor. Starts
+// from Schroeder phases and minimises the L_p norm of the waveform over the
+// phases by gradient descent, raising p from 4 to 256 so the norm tends to
+// the peak. The gradient for every tone comes from one FFT of x^(p-1).
+inline std::vector<float> multitonePeriod(size_t n, const std::vector<size_t> &bins)
+{
+    FftPlan<double> plan(n);
+    std::vector<double> magnitude(n / 2), phase(n / 2), re(n), im(n), x, best;
+    std::vector<double> gradient(bins.size());
+    size_t count = bins.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        magnitude[bins[i]] = 1.0;
+        phase[bins[i]] = -M_PI * double(i) * double(i) / double(count);
+    }
+
+    double bestPeak = 1e300;
+    for (int p = 4; p <= 256; p *= 2)
+    {
+        double step = 0.1;
+        for (int round = 0; round < 50; round++, step *= 0.99)
+        {
+            synthesize(plan, magnitude, phase, re, im);
+            x = re;
+            double peak = 0.0;
+            for (double v : x)
+                peak = std::max(peak, std::fabs(v));
+            if (peak < bestPeak) // the RMS doesn't depend on the phases
+            {
+                bestPeak = peak;
+                best = x;
+            }
+
+            // dJ/dphi_k is proportional to -sum_t x^(p-1) sin(w_k t + phi_k) = -Im(e^(i phi_k) conj(X_k)),
+            // X = FFT of x^(p-1); x is scaled by its peak to stay in range
+            for (size_t t = 0; t < n; t++)
+            {
+                double v = x[t] / peak, power = v; // v^(p-1) = v * v^2 * v^4 * ... * v^(p/2)
+                for (int k = 2; k < p; k *= 2)
+                {
+                    v *= v;
+                    power *= v;
+                }
+                re[t] = power;
+                im[t] = 0.0;
+            }
+            plan.forward(re.data(), im.data());
+            double largest = 0.0;
+            for (size_t i = 0; i < count; i++)
+            {
+                size_t b = bins[i];
+                gradient[i] = std::cos(phase[b]) * im[b] - std::sin(phase[b]) * re[b];
+                largest = std::max(largest, std::fabs(gradient[i]));
+            }
+            if (largest == 0.0)
+                break;
+            for (size_t i = 0; i < count; i++)
+                phase[bins[i]] -= step * gradient[i] / largest;
+        }
+    }
+    return normalizedPeak(best);
+}
+
+} // namespace stimulus_detail
+
+// A stimulus for one run: `seconds` long, then silence. Construction does
+// all allocation and any precomputation; render() only generates or copies.
+class Stimulus
+{
+public:
+    Stimulus(const StimulusSpec &spec, double sampleRate, double seconds, size_t maxBlock = 4096)
+        : spec_(spec), rate_(sampleRate), total_(static_cast<uint64_t>(seconds * sampleRate)),
+          fadeIn_(static_cast<uint64_t>(spec.fadeIn * sampleRate)),
+          fadeOut_(static_cast<uint64_t>(spec.fadeOut * sampleRate)), block_(maxBlock)
+    {
+        using namespace stimulus_detail;
+        double amp = std::pow(10.0, spec.levelDb / 20.0);
+        double nyquist = sampleRate / 2;
+        double f1 = spec.f1 > 0 ? std::min(spec.f1, nyquist) : 0.45 * sampleRate;
+        std::string key = std::string(stimulusName(spec.kind)) + "@" + std::to_string(sampleRate);
+        // Pink noise: long enough to sound random. Multitone: about 3 Hz
+        // resolution; a longer period lets the tones line up more often,
+        // which raises the crest factor.
+        size_t period = size_t(1) << spec.periodLog2;
+        if (!spec.periodLog2)
+            period = nextPowerOfTwo(static_cast<size_t>(spec.kind == StimulusKind::PinkNoise ? 5 * sampleRate : sampleRate / 3));
+
+        switch (spec.kind)
+        {
+        case StimulusKind::Sine:
+            sine_ = std::make_unique<SineGenerator>(spec.frequency, sampleRate, amp);
+            rms_ = amp / std::sqrt(2.0);
+            break;
+        case StimulusKind::LogSweep:
+        case StimulusKind::LinearSweep:
+        {
+            // Sweeps cover exactly the stimulus length, Nyquist by default
+            double top = spec.f1 > 0 ? std::min(spec.f1, nyquist) : nyquist;
+            if (spec.kind == StimulusKind::LogSweep)
+                logSweep_ = std::make_unique<LogSweepGenerator>(spec.f0, top, seconds, sampleRate, amp);
+            else
+                linSweep_ = std::make_unique<LinearSweepGenerator>(spec.f0, top, seconds, sampleRate, amp);
+            rms_ = amp / std::sqrt(2.0);
+            break;
+        }
+        case StimulusKind::SteppedSine:
+            steps_ = std::make_unique<SteppedSineGenerator>(spec.f0, f1, spec.perOctave, spec.stepSeconds, sampleRate, amp);
+            frequencies_ = steps_->frequencies();
+            rms_ = amp / std::sqrt(2.0);
+            break;
+        case StimulusKind::WhiteNoise:
+            // Scaled so the Irwin-Hall bound, 2*sqrt(3) sigma, is the peak level
+            noise_ = std::make_unique<WhiteNoiseGenerator>(spec.seed, amp / (2 * std::sqrt(3.0)));
+            rms_ = amp / (2 * std::sqrt(3.0));
+            break;
+        case StimulusKind::PinkNoise:
+            key += ":" + std::to_string(period) + ":" + std::to_string(spec.f0) + ":" + std::to_string(f1) + ":" +
+                   std::to_string(spec.seed);
+            period_ = cachedPeriod(key, [&] { return pinkNoisePeriod(period, sampleRate, spec.f0, f1, spec.seed); });
+            break;
+        case StimulusKind::Mls:
+            key += ":" + std::to_string(spec.order);
+            period_ = cachedPeriod(key, [&] { return maximumLengthSequence(spec.order); });
+            break;
+        case StimulusKind::Multitone:
+        {
+            // Log-spaced tones snapped to the period's FFT bins, duplicates dropped
+            std::vector<size_t> bins;
+            for (int i = 0;; i++)
+            {
+                double f = spec.f0 * std::pow(2.0, i / spec.perOctave);
+                if (f > f1 * (1 + 1e-9))
+                    break;
+                size_t bin = std::max<size_t>(1, std::lround(f * period / sampleRate));
+                if (bin < period / 2 && (bins.empty() || bin != bins.back()))
+                    bins.push_back(bin);
+            }
+            if (bins.empty())
+                bins.push_back(1);
+            for (size_t b : bins)
+                frequencies_.push_back(b * sampleRate / period);
+            key += ":" + std::to_string(period);
+            for (size_t b : bins)
+                key += "," + std::to_string(b);
+            period_ = cachedPeriod(key, [&] { return multitonePeriod(period, bins); });
+            break;
+        }
+        }
+
+        if (period_)
+        {
+            double power = 0.0;
+            for (float v : *period_)
+                power += double(v) * v;
+            rms_ = amp * std::sqrt(power / period_->size());
+            amp_ = static_cast<float>(amp);
+        }
+
+        channelGain_.assign(spec.channels, spec.map.empty() ? 1.0f : 0.0f);
+        for (int c : spec.map)
+            channelGain_[c] = 1.0f;
+    }
+
+    int channels() const { return spec_.channels; }
+    uint64_t totalFrames() const { return total_; }
+    bool finished() const { return position_ >= total_; }
+    const StimulusSpec &spec() const { return spec_; }
+    // Tone frequencies of multitone and stepped-sine stimuli, in Hz
+    const std::vector<double> &frequencies() const { return frequencies_; }
+    // One period of MLS, pink noise or multitone at full scale; nullptr for the others
+    const std::vector<float> *period() const { return period_.get(); }
+    double rmsDb() const { return 20 * std::log10(std::max(rms_, 1e-12)); }
+    double crestDb() const { return spec_.levelDb - rmsDb(); }
+
+    // `frames` interleaved frames over channels(); silence once it has ended
+    void render(float *out, size_t frames)
+    {
+        int channels = spec_.channels;
+        for (size_t done = 0; done < frames;)
+        {
+            size_t n = std::min(frames - done, block_.size());
+            size_t live = position_ < total_ ? std::min<uint64_t>(n, total_ - position_) : 0;
+            generate(block_.data(), live);
+            std::fill(block_.begin() + live, block_.begin() + n, 0.0f);
+            applyFades(block_.data(), live);
+
+            float *dst = out + done * channels;
+            for (size_t i = 0; i < n; i++)
+                for (int c = 0; c < channels; c++)
+                    dst[i * channels + c] = block_[i] * channelGain_[c];
+            position_ += live;
+            done += n;
+        }
+    }
+
+    void describe(std::ostream &out) const
+    {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << stimulusName(spec_.kind) << std::fixed << std::setprecision(1) << ", " << double(total_) / rate_
+            << " s, peak " << spec_.levelDb << " dBFS, RMS " << rmsDb() << " dBFS (crest " << crestDb() << " dB)";
+        if (period_)
+            out << ", period " << period_->size() << " frames";
+        if (!frequencies_.empty())
+            out << ", " << frequencies_.size() << " tones " << frequencies_.front() << "-" << frequencies_.back()
+                << " Hz";
+        out << ", " << spec_.channels << " ch";
+        if (!spec_.map.empty())
+        {
+            out << " (signal on";
+            for (int c : spec_.map)
+                out << " " << c;
+            out << ")";
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+private:
+    void generate(float *x, size_t n)
+    {
+        if (n == 0)
+            return;
+        int frames = static_cast<int>(n);
+        if (sine_)
+            sine_->render(x, frames);
+        else if (logSweep_)
+            logSweep_->render(x, frames);
+        else if (linSweep_)
+            linSweep_->render(x, frames);
+        else if (steps_)
+            steps_->render(x, frames);
+        else if (noise_)
+            noise_->render(x, frames);
+        else
+        {
+            // Loop the cached period
+            const std::vector<float> &p = *period_;
+            for (size_t done = 0; done < n;)
+            {
+                size_t m = std::min(n - done, p.size() - loop_);
+                for (size_t i = 0; i < m; i++)
+                    x[done + i] = p[loop_ + i] * amp_;
+                done += m;
+                loop_ = (loop_ + m) % p.size();
+            }
+        }
+    }
+
+    // Raised-cosine ramps over the first fadeIn_ and last fadeOut_ frames
+    void applyFades(float *x, size_t n)
+    {
+        for (uint64_t i = position_; i < std::min<uint64_t>(position_ + n, fadeIn_); i++)
+            x[i - position_] *= static_cast<float>(0.5 - 0.5 * std::cos(M_PI * double(i) / fadeIn_));
+        uint64_t outStart = total_ - std::min(fadeOut_, total_);
+        for (uint64_t i = std::max(position_, outStart); i < position_ + n; i++)
+            x[i - position_] *= static_cast<float>(0.5 - 0.5 * std::cos(M_PI * double(total_ - i) / fadeOut_));
+    }
+
+    StimulusSpec spec_;
+    double rate_;
+    uint64_t total_;
+    uint64_t fadeIn_, fadeOut_;
+    uint64_t position_ = 0;
+    std::vector<float> block_;
+    std::vector<float> channelGain_;
+    std::vector<double> frequencies_;
+    double rms_ = 0.0;
+
+    std::unique_ptr<SineGenerator> sine_;
+    std::unique_ptr<LogSweepGenerator> logSweep_;
+    std::unique_ptr<LinearSweepGenerator> linSweep_;
+    std::unique_ptr<SteppedSineGenerator> steps_;
+    std::unique_ptr<WhiteNoiseGenerator> noise_;
+    std::shared_ptr<const std::vector<float>> period_;
+    size_t loop_ = 0;
+    float amp_ = 1.0f;
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool for many independent jobs of uneven size.
+//
+// Each worker owns a deque. Jobs submitted from outside are dealt to the
+// deques round-robin; a job submitted from inside a worker goes on that
+// worker's own deque. A worker takes jobs from the front of its own deque
+// and, when it runs dry, steals from the back of the others, starting with
+// its right neighbour. Submitting largest-first therefore has every worker
+// start on big jobs while thieves pick up the small ones at the end, which
+// keeps all cores busy until the last job. Idle workers sleep on a
+// condition variable rather than spinning.
+class WorkStealingPool
+{
+public:
+    using Job = std::function<void()>;
+
+    explicit WorkStealingPool(int threads = 0)
+    {
+        if (threads <= 0)
+            threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int i = 0; i < threads; i++)
+            queues_.push_back(std::make_unique<Queue>());
+        for (int i = 0; i < threads; i++)
+            workers_.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+
+    ~WorkStealingPool()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_)
+            worker.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    int threads() const { return static_cast<int>(workers_.size()); }
+
+    void submit(Job job)
+    {
+        size_t target = owner() == this ? currentWorker() : next_++ % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[target]->mutex);
+            queues_[target]->jobs.push_back(std::move(job));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_++;
+            queued_++;
+        }
+        wake_.notify_one();
+    }
+
+    // Block until every submitted job has finished
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    // Index of the calling worker thread in [0, threads()), -1 outside the
+    // pool; lets jobs use per-worker scratch without locking
+    int workerIndex() const { return owner() == this ? static_cast<int>(currentWorker()) : -1; }
+
+    // Jobs taken from another worker's deque so far
+    size_t stolen() const { return stolen_.load(std::memory_order_relaxed); }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    static const WorkStealingPool *&owner()
+    {
+        thread_local const WorkStealingPool *pool = nullptr;
+        return pool;
+    }
+    static size_t &currentWorker()
+    {
+        thread_local size_t index = 0;
+        return index;
+    }
+
+    bool take(size_t self, Job &job)
+    {
+        {
+            Queue &own = *queues_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.jobs.empty())
+            {
+                job = std::move(own.jobs.front());
+                own.jobs.pop_front();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues_.size(); k++)
+        {
+            Queue &victim = *queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.jobs.empty())
+            {
+                job = std::move(victim.jobs.back());
+                victim.jobs.pop_back();
+                stolen_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self)
+    {
+        owner() = this;
+        currentWorker() = self;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return queued_ > 0 || stopping_; });
+                if (queued_ == 0)
+                    return;
+                queued_--; // reserve one of the jobs already in the deques
+            }
+            // Jobs are pushed before they are counted, so one is always
+            // there for this reservation. take() scans the deques one at a
+            // time, though, and a worker with a later reservation can take
+            // it from a deque already scanned: scan again until it turns up.
+            Job job;
+            while (!take(self, job))
+                std::this_thread::yield();
+            job();
+            job = nullptr;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0)
+                done_.notify_all();
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_, done_;
+    size_t pending_ = 0; // submitted and not finished
+    size_t queued_ = 0;  // submitted and not yet reserved by a worker
+    bool stopping_ = false;
+    std::atomic<size_t> next_{0};
+    std::atomic<size_t> stolen_{0};
+};
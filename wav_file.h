@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "sample_format.h"
+
+// Whole-file WAV helpers for buffers that fit in memory. Long captures go
+// through WavStreamWriter (wav_stream.h) instead.
+
+// Write raw PCM data to simple WAV file
+inline void writeWav(const std::string &filename, const std::vector<short> &samples, int sampleRate, int channels)
+{
+    std::ofstream out(filename, std::ios::binary);
+
+    int byteRate = sampleRate * channels * 2;
+    int dataSize = samples.size() * 2;
+
+    // RIFF header
+    out.write("RIFF", 4);
+    int chunkSize = 36 + dataSize;
+    out.write(reinterpret_cast<const char *>(&chunkSize), 4);
+    out.write("WAVE", 4);
+
+    // fmt subchunk
+    out.write("fmt ", 4);
+    int subchunk1Size = 16;
+    short audioFormat = 1; // PCM
+    short numChannels = channels;
+    int sampleRate_ = sampleRate;
+    short bitsPerSample = 16;
+    short blockAlign = numChannels * bitsPerSample / 8;
+
+    out.write(reinterpret_cast<const char *>(&subchunk1Size), 4);
+    out.write(reinterpret_cast<const char *>(&audioFormat), 2);
+    out.write(reinterpret_cast<const char *>(&numChannels), 2);
+    out.write(reinterpret_cast<const char *>(&sampleRate_), 4);
+    out.write(reinterpret_cast<const char *>(&byteRate), 4);
+    out.write(reinterpret_cast<const char *>(&blockAlign), 2);
+    out.write(reinterpret_cast<const char *>(&bitsPerSample), 2);
+
+    // data subchunk
+    out.write("data", 4);
+    out.write(reinterpret_cast<const char *>(&dataSize), 4);
+    out.write(reinterpret_cast<const char *>(samples.data()), dataSize);
+    out.close();
+}
+
+// Write float samples as a 32-bit IEEE float WAV file
+inline void writeWavFloat(const std::string &filename, const std::vector<float> &samples, int sampleRate, int channels)
+{
+    std::ofstream out(filename, std::ios::binary);
+
+    int byteRate = sampleRate * channels * 4;
+    int dataSize = samples.size() * 4;
+
+    out.write("RIFF", 4);
+    int chunkSize = 36 + dataSize;
+    out.write(reinterpret_cast<const char *>(&chunkSize), 4);
+    out.write("WAVE", 4);
+
+    out.write("fmt ", 4);
+    int subchunk1Size = 16;
+    short audioFormat = 3; // IEEE float
+    short numChannels = channels;
+    int sampleRate_ = sampleRate;
+    short bitsPerSample = 32;
+    short blockAlign = numChannels * bitsPerSample / 8;
+
+    out.write(reinterpret_cast<const char *>(&subchunk1Size), 4);
+    out.write(reinterpret_cast<const char *>(&audioFormat), 2);
+    out.write(reinterpret_cast<const char *>(&numChannels), 2);
+    out.write(reinterpret_cast<const char *>(&sampleRate_), 4);
+    out.write(reinterpret_cast<const char *>(&byteRate), 4);
+    out.write(reinterpret_cast<const char *>(&blockAlign), 2);
+    out.write(reinterpret_cast<const char *>(&bitsPerSample), 2);
+
+    out.write("data", 4);
+    out.write(reinterpret_cast<const char *>(&dataSize), 4);
+    out.write(reinterpret_cast<const char *>(samples.data()), dataSize);
+    out.close();
+}
+
+// Canonical 44-byte header for `dataBytes` of samples in `format`; the
+// caller writes the samples after it
+inline void writeWavHeader(std::ostream &out, int sampleRate, int channels, SampleFormat format, uint32_t dataBytes)
+{
+    auto put16 = [&](uint16_t v) { out.write(reinterpret_cast<const char *>(&v), 2); };
+    auto put32 = [&](uint32_t v) { out.write(reinterpret_cast<const char *>(&v), 4); };
+    int bytes = sampleBytes(format);
+
+    out.write("RIFF", 4);
+    put32(36 + dataBytes);
+    out.write("WAVE", 4);
+    out.write("fmt ", 4);
+    put32(16);
+    put16(format == SampleFormat::Float ? 3 : 1); // IEEE float or PCM
+    put16(channels);
+    put32(sampleRate);
+    put32(sampleRate * channels * bytes);
+    put16(channels * bytes);
+    put16(bytes * 8);
+    out.write("data", 4);
+    put32(dataBytes);
+}
+
+namespace wav_detail
+{
+
+// Decode a "fmt " chunk body (PCM, IEEE float or WAVE_FORMAT_EXTENSIBLE)
+inline bool parseFmtChunk(const uint8_t *body, uint32_t size, const std::string &filename, SampleFormat &format,
+                          int &sampleRate, int &channels)
+{
+    uint8_t fmt[40] = {};
+    std::memcpy(fmt, body, std::min<uint32_t>(size, sizeof(fmt)));
+
+    uint16_t tag, numChannels, bits;
+    uint32_t rate;
+    std::memcpy(&tag, fmt, 2);
+    std::memcpy(&numChannels, fmt + 2, 2);
+    std::memcpy(&rate, fmt + 4, 4);
+    std::memcpy(&bits, fmt + 14, 2);
+    if (tag == 0xFFFE && size >= 26) // WAVE_FORMAT_EXTENSIBLE, sub-format GUID starts with the tag
+        std::memcpy(&tag, fmt + 24, 2);
+
+    if (tag == 3 && bits == 32)
+        format = SampleFormat::Float;
+    else if (tag == 1 && bits == 16)
+        format = SampleFormat::S16;
+    else if (tag == 1 && bits == 24)
+        format = SampleFormat::S24_3;
+    else if (tag == 1 && bits == 32)
+        format = SampleFormat::S32;
+    else
+    {
+        std::cerr << filename << ": unsupported WAV format (tag " << tag << ", " << bits << " bits).\n";
+        return false;
+    }
+    sampleRate = rate;
+    channels = numChannels;
+    return channels > 0;
+}
+
+// Walk the chunk list (no fixed 44-byte header) and return the raw data chunk
+inline bool readWavData(const std::string &filename, std::vector<uint8_t> &data, SampleFormat &format,
+                        int &sampleRate, int &channels)
+{
+    std::ifstream in(filename, std::ios::binary);
+    char id[4];
+    uint32_t size;
+    if (!in.read(id, 4) || std::memcmp(id, "RIFF", 4) != 0)
+        return false;
+    in.read(reinterpret_cast<char *>(&size), 4);
+    if (!in.read(id, 4) || std::memcmp(id, "WAVE", 4) != 0)
+        return false;
+
+    bool haveFormat = false;
+    while (in.read(id, 4) && in.read(reinterpret_cast<char *>(&size), 4))
+    {
+        if (std::memcmp(id, "fmt ", 4) == 0)
+        {
+            uint8_t fmt[40] = {};
+            in.read(reinterpret_cast<char *>(fmt), std::min<uint32_t>(size, sizeof(fmt)));
+            if (size > sizeof(fmt))
+                in.seekg(size - sizeof(fmt), std::ios::cur);
+            in.seekg(size & 1, std::ios::cur);
+
+            if (!parseFmtChunk(fmt, size, filename, format, sampleRate, channels))
+                return false;
+            haveFormat = true;
+        }
+        else if (std::memcmp(id, "data", 4) == 0)
+        {
+            if (!haveFormat)
+                return false;
+            data.resize(size);
+            in.read(reinterpret_cast<char *>(data.data()), data.size());
+            data.resize(in.gcount() - in.gcount() % (sampleBytes(format) * channels));
+            return true;
+        }
+        else
+        {
+            in.seekg(size + (size & 1), std::ios::cur);
+        }
+    }
+    return false;
+}
+
+} // namespace wav_detail
+
+// Read a 16-bit PCM WAV file
+inline bool readWav(const std::string &filename, std::vector<short> &samples, int &sampleRate, int &channels)
+{
+    std::vector<uint8_t> data;
+    SampleFormat format;
+    if (!wav_detail::readWavData(filename, data, format, sampleRate, channels))
+        return false;
+    if (format != SampleFormat::S16)
+    {
+        std::cerr << filename << ": only 16-bit PCM WAV is supported here.\n";
+        return false;
+    }
+    samples.resize(data.size() / 2);
+    std::memcpy(samples.data(), data.data(), samples.size() * 2);
+    return true;
+}
+
+// Read a 16/24/32-bit PCM or float WAV file as float samples
+inline bool readWavFloat(const std::string &filename, std::vector<float> &samples, int &sampleRate, int &channels)
+{
+    std::vector<uint8_t> data;
+    SampleFormat format;
+    if (!wav_detail::readWavData(filename, data, format, sampleRate, channels))
+        return false;
+    samples.resize(data.size() / sampleBytes(format));
+    decodeSamples(format, data.data(), samples.data(), samples.size());
+    return true;
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "sample_format.h"
+#include "wav_file.h"
+
+// Read-only memory-mapped WAV file for playback of files of any size.
+//
+// open() maps the whole file and walks its RIFF or RF64 chunk list, taking
+// the data size from the ds64 chunk when the 32-bit fields overflow. Nothing
+// is read up front, so playback starts immediately. A readahead thread stays
+// a few seconds ahead of the play position. It issues MADV_WILLNEED and
+// touches each page so the audio loop never faults on disk I/O. Pages more
+// than a second behind the play position are dropped with MADV_DONTNEED, so
+// resident memory stays constant whatever the file size. The player only
+// publishes its position; the mapped bytes are used in place.
+class MappedWav
+{
+public:
+    MappedWav() = default;
+    ~MappedWav() { close(); }
+
+    MappedWav(const MappedWav &) = delete;
+    MappedWav &operator=(const MappedWav &) = delete;
+
+    // Map and parse `path`; prints why and returns false on failure
+    bool open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            std::cerr << "Cannot open " << path << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < 12)
+        {
+            std::cerr << path << ": not a WAV file.\n";
+            ::close(fd);
+            return false;
+        }
+        fileBytes_ = st.st_size;
+        void *map = mmap(nullptr, fileBytes_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+        {
+            std::cerr << "Cannot map " << path << ": " << strerror(errno) << "\n";
+            return false;
+        }
+        map_ = static_cast<const uint8_t *>(map);
+        if (!parse(path))
+        {
+            close();
+            return false;
+        }
+        madvise(const_cast<uint8_t *>(map_), fileBytes_, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    void close()
+    {
+        stopReadahead();
+        if (map_)
+            munmap(const_cast<uint8_t *>(map_), fileBytes_);
+        map_ = nullptr;
+    }
+
+    SampleFormat format() const { return format_; }
+    int rate() const { return rate_; }
+    int channels() const { return channels_; }
+    size_t frameBytes() const { return sampleBytes(format_) * channels_; }
+    uint64_t frames() const { return frames_; }
+    bool isRf64() const { return rf64_; }
+
+    // Interleaved samples starting at `frame`, straight from the mapping
+    const uint8_t *data(uint64_t frame = 0) const { return data_ + frame * frameBytes(); }
+
+    // Keep `aheadSeconds` of data resident in front of the published position
+    void startReadahead(double aheadSeconds = 4.0)
+    {
+        ahead_ = static_cast<uint64_t>(aheadSeconds * rate_) * frameBytes();
+        behind_ = static_cast<uint64_t>(rate_) * frameBytes();
+        stop_ = false;
+        readahead_ = std::thread(&MappedWav::readaheadLoop, this);
+
+        // Have the first stretch resident before playback starts
+        while (prefetched_.load(std::memory_order_acquire) < std::min(ahead_ / 4, dataBytes_))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    void stopReadahead()
+    {
+        if (!readahead_.joinable())
+            return;
+        stop_ = true;
+        readahead_.join();
+    }
+
+    // Player side: frames consumed so far (a relaxed atomic store)
+    void setPosition(uint64_t frame) { position_.store(frame * frameBytes(), std::memory_order_relaxed); }
+
+private:
+    bool parse(const std::string &path)
+    {
+        const uint8_t *p = map_;
+        bool riff = std::memcmp(p, "RIFF", 4) == 0;
+        rf64_ = std::memcmp(p, "RF64", 4) == 0;
+        if ((!riff && !rf64_) || std::memcmp(p + 8, "WAVE", 4) != 0)
+        {
+            std::cerr << path << ": not a RIFF/RF64 WAVE file.\n";
+            return false;
+        }
+
+        uint64_t ds64Data = 0;
+        bool haveFormat = false;
+        uint64_t offset = 12;
+        while (offset + 8 <= fileBytes_)
+        {
+            const uint8_t *chunk = map_ + offset;
+            uint32_t size32;
+            std::memcpy(&size32, chunk + 4, 4);
+            uint64_t size = size32;
+            uint64_t body = offset + 8;
+
+            if (std::memcmp(chunk, "ds64", 4) == 0 && size >= 24 && body + 24 <= fileBytes_)
+                std::memcpy(&ds64Data, chunk + 16, 8); // after the 64-bit RIFF size
+            else if (std::memcmp(chunk, "fmt ", 4) == 0 && body + std::min<uint64_t>(size, 16) <= fileBytes_)
+            {
+                if (!wav_detail::parseFmtChunk(chunk + 8, static_cast<uint32_t>(std::min<uint64_t>(size, fileBytes_ - body)),
+                                               path, format_, rate_, channels_))
+                    return false;
+                haveFormat = true;
+            }
+            else if (std::memcmp(chunk, "data", 4) == 0)
+            {
+                if (!haveFormat)
+                {
+                    std::cerr << path << ": data chunk before fmt chunk.\n";
+                    return false;
+                }
+                if (rf64_ && size32 == 0xFFFFFFFF)
+                    size = ds64Data;
+                // A recording cut short leaves a size past the end of the file
+                size = std::min(size, fileBytes_ - body);
+                data_ = map_ + body;
+                dataBytes_ = size - size % frameBytes();
+                frames_ = dataBytes_ / frameBytes();
+                return true;
+            }
+            offset = body + size + (size & 1);
+        }
+        std::cerr << path << ": no " << (haveFormat ? "data" : "fmt") << " chunk.\n";
+        return false;
+    }
+
+    void readaheadLoop()
+    {
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        const uint64_t dataOffset = data_ - map_;
+        const uint64_t step = std::max<uint64_t>(page, ahead_ / 16 / page * page);
+        uint64_t fetched = 0, released = 0; // data offsets, page aligned in the file
+        volatile uint8_t sink = 0;
+
+        while (!stop_)
+        {
+            uint64_t position = position_.load(std::memory_order_relaxed);
+
+            // Advise and touch the next step until `ahead_` bytes are resident
+            if (fetched < dataBytes_ && fetched < position + ahead_)
+            {
+                uint64_t end = std::min(dataBytes_, fetched + step);
+                uint64_t from = (dataOffset + fetched) / page * page;
+                madvise(const_cast<uint8_t *>(map_) + from, dataOffset + end - from, MADV_WILLNEED);
+                for (uint64_t off = from; off < dataOffset + end; off += page)
+                    sink = sink + map_[off];
+                fetched = end;
+                prefetched_.store(fetched, std::memory_order_release);
+                continue;
+            }
+
+            // Drop what was played more than `behind_` ago
+            if (position > released + behind_ + step)
+            {
+                uint64_t from = (dataOffset + released + page - 1) / page * page;
+                uint64_t to = (dataOffset + position - behind_) / page * page;
+                if (to > from)
+                    madvise(const_cast<uint8_t *>(map_) + from, to - from, MADV_DONTNEED);
+                released = position - behind_;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    const uint8_t *map_ = nullptr;
+    uint64_t fileBytes_ = 0;
+    const uint8_t *data_ = nullptr;
+    uint64_t dataBytes_ = 0;
+    uint64_t frames_ = 0;
+    SampleFormat format_ = SampleFormat::S16;
+    int rate_ = 0, channels_ = 0;
+    bool rf64_ = false;
+
+    uint64_t ahead_ = 0, behind_ = 0;
+    std::thread readahead_;
+    std::atomic<bool> stop_{false};
+    std::atomic<uint64_t> position_{0}, prefetched_{0};
+};
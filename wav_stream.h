@@ -0,0 +1,278 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio_sink.h"
+#include "sample_format.h"
+#include "spsc_ring.h"
+
+// Streaming WAV writer (16/24/32-bit PCM or 32-bit float).
+//
+// The capture thread copies frames into fixed-size blocks taken from a
+// preallocated pool and hands full blocks to a background writer thread
+// through a lock-free queue, so memory stays bounded no matter how long the
+// take is. The RIFF sizes are patched periodically and on close; once the
+// data passes 4 GB the file is rewritten in place as RF64 (the JUNK chunk
+// reserved after the RIFF header becomes the ds64 chunk).
+//
+// Samples are converted to the file format on the capture thread as they are
+// copied into the block, with optional TPDF dither for 16/24-bit files.
+class WavStreamWriter : public AudioSink
+{
+public:
+    explicit WavStreamWriter(size_t blockFrames = 4096, size_t blockCount = 64)
+        : blockFrames_(blockFrames), blockCount_(blockCount),
+          freeBlocks_(blockCount), fullBlocks_(blockCount)
+    {
+    }
+
+    ~WavStreamWriter() override { close(); }
+
+    bool open(const std::string &filename, int sampleRate, int channels,
+              SampleFormat format = SampleFormat::S16) override
+    {
+        out_.open(filename, std::ios::binary | std::ios::trunc);
+        if (!out_)
+            return false;
+
+        sampleRate_ = sampleRate;
+        channels_ = channels;
+        format_ = format;
+        sampleBytes_ = sampleBytes(format);
+        blockSamples_ = blockFrames_ * channels;
+        storage_.assign(blockSamples_ * sampleBytes_ * blockCount_, 0);
+        if (format != SampleFormat::S16)
+            scratch_.assign(blockSamples_, 0.0f);
+        for (int i = 0; i < static_cast<int>(blockCount_); i++)
+            freeBlocks_.write(&i, 1);
+
+        current_ = -1;
+        currentFill_ = 0;
+        dataBytes_ = 0;
+        droppedFrames_.store(0);
+        submitted_.store(0);
+        closing_.store(false);
+
+        writeHeader();
+        writer_ = std::thread(&WavStreamWriter::writerLoop, this);
+        return true;
+    }
+
+    // TPDF dither when writing float samples to a 16/24-bit file
+    void setDither(bool enabled) override { dither_ = enabled; }
+
+    // Called from the capture thread. Never blocks or allocates; frames that
+    // don't fit because the writer fell behind are dropped and counted.
+    void write(const short *samples, size_t frames) override
+    {
+        append(frames, [&](uint8_t *dst, size_t done, size_t n)
+        {
+            if (format_ == SampleFormat::S16)
+            {
+                std::memcpy(dst, samples + done, n * sizeof(short));
+                return;
+            }
+            decodeSamples(SampleFormat::S16, samples + done, scratch_.data(), n);
+            encodeSamples(format_, scratch_.data(), dst, n);
+        });
+    }
+
+    // Same for float samples in [-1, 1)
+    void writeFloat(const float *samples, size_t frames) override
+    {
+        append(frames, [&](uint8_t *dst, size_t done, size_t n)
+                       { encodeSamples(format_, samples + done, dst, n, dither_ ? &ditherState_ : nullptr); });
+    }
+
+    // Flushes the partial block, stops the writer thread and finalizes the header.
+    void close() override
+    {
+        if (!writer_.joinable())
+            return;
+
+        if (current_ >= 0 && currentFill_ > 0)
+            submitCurrent();
+        closing_.store(true, std::memory_order_release);
+        submitted_.fetch_add(1, std::memory_order_release);
+        submitted_.notify_one();
+        writer_.join();
+
+        patchHeader();
+        out_.close();
+    }
+
+    uint64_t framesWritten() const override { return dataBytes_ / (sampleBytes_ * channels_); }
+    uint64_t droppedFrames() const override { return droppedFrames_.load(); }
+    bool isRf64() const { return dataBytes_ > maxRiffData; }
+    void describe(std::ostream &out) const override
+    {
+        if (isRf64())
+            out << " (RF64)";
+    }
+
+private:
+    struct Block
+    {
+        int index;
+        size_t samples;
+    };
+
+    static constexpr uint64_t maxRiffData = 0xFFFFFFFFull - 72;
+    static constexpr int headerBytes = 80;
+
+    // Hands out space for up to a block at a time: fill(dst, samplesDone, n)
+    template <typename Fill>
+    void append(size_t frames, Fill &&fill)
+    {
+        size_t total = frames * channels_, done = 0;
+        while (done < total)
+        {
+            if (current_ < 0 && freeBlocks_.read(&current_, 1) == 0)
+            {
+                current_ = -1;
+                droppedFrames_.fetch_add((total - done) / channels_, std::memory_order_relaxed);
+                return;
+            }
+
+            size_t n = std::min(total - done, blockSamples_ - currentFill_);
+            fill(&storage_[(current_ * blockSamples_ + currentFill_) * sampleBytes_], done, n);
+            currentFill_ += n;
+            done += n;
+
+            if (currentFill_ == blockSamples_)
+                submitCurrent();
+        }
+    }
+
+    void submitCurrent()
+    {
+        Block block{current_, currentFill_};
+        fullBlocks_.write(&block, 1);
+        current_ = -1;
+        currentFill_ = 0;
+        submitted_.fetch_add(1, std::memory_order_release);
+        submitted_.notify_one();
+    }
+
+    void writerLoop()
+    {
+        int blocksSincePatch = 0;
+        while (true)
+        {
+            uint64_t seen = submitted_.load(std::memory_order_acquire);
+
+            Block block;
+            while (fullBlocks_.read(&block, 1) == 1)
+            {
+                out_.write(reinterpret_cast<const char *>(&storage_[block.index * blockSamples_ * sampleBytes_]),
+                           block.samples * sampleBytes_);
+                dataBytes_ += block.samples * sampleBytes_;
+                freeBlocks_.write(&block.index, 1);
+
+                // Keep the header roughly current so a crash loses little.
+                if (++blocksSincePatch >= 64)
+                {
+                    patchHeader();
+                    blocksSincePatch = 0;
+                }
+            }
+
+            if (closing_.load(std::memory_order_acquire) && fullBlocks_.readAvailable() == 0)
+                break;
+            submitted_.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    void put16(uint16_t v) { out_.write(reinterpret_cast<const char *>(&v), 2); }
+    void put32(uint32_t v) { out_.write(reinterpret_cast<const char *>(&v), 4); }
+    void put64(uint64_t v) { out_.write(reinterpret_cast<const char *>(&v), 8); }
+
+    void writeHeader()
+    {
+        out_.write("RIFF", 4);
+        put32(headerBytes - 8);
+        out_.write("WAVE", 4);
+
+        // Placeholder that becomes the ds64 chunk if the file outgrows RIFF.
+        out_.write("JUNK", 4);
+        put32(28);
+        const char zeros[28] = {};
+        out_.write(zeros, sizeof(zeros));
+
+        out_.write("fmt ", 4);
+        put32(16);
+        put16(format_ == SampleFormat::Float ? 3 : 1); // IEEE float or PCM
+        put16(channels_);
+        put32(sampleRate_);
+        put32(sampleRate_ * channels_ * sampleBytes_);
+        put16(channels_ * sampleBytes_);
+        put16(sampleBytes_ * 8);
+
+        out_.write("data", 4);
+        put32(0);
+    }
+
+    void patchHeader()
+    {
+        std::streampos end = out_.tellp();
+
+        if (dataBytes_ <= maxRiffData)
+        {
+            out_.seekp(4);
+            put32(static_cast<uint32_t>(headerBytes - 8 + dataBytes_));
+            out_.seekp(headerBytes - 4);
+            put32(static_cast<uint32_t>(dataBytes_));
+        }
+        else
+        {
+            out_.seekp(0);
+            out_.write("RF64", 4);
+            put32(0xFFFFFFFF);
+            out_.seekp(12);
+            out_.write("ds64", 4);
+            put32(28);
+            put64(headerBytes - 8 + dataBytes_);       // RIFF size
+            put64(dataBytes_);                          // data size
+            put64(framesWritten());                     // sample count
+            put32(0);                                   // table length
+            out_.seekp(headerBytes - 4);
+            put32(0xFFFFFFFF);
+        }
+
+        out_.seekp(end);
+        out_.flush();
+    }
+
+    size_t blockFrames_;
+    size_t blockCount_;
+    size_t blockSamples_ = 0;
+    SampleFormat format_ = SampleFormat::S16;
+    int sampleBytes_ = 2;
+    std::vector<uint8_t> storage_;
+    SpscRing<int> freeBlocks_;
+    SpscRing<Block> fullBlocks_;
+
+    // Capture-thread state.
+    int current_ = -1;
+    size_t currentFill_ = 0;
+    std::vector<float> scratch_;
+    bool dither_ = false;
+    TpdfDither ditherState_;
+
+    // Writer-thread state.
+    std::ofstream out_;
+    uint64_t dataBytes_ = 0;
+    int sampleRate_ = 0;
+    int channels_ = 1;
+
+    std::atomic<uint64_t> droppedFrames_{0};
+    std::atomic<uint64_t> submitted_{0};
+    std::atomic<bool> closing_{false};
+    std::thread writer_;
+};